@@ -63,13 +63,126 @@ typedef struct a1fs_superblock {
     a1fs_blk_t inode_table_start; //starting block number for inode table
     a1fs_blk_t data_start; //starting block number for data blocks
 
+    a1fs_blk_t refcount_start; //starting block number for the block reference count table
+    a1fs_blk_t refcount_blocks; //number of blocks in the reference count table, 0 if absent
+
+    a1fs_ino_t orphan_head; //first inode of the orphan list (unlinked files whose blocks are being freed), 0 if empty
+
+    a1fs_ino_t inodes_init_end; //inodes from this number on are not initialized yet (lazy inode table), 0 if all are
+
+    a1fs_blk_t journal_start; //starting block number for the metadata journal
+    a1fs_blk_t journal_blocks; //number of blocks in the journal, 0 if absent
+
+    a1fs_blk_t summary_start; //starting block number for the free space summary (one a1fs_region per region)
+    a1fs_blk_t summary_blocks; //number of blocks in the free space summary, 0 if absent
+    uint32_t state; //A1FS_STATE_CLEAN if the free space summary matches the block bitmap, 0 while mounted
+
+    uint64_t generation; //incremented every time the image is opened, to validate state kept outside of it
+
 } a1fs_superblock;
 
+/** Superblock state of a cleanly unmounted image. */
+#define A1FS_STATE_CLEAN 0xC1EA4u
+
 // Superblock must fit into a single block
 static_assert(sizeof(a1fs_superblock) <= A1FS_BLOCK_SIZE,
               "superblock is too large");
 
 
+/**
+ * Block reference count type.
+ *
+ * Each block has an entry in the reference count table that holds the number
+ * of *extra* extents referring to it, so a zeroed table describes an image
+ * where no blocks are shared. Blocks shared by reflink clones have a non-zero
+ * entry, and are only released in the block bitmap once it drops back to 0.
+ */
+typedef uint16_t a1fs_ref_t;
+
+/** Maximum number of extra references to a single block. */
+#define A1FS_REF_MAX UINT16_MAX
+
+
+/**
+ * Metadata journal.
+ *
+ * The first journal block holds a1fs_journal_sb; the rest is a log of
+ * transactions written from the second block on. A transaction is one or more
+ * descriptor blocks, each followed by the new contents of the blocks it lists,
+ * and a commit block. Transactions have consecutive sequence numbers starting
+ * at a1fs_journal_sb.seq; the log ends at the first block that doesn't
+ * continue the sequence. A transaction is only replayed if its commit block is
+ * present and its checksum matches.
+ */
+#define A1FS_JOURNAL_MAGIC 0xA1F5105Bu
+#define A1FS_JDESC_MAGIC   0xA1F5DE5Cu
+#define A1FS_JCOMMIT_MAGIC 0xA1F5C0DEu
+
+/** Journal superblock. */
+typedef struct a1fs_journal_sb {
+	/** Must match A1FS_JOURNAL_MAGIC. */
+	uint32_t magic;
+	uint32_t reserved;
+	/** Sequence number of the first transaction in the log. */
+	uint64_t seq;
+
+} a1fs_journal_sb;
+
+/** Maximum number of blocks listed in a descriptor block. */
+#define A1FS_JDESC_MAX ((A1FS_BLOCK_SIZE - 16) / sizeof(a1fs_blk_t))
+
+/** Journal descriptor block. */
+typedef struct a1fs_journal_desc {
+	/** Must match A1FS_JDESC_MAGIC. */
+	uint32_t magic;
+	/** Number of block images following this descriptor. */
+	uint32_t count;
+	/** Transaction sequence number. */
+	uint64_t seq;
+	/** Home locations of the block images. */
+	a1fs_blk_t blocks[A1FS_JDESC_MAX];
+
+} a1fs_journal_desc;
+
+static_assert(sizeof(a1fs_journal_desc) == A1FS_BLOCK_SIZE, "invalid journal descriptor size");
+
+/** Journal commit block. */
+typedef struct a1fs_journal_commit {
+	/** Must match A1FS_JCOMMIT_MAGIC. */
+	uint32_t magic;
+	/** Number of log blocks of the transaction before this one. */
+	uint32_t nblocks;
+	/** Transaction sequence number. */
+	uint64_t seq;
+	/** Checksum of the log blocks of the transaction before this one. */
+	uint64_t checksum;
+
+} a1fs_journal_commit;
+
+
+/**
+ * Free space summary.
+ *
+ * The blocks are divided into regions covered by one block of the block
+ * bitmap each. The summary holds the free space of every region, so that the
+ * allocator skips full regions without scanning their bitmap. It is written
+ * on unmount and only trusted if the superblock state says the image was
+ * unmounted cleanly; otherwise regions are scanned when they are first used.
+ */
+#define A1FS_REGION_BLOCKS (A1FS_BLOCK_SIZE * 8)
+/** Value of an a1fs_region field that is not known. */
+#define A1FS_REGION_UNKNOWN UINT32_MAX
+
+/** Free space summary of a region. */
+typedef struct a1fs_region {
+	/** Number of free blocks. */
+	uint32_t free;
+	/** Length of the longest run of free blocks. */
+	uint32_t longest;
+
+} a1fs_region;
+
+
 /** Extent - a contiguous range of blocks. */
 typedef struct a1fs_extent {
 	/** Starting block of the extent. */
@@ -116,19 +229,71 @@ typedef struct a1fs_inode {
     
     //parent inode number
     a1fs_ino_t parent_ino;
+
+    //A1FS_INODE_* flags
+    uint32_t flags;
+
+    //next inode on the orphan list if A1FS_INODE_ORPHAN is set, 0 at the end
+    a1fs_ino_t next_orphan;
     
     //NOTE: You might have to add padding (e.g. a dummy char array field) at the
     // end of the struct in order to satisfy the assertion below. Try to keep
     // the size of this struct minimal, but don't worry about the "wasted space"
     // introduced by the required padding.
     
-    char padding[12];
+    //number of blocks reserved for the chunk table if A1FS_INODE_COMPRESSED is set,
+    //0 for a table without spare entries (see a1fs_chunk)
+    uint32_t chunk_table;
 
 } a1fs_inode;
 
 // A single block must fit an integral number of inodes
 static_assert(A1FS_BLOCK_SIZE % sizeof(a1fs_inode) == 0, "invalid inode size");
 
+/**
+ * Compression policy. On a file: the data is compressed when the file is
+ * flushed. On a directory: files and directories created in it inherit the
+ * flag. This is the only flag that can be changed with A1FS_IOC_SETFLAGS.
+ */
+#define A1FS_INODE_COMPRESS   0x1u
+/** File data is stored in the compressed format (see a1fs_chunk). */
+#define A1FS_INODE_COMPRESSED 0x2u
+/** Unlinked file on the orphan list; its blocks are being freed. */
+#define A1FS_INODE_ORPHAN     0x4u
+
+
+/**
+ * Compressed files are split into chunks of A1FS_CHUNK_SIZE bytes of file data
+ * (the last one may be shorter) that are compressed independently, so that a
+ * read only needs to decompress the chunks it touches.
+ *
+ * The blocks of a compressed file (in extent order) start with the chunk table
+ * - an array of a1fs_chunk with one entry per chunk, in the first
+ * a1fs_inode.chunk_table blocks so that chunks can be appended - followed by
+ * the stored chunks. A write stores the chunks it changes back as is, in their
+ * old place if they fit or else at the end of the file; the blocks left behind
+ * are reclaimed when the file is repacked. The inode size is the uncompressed
+ * file size.
+ */
+#define A1FS_CHUNK_SIZE (16 * A1FS_BLOCK_SIZE)
+
+/** Set in a1fs_chunk.len if the chunk didn't compress and is stored as is. */
+#define A1FS_CHUNK_RAW 0x80000000u
+/** Set in a1fs_chunk.len (with A1FS_CHUNK_RAW) if the chunk was written since
+ * the file was last flushed and has to be compressed again. */
+#define A1FS_CHUNK_DIRTY 0x40000000u
+/** Stored chunk size bits of a1fs_chunk.len. */
+#define A1FS_CHUNK_LEN_MASK 0x3fffffffu
+
+/** Chunk table entry of a compressed file. */
+typedef struct a1fs_chunk {
+	/** Index of the first file block holding the stored chunk. */
+	uint32_t blk;
+	/** Stored chunk size in bytes, possibly with A1FS_CHUNK_RAW and A1FS_CHUNK_DIRTY set. */
+	uint32_t len;
+
+} a1fs_chunk;
+
 
 /** Maximum file name (path component) length. Includes the null terminator. */
 #define A1FS_NAME_MAX 252
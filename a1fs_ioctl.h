@@ -0,0 +1,37 @@
+/**
+ * a1fs specific ioctl commands, shared by the driver and the a1fsctl tool.
+ */
+
+#pragma once
+
+#include <sys/ioctl.h>
+
+#include "a1fs.h"
+
+
+/** ioctl "type" (magic) number of a1fs commands. */
+#define A1FS_IOC_MAGIC 0xA1
+
+/** Argument of A1FS_IOC_CLONE. */
+typedef struct a1fs_clone_args {
+	/** Source file path within the file system, starting with '/'. */
+	char src[A1FS_PATH_MAX];
+
+} a1fs_clone_args;
+
+/**
+ * Make the file the ioctl is issued on a reflink clone of args.src.
+ *
+ * This is the a1fs counterpart of FICLONE. FUSE cannot resolve a file
+ * descriptor of the source file, so the source is passed by its path.
+ */
+#define A1FS_IOC_CLONE _IOW(A1FS_IOC_MAGIC, 1, a1fs_clone_args)
+
+/** Get the A1FS_INODE_* flags of a file or directory. */
+#define A1FS_IOC_GETFLAGS _IOR(A1FS_IOC_MAGIC, 2, uint32_t)
+
+/**
+ * Set the user changeable flags of a file or directory. Only
+ * A1FS_INODE_COMPRESS can be changed; files created in a directory inherit it.
+ */
+#define A1FS_IOC_SETFLAGS _IOW(A1FS_IOC_MAGIC, 3, uint32_t)
@@ -0,0 +1,188 @@
+/**
+ * a1fs control tool - issues a1fs specific ioctls on a mounted file system.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "a1fs_ioctl.h"
+
+
+static const char *help_str = "\
+Usage: %s command [arguments]\n\
+\n\
+Perform a1fs specific operations on files in a mounted a1fs file system.\n\
+\n\
+Commands:\n\
+    clone SRC DST   make DST a reflink clone of SRC; DST is created if it\n\
+                    doesn't exist. Both files must be in the same a1fs mount.\n\
+    compress on|off PATH...\n\
+                    enable or disable transparent compression of files, or\n\
+                    of new files created in directories\n\
+    compress status PATH...\n\
+                    print the compression flags and the logical and physical\n\
+                    size of files\n\
+    help            print help and exit\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+	fprintf(f, help_str, progname);
+}
+
+
+/**
+ * Translate a host path to a path within the a1fs mount it belongs to.
+ *
+ * The mount root is the topmost ancestor directory on the same device.
+ *
+ * @param path     host path to an existing file.
+ * @param fs_path  buffer of A1FS_PATH_MAX bytes that receives the result.
+ * @param dev      pointer to the variable that receives the device number.
+ * @return         true on success; false on failure (errno is set).
+ */
+static bool fs_path_of(const char *path, char *fs_path, dev_t *dev)
+{
+	char full[PATH_MAX];
+	if (realpath(path, full) == NULL) return false;
+
+	struct stat s;
+	if (stat(full, &s) < 0) return false;
+	*dev = s.st_dev;
+
+	// Walk up while the parent directory is still on the same device
+	size_t root_len = strlen(full);
+	while (root_len > 1) {
+		size_t slash = root_len - 1;
+		while (slash > 0 && full[slash] != '/') slash--;
+		size_t parent_len = (slash == 0) ? 1 : slash;
+		char saved = full[parent_len];
+		full[parent_len] = '\0';
+		int ret = stat(full, &s);
+		full[parent_len] = saved;
+		if (ret < 0) return false;
+		if (s.st_dev != *dev) break;
+		root_len = parent_len;
+	}
+
+	const char *rest = (root_len == 1) ? full : full + root_len;
+	if (*rest == '\0') rest = "/";
+	if (strlen(rest) >= A1FS_PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	strcpy(fs_path, rest);
+	return true;
+}
+
+static int do_clone(const char *src, const char *dst)
+{
+	a1fs_clone_args args;
+	dev_t src_dev;
+	if (!fs_path_of(src, args.src, &src_dev)) {
+		perror(src);
+		return 1;
+	}
+
+	int fd = open(dst, O_WRONLY | O_CREAT, 0644);
+	if (fd < 0) {
+		perror(dst);
+		return 1;
+	}
+
+	int ret = 1;
+	struct stat s;
+	if (fstat(fd, &s) < 0) {
+		perror("fstat");
+		goto end;
+	}
+	if (s.st_dev != src_dev) {
+		fprintf(stderr, "%s and %s are not in the same file system\n", src, dst);
+		goto end;
+	}
+	if (ioctl(fd, A1FS_IOC_CLONE, &args) < 0) {
+		perror("clone");
+		goto end;
+	}
+	ret = 0;
+
+end:
+	close(fd);
+	return ret;
+}
+
+static int do_compress(const char *action, int n_paths, char *paths[])
+{
+	bool status = (strcmp(action, "status") == 0);
+	bool on = (strcmp(action, "on") == 0);
+	if (!status && !on && strcmp(action, "off") != 0) {
+		fprintf(stderr, "Unknown compress action: %s\n", action);
+		return 1;
+	}
+
+	int ret = 0;
+	for (int i = 0; i < n_paths; i++) {
+		int fd = open(paths[i], O_RDONLY);
+		if (fd < 0) {
+			perror(paths[i]);
+			ret = 1;
+			continue;
+		}
+
+		uint32_t flags;
+		if (ioctl(fd, A1FS_IOC_GETFLAGS, &flags) < 0) {
+			perror(paths[i]);
+			ret = 1;
+		} else if (status) {
+			struct stat s;
+			if (fstat(fd, &s) < 0) {
+				perror(paths[i]);
+				ret = 1;
+			} else {
+				printf("%s: %s%s, logical %lld bytes, physical %lld bytes\n", paths[i],
+				       (flags & A1FS_INODE_COMPRESS) ? "compress" : "-",
+				       (flags & A1FS_INODE_COMPRESSED) ? " (compressed)" : "",
+				       (long long)s.st_size, (long long)s.st_blocks * 512);
+			}
+		} else {
+			flags = on ? A1FS_INODE_COMPRESS : 0;
+			if (ioctl(fd, A1FS_IOC_SETFLAGS, &flags) < 0) {
+				perror(paths[i]);
+				ret = 1;
+			}
+		}
+		close(fd);
+	}
+	return ret;
+}
+
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		print_help(stderr, argv[0]);
+		return 1;
+	}
+
+	if (strcmp(argv[1], "clone") == 0 && argc == 4) {
+		return do_clone(argv[2], argv[3]);
+	}
+	if (strcmp(argv[1], "compress") == 0 && argc >= 4) {
+		return do_compress(argv[2], argc - 3, &argv[3]);
+	}
+	if (strcmp(argv[1], "help") == 0) {
+		print_help(stdout, argv[0]);
+		return 0;
+	}
+
+	print_help(stderr, argv[0]);
+	return 1;
+}
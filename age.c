@@ -0,0 +1,546 @@
+/**
+ * a1fs aging benchmark.
+ *
+ * Ages an image with a synthetic churn of file creations, deletions and
+ * appends through liba1fs, and samples at regular intervals how fragmented it
+ * has become: extents per file, the runs of free data blocks, and the
+ * throughput of reading a random sample of files sequentially. The churn
+ * profile is configurable: the file size distribution (log-normal), the
+ * shares of deletes and appends, the write and append sizes, and the
+ * utilization around which the image is kept.
+ *
+ * By default the image is formatted in memory (with mkfs.a1fs); an existing
+ * image file can be aged instead, in place, to inspect it afterwards with
+ * a1fs-dump or to run other benchmarks on it.
+ *
+ * The samples are printed as tab-separated lines, preceded by '#' lines with
+ * the configuration, like the output of a1fs-bench.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+#include "liba1fs.h"
+
+
+/** Command line options. */
+typedef struct age_opts {
+	/** Image file to age in place; NULL to format one in memory. */
+	const char *img_path;
+	/** Size of the in-memory image in MiB. */
+	size_t size_mib;
+	/** Number of inodes of the in-memory image. */
+	size_t n_inodes;
+	/** mkfs.a1fs executable. */
+	const char *mkfs;
+
+	/** Number of operations. */
+	uint64_t n_ops;
+	/** Number of operations between samples. */
+	uint64_t interval;
+	/** Median file size in bytes. */
+	uint64_t median;
+	/** Standard deviation of the natural log of the file size. */
+	double sigma;
+	/** Largest file size in bytes. */
+	uint64_t max_size;
+	/** Percentage of operations that delete a file. */
+	unsigned int delete_pct;
+	/** Percentage of operations that append to a file. */
+	unsigned int append_pct;
+	/** Size of each append in bytes. */
+	size_t append_size;
+	/** Size of each write of a new file in bytes. */
+	size_t write_size;
+	/** Percentage of the data blocks in use above which files are only deleted. */
+	unsigned int fullness;
+	/** Number of directories the files are spread over. */
+	unsigned int n_dirs;
+	/** Number of files read by each sequential read sample. */
+	unsigned int n_reads;
+	/** Random seed. */
+	uint64_t seed;
+
+	/** Print help and exit. */
+	bool help;
+
+} age_opts;
+
+static const char *help_str = "\
+Usage: %s options [image]\n\
+\n\
+Age an a1fs image with a synthetic churn of file creations, deletions and\n\
+appends, printing one line per sample: operations so far, files, data\n\
+blocks in use, extents per file and per MiB, fragmented files, free runs,\n\
+and the throughput of reading files sequentially. The image file, if given,\n\
+is aged in place (files already in it are left alone); otherwise one is\n\
+formatted in memory.\n\
+\n\
+Image options (without an image file):\n\
+    -s MiB   image size (default: 512)\n\
+    -i num   number of inodes (default: 65536)\n\
+    -m path  mkfs.a1fs executable (default: ./mkfs.a1fs)\n\
+\n\
+Churn profile:\n\
+    -n num   number of operations (default: 1000000)\n\
+    -I num   operations between samples (default: a twentieth of them)\n\
+    -z KiB   median file size (default: 16)\n\
+    -g num   standard deviation of the log of the file size (default: 1.5)\n\
+    -Z KiB   largest file size (default: 65536)\n\
+    -d pct   share of operations deleting a random file (default: 30)\n\
+    -a pct   share of operations appending to a random file (default: 30);\n\
+             the others create a file\n\
+    -A bytes size of an append (default: 4096)\n\
+    -w bytes size of each write of a new file (default: 65536)\n\
+    -f pct   utilization of the data blocks above which files are only\n\
+             deleted (default: 80)\n\
+    -D num   number of directories (default: 64)\n\
+    -R num   number of files read by each read sample (default: 256)\n\
+    -r num   random seed (default: 369)\n\
+    -h       print help and exit\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+	fprintf(f, help_str, progname);
+}
+
+
+static bool parse_args(int argc, char *argv[], age_opts *opts)
+{
+	// 0 is a valid share
+	opts->delete_pct = 30;
+	opts->append_pct = 30;
+
+	int o;
+	while ((o = getopt(argc, argv, "s:i:m:n:I:z:g:Z:d:a:A:w:f:D:R:r:h")) != -1) {
+		switch (o) {
+			case 's': opts->size_mib    = strtoul(optarg, NULL, 10); break;
+			case 'i': opts->n_inodes    = strtoul(optarg, NULL, 10); break;
+			case 'm': opts->mkfs        = optarg; break;
+			case 'n': opts->n_ops       = strtoull(optarg, NULL, 10); break;
+			case 'I': opts->interval    = strtoull(optarg, NULL, 10); break;
+			case 'z': opts->median      = strtoull(optarg, NULL, 10) << 10; break;
+			case 'g': opts->sigma       = strtod(optarg, NULL); break;
+			case 'Z': opts->max_size    = strtoull(optarg, NULL, 10) << 10; break;
+			case 'd': opts->delete_pct  = strtoul(optarg, NULL, 10); break;
+			case 'a': opts->append_pct  = strtoul(optarg, NULL, 10); break;
+			case 'A': opts->append_size = strtoul(optarg, NULL, 10); break;
+			case 'w': opts->write_size  = strtoul(optarg, NULL, 10); break;
+			case 'f': opts->fullness    = strtoul(optarg, NULL, 10); break;
+			case 'D': opts->n_dirs      = strtoul(optarg, NULL, 10); break;
+			case 'R': opts->n_reads     = strtoul(optarg, NULL, 10); break;
+			case 'r': opts->seed        = strtoull(optarg, NULL, 10); break;
+
+			case 'h': opts->help = true; return true;// skip other arguments
+
+			case '?': return false;
+			default : assert(false);
+		}
+	}
+	if (optind < argc) opts->img_path = argv[optind];
+
+	if (opts->size_mib == 0) opts->size_mib = 512;
+	if (opts->n_inodes == 0) opts->n_inodes = 65536;
+	if (opts->mkfs == NULL) opts->mkfs = "./mkfs.a1fs";
+	if (opts->n_ops == 0) opts->n_ops = 1000000;
+	if (opts->interval == 0) opts->interval = (opts->n_ops >= 20) ? opts->n_ops / 20 : 1;
+	if (opts->median == 0) opts->median = 16 << 10;
+	if (opts->sigma <= 0) opts->sigma = 1.5;
+	if (opts->max_size == 0) opts->max_size = 64ul << 20;
+	if (opts->append_size == 0) opts->append_size = 4096;
+	if (opts->write_size == 0) opts->write_size = 65536;
+	if (opts->fullness == 0) opts->fullness = 80;
+	if (opts->n_dirs == 0) opts->n_dirs = 64;
+	if (opts->n_reads == 0) opts->n_reads = 256;
+	if (opts->seed == 0) opts->seed = 369;
+	if (opts->delete_pct + opts->append_pct > 100) {
+		fprintf(stderr, "Deletes and appends must add up to at most 100%%\n");
+		return false;
+	}
+	if (opts->fullness > 99) {
+		fprintf(stderr, "Fullness must be below 100%%\n");
+		return false;
+	}
+	return true;
+}
+
+
+/** File created by the churn. */
+typedef struct age_file {
+	uint32_t dir;
+	uint32_t id;
+	uint64_t size;
+} age_file;
+
+/** Aging state. */
+typedef struct age_ctx {
+	const age_opts *opts;
+	fs_ctx *fs;
+	/** In-memory image; -1 when aging an image file. */
+	int fd;
+
+	/** Live files, in no particular order. */
+	age_file *files;
+	size_t n_files;
+	size_t cap_files;
+	uint32_t next_id;
+
+	/** Pseudo-random data written to the files, and the read buffer. */
+	char *data;
+	size_t data_size;
+	char *buf;
+
+	uint64_t rng;
+	/** Operations that failed, e.g. with ENOSPC or too many extents. */
+	uint64_t failed;
+} age_ctx;
+
+/** xorshift64* generator; good enough and reproducible everywhere. */
+static uint64_t rnd(age_ctx *a)
+{
+	a->rng ^= a->rng >> 12;
+	a->rng ^= a->rng << 25;
+	a->rng ^= a->rng >> 27;
+	return a->rng * 0x2545F4914F6CDD1Dul;
+}
+
+/** Uniform random number in (0, 1). */
+static double rnd_unit(age_ctx *a)
+{
+	return ((rnd(a) >> 11) + 0.5) / (double)(1ul << 53);
+}
+
+/** Draw a file size from the log-normal distribution of the profile. */
+static uint64_t rnd_size(age_ctx *a)
+{
+	// Box-Muller transform
+	double z = sqrt(-2.0 * log(rnd_unit(a))) * cos(2.0 * M_PI * rnd_unit(a));
+	double size = a->opts->median * exp(a->opts->sigma * z);
+	if (size < 1) return 1;
+	if (size > a->opts->max_size) return a->opts->max_size;
+	return (uint64_t)size;
+}
+
+static void file_path(const age_file *f, char *path)
+{
+	snprintf(path, A1FS_PATH_MAX, "/d%u/f%u", f->dir, f->id);
+}
+
+
+/** Format a new in-memory image with mkfs.a1fs and open it. */
+static bool image_create(age_ctx *a)
+{
+	const age_opts *opts = a->opts;
+	a->fd = memfd_create("a1fs-age", 0);
+	if (a->fd < 0 || ftruncate(a->fd, opts->size_mib << 20) < 0) {
+		perror("memfd");
+		return false;
+	}
+	char path[64], inodes[32];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", a->fd);
+	snprintf(inodes, sizeof(inodes), "%zu", opts->n_inodes);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		// The child inherits the descriptor, so the path works there too
+		int null = open("/dev/null", O_WRONLY);
+		if (null >= 0) dup2(null, STDOUT_FILENO);
+		execl(opts->mkfs, opts->mkfs, "-f", "-i", inodes, path, (char *)NULL);
+		perror(opts->mkfs);
+		_exit(127);
+	}
+	int status;
+	if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "Failed to format the image\n");
+		return false;
+	}
+	a->fs = a1fs_open_fd(a->fd, NULL);
+	return a->fs != NULL;
+}
+
+static bool image_open(age_ctx *a)
+{
+	a->fd = -1;
+	if (a->opts->img_path == NULL) {
+		if (!image_create(a)) return false;
+	} else {
+		a->fs = a1fs_open(a->opts->img_path, NULL);
+		if (a->fs == NULL) return false;
+	}
+	// Large unlinked files are freed in the background, like on a mount
+	a1fs_start(a->fs);
+
+	char path[32];
+	for (unsigned int i = 0; i < a->opts->n_dirs; i++) {
+		snprintf(path, sizeof(path), "/d%u", i);
+		int ret = a1fs_mkdir(a->fs, path, 0755);
+		if (ret < 0 && ret != -EEXIST) {
+			fprintf(stderr, "mkdir %s: %s\n", path, strerror(-ret));
+			return false;
+		}
+	}
+	return true;
+}
+
+static void image_close(age_ctx *a)
+{
+	if (a->fs != NULL) a1fs_close(a->fs);
+	if (a->fd >= 0) close(a->fd);
+}
+
+
+/** Percentage of the data blocks in use. */
+static double utilization(age_ctx *a)
+{
+	struct statvfs st;
+	a1fs_statfs(a->fs, &st);
+	a1fs_superblock *sb = a->fs->sb;
+	uint64_t data_blocks = sb->blocks_count - sb->data_start;
+	return 100.0 * (data_blocks - st.f_bfree) / data_blocks;
+}
+
+/** Write data to a file in chunks; false if a write failed. */
+static bool write_file(age_ctx *a, const char *path, uint64_t offset, uint64_t size, size_t chunk)
+{
+	while (size > 0) {
+		size_t n = (size < chunk) ? size : chunk;
+		// Vary the data, so that compressed files don't shrink to nothing
+		size_t skew = (offset / 64) % (a->data_size - chunk + 1);
+		int ret = a1fs_write(a->fs, path, a->data + skew, n, offset);
+		if (ret < 0) return false;
+		offset += n;
+		size -= n;
+	}
+	return true;
+}
+
+static void op_create(age_ctx *a)
+{
+	if (a->n_files == a->cap_files) {
+		size_t cap = a->cap_files ? a->cap_files * 2 : 4096;
+		age_file *files = realloc(a->files, cap * sizeof(age_file));
+		if (files == NULL) {
+			a->failed++;
+			return;
+		}
+		a->files = files;
+		a->cap_files = cap;
+	}
+
+	age_file f = { (uint32_t)(rnd(a) % a->opts->n_dirs), a->next_id++, rnd_size(a) };
+	char path[A1FS_PATH_MAX];
+	file_path(&f, path);
+	if (a1fs_create(a->fs, path, 0644) < 0) {
+		a->failed++;
+		return;
+	}
+	if (!write_file(a, path, 0, f.size, a->opts->write_size)) {
+		// Keep the file anyway, with whatever was written; a full image
+		// frees up again with the next deletes
+		struct stat st;
+		a1fs_stat(a->fs, path, &st);
+		f.size = st.st_size;
+		a->failed++;
+	}
+	a1fs_flush(a->fs, path);
+	a->files[a->n_files++] = f;
+}
+
+static void op_delete(age_ctx *a)
+{
+	size_t i = rnd(a) % a->n_files;
+	char path[A1FS_PATH_MAX];
+	file_path(&a->files[i], path);
+	if (a1fs_unlink(a->fs, path) < 0) a->failed++;
+	a->files[i] = a->files[--a->n_files];
+}
+
+static void op_append(age_ctx *a)
+{
+	age_file *f = &a->files[rnd(a) % a->n_files];
+	char path[A1FS_PATH_MAX];
+	file_path(f, path);
+	size_t n = a->opts->append_size;
+	if (f->size + n > a->opts->max_size || !write_file(a, path, f->size, n, n)) {
+		a->failed++;
+		return;
+	}
+	f->size += n;
+	a1fs_flush(a->fs, path);
+}
+
+
+/** Fragmentation metrics of a sample. */
+typedef struct sample {
+	uint64_t files;
+	uint64_t extents;
+	uint64_t file_blocks;
+	/** Files with more than one extent. */
+	uint64_t fragmented;
+	uint64_t max_extents;
+	uint64_t free_blocks;
+	uint64_t free_runs;
+	uint64_t longest_run;
+	/** Sequential read throughput in MiB/s. */
+	double read_mibs;
+} sample;
+
+static void sample_extents(age_ctx *a, sample *s)
+{
+	fs_ctx *fs = a->fs;
+	for (uint64_t i = 1; i < fs->sb->inodes_count; i++) {
+		if (!(fs->inode_bitmap[i / 8] & (1 << (i % 8)))) continue;
+		const a1fs_inode *inode = &fs->inodes[i];
+		if (inode->type == 0 || (inode->flags & A1FS_INODE_ORPHAN)) continue;
+		uint64_t n = 512 - inode->free_extent_num;
+		s->files++;
+		s->extents += n;
+		s->file_blocks += (inode->size + A1FS_BLOCK_SIZE - 1) / A1FS_BLOCK_SIZE;
+		if (n > 1) s->fragmented++;
+		if (n > s->max_extents) s->max_extents = n;
+	}
+}
+
+/**
+ * Scan the runs of free data blocks. Blocks sitting in the allocation pools
+ * count as used; there are only a few of them.
+ */
+static void sample_free_space(age_ctx *a, sample *s)
+{
+	a1fs_superblock *sb = a->fs->sb;
+	const unsigned char *bitmap = a->fs->block_bitmap;
+	uint64_t run = 0;
+	for (uint64_t b = sb->data_start; b <= sb->blocks_count; b++) {
+		if (b < sb->blocks_count && !(bitmap[b / 8] & (1 << (b % 8)))) {
+			run++;
+			continue;
+		}
+		if (run == 0) continue;
+		s->free_blocks += run;
+		s->free_runs++;
+		if (run > s->longest_run) s->longest_run = run;
+		run = 0;
+	}
+}
+
+/** Read a random sample of files from start to end, in 1 MiB reads. */
+static void sample_reads(age_ctx *a, sample *s)
+{
+	if (a->n_files == 0) return;
+	// Draw the files from their own generator, so that sampling doesn't
+	// change the churn
+	age_ctx r = { .rng = a->rng ^ 0x5DEECE66Dul };
+	uint64_t bytes = 0;
+	struct timespec start, end;
+	char path[A1FS_PATH_MAX];
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned int i = 0; i < a->opts->n_reads; i++) {
+		const age_file *f = &a->files[rnd(&r) % a->n_files];
+		file_path(f, path);
+		for (uint64_t off = 0; off < f->size; off += 1 << 20) {
+			int ret = a1fs_read(a->fs, path, a->buf, 1 << 20, off);
+			if (ret <= 0) break;
+			bytes += ret;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	s->read_mibs = (secs > 0) ? bytes / secs / (1 << 20) : 0;
+}
+
+static void print_sample(age_ctx *a, uint64_t ops)
+{
+	sample s = {0};
+	sample_extents(a, &s);
+	sample_free_space(a, &s);
+	sample_reads(a, &s);
+	printf("%lu\t%lu\t%.1f\t%.2f\t%.2f\t%lu\t%.1f\t%lu\t%lu\t%.1f\t%.1f\t%lu\n",
+	       ops, s.files, utilization(a),
+	       s.files ? (double)s.extents / s.files : 0.0,
+	       s.file_blocks ? (double)s.extents / s.file_blocks * 256 : 0.0,
+	       s.max_extents,
+	       s.files ? 100.0 * s.fragmented / s.files : 0.0,
+	       s.free_runs, s.longest_run,
+	       s.free_runs ? (double)s.free_blocks / s.free_runs : 0.0,
+	       s.read_mibs, a->failed);
+	fflush(stdout);
+}
+
+
+int main(int argc, char *argv[])
+{
+	age_opts opts = {0};// defaults are all 0
+	if (!parse_args(argc, argv, &opts)) {
+		// Invalid arguments, print help to stderr
+		print_help(stderr, argv[0]);
+		return 1;
+	}
+	if (opts.help) {
+		// Help requested, print it to stdout
+		print_help(stdout, argv[0]);
+		return 0;
+	}
+
+	age_ctx a = { .opts = &opts, .rng = opts.seed };
+	size_t chunk = (opts.write_size > opts.append_size) ? opts.write_size : opts.append_size;
+	a.data_size = 2 * chunk;
+	a.data = malloc(a.data_size);
+	a.buf = malloc(1 << 20);
+	if (a.data == NULL || a.buf == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	for (size_t i = 0; i < a.data_size; i++) a.data[i] = (char)rnd(&a);
+
+	int ret = 1;
+	if (!image_open(&a)) goto end;
+
+	if (opts.img_path != NULL) {
+		printf("# image=%s", opts.img_path);
+	} else {
+		printf("# size_mib=%zu inodes=%zu", opts.size_mib, opts.n_inodes);
+	}
+	printf(" ops=%lu median=%lu sigma=%.2f max_size=%lu delete=%u%% append=%u%% append_size=%zu"
+	       " write_size=%zu fullness=%u%% dirs=%u seed=%lu\n", opts.n_ops, opts.median, opts.sigma,
+	       opts.max_size, opts.delete_pct, opts.append_pct, opts.append_size, opts.write_size,
+	       opts.fullness, opts.n_dirs, opts.seed);
+	printf("# ops\tfiles\tused_pct\textents_per_file\textents_per_mib\tmax_extents"
+	       "\tfragmented_pct\tfree_runs\tlongest_free_run\tavg_free_run\tread_mib_s\tfailed\n");
+	print_sample(&a, 0);
+
+	for (uint64_t op = 1; op <= opts.n_ops; op++) {
+		unsigned int r = rnd(&a) % 100;
+		if (a.n_files > 0 && (r < opts.delete_pct || utilization(&a) >= opts.fullness)) {
+			op_delete(&a);
+		} else if (a.n_files > 0 && r < opts.delete_pct + opts.append_pct) {
+			op_append(&a);
+		} else {
+			op_create(&a);
+		}
+		if (op % opts.interval == 0) print_sample(&a, op);
+	}
+	ret = 0;
+
+end:
+	image_close(&a);
+	free(a.files);
+	free(a.data);
+	free(a.buf);
+	return ret;
+}
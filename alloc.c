@@ -0,0 +1,503 @@
+/**
+ * a1fs block and inode allocator implementation.
+ */
+
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "alloc.h"
+#include "fs_ctx.h"
+#include "helper.h"
+#include "trace.h"
+
+
+/** Number of entries moved between a pool and the bitmaps at a time. */
+#define BLOCK_BATCH (A1FS_POOL_BLOCKS / 2)
+#define INODE_BATCH (A1FS_POOL_INODES / 2)
+
+static bool test_bit(const unsigned char *bitmap, uint32_t bit)
+{
+	return bitmap[bit / 8] & (1 << (bit % 8));
+}
+
+static void flip_bit(fs_ctx *fs, unsigned char *bitmap, uint32_t bit, bool val)
+{
+	if (val) {
+		bitmap[bit / 8] |= 1 << (bit % 8);
+	} else {
+		bitmap[bit / 8] &= ~(1 << (bit % 8));
+	}
+	journal_dirty(fs, &bitmap[bit / 8], 1);
+
+	if (bitmap == fs->block_bitmap && fs->regions != NULL) {
+		a1fs_region *region = &fs->regions[bit / A1FS_REGION_BLOCKS];
+		if (region->free != A1FS_REGION_UNKNOWN) region->free += val ? -1 : 1;
+		// Only needed in the stored summary, found again on unmount
+		region->longest = A1FS_REGION_UNKNOWN;
+	}
+}
+
+/** Count the free blocks of a region and find its longest free run. */
+static void scan_region(fs_ctx *fs, uint32_t r)
+{
+	a1fs_blk_t start = r * A1FS_REGION_BLOCKS;
+	a1fs_blk_t end = (fs->sb->blocks_count - start < A1FS_REGION_BLOCKS) ?
+	                 fs->sb->blocks_count : start + A1FS_REGION_BLOCKS;
+	uint32_t free = 0, longest = 0, run = 0;
+	for (a1fs_blk_t blk = start; blk < end; blk++) {
+		if (blk % 8 == 0 && fs->block_bitmap[blk / 8] == 0xff && blk + 8 <= end) {
+			run = 0;
+			blk += 7;
+		} else if (test_bit(fs->block_bitmap, blk)) {
+			run = 0;
+		} else {
+			free++;
+			if (++run > longest) longest = run;
+		}
+	}
+	fs->regions[r].free = free;
+	fs->regions[r].longest = longest;
+}
+
+/** Check if a region has no free blocks, scanning it on first use. */
+static bool region_full(fs_ctx *fs, uint32_t r)
+{
+	if (fs->regions[r].free == A1FS_REGION_UNKNOWN) scan_region(fs, r);
+	return fs->regions[r].free == 0;
+}
+
+/**
+ * Take up to n free bits in [first, end) from the bitmap, scanning from *hint
+ * and wrapping around. The caller holds the allocator lock.
+ *
+ * @param out  array that receives the bit numbers in increasing order (apart
+ *             from a wrap around).
+ * @return     number of bits taken.
+ */
+static int take_bits(fs_ctx *fs, unsigned char *bitmap, uint32_t first, uint32_t end,
+                     uint32_t *hint, uint32_t *out, int n)
+{
+	if (first >= end) return 0;
+	uint32_t bit = (*hint >= first && *hint < end) ? *hint : first;
+	bool summary = (bitmap == fs->block_bitmap);
+	int taken = 0;
+	for (uint32_t scanned = 0; scanned < end - first && taken < n; ) {
+		uint32_t step = 1;
+		if (summary && (scanned == 0 || bit == first || bit % A1FS_REGION_BLOCKS == 0) &&
+		    region_full(fs, bit / A1FS_REGION_BLOCKS)) {
+			// Skip the rest of a full region
+			uint32_t next = (bit / A1FS_REGION_BLOCKS + 1) * A1FS_REGION_BLOCKS;
+			step = ((next < end) ? next : end) - bit;
+		} else if (bit % 8 == 0 && bitmap[bit / 8] == 0xff && bit + 8 <= end) {
+			// Skip whole bytes that are fully used
+			step = 8;
+		} else if (!test_bit(bitmap, bit)) {
+			flip_bit(fs, bitmap, bit, true);
+			out[taken++] = bit;
+		}
+		scanned += step;
+		bit += step;
+		if (bit >= end) bit = first;
+	}
+	*hint = bit;
+	return taken;
+}
+
+static alloc_pool *my_pool(fs_ctx *fs)
+{
+	int cpu = sched_getcpu();
+	return &fs->pools[(cpu < 0 ? 0 : cpu) % fs->n_pools];
+}
+
+static void add_delta(int64_t *delta, int64_t val)
+{
+	__atomic_fetch_add(delta, val, __ATOMIC_RELAXED);
+}
+
+/** Return the oldest half of the pooled blocks to the bitmap. */
+static void spill_blocks(fs_ctx *fs, alloc_pool *pool)
+{
+	pthread_mutex_lock(&fs->alloc_lock);
+	for (int i = 0; i < BLOCK_BATCH; i++) {
+		flip_bit(fs, fs->block_bitmap, pool->blocks[i], false);
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	pool->n_blocks -= BLOCK_BATCH;
+	memmove(pool->blocks, &pool->blocks[BLOCK_BATCH], pool->n_blocks * sizeof(a1fs_blk_t));
+}
+
+static void spill_inodes(fs_ctx *fs, alloc_pool *pool)
+{
+	pthread_mutex_lock(&fs->alloc_lock);
+	for (int i = 0; i < INODE_BATCH; i++) {
+		flip_bit(fs, fs->inode_bitmap, pool->inodes[i], false);
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	pool->n_inodes -= INODE_BATCH;
+	memmove(pool->inodes, &pool->inodes[INODE_BATCH], pool->n_inodes * sizeof(a1fs_ino_t));
+}
+
+/** Refill an empty pool from the bitmap. */
+static void refill_blocks(fs_ctx *fs, alloc_pool *pool)
+{
+	uint32_t got[BLOCK_BATCH];
+	TRACE_START(start);
+	pthread_mutex_lock(&fs->alloc_lock);
+	int n = take_bits(fs, fs->block_bitmap, fs->sb->data_start, fs->sb->blocks_count,
+	                  &fs->blk_hint, got, BLOCK_BATCH);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	stats_count(fs, STATS_POOL_REFILLS, 1);
+	TRACE(TRACE_POOL_REFILL, start, (a1fs_ino_t)-1, n, 0, 0);
+	// Blocks are allocated from the end, keep them in increasing order
+	for (int i = 0; i < n; i++) {
+		pool->blocks[i] = got[n - 1 - i];
+	}
+	pool->n_blocks = n;
+}
+
+/**
+ * Initialize the lazily initialized part of the inode table up to and
+ * including the block holding the given inode. The caller holds the allocator
+ * lock.
+ */
+static void init_inode_table(fs_ctx *fs, a1fs_ino_t ino)
+{
+	a1fs_superblock *sb = fs->sb;
+	if (sb->inodes_init_end == 0 || ino < sb->inodes_init_end) return;
+
+	uint64_t per_block = A1FS_BLOCK_SIZE / sizeof(a1fs_inode);
+	uint64_t end = (ino / per_block + 1) * per_block;
+	if (end > sb->inodes_count) end = sb->inodes_count;
+	memset(&fs->inodes[sb->inodes_init_end], 0, (end - sb->inodes_init_end) * sizeof(a1fs_inode));
+	journal_dirty(fs, &fs->inodes[sb->inodes_init_end], (end - sb->inodes_init_end) * sizeof(a1fs_inode));
+	journal_dirty(fs, sb, sizeof(*sb));
+	sb->inodes_init_end = (end == sb->inodes_count) ? 0 : end;
+}
+
+static void refill_inodes(fs_ctx *fs, alloc_pool *pool)
+{
+	uint32_t got[INODE_BATCH];
+	TRACE_START(start);
+	pthread_mutex_lock(&fs->alloc_lock);
+	int n = take_bits(fs, fs->inode_bitmap, 0, fs->sb->inodes_count, &fs->ino_hint, got, INODE_BATCH);
+	for (int i = 0; i < n; i++) {
+		init_inode_table(fs, got[i]);
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	stats_count(fs, STATS_POOL_REFILLS, 1);
+	TRACE(TRACE_POOL_REFILL, start, (a1fs_ino_t)-1, n, 1, 0);
+	for (int i = 0; i < n; i++) {
+		pool->inodes[i] = got[n - 1 - i];
+	}
+	pool->n_inodes = n;
+}
+
+/**
+ * Load the free space summary if the image was unmounted cleanly, and mark
+ * the image as mounted before the bitmaps change.
+ */
+static bool summary_load(fs_ctx *fs)
+{
+	a1fs_superblock *sb = fs->sb;
+	fs->n_regions = (sb->blocks_count + A1FS_REGION_BLOCKS - 1) / A1FS_REGION_BLOCKS;
+	fs->regions = malloc(fs->n_regions * sizeof(a1fs_region));
+	if (fs->regions == NULL) return false;
+	// All unknown, regions are scanned when first used
+	memset(fs->regions, 0xff, fs->n_regions * sizeof(a1fs_region));
+	if (sb->state != A1FS_STATE_CLEAN) return true;
+
+	sb->state = 0;
+	journal_dirty(fs, sb, sizeof(*sb));
+	// The stored summary can't be trusted after a crash once any bitmap
+	// change may have reached the disk
+	if (writeback_write(fs, 0, sb, 1) != 0 || writeback_flush(fs) != 0) return true;
+	if ((uint64_t)sb->summary_blocks * A1FS_BLOCK_SIZE >= fs->n_regions * sizeof(a1fs_region)) {
+		memcpy(fs->regions, (char *)fs->image + (size_t)sb->summary_start * A1FS_BLOCK_SIZE,
+		       fs->n_regions * sizeof(a1fs_region));
+	}
+	return true;
+}
+
+/**
+ * Store the free space summary and mark the image as clean. Regions that
+ * changed are scanned again for their longest free run; regions that were
+ * never scanned are stored as unknown.
+ */
+static void summary_store(fs_ctx *fs)
+{
+	a1fs_superblock *sb = fs->sb;
+	if ((uint64_t)sb->summary_blocks * A1FS_BLOCK_SIZE < fs->n_regions * sizeof(a1fs_region)) return;
+
+	for (uint32_t r = 0; r < fs->n_regions; r++) {
+		if (fs->regions[r].free != A1FS_REGION_UNKNOWN &&
+		    fs->regions[r].longest == A1FS_REGION_UNKNOWN) {
+			scan_region(fs, r);
+		}
+	}
+	a1fs_region *summary = (a1fs_region *)((char *)fs->image + (size_t)sb->summary_start * A1FS_BLOCK_SIZE);
+	memcpy(summary, fs->regions, fs->n_regions * sizeof(a1fs_region));
+	journal_dirty(fs, summary, fs->n_regions * sizeof(a1fs_region));
+
+	// The journal commits the flag together with the summary and the bitmaps;
+	// in place, they must reach the disk first
+	if (fs->journal == NULL && writeback_range(fs, 0, sb->data_start) != 0) return;
+	sb->state = A1FS_STATE_CLEAN;
+	journal_dirty(fs, sb, sizeof(*sb));
+}
+
+
+bool alloc_init(fs_ctx *fs)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_CONF);
+	fs->n_pools = (ncpu < 1) ? 1 : (ncpu > 256 ? 256 : (int)ncpu);
+	fs->pools = aligned_alloc(_Alignof(alloc_pool), fs->n_pools * sizeof(alloc_pool));
+	if (fs->pools == NULL) return false;
+	memset(fs->pools, 0, fs->n_pools * sizeof(alloc_pool));
+	for (int i = 0; i < fs->n_pools; i++) {
+		pthread_mutex_init(&fs->pools[i].lock, NULL);
+	}
+	fs->blk_hint = fs->sb->data_start;
+	fs->ino_hint = 0;
+	if (!summary_load(fs)) {
+		free(fs->pools);
+		fs->pools = NULL;
+		return false;
+	}
+	return true;
+}
+
+void alloc_destroy(fs_ctx *fs)
+{
+	for (int i = 0; i < fs->n_pools; i++) {
+		alloc_pool *pool = &fs->pools[i];
+		for (int j = 0; j < pool->n_blocks; j++) {
+			flip_bit(fs, fs->block_bitmap, pool->blocks[j], false);
+		}
+		for (int j = 0; j < pool->n_inodes; j++) {
+			flip_bit(fs, fs->inode_bitmap, pool->inodes[j], false);
+		}
+		pool->n_blocks = 0;
+		pool->n_inodes = 0;
+	}
+	alloc_sync(fs);
+	summary_store(fs);
+	for (int i = 0; i < fs->n_pools; i++) {
+		pthread_mutex_destroy(&fs->pools[i].lock);
+	}
+	free(fs->pools);
+	fs->pools = NULL;
+	free(fs->regions);
+	fs->regions = NULL;
+}
+
+void alloc_sync(fs_ctx *fs)
+{
+	for (int i = 0; i < fs->n_pools; i++) {
+		alloc_pool *pool = &fs->pools[i];
+		int64_t blocks = __atomic_exchange_n(&pool->free_blocks_delta, 0, __ATOMIC_RELAXED);
+		int64_t inodes = __atomic_exchange_n(&pool->free_inodes_delta, 0, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&fs->sb->free_blocks_count, blocks, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&fs->sb->free_inodes_count, inodes, __ATOMIC_RELAXED);
+	}
+	journal_dirty(fs, fs->sb, sizeof(*fs->sb));
+}
+
+a1fs_blk_t alloc_block(fs_ctx *fs)
+{
+	alloc_pool *pool = my_pool(fs);
+	pthread_mutex_lock(&pool->lock);
+	if (pool->n_blocks == 0) refill_blocks(fs, pool);
+	if (pool->n_blocks > 0) {
+		a1fs_blk_t blk = pool->blocks[--pool->n_blocks];
+		add_delta(&pool->free_blocks_delta, -1);
+		pthread_mutex_unlock(&pool->lock);
+		stats_count(fs, STATS_BLOCKS_ALLOCATED, 1);
+		return blk;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	// The bitmap is full, the remaining free blocks are cached by other pools
+	for (int i = 0; i < fs->n_pools; i++) {
+		alloc_pool *victim = &fs->pools[i];
+		pthread_mutex_lock(&victim->lock);
+		if (victim->n_blocks > 0) {
+			a1fs_blk_t blk = victim->blocks[--victim->n_blocks];
+			add_delta(&victim->free_blocks_delta, -1);
+			pthread_mutex_unlock(&victim->lock);
+			stats_count(fs, STATS_BLOCKS_ALLOCATED, 1);
+			return blk;
+		}
+		pthread_mutex_unlock(&victim->lock);
+	}
+	return (a1fs_blk_t)-1;
+}
+
+a1fs_blk_t alloc_run(fs_ctx *fs, a1fs_blk_t count, a1fs_blk_t *start)
+{
+	a1fs_blk_t first = fs->sb->data_start;
+	a1fs_blk_t end = fs->sb->blocks_count;
+	if (count == 0 || first >= end) return 0;
+
+	pthread_mutex_lock(&fs->alloc_lock);
+	a1fs_blk_t blk = (fs->blk_hint >= first && fs->blk_hint < end) ? fs->blk_hint : first;
+	a1fs_blk_t run_start = blk, run = 0, best_start = 0, best = 0;
+	for (uint32_t scanned = 0; scanned < end - first && run < count; ) {
+		uint32_t step = 1;
+		bool used;
+		if ((scanned == 0 || blk == first || blk % A1FS_REGION_BLOCKS == 0) &&
+		    region_full(fs, blk / A1FS_REGION_BLOCKS)) {
+			uint32_t next = (blk / A1FS_REGION_BLOCKS + 1) * A1FS_REGION_BLOCKS;
+			step = ((next < end) ? next : end) - blk;
+			used = true;
+		} else if (blk % 8 == 0 && fs->block_bitmap[blk / 8] == 0xff && blk + 8 <= end) {
+			step = 8;
+			used = true;
+		} else {
+			used = test_bit(fs->block_bitmap, blk);
+		}
+		if (!used) {
+			if (run == 0) run_start = blk;
+			run++;
+		}
+		scanned += step;
+		blk += step;
+		// Runs end at used blocks and don't wrap around
+		if (used || blk >= end) {
+			if (run > best) {
+				best = run;
+				best_start = run_start;
+			}
+			run = 0;
+		}
+		if (blk >= end) blk = first;
+	}
+	if (run > best) {
+		best = run;
+		best_start = run_start;
+	}
+	for (a1fs_blk_t i = 0; i < best; i++) {
+		flip_bit(fs, fs->block_bitmap, best_start + i, true);
+	}
+	// The next run follows this one, so that runs allocated in turn are laid
+	// out in order
+	fs->blk_hint = best_start + best;
+	pthread_mutex_unlock(&fs->alloc_lock);
+
+	if (best == 0) return 0;
+	add_delta(&my_pool(fs)->free_blocks_delta, -(int64_t)best);
+	stats_count(fs, STATS_BLOCKS_ALLOCATED, best);
+	*start = best_start;
+	return best;
+}
+
+a1fs_ino_t alloc_inode(fs_ctx *fs)
+{
+	alloc_pool *pool = my_pool(fs);
+	pthread_mutex_lock(&pool->lock);
+	if (pool->n_inodes == 0) refill_inodes(fs, pool);
+	if (pool->n_inodes > 0) {
+		a1fs_ino_t ino = pool->inodes[--pool->n_inodes];
+		add_delta(&pool->free_inodes_delta, -1);
+		pthread_mutex_unlock(&pool->lock);
+		stats_count(fs, STATS_INODES_ALLOCATED, 1);
+		return ino;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 0; i < fs->n_pools; i++) {
+		alloc_pool *victim = &fs->pools[i];
+		pthread_mutex_lock(&victim->lock);
+		if (victim->n_inodes > 0) {
+			a1fs_ino_t ino = victim->inodes[--victim->n_inodes];
+			add_delta(&victim->free_inodes_delta, -1);
+			pthread_mutex_unlock(&victim->lock);
+			stats_count(fs, STATS_INODES_ALLOCATED, 1);
+			return ino;
+		}
+		pthread_mutex_unlock(&victim->lock);
+	}
+	return (a1fs_ino_t)-1;
+}
+
+/**
+ * Drop a reference held by a reflink clone, if there is one.
+ *
+ * @return  true if the block is still referenced and must not be freed.
+ */
+static bool drop_ref(a1fs_blk_t blk, fs_ctx *fs)
+{
+	a1fs_ref_t *ref = block_refcount(blk, fs);
+	// A block only referenced by the caller's file can't gain references
+	// concurrently (that would need a clone of that file), so no lock is
+	// needed to see that it is unshared
+	if (ref == NULL || __atomic_load_n(ref, __ATOMIC_RELAXED) == 0) return false;
+
+	pthread_mutex_lock(&fs->alloc_lock);
+	bool shared = *ref > 0;
+	if (shared) {
+		__atomic_store_n(ref, *ref - 1, __ATOMIC_RELAXED);
+		journal_dirty(fs, ref, sizeof(*ref));
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	return shared;
+}
+
+void release_blocks(a1fs_blk_t start, a1fs_blk_t count, fs_ctx *fs)
+{
+	alloc_pool *pool = my_pool(fs);
+	uint64_t freed = 0;
+	pthread_mutex_lock(&pool->lock);
+	// Pooled blocks are handed out last in first out; push the range from
+	// its end so that a file reusing it gets it in increasing order and
+	// can extend its extents
+	for (a1fs_blk_t blk = start + count; blk-- > start; ) {
+		if (drop_ref(blk, fs)) continue;
+		writeback_forget(fs, blk);
+		journal_release(fs, blk);
+		if (pool->n_blocks == A1FS_POOL_BLOCKS) spill_blocks(fs, pool);
+		pool->blocks[pool->n_blocks++] = blk;
+		add_delta(&pool->free_blocks_delta, 1);
+		freed++;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	stats_count(fs, STATS_BLOCKS_FREED, freed);
+}
+
+void release_block(a1fs_blk_t blk, fs_ctx *fs)
+{
+	release_blocks(blk, 1, fs);
+}
+
+void release_inode(a1fs_ino_t ino, fs_ctx *fs)
+{
+	alloc_pool *pool = my_pool(fs);
+	pthread_mutex_lock(&pool->lock);
+	if (pool->n_inodes == A1FS_POOL_INODES) spill_inodes(fs, pool);
+	pool->inodes[pool->n_inodes++] = ino;
+	add_delta(&pool->free_inodes_delta, 1);
+	pthread_mutex_unlock(&pool->lock);
+	stats_count(fs, STATS_INODES_FREED, 1);
+}
+
+uint64_t free_blocks(fs_ctx *fs)
+{
+	int64_t count = __atomic_load_n(&fs->sb->free_blocks_count, __ATOMIC_RELAXED);
+	for (int i = 0; i < fs->n_pools; i++) {
+		count += __atomic_load_n(&fs->pools[i].free_blocks_delta, __ATOMIC_RELAXED);
+	}
+	return (count < 0) ? 0 : (uint64_t)count;
+}
+
+uint64_t free_inodes(fs_ctx *fs)
+{
+	int64_t count = __atomic_load_n(&fs->sb->free_inodes_count, __ATOMIC_RELAXED);
+	for (int i = 0; i < fs->n_pools; i++) {
+		count += __atomic_load_n(&fs->pools[i].free_inodes_delta, __ATOMIC_RELAXED);
+	}
+	return (count < 0) ? 0 : (uint64_t)count;
+}
@@ -0,0 +1,147 @@
+/**
+ * a1fs block and inode allocator.
+ *
+ * Free blocks and inode numbers are handed out from per-CPU pools that are
+ * refilled in batches from the global bitmaps, so that threads allocating in
+ * parallel don't contend on the allocator lock or on the free counters in the
+ * superblock. Each pool keeps its own delta of the free counters; the deltas
+ * are folded back into the superblock by alloc_sync().
+ *
+ * Bits of blocks and inodes sitting in a pool are set in the bitmaps while
+ * the file system is mounted; alloc_destroy() clears them again.
+ *
+ * Block bitmap scans skip regions that the free space summary (see
+ * a1fs_region) shows to be full. The summary is loaded on mount if the image
+ * was unmounted cleanly, and stored again by alloc_destroy().
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+
+/** Maximum number of free blocks cached by a pool. */
+#define A1FS_POOL_BLOCKS 64
+/** Maximum number of free inodes cached by a pool. */
+#define A1FS_POOL_INODES 16
+
+struct fs_ctx;
+
+/** Per-CPU allocation pool. */
+typedef struct alloc_pool {
+	/** Protects the pool contents. */
+	pthread_mutex_t lock;
+	/** Cached free blocks, allocated from the end. */
+	a1fs_blk_t blocks[A1FS_POOL_BLOCKS];
+	int n_blocks;
+	/** Cached free inodes, allocated from the end. */
+	a1fs_ino_t inodes[A1FS_POOL_INODES];
+	int n_inodes;
+	/** Changes of the free counters not yet folded into the superblock. */
+	int64_t free_blocks_delta;
+	int64_t free_inodes_delta;
+} __attribute__((aligned(64))) alloc_pool;
+
+/**
+ * Create the allocation pools, load the free space summary and mark the image
+ * as mounted.
+ *
+ * @param fs  file system context.
+ * @return    true on success; false if out of memory.
+ */
+bool alloc_init(struct fs_ctx *fs);
+
+/**
+ * Return all pooled blocks and inodes to the bitmaps, fold the counters into
+ * the superblock, store the free space summary, mark the image as clean and
+ * free the pools.
+ *
+ * @param fs  file system context.
+ */
+void alloc_destroy(struct fs_ctx *fs);
+
+/**
+ * Fold the free counter deltas of all pools into the superblock.
+ *
+ * @param fs  file system context.
+ */
+void alloc_sync(struct fs_ctx *fs);
+
+/**
+ * Allocate a data block.
+ *
+ * @param fs  file system context.
+ * @return    block number; (a1fs_blk_t)-1 if the image is full.
+ */
+a1fs_blk_t alloc_block(struct fs_ctx *fs);
+
+/**
+ * Allocate a run of contiguous data blocks, for a file whose size is known
+ * up front (e.g. by a bulk import). The first free run of count blocks from
+ * the allocation hint is taken; if there is none, the longest free run in
+ * the bitmap is taken instead, and the caller allocates the rest with further
+ * calls. The hint moves past the run, so runs allocated one after another
+ * are laid out in order. Blocks cached by the pools are not considered.
+ *
+ * @param fs     file system context.
+ * @param count  number of blocks wanted.
+ * @param start  receives the first block of the run.
+ * @return       number of blocks allocated, at most count; 0 if the bitmap
+ *               has no free blocks.
+ */
+a1fs_blk_t alloc_run(struct fs_ctx *fs, a1fs_blk_t count, a1fs_blk_t *start);
+
+/**
+ * Allocate an inode.
+ *
+ * @param fs  file system context.
+ * @return    inode number; (a1fs_ino_t)-1 if there is no free inode.
+ */
+a1fs_ino_t alloc_inode(struct fs_ctx *fs);
+
+/**
+ * Drop one reference to each block of a run of data blocks. A block is only
+ * freed when no reflink clone still refers to it.
+ *
+ * @param start  first block of the run.
+ * @param count  number of blocks.
+ * @param fs     file system context.
+ */
+void release_blocks(a1fs_blk_t start, a1fs_blk_t count, struct fs_ctx *fs);
+
+/**
+ * Drop one reference to a data block (see release_blocks()).
+ *
+ * @param blk  block number.
+ * @param fs   file system context.
+ */
+void release_block(a1fs_blk_t blk, struct fs_ctx *fs);
+
+/**
+ * Free an inode.
+ *
+ * @param ino  inode number.
+ * @param fs   file system context.
+ */
+void release_inode(a1fs_ino_t ino, struct fs_ctx *fs);
+
+/**
+ * Get the number of free data blocks, including blocks cached in the pools.
+ * The value may be stale as soon as it is returned.
+ *
+ * @param fs  file system context.
+ * @return    number of free blocks.
+ */
+uint64_t free_blocks(struct fs_ctx *fs);
+
+/**
+ * Get the number of free inodes, including inodes cached in the pools.
+ *
+ * @param fs  file system context.
+ * @return    number of free inodes.
+ */
+uint64_t free_inodes(struct fs_ctx *fs);
@@ -0,0 +1,444 @@
+/**
+ * a1fs microbenchmarks.
+ *
+ * Times the hot paths of helper.c directly, without FUSE, on images kept in
+ * memory: bitmap scans, path lookups at various depths and directory sizes,
+ * directory entry churn, growing and shrinking files, and the file data copy
+ * paths. Each benchmark runs on a freshly formatted image (formatted with
+ * mkfs.a1fs) whose data blocks are filled to the requested level first.
+ *
+ * The results are printed as tab-separated lines "name params iterations
+ * ns/op", preceded by a '#' line with the image configuration, so that runs
+ * can be compared with standard tools.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+#include "helper.h"
+#include "map.h"
+
+
+/** Command line options. */
+typedef struct bench_opts {
+	/** Image size in MiB. */
+	size_t size_mib;
+	/** Number of inodes. */
+	size_t n_inodes;
+	/** Percentage of the data blocks in use before each benchmark. */
+	unsigned int fullness;
+	/** Fill the data blocks at random rather than from the start. */
+	bool random_fill;
+	/** Minimum duration of each benchmark in milliseconds. */
+	long duration_ms;
+	/** Only run the benchmarks whose name contains this string. */
+	const char *filter;
+	/** mkfs.a1fs executable. */
+	const char *mkfs;
+
+	/** Print help and exit. */
+	bool help;
+
+} bench_opts;
+
+static const char *help_str = "\
+Usage: %s options\n\
+\n\
+Run the a1fs microbenchmarks on in-memory images and print one line per\n\
+benchmark: name, parameters, number of iterations and nanoseconds per\n\
+operation, separated by tabs.\n\
+\n\
+Options:\n\
+    -s MiB   image size (default: 256)\n\
+    -i num   number of inodes (default: 8192)\n\
+    -f pct   percentage of the data blocks in use (default: 0)\n\
+    -r       use data blocks at random rather than from the start\n\
+    -t ms    minimum duration of each benchmark (default: 200)\n\
+    -b name  only run benchmarks whose name contains this string\n\
+    -m path  mkfs.a1fs executable (default: ./mkfs.a1fs)\n\
+    -h       print help and exit\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+	fprintf(f, help_str, progname);
+}
+
+
+static bool parse_args(int argc, char *argv[], bench_opts *opts)
+{
+	int o;
+	while ((o = getopt(argc, argv, "s:i:f:rt:b:m:h")) != -1) {
+		switch (o) {
+			case 's': opts->size_mib = strtoul(optarg, NULL, 10); break;
+			case 'i': opts->n_inodes = strtoul(optarg, NULL, 10); break;
+			case 'f': opts->fullness = strtoul(optarg, NULL, 10); break;
+			case 'r': opts->random_fill = true; break;
+			case 't': opts->duration_ms = strtol(optarg, NULL, 10); break;
+			case 'b': opts->filter = optarg; break;
+			case 'm': opts->mkfs = optarg; break;
+
+			case 'h': opts->help = true; return true;// skip other arguments
+
+			case '?': return false;
+			default : assert(false);
+		}
+	}
+
+	if (opts->size_mib == 0) opts->size_mib = 256;
+	if (opts->n_inodes == 0) opts->n_inodes = 8192;
+	if (opts->duration_ms <= 0) opts->duration_ms = 200;
+	if (opts->mkfs == NULL) opts->mkfs = "./mkfs.a1fs";
+	if (opts->fullness > 99) {
+		fprintf(stderr, "Fullness must be below 100%%\n");
+		return false;
+	}
+	return true;
+}
+
+
+/** Benchmark state. */
+typedef struct bench_ctx {
+	const bench_opts *opts;
+	/** In-memory image file and its mapping. */
+	int fd;
+	fs_ctx fs;
+
+	/** Path to look up, and a copy for find_inode() to modify. */
+	char path[A1FS_PATH_MAX];
+	char path_copy[A1FS_PATH_MAX];
+	/** Directory or file the benchmark works on. */
+	a1fs_ino_t ino;
+	/** Size of each operation in bytes or blocks. */
+	size_t len;
+	/** Data buffer and the file offset of the next copy. */
+	char *buf;
+	uint64_t offset;
+} bench_ctx;
+
+/**
+ * Format a new in-memory image and fill its data blocks to the requested
+ * level. The image lives in a memfd, formatted by running mkfs.a1fs on it.
+ */
+static bool image_create(bench_ctx *b)
+{
+	const bench_opts *opts = b->opts;
+	size_t size = opts->size_mib << 20;
+	b->fd = memfd_create("a1fs-bench", 0);
+	if (b->fd < 0 || ftruncate(b->fd, size) < 0) {
+		perror("memfd");
+		if (b->fd >= 0) close(b->fd);
+		return false;
+	}
+	char path[64], inodes[32];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", b->fd);
+	snprintf(inodes, sizeof(inodes), "%zu", opts->n_inodes);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		// The child inherits the descriptor, so the path works there too
+		int null = open("/dev/null", O_WRONLY);
+		if (null >= 0) dup2(null, STDOUT_FILENO);
+		execl(opts->mkfs, opts->mkfs, "-f", "-i", inodes, path, (char *)NULL);
+		perror(opts->mkfs);
+		_exit(127);
+	}
+	int status;
+	if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "Failed to format the image\n");
+		close(b->fd);
+		return false;
+	}
+
+	void *image = map_file(path, A1FS_BLOCK_SIZE, &size);
+	if (image == NULL) {
+		close(b->fd);
+		return false;
+	}
+
+	// Fill the data blocks; the free space summary no longer matches
+	a1fs_superblock *sb = (a1fs_superblock *)image;
+	unsigned char *bitmap = (unsigned char *)image + (size_t)sb->block_bitmap_start * A1FS_BLOCK_SIZE;
+	uint64_t data_blocks = sb->blocks_count - sb->data_start;
+	uint64_t fill = data_blocks * opts->fullness / 100;
+	srand(369);
+	for (uint64_t i = 0; i < fill; ) {
+		uint64_t blk = sb->data_start + (opts->random_fill ? (uint64_t)rand() % data_blocks : i);
+		if (bitmap[blk / 8] & (1 << (blk % 8))) continue;
+		set_bit(bitmap, 1, (int)blk, 1, sb);
+		i++;
+	}
+	sb->state = 0;
+
+	if (!fs_ctx_init(&b->fs, image, size, -1, NULL)) {
+		munmap(image, size);
+		close(b->fd);
+		return false;
+	}
+	return true;
+}
+
+static void image_destroy(bench_ctx *b)
+{
+	fs_ctx_destroy(&b->fs);
+	munmap(b->fs.image, b->fs.size);
+	close(b->fd);
+}
+
+/** Create a file or directory (type 0) in a directory. */
+static a1fs_ino_t add_entry(bench_ctx *b, a1fs_ino_t dir, const char *name, uint32_t type)
+{
+	a1fs_ino_t ino = create_inode(type == 0 ? S_IFDIR | 0755 : S_IFREG | 0644, dir, &b->fs, type);
+	if (ino == (a1fs_ino_t)-1) {
+		fprintf(stderr, "Out of inodes or blocks, use a larger image\n");
+		exit(1);
+	}
+	write_dentry(name, ino, dir, &b->fs);
+	return ino;
+}
+
+/**
+ * Run an operation repeatedly for at least the requested duration and print
+ * the time it took per operation.
+ */
+static void run(bench_ctx *b, const char *name, const char *params, void (*op)(bench_ctx *))
+{
+	struct timespec start, now;
+	uint64_t iters = 0, batch = 1;
+	double elapsed_ns;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		for (uint64_t i = 0; i < batch; i++) {
+			op(b);
+		}
+		iters += batch;
+		if (batch < (1 << 16)) batch *= 2;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed_ns = (now.tv_sec - start.tv_sec) * 1e9 + (now.tv_nsec - start.tv_nsec);
+	} while (elapsed_ns < b->opts->duration_ms * 1e6);
+
+	printf("%s\t%s\t%lu\t%.1f\n", name, params, (unsigned long)iters, elapsed_ns / iters);
+	fflush(stdout);
+}
+
+
+static void op_find_free_bit(bench_ctx *b)
+{
+	a1fs_superblock *sb = b->fs.sb;
+	uint32_t bit = find_free_bit(b->fs.block_bitmap, sb->blk_bitmap_bytes, 1, sb);
+	__asm__ volatile("" : : "r"(bit));
+}
+
+static void bench_find_free_bit(bench_ctx *b)
+{
+	run(b, "find_free_bit", "bitmap=block", op_find_free_bit);
+}
+
+static void op_find_inode(bench_ctx *b)
+{
+	strcpy(b->path_copy, b->path);
+	a1fs_ino_t ino = find_inode(b->path_copy, b->fs.inodes, &b->fs);
+	if (ino != b->ino) {
+		fprintf(stderr, "find_inode(%s) failed\n", b->path);
+		exit(1);
+	}
+}
+
+/**
+ * Look up the deepest file of a chain of directories, each holding width
+ * entries with the next directory last, so that every level is scanned in
+ * full.
+ */
+static void bench_find_inode(bench_ctx *b, int depth, int width)
+{
+	a1fs_ino_t dir = 0;
+	size_t len = 0;
+	for (int level = 0; level < depth; level++) {
+		for (int i = 0; i < width - 1; i++) {
+			char name[32];
+			snprintf(name, sizeof(name), "f%d", i);
+			add_entry(b, dir, name, 1);
+		}
+		char name[32];
+		snprintf(name, sizeof(name), "d%d", level);
+		// The last level ends with a file
+		dir = add_entry(b, dir, name, (level == depth - 1) ? 1 : 0);
+		len += snprintf(b->path + len, sizeof(b->path) - len, "/%s", name);
+	}
+	b->ino = dir;
+
+	char params[64];
+	snprintf(params, sizeof(params), "depth=%d,width=%d", depth, width);
+	run(b, "find_inode", params, op_find_inode);
+}
+
+static void op_dentry_churn(bench_ctx *b)
+{
+	a1fs_inode *dir = &b->fs.inodes[b->ino];
+	write_dentry("churn", b->ino, b->ino, &b->fs);
+	a1fs_dentry *dentry = find_dentry(dir, "churn", &b->fs);
+	promote_last_dentry(dir, dentry, &b->fs);
+}
+
+/**
+ * Add an entry to a directory and remove it again. When the directory holds a
+ * multiple of 16 entries (including "." and ".."), each add allocates a
+ * directory block and each remove frees it.
+ */
+static void bench_dentry_churn(bench_ctx *b, int width)
+{
+	b->ino = add_entry(b, 0, "dir", 0);
+	for (int i = 0; i < width; i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "f%d", i);
+		add_entry(b, b->ino, name, 1);
+	}
+
+	char params[64];
+	snprintf(params, sizeof(params), "entries=%d", width + 2);
+	run(b, "dentry_churn", params, op_dentry_churn);
+}
+
+static void op_extend_shrink(bench_ctx *b)
+{
+	a1fs_inode *inode = &b->fs.inodes[b->ino];
+	if (extend_data(b->len * A1FS_BLOCK_SIZE, inode, &b->fs) != 0) {
+		fprintf(stderr, "extend_data() failed, use a larger or emptier image\n");
+		exit(1);
+	}
+	shrink_data(0, inode, &b->fs);
+}
+
+/** Grow an empty file by a number of blocks and truncate it back. */
+static void bench_extend_shrink(bench_ctx *b, size_t blocks)
+{
+	b->ino = add_entry(b, 0, "file", 1);
+	b->len = blocks;
+
+	char params[64];
+	snprintf(params, sizeof(params), "blocks=%zu", blocks);
+	run(b, "extend_shrink", params, op_extend_shrink);
+}
+
+/** Size of the file the copy benchmarks work on. */
+#define COPY_FILE_SIZE (16u << 20)
+
+static void op_write(bench_ctx *b)
+{
+	if (write_data(&b->fs.inodes[b->ino], b->buf, b->len, b->offset, &b->fs) != (long)b->len) {
+		fprintf(stderr, "write_data() failed\n");
+		exit(1);
+	}
+	b->offset = (b->offset + b->len) % COPY_FILE_SIZE;
+}
+
+static void op_read(bench_ctx *b)
+{
+	if (read_data(&b->fs.inodes[b->ino], b->buf, b->len, b->offset, &b->fs) != (long)b->len) {
+		fprintf(stderr, "read_data() failed\n");
+		exit(1);
+	}
+	b->offset = (b->offset + b->len) % COPY_FILE_SIZE;
+}
+
+/** Overwrite or read a 16 MiB file sequentially, len bytes at a time. */
+static void bench_copy(bench_ctx *b, size_t len, bool write)
+{
+	b->ino = add_entry(b, 0, "file", 1);
+	b->len = len;
+	b->offset = 0;
+	b->buf = malloc(len);
+	if (b->buf == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	memset(b->buf, 'a', len);
+	// Allocate the whole file first, only the copy is measured
+	for (uint64_t off = 0; off < COPY_FILE_SIZE; off += len) {
+		op_write(b);
+	}
+
+	char params[64];
+	snprintf(params, sizeof(params), "bytes=%zu", len);
+	run(b, write ? "write_data" : "read_data", params, write ? op_write : op_read);
+	free(b->buf);
+	b->buf = NULL;
+}
+
+
+/** A benchmark with its parameters. */
+typedef struct bench_case {
+	const char *name;
+	void (*fn)(bench_ctx *b, long a, long c);
+	long a, c;
+} bench_case;
+
+static void case_find_free_bit(bench_ctx *b, long a, long c) { (void)a; (void)c; bench_find_free_bit(b); }
+static void case_find_inode(bench_ctx *b, long a, long c) { bench_find_inode(b, (int)a, (int)c); }
+static void case_dentry_churn(bench_ctx *b, long a, long c) { (void)c; bench_dentry_churn(b, (int)a); }
+static void case_extend_shrink(bench_ctx *b, long a, long c) { (void)c; bench_extend_shrink(b, a); }
+static void case_copy(bench_ctx *b, long a, long c) { bench_copy(b, a, c != 0); }
+
+static const bench_case cases[] = {
+	{ "find_free_bit", case_find_free_bit, 0,    0   },
+	{ "find_inode",    case_find_inode,    1,    16  },
+	{ "find_inode",    case_find_inode,    1,    256 },
+	{ "find_inode",    case_find_inode,    4,    16  },
+	{ "find_inode",    case_find_inode,    4,    256 },
+	{ "find_inode",    case_find_inode,    16,   16  },
+	{ "find_inode",    case_find_inode,    16,   64  },
+	{ "dentry_churn",  case_dentry_churn,  0,    0   },
+	{ "dentry_churn",  case_dentry_churn,  14,   0   },
+	{ "dentry_churn",  case_dentry_churn,  1000, 0   },
+	{ "extend_shrink", case_extend_shrink, 1,    0   },
+	{ "extend_shrink", case_extend_shrink, 16,   0   },
+	{ "extend_shrink", case_extend_shrink, 256,  0   },
+	{ "write_data",    case_copy,          4096,    1 },
+	{ "write_data",    case_copy,          65536,   1 },
+	{ "write_data",    case_copy,          1 << 20, 1 },
+	{ "read_data",     case_copy,          4096,    0 },
+	{ "read_data",     case_copy,          65536,   0 },
+	{ "read_data",     case_copy,          1 << 20, 0 },
+};
+
+
+int main(int argc, char *argv[])
+{
+	bench_opts opts = {0};// defaults are all 0
+	if (!parse_args(argc, argv, &opts)) {
+		// Invalid arguments, print help to stderr
+		print_help(stderr, argv[0]);
+		return 1;
+	}
+	if (opts.help) {
+		// Help requested, print it to stdout
+		print_help(stdout, argv[0]);
+		return 0;
+	}
+
+	printf("# size_mib=%zu inodes=%zu fullness=%u fill=%s\n", opts.size_mib, opts.n_inodes,
+	       opts.fullness, opts.random_fill ? "random" : "sequential");
+	printf("# bench\tparams\titerations\tns_per_op\n");
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		if (opts.filter != NULL && strstr(cases[i].name, opts.filter) == NULL) continue;
+		bench_ctx b = { .opts = &opts };
+		if (!image_create(&b)) return 1;
+		cases[i].fn(&b, cases[i].a, cases[i].c);
+		image_destroy(&b);
+	}
+	return 0;
+}
@@ -0,0 +1,544 @@
+/**
+ * a1fs transparent compression implementation.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "a1fs.h"
+#include "compress.h"
+#include "helper.h"
+#include "lz.h"
+#include "trace.h"
+
+
+/** Extents of a file layout under construction, before it replaces the file's data. */
+typedef struct extent_list {
+	a1fs_extent extent[512];
+	int num;
+} extent_list;
+
+static uint64_t blocks_of(uint64_t bytes)
+{
+	return bytes / A1FS_BLOCK_SIZE + (bytes % A1FS_BLOCK_SIZE > 0 ? 1 : 0);
+}
+
+/** Append n newly allocated blocks to the list. */
+static int list_alloc(extent_list *list, uint64_t n, fs_ctx *fs)
+{
+	for (uint64_t i = 0; i < n; i++) {
+		a1fs_blk_t blk = alloc_block(fs);
+		if (blk == (a1fs_blk_t)-1) return -ENOSPC;
+
+		a1fs_extent *last = (list->num > 0) ? &list->extent[list->num - 1] : NULL;
+		if (last != NULL && last->start + last->count == blk) {
+			last->count++;
+		} else {
+			if (list->num == 512) {
+				release_block(blk, fs);
+				return -ENOSPC;
+			}
+			list->extent[list->num].start = blk;
+			list->extent[list->num].count = 1;
+			list->num++;
+		}
+	}
+	return 0;
+}
+
+/** Release all blocks of an abandoned layout. */
+static void list_release(extent_list *list, fs_ctx *fs)
+{
+	for (int i = 0; i < list->num; i++) {
+		free_in_extent(&list->extent[i], fs);
+	}
+	list->num = 0;
+}
+
+/** Replace the file's data blocks with the ones in the list. */
+static void list_install(extent_list *list, a1fs_inode *inode, fs_ctx *fs)
+{
+	a1fs_extent *extent = (a1fs_extent *)((char *)fs->image + inode->block_no * A1FS_BLOCK_SIZE);
+
+	free_data(inode, fs);
+	memcpy(extent, list->extent, list->num * sizeof(a1fs_extent));
+	inode->free_extent_num = 512 - list->num;
+}
+
+/** Number of chunks of a file of the given size. */
+static uint64_t chunks_of(uint64_t size)
+{
+	return (size + A1FS_CHUNK_SIZE - 1) / A1FS_CHUNK_SIZE;
+}
+
+/** Size of chunk idx of a file of the given size. */
+static size_t chunk_len(uint64_t size, uint64_t idx)
+{
+	uint64_t chunk_start = idx * A1FS_CHUNK_SIZE;
+	return (size - chunk_start < A1FS_CHUNK_SIZE) ? size - chunk_start : A1FS_CHUNK_SIZE;
+}
+
+/** Number of blocks reserved for the chunk table of a compressed file. */
+static uint64_t table_blocks(a1fs_inode *inode)
+{
+	// Files compressed without spare entries have a table that just fits their chunks
+	if (inode->chunk_table == 0) return blocks_of(chunks_of(inode->size) * sizeof(a1fs_chunk));
+	return inode->chunk_table;
+}
+
+static a1fs_extent *file_extents(a1fs_inode *inode, fs_ctx *fs)
+{
+	return (a1fs_extent *)((char *)fs->image + inode->block_no * A1FS_BLOCK_SIZE);
+}
+
+static void get_entry(a1fs_inode *inode, uint64_t idx, a1fs_chunk *entry, fs_ctx *fs)
+{
+	extents_read(file_extents(inode, fs), 512 - (int)inode->free_extent_num, idx * sizeof(a1fs_chunk),
+	             entry, sizeof(*entry), fs);
+}
+
+static int put_entry(a1fs_inode *inode, uint64_t idx, const a1fs_chunk *entry, fs_ctx *fs)
+{
+	// The table block may be shared with a reflink clone
+	int ret = unshare_block(inode, idx * sizeof(a1fs_chunk) / A1FS_BLOCK_SIZE, fs);
+	if (ret != 0) return ret;
+	extents_write(file_extents(inode, fs), 512 - (int)inode->free_extent_num, idx * sizeof(a1fs_chunk),
+	              entry, sizeof(*entry), fs);
+	return 0;
+}
+
+/**
+ * Read and decompress one chunk of a compressed file.
+ *
+ * @param in   scratch buffer of LZ_BOUND(A1FS_CHUNK_SIZE) bytes.
+ * @param out  buffer of A1FS_CHUNK_SIZE bytes that receives the chunk.
+ * @param len  pointer to the variable that receives the chunk size.
+ */
+static int read_chunk(a1fs_inode *inode, uint64_t idx, uint8_t *in, uint8_t *out,
+                      size_t *len, fs_ctx *fs)
+{
+	a1fs_extent *extent = file_extents(inode, fs);
+	int extent_num = 512 - (int)inode->free_extent_num;
+
+	a1fs_chunk entry;
+	get_entry(inode, idx, &entry, fs);
+
+	size_t expected = chunk_len(inode->size, idx);
+	size_t stored = entry.len & A1FS_CHUNK_LEN_MASK;
+	if (stored > LZ_BOUND(A1FS_CHUNK_SIZE) ||
+	    (uint64_t)entry.blk + blocks_of(stored) > inode_blocks(inode, fs)) {
+		return -EIO;
+	}
+
+	if (entry.len & A1FS_CHUNK_RAW) {
+		if (stored != expected) return -EIO;
+		extents_read(extent, extent_num, (uint64_t)entry.blk * A1FS_BLOCK_SIZE, out, stored, fs);
+	} else {
+		extents_read(extent, extent_num, (uint64_t)entry.blk * A1FS_BLOCK_SIZE, in, stored, fs);
+		if (lz_decompress(in, stored, out, A1FS_CHUNK_SIZE) != (long)expected) return -EIO;
+	}
+	*len = expected;
+	return 0;
+}
+
+/**
+ * Store a chunk of a compressed file and point its table entry at it. The
+ * chunk goes into its old place if it fits there or if that place is at the
+ * end of the file (which is then extended or shortened), and otherwise is
+ * appended to the file.
+ *
+ * @param old    the current entry of the chunk, or NULL for a new chunk.
+ * @param len    stored chunk size in bytes.
+ * @param flags  A1FS_CHUNK_* flags of the new entry.
+ * @param from   offset of the first byte that differs from the old raw chunk;
+ *               the bytes before it are not rewritten if the chunk stays raw
+ *               in its old place.
+ */
+static int store_chunk(a1fs_inode *inode, uint64_t idx, const a1fs_chunk *old, const uint8_t *data,
+                       size_t len, uint32_t flags, size_t from, fs_ctx *fs)
+{
+	uint64_t file_blocks = inode_blocks(inode, fs);
+	uint64_t chunk_blocks = blocks_of(len);
+	uint64_t blk = file_blocks;
+	if (old != NULL) {
+		uint64_t old_blocks = blocks_of(old->len & A1FS_CHUNK_LEN_MASK);
+		if (old->blk + old_blocks == file_blocks) {
+			blk = old->blk;
+			if (chunk_blocks < old_blocks) {
+				shrink_data((blk + chunk_blocks) * A1FS_BLOCK_SIZE, inode, fs);
+				file_blocks = blk + chunk_blocks;
+			}
+		} else if (chunk_blocks <= old_blocks) {
+			blk = old->blk;
+		}
+	}
+	if (old == NULL || blk != old->blk || !(old->len & A1FS_CHUNK_RAW) || !(flags & A1FS_CHUNK_RAW)) {
+		from = 0;
+	}
+
+	// Blocks rewritten in place may be shared with a reflink clone
+	for (uint64_t lblk = blk + from / A1FS_BLOCK_SIZE; lblk < blk + chunk_blocks && lblk < file_blocks; lblk++) {
+		int ret = unshare_block(inode, lblk, fs);
+		if (ret != 0) return ret;
+	}
+	if (blk + chunk_blocks > file_blocks) {
+		int ret = extend_data((blk + chunk_blocks - file_blocks) * A1FS_BLOCK_SIZE, inode, fs);
+		if (ret != 0) return ret;
+	}
+	extents_write(file_extents(inode, fs), 512 - (int)inode->free_extent_num,
+	              blk * A1FS_BLOCK_SIZE + from, data + from, len - from, fs);
+
+	a1fs_chunk entry = { .blk = (uint32_t)blk, .len = (uint32_t)len | flags };
+	return put_entry(inode, idx, &entry, fs);
+}
+
+/**
+ * Write the file data in a new compressed layout that replaces the file's
+ * blocks: a chunk table with room for twice min_chunks entries (and at least
+ * the current chunks), followed by the chunks back to back.
+ *
+ * A raw file is compressed chunk by chunk and left as is if that doesn't save
+ * at least one block. The chunks of a compressed file are copied as they are
+ * stored, which drops the blocks that moved chunks have left behind.
+ */
+static int pack_file(a1fs_inode *inode, uint64_t min_chunks, fs_ctx *fs)
+{
+	bool compressed = inode->flags & A1FS_INODE_COMPRESSED;
+	a1fs_extent *extent = file_extents(inode, fs);
+	int extent_num = 512 - (int)inode->free_extent_num;
+	uint64_t raw_blocks = inode_blocks(inode, fs);
+	uint64_t chunk_num = chunks_of(inode->size);
+	if (min_chunks < chunk_num) min_chunks = chunk_num;
+	uint64_t new_table_blocks = blocks_of(2 * min_chunks * sizeof(a1fs_chunk));
+	if (new_table_blocks == 0) new_table_blocks = 1;
+	if (!compressed && new_table_blocks + 1 >= raw_blocks) return 0;
+
+	a1fs_chunk *table = calloc(new_table_blocks, A1FS_BLOCK_SIZE);
+	uint8_t *raw = malloc(A1FS_CHUNK_SIZE);
+	uint8_t *out = malloc(LZ_BOUND(A1FS_CHUNK_SIZE));
+	extent_list *list = malloc(sizeof(*list));
+	int ret = 0;
+	if (table == NULL || raw == NULL || out == NULL || list == NULL) {
+		ret = -ENOMEM;
+		goto end;
+	}
+	list->num = 0;
+
+	// The chunk table comes first, the stored chunks follow it
+	ret = list_alloc(list, new_table_blocks, fs);
+	if (ret != 0) goto abandon;
+	uint64_t blk = new_table_blocks;
+	for (uint64_t idx = 0; idx < chunk_num; idx++) {
+		const uint8_t *stored = out;
+		size_t stored_len;
+		uint32_t entry_len;
+		if (compressed) {
+			a1fs_chunk entry;
+			get_entry(inode, idx, &entry, fs);
+			stored_len = entry.len & A1FS_CHUNK_LEN_MASK;
+			entry_len = entry.len;
+			if (stored_len > LZ_BOUND(A1FS_CHUNK_SIZE) ||
+			    (uint64_t)entry.blk + blocks_of(stored_len) > raw_blocks) {
+				ret = -EIO;
+				goto abandon;
+			}
+			extents_read(extent, extent_num, (uint64_t)entry.blk * A1FS_BLOCK_SIZE, out, stored_len, fs);
+		} else {
+			size_t len = chunk_len(inode->size, idx);
+			extents_read(extent, extent_num, idx * A1FS_CHUNK_SIZE, raw, len, fs);
+
+			// Chunks that don't save a block are stored as is
+			stored_len = lz_compress(raw, len, out, len);
+			entry_len = (uint32_t)stored_len;
+			if (stored_len == 0 || blocks_of(stored_len) >= blocks_of(len)) {
+				stored = raw;
+				stored_len = len;
+				entry_len = (uint32_t)len | A1FS_CHUNK_RAW;
+			}
+		}
+
+		// Give up as soon as the compressed copy of a raw file can't be smaller
+		uint64_t chunk_blocks = blocks_of(stored_len);
+		if (!compressed && blk + chunk_blocks >= raw_blocks) goto abandon;
+		ret = list_alloc(list, chunk_blocks, fs);
+		if (ret != 0) goto abandon;
+
+		extents_write(list->extent, list->num, blk * A1FS_BLOCK_SIZE, stored, stored_len, fs);
+		table[idx].blk = (uint32_t)blk;
+		table[idx].len = entry_len;
+		blk += chunk_blocks;
+	}
+	extents_write(list->extent, list->num, 0, table, new_table_blocks * A1FS_BLOCK_SIZE, fs);
+
+	list_install(list, inode, fs);
+	inode->flags |= A1FS_INODE_COMPRESSED;
+	inode->chunk_table = (uint32_t)new_table_blocks;
+	journal_dirty_inode(fs, inode);
+	goto end;
+
+abandon:
+	list_release(list, fs);
+	// Compression of a raw file is best effort
+	if (!compressed && ret == -ENOSPC) ret = 0;
+end:
+	free(table);
+	free(raw);
+	free(out);
+	free(list);
+	return ret;
+}
+
+/**
+ * Compress the chunks of a compressed file that were written since the last
+ * flush, and repack the file once the blocks left behind by moved chunks
+ * outnumber the ones in use.
+ */
+static int flush_chunks(a1fs_inode *inode, fs_ctx *fs)
+{
+	uint64_t chunk_num = chunks_of(inode->size);
+	a1fs_chunk *table = malloc(chunk_num * sizeof(a1fs_chunk) + 1);
+	uint8_t *raw = malloc(A1FS_CHUNK_SIZE);
+	uint8_t *out = malloc(LZ_BOUND(A1FS_CHUNK_SIZE));
+	int ret = -ENOMEM;
+	if (table == NULL || raw == NULL || out == NULL) goto end;
+
+	extents_read(file_extents(inode, fs), 512 - (int)inode->free_extent_num, 0, table,
+	             chunk_num * sizeof(a1fs_chunk), fs);
+	uint64_t used = table_blocks(inode);
+	bool changed = false;
+	bool full = false;
+	ret = 0;
+	for (uint64_t idx = 0; idx < chunk_num; idx++) {
+		a1fs_chunk entry = table[idx];
+		size_t len = entry.len & A1FS_CHUNK_LEN_MASK;
+		if (entry.len & A1FS_CHUNK_DIRTY) {
+			if (len > A1FS_CHUNK_SIZE) {
+				ret = -EIO;
+				goto end;
+			}
+			// Written chunks are stored as is
+			extents_read(file_extents(inode, fs), 512 - (int)inode->free_extent_num,
+			             (uint64_t)entry.blk * A1FS_BLOCK_SIZE, raw, len, fs);
+			size_t stored_len = lz_compress(raw, len, out, len);
+			if (stored_len != 0 && blocks_of(stored_len) < blocks_of(len)) {
+				ret = store_chunk(inode, idx, &entry, out, stored_len, 0, 0, fs);
+				len = stored_len;
+			} else {
+				entry.len &= ~A1FS_CHUNK_DIRTY;
+				ret = put_entry(inode, idx, &entry, fs);
+			}
+			// Without room to unshare a block the chunk stays raw until the next flush
+			if (ret == -ENOSPC) {
+				ret = 0;
+				full = true;
+				break;
+			}
+			if (ret != 0) goto end;
+			changed = true;
+		}
+		used += blocks_of(len);
+	}
+	if (changed) journal_dirty_inode(fs, inode);
+
+	if (!full && inode_blocks(inode, fs) > 2 * used) {
+		ret = pack_file(inode, 0, fs);
+		if (ret == -ENOSPC) ret = 0;
+	}
+
+end:
+	free(table);
+	free(raw);
+	free(out);
+	return ret;
+}
+
+
+int compress_file(a1fs_inode *inode, fs_ctx *fs)
+{
+	if (inode->type != 1) return 0;
+	if (!(inode->flags & A1FS_INODE_COMPRESSED) && inode->size == 0) return 0;
+
+	TRACE_START(start);
+	int ret = (inode->flags & A1FS_INODE_COMPRESSED) ? flush_chunks(inode, fs) : pack_file(inode, 0, fs);
+	TRACE(TRACE_COMPRESS, start, (a1fs_ino_t)(inode - fs->inodes), inode->size, 0, ret);
+	return ret;
+}
+
+int decompress_file(a1fs_inode *inode, fs_ctx *fs)
+{
+	if (!(inode->flags & A1FS_INODE_COMPRESSED)) return 0;
+
+	uint64_t raw_blocks = blocks_of(inode->size);
+	if (raw_blocks > free_blocks(fs)) return -ENOSPC;
+
+	uint8_t *in = malloc(LZ_BOUND(A1FS_CHUNK_SIZE));
+	uint8_t *out = malloc(A1FS_CHUNK_SIZE);
+	extent_list *list = malloc(sizeof(*list));
+	int ret = -ENOMEM;
+	if (in == NULL || out == NULL || list == NULL) goto end;
+	list->num = 0;
+
+	ret = list_alloc(list, raw_blocks, fs);
+	if (ret != 0) goto abandon;
+	uint64_t chunk_num = (inode->size + A1FS_CHUNK_SIZE - 1) / A1FS_CHUNK_SIZE;
+	for (uint64_t idx = 0; idx < chunk_num; idx++) {
+		size_t len;
+		ret = read_chunk(inode, idx, in, out, &len, fs);
+		if (ret != 0) goto abandon;
+		extents_write(list->extent, list->num, idx * A1FS_CHUNK_SIZE, out, len, fs);
+	}
+
+	list_install(list, inode, fs);
+	inode->flags &= ~A1FS_INODE_COMPRESSED;
+	goto end;
+
+abandon:
+	list_release(list, fs);
+end:
+	free(in);
+	free(out);
+	free(list);
+	return ret;
+}
+
+long read_compressed(a1fs_inode *inode, char *buf, size_t size, uint64_t offset, fs_ctx *fs)
+{
+	uint8_t *in = malloc(LZ_BOUND(A1FS_CHUNK_SIZE));
+	uint8_t *out = malloc(A1FS_CHUNK_SIZE);
+	long ret = -ENOMEM;
+	if (in == NULL || out == NULL) goto end;
+
+	size_t done = 0;
+	while (done < size) {
+		uint64_t pos = offset + done;
+		size_t len;
+		int err = read_chunk(inode, pos / A1FS_CHUNK_SIZE, in, out, &len, fs);
+		if (err != 0) {
+			ret = err;
+			goto end;
+		}
+		size_t within = pos % A1FS_CHUNK_SIZE;
+		size_t n = (len - within < size - done) ? len - within : size - done;
+		memcpy(buf + done, out + within, n);
+		done += n;
+	}
+	ret = (long)size;
+
+end:
+	free(in);
+	free(out);
+	return ret;
+}
+
+/**
+ * Fill the chunks of a compressed file that overlap [start, end) with the
+ * bytes of buf, or with zeros if buf is NULL, extending the file up to end.
+ * The chunks between the old end of the file and start are filled with zeros.
+ */
+static int update_chunks(a1fs_inode *inode, const char *buf, uint64_t start, uint64_t end, fs_ctx *fs)
+{
+	uint64_t old_size = inode->size;
+	uint64_t new_size = (end > old_size) ? end : old_size;
+	uint64_t old_chunks = chunks_of(old_size);
+	uint64_t first = ((start < old_size) ? start : old_size) / A1FS_CHUNK_SIZE;
+	uint64_t last = (end - 1) / A1FS_CHUNK_SIZE;
+
+	// The table is moved to make room for new entries, with spare room for as many again
+	inode->chunk_table = (uint32_t)table_blocks(inode);
+	if (chunks_of(new_size) > inode->chunk_table * (A1FS_BLOCK_SIZE / sizeof(a1fs_chunk))) {
+		int ret = pack_file(inode, chunks_of(new_size), fs);
+		if (ret != 0) return ret;
+	}
+
+	uint8_t *in = malloc(LZ_BOUND(A1FS_CHUNK_SIZE));
+	uint8_t *data = malloc(A1FS_CHUNK_SIZE);
+	int ret = -ENOMEM;
+	if (in == NULL || data == NULL) goto end;
+
+	ret = 0;
+	for (uint64_t idx = first; idx <= last; idx++) {
+		uint64_t chunk_start = idx * A1FS_CHUNK_SIZE;
+		a1fs_chunk entry;
+		size_t old_len = 0;
+		if (idx < old_chunks) {
+			get_entry(inode, idx, &entry, fs);
+			ret = read_chunk(inode, idx, in, data, &old_len, fs);
+			if (ret != 0) goto end;
+		}
+		size_t len = chunk_len(new_size, idx);
+		memset(data + old_len, 0, len - old_len);
+
+		size_t from = old_len;
+		uint64_t lo = (start > chunk_start) ? start : chunk_start;
+		uint64_t hi = (end < chunk_start + len) ? end : chunk_start + len;
+		if (buf != NULL && lo < hi) {
+			memcpy(data + (lo - chunk_start), buf + (lo - start), hi - lo);
+			if (lo - chunk_start < from) from = lo - chunk_start;
+		}
+
+		ret = store_chunk(inode, idx, (idx < old_chunks) ? &entry : NULL, data, len,
+		                  A1FS_CHUNK_RAW | A1FS_CHUNK_DIRTY, from, fs);
+		if (ret != 0) goto end;
+		// The file grows chunk by chunk, so that it stays readable if a later chunk fails
+		if (chunk_start + len > inode->size) inode->size = chunk_start + len;
+	}
+
+end:
+	free(in);
+	free(data);
+	return ret;
+}
+
+int write_compressed(a1fs_inode *inode, const char *buf, size_t size, uint64_t offset, fs_ctx *fs)
+{
+	if (size == 0) return 0;
+	return update_chunks(inode, buf, offset, offset + size, fs);
+}
+
+int resize_compressed(a1fs_inode *inode, uint64_t size, fs_ctx *fs)
+{
+	if (size > inode->size) return update_chunks(inode, NULL, inode->size, size, fs);
+	if (size == inode->size) return 0;
+
+	inode->chunk_table = (uint32_t)table_blocks(inode);
+	uint64_t chunk_num = chunks_of(size);
+	uint8_t *in = malloc(LZ_BOUND(A1FS_CHUNK_SIZE));
+	uint8_t *data = malloc(A1FS_CHUNK_SIZE);
+	a1fs_chunk *table = malloc(chunk_num * sizeof(a1fs_chunk) + 1);
+	int ret = -ENOMEM;
+	if (in == NULL || data == NULL || table == NULL) goto end;
+
+	// The new last chunk is cut short
+	if (size % A1FS_CHUNK_SIZE != 0) {
+		a1fs_chunk entry;
+		size_t len;
+		get_entry(inode, chunk_num - 1, &entry, fs);
+		ret = read_chunk(inode, chunk_num - 1, in, data, &len, fs);
+		if (ret != 0) goto end;
+		len = size % A1FS_CHUNK_SIZE;
+		ret = store_chunk(inode, chunk_num - 1, &entry, data, len, A1FS_CHUNK_RAW | A1FS_CHUNK_DIRTY, len, fs);
+		if (ret != 0) goto end;
+	}
+	inode->size = size;
+
+	// Release the blocks past the last chunk still in use
+	extents_read(file_extents(inode, fs), 512 - (int)inode->free_extent_num, 0, table,
+	             chunk_num * sizeof(a1fs_chunk), fs);
+	uint64_t used_end = inode->chunk_table;
+	for (uint64_t idx = 0; idx < chunk_num; idx++) {
+		uint64_t chunk_end = table[idx].blk + blocks_of(table[idx].len & A1FS_CHUNK_LEN_MASK);
+		if (chunk_end > used_end) used_end = chunk_end;
+	}
+	if (used_end < inode_blocks(inode, fs)) {
+		shrink_data(used_end * A1FS_BLOCK_SIZE, inode, fs);
+	}
+	ret = 0;
+
+end:
+	free(in);
+	free(data);
+	free(table);
+	return ret;
+}
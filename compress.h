@@ -0,0 +1,84 @@
+/**
+ * a1fs transparent compression - conversion between the raw and the chunked
+ * compressed file formats (see A1FS_CHUNK_SIZE in a1fs.h).
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+
+/**
+ * Convert a raw regular file to the compressed format, or compress the chunks
+ * of a compressed file that were written since it was last flushed.
+ *
+ * Compression is best effort: a raw file is left raw if it doesn't shrink by
+ * at least one block, or if there is no room for the compressed copy next to
+ * the raw one. A compressed file is repacked when the blocks left behind by
+ * chunks that moved outnumber the blocks in use.
+ *
+ * @param inode  the file inode.
+ * @param fs     file system context.
+ * @return       0 on success (including when the file was left raw);
+ *               -ENOMEM if a buffer could not be allocated; -EIO if the
+ *               compressed data is corrupted.
+ */
+int compress_file(a1fs_inode *inode, fs_ctx *fs);
+
+/**
+ * Convert a compressed file back to the raw format, e.g. before it is
+ * modified. Raw files are left untouched.
+ *
+ * @param inode  the file inode.
+ * @param fs     file system context.
+ * @return       0 on success; -ENOSPC if there is no room for the raw copy;
+ *               -ENOMEM if a buffer could not be allocated; -EIO if the
+ *               compressed data is corrupted.
+ */
+int decompress_file(a1fs_inode *inode, fs_ctx *fs);
+
+/**
+ * Read data from a compressed file, decompressing only the chunks that
+ * overlap the requested range.
+ *
+ * @param inode   the file inode.
+ * @param buf     buffer that receives the data.
+ * @param size    number of bytes to read; offset + size must not be past EOF.
+ * @param offset  offset in the (uncompressed) file.
+ * @param fs      file system context.
+ * @return        number of bytes read on success; -errno on error.
+ */
+long read_compressed(a1fs_inode *inode, char *buf, size_t size, uint64_t offset, fs_ctx *fs);
+
+/**
+ * Write data to a compressed file. Only the chunks that overlap the written
+ * range (and the ones between the old end of the file and offset) are
+ * decompressed, updated and stored back; they are stored uncompressed until
+ * the file is flushed.
+ *
+ * @param inode   the file inode.
+ * @param buf     data to write.
+ * @param size    number of bytes to write.
+ * @param offset  offset in the (uncompressed) file.
+ * @param fs      file system context.
+ * @return        0 on success; -ENOSPC if there is no room for the chunks;
+ *                -ENOMEM if a buffer could not be allocated; -EIO if the
+ *                compressed data is corrupted.
+ */
+int write_compressed(a1fs_inode *inode, const char *buf, size_t size, uint64_t offset, fs_ctx *fs);
+
+/**
+ * Set the size of a compressed file. Growing the file appends chunks of zeros;
+ * shrinking it cuts the new last chunk and releases the blocks at the end of
+ * the file that are no longer used.
+ *
+ * @param inode  the file inode.
+ * @param size   new (uncompressed) size.
+ * @param fs     file system context.
+ * @return       0 on success; -ENOSPC, -ENOMEM or -EIO as write_compressed().
+ */
+int resize_compressed(a1fs_inode *inode, uint64_t size, fs_ctx *fs);
@@ -0,0 +1,220 @@
+/**
+ * a1fs path lookup cache implementation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "dcache.h"
+#include "fs_ctx.h"
+#include "helper.h"
+#include "seqlock.h"
+
+
+/** Must be at the start of a cache file. */
+#define DCACHE_MAGIC 0xA1F5DCA7u
+
+/** Cache file header, followed by count records, hottest first. */
+typedef struct dcache_file {
+	uint32_t magic;
+	uint32_t count;
+	/** Superblock generation of the mount that saved the file. */
+	uint64_t generation;
+} dcache_file;
+
+/** Cache file record. */
+typedef struct dcache_record {
+	uint32_t hits;
+	char path[DCACHE_PATH_MAX];
+} dcache_record;
+
+
+/** FNV-1a hash of a path. */
+static uint64_t hash_path(const char *path, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ull;
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ (unsigned char)path[i]) * 0x100000001b3ull;
+	}
+	return h;
+}
+
+/** Get the set a path belongs to, 2 consecutive entries. */
+static dcache_entry *path_set(fs_ctx *fs, const char *path, size_t len)
+{
+	return &fs->dcache[(hash_path(path, len) % (DCACHE_SIZE / 2)) * 2];
+}
+
+/**
+ * Cache a path, replacing an older entry of the same path, an entry that is
+ * no longer valid or else the colder entry of its set.
+ *
+ * @param hits  initial hit count; 0 to keep the count of an older entry of
+ *              the same path.
+ */
+static void put(fs_ctx *fs, const char *path, size_t len, a1fs_ino_t ino, uint32_t ns, uint32_t hits)
+{
+	dcache_entry *set = path_set(fs, path, len);
+	dcache_entry *victim = NULL;
+	for (int i = 0; i < 2 && victim == NULL; i++) {
+		// Racy, but a torn read only leads to a worse choice
+		if (strncmp(set[i].path, path, DCACHE_PATH_MAX) == 0) victim = &set[i];
+	}
+	if (victim == NULL) {
+		bool valid0 = __atomic_load_n(&set[0].ns, __ATOMIC_RELAXED) == ns && set[0].path[0] != '\0';
+		bool valid1 = __atomic_load_n(&set[1].ns, __ATOMIC_RELAXED) == ns && set[1].path[0] != '\0';
+		uint32_t hits0 = __atomic_load_n(&set[0].hits, __ATOMIC_RELAXED);
+		uint32_t hits1 = __atomic_load_n(&set[1].hits, __ATOMIC_RELAXED);
+		victim = (valid0 && (!valid1 || hits1 < hits0)) ? &set[1] : &set[0];
+		if (hits == 0) hits = 1;
+	} else if (hits == 0) {
+		hits = __atomic_load_n(&victim->hits, __ATOMIC_RELAXED);
+	}
+
+	// Entries being replaced by another thread are left alone
+	uint32_t seq = __atomic_load_n(&victim->seq, __ATOMIC_RELAXED);
+	if ((seq & 1) || !__atomic_compare_exchange_n(&victim->seq, &seq, seq + 1, false,
+	                                              __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		return;
+	}
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&victim->ns, ns, __ATOMIC_RELAXED);
+	__atomic_store_n(&victim->ino, ino, __ATOMIC_RELAXED);
+	__atomic_store_n(&victim->hits, hits, __ATOMIC_RELAXED);
+	memcpy(victim->path, path, len + 1);
+	seq_write_end(&victim->seq);
+}
+
+
+bool dcache_init(fs_ctx *fs)
+{
+	fs->dcache = calloc(DCACHE_SIZE, sizeof(dcache_entry));
+	return fs->dcache != NULL;
+}
+
+void dcache_destroy(fs_ctx *fs)
+{
+	free(fs->dcache);
+	fs->dcache = NULL;
+}
+
+long dcache_lookup(fs_ctx *fs, const char *path, uint32_t ns)
+{
+	// Not cached while the namespace is changing
+	if (fs->dcache == NULL || (ns & 1)) return -1;
+	size_t len = strlen(path);
+	if (len >= DCACHE_PATH_MAX) return -1;
+
+	dcache_entry *set = path_set(fs, path, len);
+	for (int i = 0; i < 2; i++) {
+		dcache_entry copy;
+		uint32_t seq = seq_read_begin(&set[i].seq);
+		memcpy(&copy, &set[i], sizeof(copy));
+		if (seq_read_retry(&set[i].seq, seq)) continue;
+		if (copy.ns != ns || memcmp(copy.path, path, len + 1) != 0) continue;
+
+		if (copy.hits < DCACHE_HITS_MAX) __atomic_fetch_add(&set[i].hits, 1, __ATOMIC_RELAXED);
+		return copy.ino;
+	}
+	return -1;
+}
+
+void dcache_insert(fs_ctx *fs, const char *path, a1fs_ino_t ino, uint32_t ns)
+{
+	if (fs->dcache == NULL || (ns & 1)) return;
+	size_t len = strlen(path);
+	if (len >= DCACHE_PATH_MAX) return;
+	put(fs, path, len, ino, ns, 0);
+}
+
+void dcache_load(fs_ctx *fs)
+{
+	if (fs->dcache == NULL || fs->opts == NULL || fs->opts->cache_file == NULL) return;
+	FILE *f = fopen(fs->opts->cache_file, "r");
+	if (f == NULL) return;
+
+	// Only valid for the mount right after the one that saved it
+	dcache_file hdr;
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != DCACHE_MAGIC ||
+	    hdr.generation + 1 != fs->sb->generation) {
+		fclose(f);
+		return;
+	}
+
+	uint32_t loaded = 0;
+	dcache_record rec;
+	for (uint32_t i = 0; i < hdr.count && fread(&rec, sizeof(rec), 1, f) == 1; i++) {
+		rec.path[DCACHE_PATH_MAX - 1] = '\0';
+		if (rec.path[0] != '/') continue;
+		// find_inode() modifies the path
+		char path[DCACHE_PATH_MAX];
+		strcpy(path, rec.path);
+		a1fs_ino_t ino = find_inode(path, fs->inodes, fs);
+		if (ino >= fs->sb->inodes_count) continue;
+
+		// The lookup read the directories on the way, read the extents too
+		a1fs_blk_t extent_blk = fs->inodes[ino].block_no;
+		if (extent_blk < fs->sb->blocks_count) {
+			madvise((char *)fs->image + (size_t)extent_blk * A1FS_BLOCK_SIZE, A1FS_BLOCK_SIZE, MADV_WILLNEED);
+		}
+		put(fs, rec.path, strlen(rec.path), ino, fs->ns_seq, (rec.hits == 0) ? 1 : rec.hits);
+		loaded++;
+	}
+	fclose(f);
+	if (fs->opts->verbose) fprintf(stderr, "Preloaded %u cached paths\n", loaded);
+}
+
+static int hotter_first(const void *a, const void *b)
+{
+	uint32_t ha = ((const dcache_record *)a)->hits, hb = ((const dcache_record *)b)->hits;
+	return (ha < hb) - (ha > hb);
+}
+
+void dcache_save(fs_ctx *fs)
+{
+	if (fs->dcache == NULL || fs->opts == NULL || fs->opts->cache_file == NULL) return;
+	dcache_record *recs = calloc(DCACHE_SIZE, sizeof(dcache_record));
+	if (recs == NULL) {
+		perror("calloc");
+		return;
+	}
+
+	uint32_t n = 0;
+	for (int i = 0; i < DCACHE_SIZE; i++) {
+		if (fs->dcache[i].path[0] == '\0') continue;
+		recs[n].hits = fs->dcache[i].hits;
+		strcpy(recs[n].path, fs->dcache[i].path);
+		n++;
+	}
+	qsort(recs, n, sizeof(dcache_record), hotter_first);
+
+	// Written under a temporary name so that a crash doesn't leave a torn file
+	const char *file = fs->opts->cache_file;
+	size_t len = strlen(file) + sizeof(".tmp");
+	char *tmp = malloc(len);
+	if (tmp == NULL) {
+		perror("malloc");
+		free(recs);
+		return;
+	}
+	snprintf(tmp, len, "%s.tmp", file);
+	FILE *f = fopen(tmp, "w");
+	if (f == NULL) {
+		perror(tmp);
+		free(tmp);
+		free(recs);
+		return;
+	}
+	dcache_file hdr = {DCACHE_MAGIC, n, fs->sb->generation};
+	bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 && fwrite(recs, sizeof(dcache_record), n, f) == n;
+	if (fclose(f) != 0) ok = false;
+	if (!ok || rename(tmp, file) != 0) {
+		perror(file);
+		unlink(tmp);
+	}
+	free(tmp);
+	free(recs);
+}
@@ -0,0 +1,99 @@
+/**
+ * a1fs path lookup cache.
+ *
+ * Maps absolute paths to inode numbers, so that repeated lookups of the same
+ * path don't walk every directory on the way. An entry records the namespace
+ * sequence count it was looked up at, and is only used while the count is
+ * unchanged: removing or moving any directory entry (which bumps the count,
+ * see ns_write_lock()) invalidates every entry at once, while new entries
+ * leave the cache valid. The table is a fixed array of 2-way sets, read without locking
+ * under a per-entry sequence count.
+ *
+ * On unmount the cached paths and their hit counts are saved to a sidecar file
+ * next to the image (see --cache-file). The next mount looks them up again,
+ * hottest first, which reads the directories, inodes and extent blocks on the
+ * way back into memory and fills the cache, so it starts out warm. The file is
+ * only used if the image wasn't opened by anything else in between (see the
+ * superblock generation); a stale entry is just looked up and dropped.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+
+/** Number of entries in the cache. */
+#define DCACHE_SIZE 4096
+/** Paths of this length or longer are not cached. */
+#define DCACHE_PATH_MAX 112
+/** Hit counts stop growing here, so that hot entries aren't written on every hit. */
+#define DCACHE_HITS_MAX 0xffff
+
+struct fs_ctx;
+
+/** Path lookup cache entry. */
+typedef struct dcache_entry {
+	/** Sequence count, odd while the entry is being replaced. */
+	uint32_t seq;
+	/** Namespace sequence count the entry is valid at. */
+	uint32_t ns;
+	/** Inode number. */
+	a1fs_ino_t ino;
+	/** Number of lookups served by this entry, including previous mounts. */
+	uint32_t hits;
+	/** Path; an empty entry has an empty path. */
+	char path[DCACHE_PATH_MAX];
+} dcache_entry;
+
+/**
+ * Create an empty cache.
+ *
+ * @param fs  file system context.
+ * @return    true on success; false if out of memory.
+ */
+bool dcache_init(struct fs_ctx *fs);
+
+/**
+ * Free the cache.
+ *
+ * @param fs  file system context.
+ */
+void dcache_destroy(struct fs_ctx *fs);
+
+/**
+ * Look up a path in the cache.
+ *
+ * @param fs    file system context.
+ * @param path  absolute path.
+ * @param ns    namespace sequence count read before the lookup.
+ * @return      inode number; -1 if the path is not cached.
+ */
+long dcache_lookup(struct fs_ctx *fs, const char *path, uint32_t ns);
+
+/**
+ * Add the result of a successful path lookup to the cache.
+ *
+ * @param fs    file system context.
+ * @param path  absolute path.
+ * @param ino   inode number the path was found to refer to.
+ * @param ns    namespace sequence count read before the path was looked up.
+ */
+void dcache_insert(struct fs_ctx *fs, const char *path, a1fs_ino_t ino, uint32_t ns);
+
+/**
+ * Look up the paths saved by the previous mount and cache them. Must be
+ * called before the file system is accessed by multiple threads.
+ *
+ * @param fs  file system context.
+ */
+void dcache_load(struct fs_ctx *fs);
+
+/**
+ * Save the cached paths for the next mount.
+ *
+ * @param fs  file system context.
+ */
+void dcache_save(struct fs_ctx *fs);
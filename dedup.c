@@ -0,0 +1,486 @@
+/**
+ * a1fs offline block-level deduplication tool.
+ *
+ * Finds data blocks of regular files with identical contents in an unmounted
+ * image and makes the files share a single copy of each, using the block
+ * reference count table set up by mkfs.a1fs. Duplicate copies are released in
+ * the block bitmap.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+#include "helper.h"
+#include "map.h"
+#include "util.h"
+
+
+/** Command line options. */
+typedef struct dedup_opts {
+	/** File system image file path. */
+	const char *img_path;
+	/** Number of hashing threads. */
+	size_t n_threads;
+
+	/** Print help and exit. */
+	bool help;
+	/** Only report what would be reclaimed, don't modify the image. */
+	bool dry_run;
+	/** Sync memory-mapped image file contents to disk. */
+	bool sync;
+	/** Verbose output. */
+	bool verbose;
+
+} dedup_opts;
+
+static const char *help_str = "\
+Usage: %s options image\n\
+\n\
+Deduplicate identical data blocks of an unmounted a1fs image. The image must\n\
+have been formatted with a block reference count table.\n\
+\n\
+Options:\n\
+    -j num  number of hashing threads (default: number of CPUs)\n\
+    -h      print help and exit\n\
+    -n      dry run - report reclaimable space without modifying the image\n\
+    -s      sync image file contents to disk\n\
+    -v      verbose output\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+	fprintf(f, help_str, progname);
+}
+
+
+static bool parse_args(int argc, char *argv[], dedup_opts *opts)
+{
+	int o;
+	while ((o = getopt(argc, argv, "j:hnsv")) != -1) {
+		switch (o) {
+			case 'j': opts->n_threads = strtoul(optarg, NULL, 10); break;
+
+			case 'h': opts->help    = true; return true;// skip other arguments
+			case 'n': opts->dry_run = true; break;
+			case 's': opts->sync    = true; break;
+			case 'v': opts->verbose = true; break;
+
+			case '?': return false;
+			default : assert(false);
+		}
+	}
+
+	if (optind >= argc) {
+		fprintf(stderr, "Missing image path\n");
+		return false;
+	}
+	opts->img_path = argv[optind];
+
+	if (opts->n_threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		opts->n_threads = (cpus > 0) ? (size_t)cpus : 1;
+	}
+	return true;
+}
+
+
+/** Data block and the hash of its contents. */
+typedef struct blk_hash {
+	uint64_t hash;
+	a1fs_blk_t blk;
+} blk_hash;
+
+/** Work item of a hashing thread. */
+typedef struct hash_work {
+	void *image;
+	blk_hash *blocks;
+	size_t begin;
+	size_t end;
+} hash_work;
+
+/** Hash a data block; 4 independent lanes keep the multipliers busy. */
+static uint64_t hash_block(const void *data)
+{
+	const uint64_t *w = (const uint64_t *)data;
+	uint64_t h[4] = {
+		0x9E3779B97F4A7C15ul, 0xC2B2AE3D27D4EB4Ful,
+		0x165667B19E3779F9ul, 0x27D4EB2F165667C5ul,
+	};
+	for (size_t i = 0; i < A1FS_BLOCK_SIZE / sizeof(uint64_t); i += 4) {
+		for (int lane = 0; lane < 4; lane++) {
+			h[lane] ^= w[i + lane];
+			h[lane] *= 0xFF51AFD7ED558CCDul;
+			h[lane] ^= h[lane] >> 32;
+		}
+	}
+	return h[0] ^ (h[1] * 31) ^ (h[2] * 961) ^ (h[3] * 29791);
+}
+
+static void *hash_thread(void *arg)
+{
+	hash_work *work = (hash_work *)arg;
+	for (size_t i = work->begin; i < work->end; i++) {
+		blk_hash *b = &work->blocks[i];
+		b->hash = hash_block(work->image + (size_t)b->blk * A1FS_BLOCK_SIZE);
+	}
+	return NULL;
+}
+
+static int cmp_blk_hash(const void *a, const void *b)
+{
+	const blk_hash *x = (const blk_hash *)a;
+	const blk_hash *y = (const blk_hash *)b;
+	if (x->hash != y->hash) return (x->hash < y->hash) ? -1 : 1;
+	return (x->blk < y->blk) ? -1 : (x->blk > y->blk);
+}
+
+
+/** Duplicate block and the block it is replaced with. */
+typedef struct blk_remap {
+	a1fs_blk_t dup;
+	a1fs_blk_t canon;
+} blk_remap;
+
+static int cmp_blk_remap(const void *a, const void *b)
+{
+	const blk_remap *x = (const blk_remap *)a;
+	const blk_remap *y = (const blk_remap *)b;
+	return (x->dup < y->dup) ? -1 : (x->dup > y->dup);
+}
+
+/** Look up the canonical copy of a block; returns the block itself if unique. */
+static a1fs_blk_t canonical(blk_remap *remaps, size_t n_remaps, a1fs_blk_t blk)
+{
+	blk_remap key = { blk, 0 };
+	blk_remap *r = bsearch(&key, remaps, n_remaps, sizeof(*remaps), cmp_blk_remap);
+	return (r != NULL) ? r->canon : blk;
+}
+
+static double elapsed(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/** Check if the inode is allocated in the inode bitmap. */
+static bool inode_in_use(void *image, a1fs_ino_t ino)
+{
+	a1fs_superblock *superblock = (a1fs_superblock *)image;
+	unsigned char *ino_bitmap = (unsigned char *)(image + superblock->inode_bitmap_start * A1FS_BLOCK_SIZE);
+	return (ino_bitmap[ino / 8] & (1 << (ino % 8))) != 0;
+}
+
+
+/** Statistics reported at the end of a run. */
+typedef struct dedup_stats {
+	size_t blocks_scanned;
+	size_t dup_blocks;
+	size_t files_rewritten;
+	size_t files_skipped;
+	size_t blocks_freed;
+	double hash_time;
+	double total_time;
+} dedup_stats;
+
+/**
+ * Walk the first blocks of a file together with their new locations in
+ * scratch. Where a block is remapped, either release the duplicate, whose
+ * reference moved to the canonical block, or, when the remap is abandoned,
+ * drop the reference taken on the canonical block instead.
+ */
+static void finish_remaps(fs_ctx *fs, const a1fs_extent *extent, const a1fs_extent *scratch,
+                          size_t n_blocks, bool apply)
+{
+	int s = 0;
+	a1fs_blk_t s_off = 0;
+	for (int e = 0; n_blocks > 0; e++) {
+		for (a1fs_blk_t i = extent[e].start; i < extent[e].start + extent[e].count && n_blocks > 0; i++) {
+			a1fs_blk_t blk = scratch[s].start + s_off;
+			if (++s_off == scratch[s].count) {
+				s++;
+				s_off = 0;
+			}
+			n_blocks--;
+			if (blk == i) continue;
+			if (apply) {
+				journal_dirty(fs, block_refcount(blk, fs), sizeof(a1fs_ref_t));
+				release_block(i, fs);
+			} else {
+				(*block_refcount(blk, fs))--;
+			}
+		}
+	}
+}
+
+/**
+ * Rewrite the extents of a file so that duplicate blocks refer to their
+ * canonical copies.
+ *
+ * @return  false if the file was skipped (too many extents after the remap).
+ */
+static bool remap_file(fs_ctx *fs, a1fs_inode *inode, blk_remap *remaps,
+                       size_t n_remaps, a1fs_extent *scratch, dedup_stats *stats)
+{
+	void *image = fs->image;
+	a1fs_extent *extent = (a1fs_extent *)(image + inode->block_no * A1FS_BLOCK_SIZE);
+	int existing_extents = 512 - (int)inode->free_extent_num;
+
+	// Build the new extent list in scratch, coalescing physically contiguous
+	// runs. Each remap takes its reference on the canonical block right away,
+	// so that a block reaching the reference limit is not remapped further.
+	int n_new = 0;
+	size_t done = 0;
+	bool changed = false;
+	for (int e = 0; e < existing_extents; e++) {
+		for (a1fs_blk_t i = extent[e].start; i < extent[e].start + extent[e].count; i++) {
+			a1fs_blk_t blk = canonical(remaps, n_remaps, i);
+			if (blk != i && *block_refcount(blk, fs) == A1FS_REF_MAX) blk = i;
+			if (blk != i) {
+				(*block_refcount(blk, fs))++;
+				changed = true;
+			}
+
+			if (n_new > 0 && scratch[n_new - 1].start + scratch[n_new - 1].count == blk) {
+				scratch[n_new - 1].count++;
+				done++;
+				continue;
+			}
+			if (n_new == 512) {
+				if (blk != i) (*block_refcount(blk, fs))--;
+				finish_remaps(fs, extent, scratch, done, false);
+				return false;
+			}
+			scratch[n_new].start = blk;
+			scratch[n_new].count = 1;
+			n_new++;
+			done++;
+		}
+	}
+	if (!changed) return true;
+
+	size_t free_before = free_blocks(fs);
+	finish_remaps(fs, extent, scratch, done, true);
+	stats->blocks_freed += free_blocks(fs) - free_before;
+
+	memcpy(extent, scratch, n_new * sizeof(a1fs_extent));
+	memset(&extent[n_new], 0, (512 - n_new) * sizeof(a1fs_extent));
+	inode->free_extent_num = 512 - n_new;
+	journal_dirty_inode(fs, inode);
+	stats->files_rewritten++;
+	return true;
+}
+
+/**
+ * Deduplicate the image.
+ *
+ * @return  0 on success; -errno on failure.
+ */
+static int dedup(fs_ctx *fs, dedup_opts *opts, dedup_stats *stats)
+{
+	void *image = fs->image;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	a1fs_superblock *superblock = (a1fs_superblock *)image;
+	a1fs_inode *inode_table = (a1fs_inode *)(image + superblock->inode_table_start * A1FS_BLOCK_SIZE);
+
+	// Collect every data block of every regular file once
+	unsigned char *seen = calloc(superblock->blocks_count / 8 + 1, 1);
+	size_t cap = 1024, n_blocks = 0;
+	blk_hash *blocks = malloc(cap * sizeof(*blocks));
+	if (seen == NULL || blocks == NULL) {
+		free(seen);
+		free(blocks);
+		return -ENOMEM;
+	}
+	for (a1fs_ino_t ino = 0; ino < superblock->inodes_count; ino++) {
+		a1fs_inode *inode = &inode_table[ino];
+		if (!inode_in_use(image, ino) || inode->type != 1 || (inode->flags & A1FS_INODE_ORPHAN)) continue;
+
+		a1fs_extent *extent = (a1fs_extent *)(image + inode->block_no * A1FS_BLOCK_SIZE);
+		for (int e = 0; e < 512 - (int)inode->free_extent_num; e++) {
+			for (a1fs_blk_t i = extent[e].start; i < extent[e].start + extent[e].count; i++) {
+				if (seen[i / 8] & (1 << (i % 8))) continue;
+				seen[i / 8] |= 1 << (i % 8);
+				if (n_blocks == cap) {
+					cap *= 2;
+					blk_hash *grown = realloc(blocks, cap * sizeof(*blocks));
+					if (grown == NULL) {
+						free(seen);
+						free(blocks);
+						return -ENOMEM;
+					}
+					blocks = grown;
+				}
+				blocks[n_blocks++].blk = i;
+			}
+		}
+	}
+	free(seen);
+	stats->blocks_scanned = n_blocks;
+
+	// Hash blocks in parallel
+	struct timespec hash_start;
+	clock_gettime(CLOCK_MONOTONIC, &hash_start);
+	size_t n_threads = opts->n_threads;
+	if (n_threads > n_blocks) n_threads = (n_blocks > 0) ? n_blocks : 1;
+	pthread_t *threads = malloc(n_threads * sizeof(*threads));
+	hash_work *work = malloc(n_threads * sizeof(*work));
+	if (threads == NULL || work == NULL) {
+		free(threads);
+		free(work);
+		free(blocks);
+		return -ENOMEM;
+	}
+	for (size_t t = 0; t < n_threads; t++) {
+		work[t].image = image;
+		work[t].blocks = blocks;
+		work[t].begin = n_blocks * t / n_threads;
+		work[t].end = n_blocks * (t + 1) / n_threads;
+		if (pthread_create(&threads[t], NULL, hash_thread, &work[t]) != 0) {
+			// Hash this slice on the calling thread instead
+			hash_thread(&work[t]);
+			threads[t] = 0;
+		}
+	}
+	for (size_t t = 0; t < n_threads; t++) {
+		if (threads[t] != 0) pthread_join(threads[t], NULL);
+	}
+	free(threads);
+	free(work);
+	stats->hash_time = elapsed(&hash_start);
+
+	// Sort by hash (then by block number, so the lowest block of a group becomes
+	// canonical and duplicated runs map onto contiguous canonical runs)
+	qsort(blocks, n_blocks, sizeof(*blocks), cmp_blk_hash);
+
+	blk_remap *remaps = malloc((n_blocks + 1) * sizeof(*remaps));
+	if (remaps == NULL) {
+		free(blocks);
+		return -ENOMEM;
+	}
+	size_t n_remaps = 0;
+	for (size_t g = 0; g < n_blocks; ) {
+		size_t g_end = g + 1;
+		while (g_end < n_blocks && blocks[g_end].hash == blocks[g].hash) g_end++;
+
+		// Compare contents to rule out hash collisions: each block is matched
+		// against the distinct contents seen earlier in its group. Matched
+		// blocks are marked by setting their hash slot to the canonical block.
+		for (size_t i = g + 1; i < g_end; i++) {
+			void *data = image + (size_t)blocks[i].blk * A1FS_BLOCK_SIZE;
+			for (size_t j = g; j < i; j++) {
+				if (blocks[j].hash != blocks[g].hash) continue;// not canonical
+				if (memcmp(data, image + (size_t)blocks[j].blk * A1FS_BLOCK_SIZE, A1FS_BLOCK_SIZE) == 0) {
+					remaps[n_remaps].dup = blocks[i].blk;
+					remaps[n_remaps].canon = blocks[j].blk;
+					n_remaps++;
+					blocks[i].hash = ~blocks[g].hash;
+					break;
+				}
+			}
+		}
+		g = g_end;
+	}
+	qsort(remaps, n_remaps, sizeof(*remaps), cmp_blk_remap);
+	free(blocks);
+	stats->dup_blocks = n_remaps;
+
+	if (!opts->dry_run && n_remaps > 0) {
+		a1fs_extent scratch[512];
+		for (a1fs_ino_t ino = 0; ino < superblock->inodes_count; ino++) {
+			a1fs_inode *inode = &inode_table[ino];
+			if (!inode_in_use(image, ino) || inode->type != 1 || (inode->flags & A1FS_INODE_ORPHAN)) continue;
+			if (!remap_file(fs, inode, remaps, n_remaps, scratch, stats)) {
+				if (opts->verbose) {
+					fprintf(stderr, "inode %u: too many extents after dedup, skipped\n", ino);
+				}
+				stats->files_skipped++;
+			}
+		}
+	}
+	free(remaps);
+
+	stats->total_time = elapsed(&start);
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	dedup_opts opts = {0};// defaults are all 0
+	if (!parse_args(argc, argv, &opts)) {
+		// Invalid arguments, print help to stderr
+		print_help(stderr, argv[0]);
+		return 1;
+	}
+	if (opts.help) {
+		// Help requested, print it to stdout
+		print_help(stdout, argv[0]);
+		return 0;
+	}
+
+	// Map image file into memory
+	size_t size;
+	// A dry run still replays the journal and updates the superblock, but only
+	// in a private copy-on-write mapping
+	void *image = opts.dry_run ? map_file_private(opts.img_path, A1FS_BLOCK_SIZE, &size)
+	                           : map_file(opts.img_path, A1FS_BLOCK_SIZE, &size);
+	if (image == NULL) return 1;
+
+	int ret = 1;
+	a1fs_superblock *superblock = (a1fs_superblock *)image;
+	if (superblock->magic != A1FS_MAGIC) {
+		fprintf(stderr, "Image does not contain a1fs\n");
+		goto end;
+	}
+	if (superblock->refcount_blocks == 0) {
+		fprintf(stderr, "Image has no block reference count table; reformat it with a newer mkfs.a1fs\n");
+		goto end;
+	}
+
+	fs_ctx fs;
+	if (!fs_ctx_init(&fs, image, size, -1, NULL)) goto end;
+	// Finish freeing files unlinked before an unclean unmount
+	if (!opts.dry_run) orphan_reclaim_all(&fs);
+	dedup_stats stats = {0};
+	int err = dedup(&fs, &opts, &stats);
+	fs_ctx_destroy(&fs);
+	if (err != 0) {
+		fprintf(stderr, "Deduplication failed: %s\n", strerror(-err));
+		goto end;
+	}
+
+	printf("blocks scanned:    %zu\n", stats.blocks_scanned);
+	printf("duplicate blocks:  %zu\n", stats.dup_blocks);
+	if (opts.dry_run) {
+		printf("bytes reclaimable: %zu\n", stats.dup_blocks * A1FS_BLOCK_SIZE);
+	} else {
+		printf("files rewritten:   %zu\n", stats.files_rewritten);
+		printf("files skipped:     %zu\n", stats.files_skipped);
+		printf("bytes reclaimed:   %zu\n", stats.blocks_freed * A1FS_BLOCK_SIZE);
+	}
+	printf("hash time:         %.3f s (%zu threads)\n", stats.hash_time, opts.n_threads);
+	printf("total time:        %.3f s\n", stats.total_time);
+
+	// Sync to disk if requested
+	if (opts.sync && !opts.dry_run && (msync(image, size, MS_SYNC) < 0)) {
+		perror("msync");
+		goto end;
+	}
+
+	ret = 0;
+end:
+	munmap(image, size);
+	return ret;
+}
@@ -0,0 +1,567 @@
+/**
+ * a1fs image inspection tool.
+ *
+ * Prints the superblock and the on-disk layout of an image, followed by a
+ * report on how it is used: inode table occupancy, a histogram of the runs of
+ * free data blocks, extent counts of the files with the most fragmented ones,
+ * and directory sizes. The image is mapped read-only and parsed directly, so
+ * it can be inspected while mounted (the report may then be slightly stale).
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "map.h"
+#include "util.h"
+
+
+/** Command line options. */
+typedef struct dump_opts {
+	/** File system image file path. */
+	const char *img_path;
+	/** Number of files and directories to list in the top lists. */
+	size_t top;
+
+	/** Print help and exit. */
+	bool help;
+
+} dump_opts;
+
+static const char *help_str = "\
+Usage: %s options image\n\
+\n\
+Print the layout of an a1fs image and report on inode table occupancy, free\n\
+space fragmentation, file extent counts and directory sizes. The image is\n\
+only read and may be mounted.\n\
+\n\
+Options:\n\
+    -n num  number of most fragmented files and largest directories to list\n\
+            (default: 10)\n\
+    -h      print help and exit\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+	fprintf(f, help_str, progname);
+}
+
+
+static bool parse_args(int argc, char *argv[], dump_opts *opts)
+{
+	opts->top = 10;
+
+	int o;
+	while ((o = getopt(argc, argv, "n:h")) != -1) {
+		switch (o) {
+			case 'n': opts->top = strtoul(optarg, NULL, 10); break;
+
+			case 'h': opts->help = true; return true;// skip other arguments
+
+			case '?': return false;
+			default : assert(false);
+		}
+	}
+
+	if (optind >= argc) {
+		fprintf(stderr, "Missing image path\n");
+		return false;
+	}
+	opts->img_path = argv[optind];
+	return true;
+}
+
+
+/** Number of power of two buckets in the histograms. */
+#define N_BUCKETS 33
+
+/** Power of two histogram bucket of a positive value: 1, 2-3, 4-7, ... */
+static int bucket(uint64_t n)
+{
+	int b = 63 - __builtin_clzll(n);
+	return (b < N_BUCKETS) ? b : N_BUCKETS - 1;
+}
+
+/** Print the range of values in a power of two histogram bucket. */
+static void print_bucket(int b)
+{
+	uint64_t lo = 1ul << b;
+	uint64_t hi = (lo << 1) - 1;
+	if (lo == hi) {
+		printf("  %10lu       ", lo);
+	} else {
+		printf("  %10lu-%-6lu", lo, hi);
+	}
+}
+
+/** Number of blocks needed to hold a number of bytes. */
+static uint64_t blocks_of(uint64_t bytes)
+{
+	return align_up(bytes, A1FS_BLOCK_SIZE) / A1FS_BLOCK_SIZE;
+}
+
+static double percent(uint64_t n, uint64_t total)
+{
+	return total ? 100.0 * n / total : 0.0;
+}
+
+
+/** A file or directory on a top list. */
+typedef struct top_entry {
+	a1fs_ino_t ino;
+	/** Sort key: number of extents or of directory entries. */
+	uint64_t key;
+	char *path;
+} top_entry;
+
+/** The entries with the largest keys, in descending order. */
+typedef struct top_list {
+	top_entry *entries;
+	size_t n;
+	size_t cap;
+} top_list;
+
+/** Add an entry to a top list if its key is large enough; path is copied. */
+static void top_add(top_list *top, a1fs_ino_t ino, uint64_t key, const char *path)
+{
+	if (top->cap == 0) return;
+	if (top->n == top->cap) {
+		if (key <= top->entries[top->n - 1].key) return;
+		free(top->entries[--top->n].path);
+	}
+	size_t i = top->n++;
+	for (; i > 0 && top->entries[i - 1].key < key; i--) top->entries[i] = top->entries[i - 1];
+	top->entries[i] = (top_entry){ ino, key, strdup(path) };
+}
+
+static void top_free(top_list *top)
+{
+	for (size_t i = 0; i < top->n; i++) free(top->entries[i].path);
+	free(top->entries);
+}
+
+
+/** Image being inspected. */
+typedef struct image {
+	const unsigned char *data;
+	const a1fs_superblock *sb;
+	const unsigned char *ino_bitmap;
+	const unsigned char *blk_bitmap;
+	const a1fs_inode *itable;
+} image;
+
+/** Statistics gathered by walking the directory tree. */
+typedef struct tree_stats {
+	/** Inodes reached from the root directory. */
+	unsigned char *visited;
+	/** Inodes reached more than once, or used but not marked in the bitmap. */
+	uint64_t bad_links;
+	/** Extent blocks or extents pointing outside of the data area. */
+	uint64_t bad_extents;
+
+	uint64_t files;
+	uint64_t file_blocks;
+	uint64_t file_extents;
+	uint64_t fragmented;
+	uint64_t compressed;
+	uint64_t extent_hist[N_BUCKETS];
+	top_list worst_files;
+
+	uint64_t dirs;
+	uint64_t dir_entries;
+	uint64_t dir_hist[N_BUCKETS];
+	uint64_t empty_dirs;
+	top_list largest_dirs;
+} tree_stats;
+
+static bool bit_set(const unsigned char *bitmap, uint64_t i)
+{
+	return bitmap[i / 8] & (1 << (i % 8));
+}
+
+/**
+ * Get the used extents of an inode.
+ *
+ * @param img    image.
+ * @param inode  inode.
+ * @param count  receives the number of used extents.
+ * @return       the extents; NULL if the inode has none or its extent block
+ *               is out of range.
+ */
+static const a1fs_extent *inode_extents(const image *img, const a1fs_inode *inode, uint32_t *count)
+{
+	const uint32_t max = A1FS_BLOCK_SIZE / sizeof(a1fs_extent);
+	*count = 0;
+	if (inode->free_extent_num >= max) return NULL;
+	if (inode->block_no < img->sb->data_start || inode->block_no >= img->sb->blocks_count) return NULL;
+	*count = max - inode->free_extent_num;
+	return (const a1fs_extent *)(img->data + (size_t)inode->block_no * A1FS_BLOCK_SIZE);
+}
+
+/** Check that an extent lies within the data area. */
+static bool extent_valid(const image *img, const a1fs_extent *ext)
+{
+	return ext->start >= img->sb->data_start &&
+	       (uint64_t)ext->start + ext->count <= img->sb->blocks_count;
+}
+
+static void walk_file(const image *img, tree_stats *st, a1fs_ino_t ino, const char *path)
+{
+	const a1fs_inode *inode = &img->itable[ino];
+	uint32_t n;
+	const a1fs_extent *extents = inode_extents(img, inode, &n);
+	if (extents == NULL && inode->free_extent_num != A1FS_BLOCK_SIZE / sizeof(a1fs_extent)) {
+		st->bad_extents++;
+	}
+
+	uint64_t blocks = 0;
+	for (uint32_t i = 0; i < n; i++) {
+		if (!extent_valid(img, &extents[i])) {
+			st->bad_extents++;
+			continue;
+		}
+		blocks += extents[i].count;
+	}
+
+	st->files++;
+	st->file_blocks += blocks;
+	st->file_extents += n;
+	if (n > 1) st->fragmented++;
+	if (inode->flags & A1FS_INODE_COMPRESSED) st->compressed++;
+	if (n > 0) {
+		st->extent_hist[bucket(n)]++;
+		top_add(&st->worst_files, ino, n, path);
+	}
+}
+
+static void walk_dir(const image *img, tree_stats *st, a1fs_ino_t ino, char *path, size_t len)
+{
+	const a1fs_inode *inode = &img->itable[ino];
+	uint32_t n;
+	const a1fs_extent *extents = inode_extents(img, inode, &n);
+	uint64_t entries = 0;
+
+	// Only walk as many entries as the directory size says are in use
+	uint64_t remaining = inode->size / A1FS_DENTRY_SIZE;
+	for (uint32_t i = 0; i < n && remaining > 0; i++) {
+		if (!extent_valid(img, &extents[i])) {
+			st->bad_extents++;
+			continue;
+		}
+		const a1fs_dentry *dentries = (const a1fs_dentry *)
+			(img->data + (size_t)extents[i].start * A1FS_BLOCK_SIZE);
+		uint64_t count = (uint64_t)extents[i].count * (A1FS_BLOCK_SIZE / A1FS_DENTRY_SIZE);
+		for (uint64_t j = 0; j < count && remaining > 0; j++, remaining--) {
+			const a1fs_dentry *d = &dentries[j];
+			if (d->name[0] == '\0') continue;
+			if (strcmp(d->name, ".") == 0 || strcmp(d->name, "..") == 0) continue;
+			entries++;
+
+			if (d->ino >= img->sb->inodes_count || !bit_set(img->ino_bitmap, d->ino) ||
+			    bit_set(st->visited, d->ino))
+			{
+				st->bad_links++;
+				continue;
+			}
+			st->visited[d->ino / 8] |= 1 << (d->ino % 8);
+
+			size_t name_len = strnlen(d->name, A1FS_NAME_MAX);
+			if (len + 1 + name_len >= A1FS_PATH_MAX) continue;
+			char *end = path + len;
+			if (len > 1) *end++ = '/';
+			memcpy(end, d->name, name_len);
+			end[name_len] = '\0';
+			size_t child_len = end + name_len - path;
+
+			if (img->itable[d->ino].type == 0) {
+				walk_dir(img, st, d->ino, path, child_len);
+			} else {
+				walk_file(img, st, d->ino, path);
+			}
+			path[len] = '\0';
+		}
+	}
+
+	st->dirs++;
+	st->dir_entries += entries;
+	if (entries == 0) {
+		st->empty_dirs++;
+	} else {
+		st->dir_hist[bucket(entries)]++;
+	}
+	top_add(&st->largest_dirs, ino, entries, path);
+}
+
+
+static void print_superblock(const image *img)
+{
+	const a1fs_superblock *sb = img->sb;
+	printf("Superblock\n");
+	printf("  size:                %lu bytes\n", sb->size);
+	printf("  blocks:              %lu (%lu free)\n", sb->blocks_count, sb->free_blocks_count);
+	printf("  inodes:              %lu (%lu free)\n", sb->inodes_count, sb->free_inodes_count);
+	printf("  inode bitmap bytes:  %lu\n", sb->ino_bitmap_bytes);
+	printf("  block bitmap bytes:  %lu\n", sb->blk_bitmap_bytes);
+	printf("  orphan head:         %u\n", sb->orphan_head);
+	printf("  inodes init end:     %u%s\n", sb->inodes_init_end,
+	       sb->inodes_init_end ? "" : " (all initialized)");
+	printf("  state:               %s\n", sb->state == A1FS_STATE_CLEAN ? "clean" : "mounted or not cleanly unmounted");
+	printf("  generation:          %lu\n", sb->generation);
+
+	uint64_t itable_blocks = blocks_of(sb->inodes_count * sizeof(a1fs_inode));
+	printf("\nLayout\n");
+	printf("  %-16s %10s %10s\n", "area", "start", "blocks");
+	printf("  %-16s %10u %10u\n", "superblock", 0, 1);
+	printf("  %-16s %10u %10lu\n", "inode bitmap", sb->inode_bitmap_start,
+	       blocks_of(sb->ino_bitmap_bytes));
+	printf("  %-16s %10u %10lu\n", "block bitmap", sb->block_bitmap_start,
+	       blocks_of(sb->blk_bitmap_bytes));
+	printf("  %-16s %10u %10lu\n", "inode table", sb->inode_table_start, itable_blocks);
+	if (sb->refcount_blocks != 0) {
+		printf("  %-16s %10u %10u\n", "refcount table", sb->refcount_start, sb->refcount_blocks);
+	}
+	if (sb->summary_blocks != 0) {
+		printf("  %-16s %10u %10u\n", "space summary", sb->summary_start, sb->summary_blocks);
+	}
+	if (sb->journal_blocks != 0) {
+		printf("  %-16s %10u %10u\n", "journal", sb->journal_start, sb->journal_blocks);
+	}
+	printf("  %-16s %10u %10lu\n", "data", sb->data_start, sb->blocks_count - sb->data_start);
+}
+
+static void print_inodes(const image *img, const tree_stats *st)
+{
+	const a1fs_superblock *sb = img->sb;
+	const uint64_t per_block = A1FS_BLOCK_SIZE / sizeof(a1fs_inode);
+	uint64_t used = 0, files = 0, dirs = 0, orphans = 0, unreachable = 0;
+	uint64_t blocks = blocks_of(sb->inodes_count * sizeof(a1fs_inode));
+	uint64_t block_hist[5] = {0};// empty, <= 1/4, <= 1/2, <= 3/4, more
+
+	for (uint64_t b = 0; b < blocks; b++) {
+		uint64_t in_block = 0;
+		for (uint64_t i = b * per_block; i < (b + 1) * per_block && i < sb->inodes_count; i++) {
+			if (!bit_set(img->ino_bitmap, i)) continue;
+			in_block++;
+			const a1fs_inode *inode = &img->itable[i];
+			if (inode->flags & A1FS_INODE_ORPHAN) {
+				orphans++;
+			} else if (inode->type == 0) {
+				dirs++;
+			} else {
+				files++;
+			}
+			if (i != 0 && !bit_set(st->visited, i) && !(inode->flags & A1FS_INODE_ORPHAN)) {
+				unreachable++;
+			}
+		}
+		used += in_block;
+		block_hist[in_block == 0 ? 0 : 1 + (in_block * 4 - 1) / per_block]++;
+	}
+
+	printf("\nInode table\n");
+	printf("  used:                %lu of %lu (%.1f%%)\n", used, sb->inodes_count,
+	       percent(used, sb->inodes_count));
+	printf("  directories:         %lu\n", dirs);
+	printf("  files:               %lu\n", files);
+	printf("  orphans:             %lu\n", orphans);
+	printf("  unreachable:         %lu\n", unreachable);
+	if (used != sb->inodes_count - sb->free_inodes_count) {
+		printf("  superblock says:     %lu used\n", sb->inodes_count - sb->free_inodes_count);
+	}
+	printf("  table blocks by occupancy (%lu inodes per block):\n", per_block);
+	static const char *labels[] = { "empty", "1-25%", "26-50%", "51-75%", "76-100%" };
+	for (int i = 0; i < 5; i++) {
+		printf("  %17s  %10lu\n", labels[i], block_hist[i]);
+	}
+}
+
+static void print_free_space(const image *img)
+{
+	const a1fs_superblock *sb = img->sb;
+	uint64_t runs[N_BUCKETS] = {0}, run_blocks[N_BUCKETS] = {0};
+	uint64_t n_free = 0, n_runs = 0, longest = 0, run = 0;
+
+	for (uint64_t b = sb->data_start; b <= sb->blocks_count; b++) {
+		if (b < sb->blocks_count && !bit_set(img->blk_bitmap, b)) {
+			run++;
+			continue;
+		}
+		if (run == 0) continue;
+		n_free += run;
+		n_runs++;
+		if (run > longest) longest = run;
+		runs[bucket(run)]++;
+		run_blocks[bucket(run)] += run;
+		run = 0;
+	}
+
+	printf("\nFree space\n");
+	printf("  free data blocks:    %lu of %lu (%.1f%%)\n", n_free, sb->blocks_count - sb->data_start,
+	       percent(n_free, sb->blocks_count - sb->data_start));
+	if (n_free != sb->free_blocks_count) {
+		printf("  superblock says:     %lu free\n", sb->free_blocks_count);
+	}
+	printf("  free runs:           %lu\n", n_runs);
+	printf("  longest run:         %lu\n", longest);
+	printf("  average run:         %.1f\n", n_runs ? (double)n_free / n_runs : 0.0);
+	if (n_runs == 0) return;
+	printf("  %17s  %10s %12s %8s\n", "run length", "runs", "blocks", "% free");
+	for (int i = 0; i < N_BUCKETS; i++) {
+		if (runs[i] == 0) continue;
+		print_bucket(i);
+		printf("  %10lu %12lu %7.1f%%\n", runs[i], run_blocks[i], percent(run_blocks[i], n_free));
+	}
+}
+
+static void print_files(const image *img, const tree_stats *st)
+{
+	printf("\nFiles\n");
+	printf("  files:               %lu\n", st->files);
+	printf("  data blocks:         %lu\n", st->file_blocks);
+	printf("  extents:             %lu\n", st->file_extents);
+	printf("  extents per file:    %.2f\n", st->files ? (double)st->file_extents / st->files : 0.0);
+	printf("  fragmented:          %lu (%.1f%%)\n", st->fragmented, percent(st->fragmented, st->files));
+	printf("  compressed:          %lu\n", st->compressed);
+	if (st->file_extents != 0) {
+		printf("  %17s  %10s\n", "extents", "files");
+		for (int i = 0; i < N_BUCKETS; i++) {
+			if (st->extent_hist[i] == 0) continue;
+			print_bucket(i);
+			printf("  %10lu\n", st->extent_hist[i]);
+		}
+	}
+
+	const top_list *top = &st->worst_files;
+	if (top->n == 0 || top->entries[0].key < 2) return;
+	printf("  most fragmented:\n");
+	printf("  %8s %10s %14s  %s\n", "extents", "blocks", "size", "path");
+	for (size_t i = 0; i < top->n && top->entries[i].key > 1; i++) {
+		const a1fs_inode *inode = &img->itable[top->entries[i].ino];
+		uint32_t n;
+		const a1fs_extent *extents = inode_extents(img, inode, &n);
+		uint64_t blocks = 0;
+		for (uint32_t j = 0; j < n; j++) {
+			if (extent_valid(img, &extents[j])) blocks += extents[j].count;
+		}
+		printf("  %8lu %10lu %14lu  %s%s\n", top->entries[i].key, blocks, inode->size,
+		       top->entries[i].path, (inode->flags & A1FS_INODE_COMPRESSED) ? " (compressed)" : "");
+	}
+}
+
+static void print_dirs(const image *img, const tree_stats *st)
+{
+	printf("\nDirectories\n");
+	printf("  directories:         %lu\n", st->dirs);
+	printf("  entries:             %lu\n", st->dir_entries);
+	printf("  entries per dir:     %.2f\n", st->dirs ? (double)st->dir_entries / st->dirs : 0.0);
+	printf("  empty:               %lu\n", st->empty_dirs);
+	if (st->dir_entries != 0) {
+		printf("  %17s  %10s\n", "entries", "dirs");
+		for (int i = 0; i < N_BUCKETS; i++) {
+			if (st->dir_hist[i] == 0) continue;
+			print_bucket(i);
+			printf("  %10lu\n", st->dir_hist[i]);
+		}
+	}
+
+	const top_list *top = &st->largest_dirs;
+	if (top->n == 0 || top->entries[0].key == 0) return;
+	printf("  largest:\n");
+	printf("  %8s %10s  %s\n", "entries", "blocks", "path");
+	for (size_t i = 0; i < top->n && top->entries[i].key > 0; i++) {
+		const a1fs_inode *inode = &img->itable[top->entries[i].ino];
+		printf("  %8lu %10lu  %s\n", top->entries[i].key,
+		       blocks_of(inode->size), top->entries[i].path);
+	}
+}
+
+
+/** Check that the superblock describes areas that fit in the image. */
+static bool check_layout(const a1fs_superblock *sb, size_t size)
+{
+	uint64_t blocks = size / A1FS_BLOCK_SIZE;
+	uint64_t itable_blocks = blocks_of(sb->inodes_count * sizeof(a1fs_inode));
+	return sb->blocks_count <= blocks && sb->inodes_count > 0 &&
+	       sb->ino_bitmap_bytes * 8 >= sb->inodes_count &&
+	       sb->blk_bitmap_bytes * 8 >= sb->blocks_count &&
+	       sb->inode_bitmap_start + blocks_of(sb->ino_bitmap_bytes) <= blocks &&
+	       sb->block_bitmap_start + blocks_of(sb->blk_bitmap_bytes) <= blocks &&
+	       sb->inode_table_start + itable_blocks <= blocks &&
+	       sb->data_start <= sb->blocks_count;
+}
+
+int main(int argc, char *argv[])
+{
+	dump_opts opts = {0};// defaults are all 0
+	if (!parse_args(argc, argv, &opts)) {
+		// Invalid arguments, print help to stderr
+		print_help(stderr, argv[0]);
+		return 1;
+	}
+	if (opts.help) {
+		// Help requested, print it to stdout
+		print_help(stdout, argv[0]);
+		return 0;
+	}
+
+	// Map image file into memory, only for reading
+	size_t size;
+	void *data = map_file_readonly(opts.img_path, A1FS_BLOCK_SIZE, &size);
+	if (data == NULL) return 1;
+
+	int ret = 1;
+	image img = { .data = data, .sb = (const a1fs_superblock *)data };
+	if (img.sb->magic != A1FS_MAGIC) {
+		fprintf(stderr, "Image does not contain a1fs\n");
+		goto end;
+	}
+	if (!check_layout(img.sb, size)) {
+		fprintf(stderr, "Superblock layout doesn't fit in the image\n");
+		goto end;
+	}
+	img.ino_bitmap = img.data + (size_t)img.sb->inode_bitmap_start * A1FS_BLOCK_SIZE;
+	img.blk_bitmap = img.data + (size_t)img.sb->block_bitmap_start * A1FS_BLOCK_SIZE;
+	img.itable = (const a1fs_inode *)(img.data + (size_t)img.sb->inode_table_start * A1FS_BLOCK_SIZE);
+
+	tree_stats st = {0};
+	st.visited = calloc(img.sb->ino_bitmap_bytes, 1);
+	st.worst_files = (top_list){ calloc(opts.top, sizeof(top_entry)), 0, opts.top };
+	st.largest_dirs = (top_list){ calloc(opts.top, sizeof(top_entry)), 0, opts.top };
+	char *path = malloc(A1FS_PATH_MAX);
+	if (st.visited == NULL || (opts.top != 0 && (st.worst_files.entries == NULL ||
+	    st.largest_dirs.entries == NULL)) || path == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		goto out;
+	}
+	strcpy(path, "/");
+	st.visited[0] |= 1;
+	walk_dir(&img, &st, 0, path, 1);
+
+	print_superblock(&img);
+	print_inodes(&img, &st);
+	print_free_space(&img);
+	print_files(&img, &st);
+	print_dirs(&img, &st);
+	if (st.bad_links != 0 || st.bad_extents != 0) {
+		printf("\nInconsistencies\n");
+		printf("  bad directory entries: %lu\n", st.bad_links);
+		printf("  bad extents:           %lu\n", st.bad_extents);
+	}
+	ret = 0;
+
+out:
+	free(path);
+	top_free(&st.largest_dirs);
+	top_free(&st.worst_files);
+	free(st.visited);
+end:
+	munmap(data, size);
+	return ret;
+}
@@ -16,22 +16,308 @@
  * CSC369 Assignment 1 - File system runtime context implementation.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "fs_ctx.h"
+#include "seqlock.h"
 
 
-bool fs_ctx_init(fs_ctx *fs, void *image, size_t size, a1fs_opts *opts)
+bool fs_ctx_init(fs_ctx *fs, void *image, size_t size, int fd, a1fs_opts *opts)
 {
 	fs->image = image;
 	fs->size = size;
+	fs->fd = fd;
 	fs->opts = opts;
 
-	//TODO: check if the file system image can be mounted and initialize its
-	// runtime state
+	a1fs_superblock *sb = (a1fs_superblock *)image;
+	if (size < A1FS_BLOCK_SIZE || sb->magic != A1FS_MAGIC ||
+	    (uint64_t)sb->blocks_count * A1FS_BLOCK_SIZE > size) {
+		fprintf(stderr, "Invalid a1fs image\n");
+		return false;
+	}
+	fs->sb = sb;
+	fs->inodes = (a1fs_inode *)((char *)image + (size_t)sb->inode_table_start * A1FS_BLOCK_SIZE);
+	fs->inode_bitmap = (unsigned char *)image + (size_t)sb->inode_bitmap_start * A1FS_BLOCK_SIZE;
+	fs->block_bitmap = (unsigned char *)image + (size_t)sb->block_bitmap_start * A1FS_BLOCK_SIZE;
+
+	fs->ino_seq = calloc(sb->inodes_count, sizeof(uint32_t));
+	if (fs->ino_seq == NULL) {
+		perror("calloc");
+		return false;
+	}
+	fs->ns_seq = 0;
+	for (int i = 0; i < A1FS_INO_LOCKS; i++) {
+		pthread_rwlock_init(&fs->ino_locks[i], NULL);
+	}
+	op_init(fs);
+	pthread_mutex_init(&fs->ns_lock, NULL);
+	pthread_mutex_init(&fs->rename_lock, NULL);
+	pthread_mutex_init(&fs->alloc_lock, NULL);
+	pthread_mutex_init(&fs->orphan_lock, NULL);
+	pthread_cond_init(&fs->orphan_cond, NULL);
+	pthread_cond_init(&fs->orphan_done, NULL);
+	fs->reclaimer_running = false;
+	fs->orphan_safe = 0;
+	fs->writeback_running = false;
+	fs->dirty = NULL;
+	fs->stats = NULL;
+	fs->pools = NULL;
+	fs->regions = NULL;
+	fs->dcache = NULL;
+	fs->journal = NULL;
+	fs->lazy_mtime = NULL;
+	fs->lazy_list = NULL;
+	fs->lazy_listed = NULL;
+	fs->n_lazy = fs->cap_lazy = 0;
+	fs->lazy_overflow = false;
+	fs->record = NULL;
+	if (!stats_init(fs)) {
+		perror("malloc");
+		fs_ctx_destroy(fs);
+		return false;
+	}
+	if (!writeback_init(fs)) {
+		perror("calloc");
+		fs_ctx_destroy(fs);
+		return false;
+	}
+	// Replay before anything reads the metadata
+	if (!journal_init(fs)) {
+		fs_ctx_destroy(fs);
+		return false;
+	}
+	if (!alloc_init(fs)) {
+		perror("malloc");
+		fs_ctx_destroy(fs);
+		return false;
+	}
+	// Anything saved outside of the image before now is stale
+	sb->generation++;
+	journal_dirty(fs, sb, sizeof(*sb));
+	if (opts != NULL && !dcache_init(fs)) {
+		perror("calloc");
+		fs_ctx_destroy(fs);
+		return false;
+	}
+	if (opts != NULL && opts->lazytime) {
+		fs->lazy_mtime = calloc(sb->inodes_count, sizeof(uint64_t));
+		fs->lazy_listed = calloc(sb->inodes_count / 8 + 1, 1);
+		pthread_mutex_init(&fs->lazy_lock, NULL);
+		if (fs->lazy_mtime == NULL || fs->lazy_listed == NULL) {
+			perror("calloc");
+			fs_ctx_destroy(fs);
+			return false;
+		}
+	}
+	if (opts != NULL && opts->record_file != NULL) {
+		fs->record = record_open(opts->record_file);
+		if (fs->record == NULL) {
+			perror(opts->record_file);
+			fs_ctx_destroy(fs);
+			return false;
+		}
+	}
 	return true;
 }
 
+/** Epoch of the operation the calling thread is in. */
+static __thread uint32_t op_current;
+
+void op_init(fs_ctx *fs)
+{
+	fs->op_epoch = 0;
+	fs->op_count[0] = fs->op_count[1] = 0;
+	fs->op_blocked = false;
+	fs->op_draining = false;
+	pthread_mutex_init(&fs->op_lock, NULL);
+	pthread_cond_init(&fs->op_cond, NULL);
+	pthread_mutex_init(&fs->op_drain_lock, NULL);
+}
+
+void op_destroy(fs_ctx *fs)
+{
+	pthread_mutex_destroy(&fs->op_lock);
+	pthread_cond_destroy(&fs->op_cond);
+	pthread_mutex_destroy(&fs->op_drain_lock);
+}
+
+static void op_leave(fs_ctx *fs, uint32_t epoch)
+{
+	if (__atomic_sub_fetch(&fs->op_count[epoch & 1], 1, __ATOMIC_SEQ_CST) == 0 &&
+	    __atomic_load_n(&fs->op_draining, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&fs->op_lock);
+		pthread_cond_broadcast(&fs->op_cond);
+		pthread_mutex_unlock(&fs->op_lock);
+	}
+}
+
+void op_begin(fs_ctx *fs)
+{
+	while (true) {
+		uint32_t epoch = __atomic_load_n(&fs->op_epoch, __ATOMIC_SEQ_CST);
+		if (!__atomic_load_n(&fs->op_blocked, __ATOMIC_SEQ_CST)) {
+			__atomic_add_fetch(&fs->op_count[epoch & 1], 1, __ATOMIC_SEQ_CST);
+			// A drain that changed the epoch meanwhile may not wait for this count
+			if (__atomic_load_n(&fs->op_epoch, __ATOMIC_SEQ_CST) == epoch &&
+			    !__atomic_load_n(&fs->op_blocked, __ATOMIC_SEQ_CST)) {
+				op_current = epoch;
+				return;
+			}
+			op_leave(fs, epoch);
+		}
+		pthread_mutex_lock(&fs->op_lock);
+		while (__atomic_load_n(&fs->op_blocked, __ATOMIC_SEQ_CST)) {
+			pthread_cond_wait(&fs->op_cond, &fs->op_lock);
+		}
+		pthread_mutex_unlock(&fs->op_lock);
+	}
+}
+
+void op_end(fs_ctx *fs)
+{
+	op_leave(fs, op_current);
+}
+
+/** Start a new epoch and wait until the operations of the previous one have ended. */
+static void op_drain(fs_ctx *fs)
+{
+	uint32_t epoch = __atomic_fetch_add(&fs->op_epoch, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&fs->op_lock);
+	__atomic_store_n(&fs->op_draining, true, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&fs->op_count[epoch & 1], __ATOMIC_SEQ_CST) != 0) {
+		pthread_cond_wait(&fs->op_cond, &fs->op_lock);
+	}
+	__atomic_store_n(&fs->op_draining, false, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&fs->op_lock);
+}
+
+void op_quiesce(fs_ctx *fs)
+{
+	pthread_mutex_lock(&fs->op_drain_lock);
+	__atomic_store_n(&fs->op_blocked, true, __ATOMIC_SEQ_CST);
+	op_drain(fs);
+}
+
+void op_resume(fs_ctx *fs)
+{
+	pthread_mutex_lock(&fs->op_lock);
+	__atomic_store_n(&fs->op_blocked, false, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&fs->op_cond);
+	pthread_mutex_unlock(&fs->op_lock);
+	pthread_mutex_unlock(&fs->op_drain_lock);
+}
+
+void op_synchronize(fs_ctx *fs)
+{
+	pthread_mutex_lock(&fs->op_drain_lock);
+	op_drain(fs);
+	pthread_mutex_unlock(&fs->op_drain_lock);
+}
+
+void inode_write_lock(fs_ctx *fs, a1fs_ino_t ino)
+{
+	pthread_rwlock_wrlock(ino_lock(fs, ino));
+	seq_write_begin(&fs->ino_seq[ino]);
+}
+
+void inode_write_unlock(fs_ctx *fs, a1fs_ino_t ino)
+{
+	journal_dirty_inode(fs, &fs->inodes[ino]);
+	seq_write_end(&fs->ino_seq[ino]);
+	pthread_rwlock_unlock(ino_lock(fs, ino));
+}
+
+/** Copy the distinct inode numbers of inos to sorted in locking order and return their count. */
+static int sort_inodes(fs_ctx *fs, const a1fs_ino_t *inos, int n, a1fs_ino_t *sorted)
+{
+	int m = 0;
+	for (int i = 0; i < n; i++) {
+		int pos = 0;
+		while (pos < m && (ino_lock(fs, sorted[pos]) < ino_lock(fs, inos[i]) ||
+		                   (ino_lock(fs, sorted[pos]) == ino_lock(fs, inos[i]) && sorted[pos] < inos[i]))) {
+			pos++;
+		}
+		if (pos < m && sorted[pos] == inos[i]) continue;
+		memmove(&sorted[pos + 1], &sorted[pos], (m - pos) * sizeof(a1fs_ino_t));
+		sorted[pos] = inos[i];
+		m++;
+	}
+	return m;
+}
+
+void inodes_write_lock(fs_ctx *fs, const a1fs_ino_t *inos, int n)
+{
+	a1fs_ino_t sorted[4];
+	int m = sort_inodes(fs, inos, n, sorted);
+	for (int i = 0; i < m; i++) {
+		if (i == 0 || ino_lock(fs, sorted[i]) != ino_lock(fs, sorted[i - 1])) {
+			pthread_rwlock_wrlock(ino_lock(fs, sorted[i]));
+		}
+		seq_write_begin(&fs->ino_seq[sorted[i]]);
+	}
+}
+
+void inodes_write_unlock(fs_ctx *fs, const a1fs_ino_t *inos, int n)
+{
+	a1fs_ino_t sorted[4];
+	int m = sort_inodes(fs, inos, n, sorted);
+	for (int i = m - 1; i >= 0; i--) {
+		journal_dirty_inode(fs, &fs->inodes[sorted[i]]);
+		seq_write_end(&fs->ino_seq[sorted[i]]);
+		if (i == 0 || ino_lock(fs, sorted[i]) != ino_lock(fs, sorted[i - 1])) {
+			pthread_rwlock_unlock(ino_lock(fs, sorted[i]));
+		}
+	}
+}
+
+void ns_write_lock(fs_ctx *fs)
+{
+	pthread_mutex_lock(&fs->ns_lock);
+	seq_write_begin(&fs->ns_seq);
+}
+
+void ns_write_unlock(fs_ctx *fs)
+{
+	seq_write_end(&fs->ns_seq);
+	pthread_mutex_unlock(&fs->ns_lock);
+}
+
 void fs_ctx_destroy(fs_ctx *fs)
 {
-	//TODO: cleanup any resources allocated in fs_ctx_init()
-	(void)fs;
+	writeback_stop(fs);
+	orphan_stop(fs);
+	// Return the pooled blocks and inodes, the image is consistent afterwards
+	if (fs->pools != NULL) alloc_destroy(fs);
+	// Only what changed since it was last written back needs syncing. A
+	// private mapping is discarded on unmap, so it is always written back;
+	// file data goes before the metadata that refers to it, except for the
+	// blocks pinned until the final checkpoint
+	bool sync = fs->fd >= 0 || (fs->opts != NULL && fs->opts->sync);
+	if (sync) writeback_range(fs, 0, fs->sb->blocks_count);
+	journal_destroy(fs);
+	if (sync) writeback_range(fs, 0, fs->sb->blocks_count);
+	writeback_destroy(fs);
+	for (int i = 0; i < A1FS_INO_LOCKS; i++) {
+		pthread_rwlock_destroy(&fs->ino_locks[i]);
+	}
+	free(fs->ino_seq);
+	if (fs->lazy_mtime != NULL || fs->lazy_listed != NULL) pthread_mutex_destroy(&fs->lazy_lock);
+	free(fs->lazy_mtime);
+	free(fs->lazy_listed);
+	free(fs->lazy_list);
+	dcache_destroy(fs);
+	op_destroy(fs);
+	pthread_mutex_destroy(&fs->ns_lock);
+	pthread_mutex_destroy(&fs->rename_lock);
+	pthread_mutex_destroy(&fs->alloc_lock);
+	pthread_mutex_destroy(&fs->orphan_lock);
+	pthread_cond_destroy(&fs->orphan_cond);
+	pthread_cond_destroy(&fs->orphan_done);
+	stats_destroy(fs);
+	if (fs->record != NULL && !record_close(fs->record)) {
+		fprintf(stderr, "Failed to write the recording %s\n", fs->opts->record_file);
+	}
+	fs->record = NULL;
 }
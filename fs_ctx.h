@@ -18,11 +18,25 @@
 
 #pragma once
 
+#include <pthread.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <time.h>
 
+#include "a1fs.h"
+#include "alloc.h"
+#include "dcache.h"
+#include "journal.h"
 #include "options.h"
+#include "orphan.h"
+#include "record.h"
+#include "stats.h"
+#include "writeback.h"
 
 
+/** Number of inode locks; inode numbers are hashed onto them (see ino_lock()). */
+#define A1FS_INO_LOCKS 1024
+
 /**
  * Mounted file system runtime state - "fs context".
  */
@@ -31,11 +45,154 @@ typedef struct fs_ctx {
 	void *image;
 	/** Image size in bytes. */
 	size_t size;
-	/** Command line options. */
+	/** The image was mapped by a1fs_open() and is unmapped by a1fs_close(). */
+	bool own_image;
+	/**
+	 * Image file of a private mapping, written with pwrite() (see
+	 * writeback_write()), so that metadata only reaches it from committed
+	 * transactions; -1 if the mapping is shared and written back with
+	 * msync().
+	 */
+	int fd;
+	/** Command line options; NULL when the image is opened by a tool. */
 	a1fs_opts *opts;
 
-	//TODO: useful runtime state of the mounted file system should be cached
-	// here (NOT in global variables in a1fs.c)
+	/** Superblock, at the start of the image. */
+	a1fs_superblock *sb;
+	/** Inode table. */
+	a1fs_inode *inodes;
+	/** Inode bitmap. */
+	unsigned char *inode_bitmap;
+	/** Block bitmap. */
+	unsigned char *block_bitmap;
+
+	/**
+	 * Operations in progress, counted per epoch (see op_begin()). Journal
+	 * commits wait for them to end, and an inode removed from the namespace is
+	 * only freed once the operations that might have looked it up have ended.
+	 * op_blocked keeps new operations out while a commit captures its blocks.
+	 */
+	uint32_t op_epoch;
+	uint32_t op_count[2];
+	bool op_blocked;
+	bool op_draining;
+	/** Protects the waits below; op_cond is broadcast when they may be over. */
+	pthread_mutex_t op_lock;
+	pthread_cond_t op_cond;
+	/** Serializes the epoch changes of op_quiesce() and op_synchronize(). */
+	pthread_mutex_t op_drain_lock;
+	/**
+	 * Inode locks. Protect the inode fields, its extent block and its data;
+	 * inode numbers share them (see ino_lock()). When several are held they
+	 * are taken in increasing order of their address, each once (see
+	 * inodes_write_lock()).
+	 */
+	pthread_rwlock_t ino_locks[A1FS_INO_LOCKS];
+	/**
+	 * Per-inode sequence counters (see seqlock.h), changed by the holder of
+	 * the inode's write lock. They let getattr, read and path lookups read an
+	 * inode, its extents, data and directory entries without locking.
+	 */
+	uint32_t *ino_seq;
+	/**
+	 * Namespace sequence counter, changed by unlink, rmdir and rename while
+	 * they hold ns_lock (see ns_write_lock()). Lock-free readers validate it to
+	 * detect that an inode they found was removed or moved meanwhile.
+	 */
+	uint32_t ns_seq;
+	pthread_mutex_t ns_lock;
+	/**
+	 * Held by renames that move a directory to another parent, so that two of
+	 * them can't make directories each other's ancestors.
+	 */
+	pthread_mutex_t rename_lock;
+	/**
+	 * Allocator lock. Protects both bitmaps, the scan hints below and changes
+	 * to the block reference count table. The free counters in the superblock
+	 * are only updated by alloc_sync().
+	 */
+	pthread_mutex_t alloc_lock;
+	/** Where the next scan of the block bitmap starts. */
+	uint32_t blk_hint;
+	/** Where the next scan of the inode bitmap starts. */
+	uint32_t ino_hint;
+	/** Per-CPU allocation pools (see alloc.h). */
+	alloc_pool *pools;
+	int n_pools;
+	/**
+	 * Free space summary of the block bitmap regions (see a1fs_region),
+	 * protected by the allocator lock. Unknown fields are filled in when
+	 * the region is first scanned.
+	 */
+	a1fs_region *regions;
+	uint32_t n_regions;
+
+	/** Protects the orphan list (see orphan.h) and the reclaimer state. */
+	pthread_mutex_t orphan_lock;
+	/** Signaled when an orphan is added or the reclaimer is asked to stop. */
+	pthread_cond_t orphan_cond;
+	/** Broadcast when the reclaimer has emptied the orphan list. */
+	pthread_cond_t orphan_done;
+	/** Background reclaimer thread, started by orphan_start(). */
+	pthread_t reclaimer;
+	bool reclaimer_running;
+	bool reclaimer_stop;
+	/** Orphan at the head of the list that no operation can use any more; 0 if none. */
+	a1fs_ino_t orphan_safe;
+
+	/** Metadata journal (see journal.h); NULL if the image has none. */
+	journal *journal;
+
+	/** Blocks changed since they were last written back, one bit each (see writeback.h). */
+	unsigned char *dirty;
+	/** Number of bits set in dirty. */
+	uint64_t n_dirty;
+	/**
+	 * When each group of A1FS_WB_GROUP blocks was first dirtied, in
+	 * milliseconds since wb_epoch plus one; 0 if the group is clean.
+	 */
+	uint64_t *dirty_since;
+	time_t wb_epoch;
+	/** Number of dirty blocks above which the writeback thread is woken up. */
+	uint64_t dirty_limit;
+	/** Protects the writeback thread state. */
+	pthread_mutex_t wb_lock;
+	/** Signaled when the dirty limit is exceeded or the thread is asked to stop. */
+	pthread_cond_t wb_cond;
+	/** Background writeback thread, started by writeback_start(). */
+	pthread_t writeback;
+	bool writeback_running;
+	bool writeback_stop;
+	bool writeback_kick;
+
+	/** Path lookup cache (see dcache.h); NULL when the image is opened by a tool. */
+	dcache_entry *dcache;
+
+	/**
+	 * Pending modification times of a --lazytime mount, in nanoseconds since
+	 * the epoch, indexed by inode number; 0 if the inode table is up to date
+	 * (see update_mtime()). NULL unless mounted with --lazytime.
+	 */
+	uint64_t *lazy_mtime;
+	/**
+	 * Inodes that got a pending modification time since the last
+	 * flush_mtimes(), each listed once (its bit in lazy_listed is set), so
+	 * that the flush doesn't scan the inode table. Protected by lazy_lock.
+	 * If the list could not grow, lazy_overflow makes the flush scan the
+	 * whole table instead.
+	 */
+	a1fs_ino_t *lazy_list;
+	size_t n_lazy;
+	size_t cap_lazy;
+	unsigned char *lazy_listed;
+	bool lazy_overflow;
+	pthread_mutex_t lazy_lock;
+
+	/** Per-CPU operation statistics (see stats.h). */
+	stats_shard *stats;
+	int n_stats;
+	/** Workload recording (see record.h); NULL unless mounted with --record. */
+	record_log *record;
 
 } fs_ctx;
 
@@ -45,10 +202,128 @@ typedef struct fs_ctx {
  * @param fs     pointer to the context to initialize.
  * @param image  pointer to the start of the image.
  * @param size   image size in bytes.
- * @param opts   command line options.
+ * @param fd     image file if the image is mapped privately (see fs_ctx.fd);
+ *               -1 if the mapping is shared.
+ * @param opts   command line options (may be NULL).
  * @return       true on success; false on failure (e.g. invalid superblock).
  */
-bool fs_ctx_init(fs_ctx *fs, void *image, size_t size, a1fs_opts *opts);
+bool fs_ctx_init(fs_ctx *fs, void *image, size_t size, int fd, a1fs_opts *opts);
+
+/**
+ * Initialize the operation tracking state (see op_begin()). Done by
+ * fs_ctx_init(); tools that use the journal without a full context call it
+ * themselves.
+ *
+ * @param fs  file system context.
+ */
+void op_init(fs_ctx *fs);
+
+/**
+ * Destroy the operation tracking state.
+ *
+ * @param fs  file system context.
+ */
+void op_destroy(fs_ctx *fs);
+
+/**
+ * Start an operation that uses inodes it looked up or changes metadata. Waits
+ * while a journal commit captures its blocks. Each thread can be in one
+ * operation at a time.
+ *
+ * @param fs  file system context.
+ */
+void op_begin(fs_ctx *fs);
+
+/**
+ * End the calling thread's operation.
+ *
+ * @param fs  file system context.
+ */
+void op_end(fs_ctx *fs);
+
+/**
+ * Keep new operations out and wait until the ones in progress have ended,
+ * until op_resume(). Must not be called from within an operation.
+ *
+ * @param fs  file system context.
+ */
+void op_quiesce(fs_ctx *fs);
+
+/**
+ * Let operations in again after op_quiesce().
+ *
+ * @param fs  file system context.
+ */
+void op_resume(fs_ctx *fs);
+
+/**
+ * Wait until the operations in progress have ended, without holding up the
+ * ones that start meanwhile. Must not be called from within an operation.
+ *
+ * @param fs  file system context.
+ */
+void op_synchronize(fs_ctx *fs);
+
+/**
+ * Return the lock of an inode.
+ *
+ * @param fs   file system context.
+ * @param ino  inode number.
+ */
+static inline pthread_rwlock_t *ino_lock(fs_ctx *fs, a1fs_ino_t ino)
+{
+	return &fs->ino_locks[ino % A1FS_INO_LOCKS];
+}
+
+/**
+ * Lock an inode for writing and start a write section of its sequence counter.
+ *
+ * @param fs   file system context.
+ * @param ino  inode number.
+ */
+void inode_write_lock(fs_ctx *fs, a1fs_ino_t ino);
+
+/**
+ * End the write section of an inode and unlock it.
+ *
+ * @param fs   file system context.
+ * @param ino  inode number.
+ */
+void inode_write_unlock(fs_ctx *fs, a1fs_ino_t ino);
+
+/**
+ * Lock several inodes for writing as inode_write_lock() does, taking their
+ * locks in order and each lock once. The same inode may be given twice.
+ *
+ * @param fs    file system context.
+ * @param inos  inode numbers.
+ * @param n     number of inode numbers, at most 4.
+ */
+void inodes_write_lock(fs_ctx *fs, const a1fs_ino_t *inos, int n);
+
+/**
+ * Unlock the inodes locked by inodes_write_lock().
+ *
+ * @param fs    file system context.
+ * @param inos  inode numbers, as given to inodes_write_lock().
+ * @param n     number of inode numbers.
+ */
+void inodes_write_unlock(fs_ctx *fs, const a1fs_ino_t *inos, int n);
+
+/**
+ * Start a write section of the namespace sequence counter, serialized with
+ * the other removals and renames. Taken after the inode locks.
+ *
+ * @param fs  file system context.
+ */
+void ns_write_lock(fs_ctx *fs);
+
+/**
+ * End the namespace write section.
+ *
+ * @param fs  file system context.
+ */
+void ns_write_unlock(fs_ctx *fs);
 
 /**
  * Destroy file system context.
@@ -0,0 +1,963 @@
+/**
+ * a1fs offline consistency checker.
+ *
+ * Checks an image that is not mounted in three passes, each run by a pool of
+ * worker threads:
+ *
+ * 1. The directory tree is walked from the root. Directories are shared out
+ *    through per-worker work-stealing deques, so that wide and deep trees
+ *    alike keep all workers busy. Each directory's entries, extents and link
+ *    count are checked, and every block referenced by a reachable inode (or
+ *    one on the orphan list, checked before the walk) is marked in an
+ *    in-memory bitmap.
+ * 2. The inode table is split into chunks, and the inode bitmap is compared
+ *    with the set of inodes reached in the walk.
+ * 3. The block bitmap is split into chunks and compared with the referenced
+ *    blocks; blocks referenced more than once are checked against the
+ *    reference count table.
+ *
+ * Finally the free counts in the superblock are checked. Problems are fixed as
+ * they are found; without -r they are fixed in a private copy-on-write mapping
+ * of the image, so that nothing is written to it but the problems that follow
+ * from them are reported just as a repair would find them. After a complete
+ * repair the free space summary is rebuilt and the image is marked clean.
+ * Committed journal transactions are replayed first, as on a mount.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+#include "journal.h"
+#include "map.h"
+#include "stats.h"
+#include "util.h"
+
+
+/** Exit status, as for other fsck tools. */
+#define FSCK_OK          0
+#define FSCK_FIXED       1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR       8
+
+/** Command line options. */
+typedef struct fsck_opts {
+	/** File system image file path. */
+	const char *img_path;
+	/** Number of worker threads. */
+	unsigned threads;
+	/** Write the repairs to the image. */
+	bool repair;
+	/** Only print the summary. */
+	bool quiet;
+
+	/** Print help and exit. */
+	bool help;
+
+} fsck_opts;
+
+static const char *help_str = "\
+Usage: %s options image\n\
+\n\
+Check the consistency of an a1fs image that is not mounted: the inode and\n\
+block bitmaps against the inodes and extents reachable from the root\n\
+directory and the orphan list, extent bounds, directory entries, link counts,\n\
+shared blocks and the free counts in the superblock. Unreachable inodes are\n\
+freed. Without -r nothing is written to the image.\n\
+\n\
+Options:\n\
+    -r      repair the image\n\
+    -j num  number of worker threads (default: number of CPUs)\n\
+    -q      only print the summary, not every problem\n\
+    -h      print help and exit\n\
+\n\
+Exit status: 0 if the image is consistent, 1 if all problems were repaired,\n\
+4 if problems are left, 8 if the image could not be checked.\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+	fprintf(f, help_str, progname);
+}
+
+
+static bool parse_args(int argc, char *argv[], fsck_opts *opts)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	opts->threads = (cpus > 0) ? (unsigned)cpus : 1;
+
+	int o;
+	while ((o = getopt(argc, argv, "rj:qh")) != -1) {
+		switch (o) {
+			case 'r': opts->repair = true; break;
+			case 'j': opts->threads = strtoul(optarg, NULL, 10); break;
+			case 'q': opts->quiet = true; break;
+
+			case 'h': opts->help = true; return true;// skip other arguments
+
+			case '?': return false;
+			default : assert(false);
+		}
+	}
+
+	if (opts->threads == 0) {
+		fprintf(stderr, "Invalid number of threads\n");
+		return false;
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "Missing image path\n");
+		return false;
+	}
+	opts->img_path = argv[optind];
+	return true;
+}
+
+
+#define MAX_EXTENTS (A1FS_BLOCK_SIZE / sizeof(a1fs_extent))
+#define DENTRIES_PER_BLOCK (A1FS_BLOCK_SIZE / A1FS_DENTRY_SIZE)
+
+/** Inodes per chunk of the inode pass; a multiple of 8, so that chunks don't share bitmap bytes. */
+#define INODE_CHUNK 4096
+/** Blocks per chunk of the block pass. */
+#define BLOCK_CHUNK 65536
+
+/** Directory to check: work item of the tree walk. */
+typedef struct dir_item {
+	a1fs_ino_t ino;
+	/** Directory whose entry led to this one; the root is its own parent. */
+	a1fs_ino_t parent;
+} dir_item;
+
+/**
+ * Work-stealing deque of a worker. The owner pushes and pops directories at
+ * the tail, walking its part of the tree depth first; idle workers steal from
+ * the head, taking the oldest directories, which tend to lead to the largest
+ * subtrees. Checking a directory takes much longer than taking the lock, so a
+ * lock per deque doesn't limit scaling.
+ */
+typedef struct work_deque {
+	pthread_mutex_t lock;
+	dir_item *items;
+	size_t head;
+	size_t tail;
+	size_t cap;
+} __attribute__((aligned(64))) work_deque;
+
+/** Checker state shared by the workers. */
+typedef struct checker {
+	unsigned char *data;
+	size_t size;
+	a1fs_superblock *sb;
+	unsigned char *ino_bitmap;
+	unsigned char *blk_bitmap;
+	a1fs_inode *itable;
+	/** Reference count table; NULL if the image has none. */
+	a1fs_ref_t *refs;
+	bool repair;
+	bool quiet;
+
+	/** Inodes reached from the root directory or the orphan list. */
+	unsigned char *reached;
+	/** Blocks referenced by reached inodes. */
+	unsigned char *claimed;
+	/** Blocks referenced more than once. */
+	unsigned char *shared;
+
+	unsigned n_workers;
+	work_deque *deques;
+	/** Directories pushed and not checked yet; the walk ends when it drops to 0. */
+	uint64_t pending;
+	/** Next chunk of the inode or block pass. */
+	uint64_t next_chunk;
+
+	/** Totals, updated atomically by the workers. */
+	uint64_t problems;
+	uint64_t unfixed;
+	uint64_t dirs;
+	uint64_t files;
+	uint64_t used_inodes;
+	uint64_t used_blocks;
+	/** A bitmap or the reference count table was changed. */
+	bool bitmaps_changed;
+} checker;
+
+typedef struct worker {
+	checker *ck;
+	unsigned id;
+	pthread_t thread;
+} worker;
+
+
+/**
+ * Report a problem. Lines are printed whole, so that workers can report
+ * concurrently.
+ *
+ * @param ck      checker.
+ * @param action  what the caller does about it, e.g. "removing entry"; NULL
+ *                if it can't be fixed.
+ * @param fmt     problem description format.
+ */
+static void problem(checker *ck, const char *action, const char *fmt, ...)
+{
+	__atomic_fetch_add(&ck->problems, 1, __ATOMIC_RELAXED);
+	if (action == NULL) __atomic_fetch_add(&ck->unfixed, 1, __ATOMIC_RELAXED);
+	if (ck->quiet) return;
+
+	char line[512];
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	if (action == NULL) {
+		printf("%s: cannot fix\n", line);
+	} else if (ck->repair) {
+		printf("%s: %s\n", line, action);
+	} else {
+		printf("%s\n", line);
+	}
+}
+
+static bool bit_set(const unsigned char *bitmap, uint64_t i)
+{
+	return bitmap[i / 8] & (1 << (i % 8));
+}
+
+/** Set or clear a bit of a byte no other thread changes. */
+static void set_bit_to(unsigned char *bitmap, uint64_t i, bool value)
+{
+	if (value) {
+		bitmap[i / 8] |= 1 << (i % 8);
+	} else {
+		bitmap[i / 8] &= ~(1 << (i % 8));
+	}
+}
+
+/** Atomically set a bit. @return  true if it was set already. */
+static bool test_and_set(unsigned char *bitmap, uint64_t i)
+{
+	unsigned char mask = 1 << (i % 8);
+	return __atomic_fetch_or(&bitmap[i / 8], mask, __ATOMIC_RELAXED) & mask;
+}
+
+static void atomic_clear(unsigned char *bitmap, uint64_t i)
+{
+	__atomic_fetch_and(&bitmap[i / 8], (unsigned char)~(1 << (i % 8)), __ATOMIC_RELAXED);
+}
+
+/** Mark a range of blocks as referenced, noting those that already were. */
+static void claim(checker *ck, uint64_t start, uint64_t count)
+{
+	uint64_t end = start + count;
+	while (start < end) {
+		unsigned bit = start % 8;
+		unsigned n = (end - start < 8 - bit) ? (unsigned)(end - start) : 8 - bit;
+		unsigned char mask = ((1u << n) - 1) << bit;
+		unsigned char old = __atomic_fetch_or(&ck->claimed[start / 8], mask, __ATOMIC_RELAXED);
+		if (old & mask) __atomic_fetch_or(&ck->shared[start / 8], old & mask, __ATOMIC_RELAXED);
+		start += n;
+	}
+}
+
+/** Check that an inode is marked in use and initialized. */
+static bool inode_in_use(const checker *ck, a1fs_ino_t ino)
+{
+	const a1fs_superblock *sb = ck->sb;
+	return ino < sb->inodes_count && bit_set(ck->ino_bitmap, ino) &&
+	       (sb->inodes_init_end == 0 || ino < sb->inodes_init_end);
+}
+
+
+static a1fs_extent *extents_of(const checker *ck, const a1fs_inode *inode)
+{
+	return (a1fs_extent *)(ck->data + (size_t)inode->block_no * A1FS_BLOCK_SIZE);
+}
+
+static uint32_t n_extents(const a1fs_inode *inode)
+{
+	return MAX_EXTENTS - inode->free_extent_num;
+}
+
+/** Number of blocks in the extents of an inode. */
+static uint64_t inode_blocks(const checker *ck, const a1fs_inode *inode)
+{
+	const a1fs_extent *ext = extents_of(ck, inode);
+	uint64_t blocks = 0;
+	for (uint32_t i = 0; i < n_extents(inode); i++) blocks += ext[i].count;
+	return blocks;
+}
+
+/**
+ * Check the extent block and extents of an inode, truncating the extents at
+ * the first one out of bounds.
+ *
+ * @return  false if the inode has no usable extent block.
+ */
+static bool check_extents(checker *ck, a1fs_ino_t ino)
+{
+	const a1fs_superblock *sb = ck->sb;
+	a1fs_inode *inode = &ck->itable[ino];
+	if (inode->block_no < sb->data_start || inode->block_no >= sb->blocks_count) return false;
+
+	if (inode->free_extent_num > MAX_EXTENTS) {
+		problem(ck, "dropping all extents", "inode %u: extent count is corrupt (%u free)",
+		        ino, inode->free_extent_num);
+		inode->free_extent_num = MAX_EXTENTS;
+	}
+	const a1fs_extent *ext = extents_of(ck, inode);
+	for (uint32_t i = 0; i < n_extents(inode); i++) {
+		if (ext[i].count == 0 || ext[i].start < sb->data_start ||
+		    (uint64_t)ext[i].start + ext[i].count > sb->blocks_count)
+		{
+			problem(ck, "truncating extents", "inode %u: extent %u (%u+%u) is out of bounds",
+			        ino, i, ext[i].start, ext[i].count);
+			inode->free_extent_num = MAX_EXTENTS - i;
+			break;
+		}
+	}
+	return true;
+}
+
+/** Mark the extent block and data blocks of an inode as referenced. */
+static void claim_inode(checker *ck, const a1fs_inode *inode)
+{
+	claim(ck, inode->block_no, 1);
+	const a1fs_extent *ext = extents_of(ck, inode);
+	for (uint32_t i = 0; i < n_extents(inode); i++) claim(ck, ext[i].start, ext[i].count);
+}
+
+/** Release the last blocks of an inode (they are not claimed, so the block pass frees them). */
+static void drop_blocks(checker *ck, a1fs_inode *inode, uint64_t count)
+{
+	a1fs_extent *ext = extents_of(ck, inode);
+	while (count > 0) {
+		a1fs_extent *last = &ext[n_extents(inode) - 1];
+		uint32_t n = (count < last->count) ? (uint32_t)count : last->count;
+		last->count -= n;
+		count -= n;
+		if (last->count == 0) inode->free_extent_num++;
+	}
+}
+
+/**
+ * Check a regular file reached through a directory entry.
+ *
+ * @return  false if the file is not usable and the entry must be removed.
+ */
+static bool check_file(checker *ck, a1fs_ino_t ino)
+{
+	a1fs_inode *inode = &ck->itable[ino];
+	if (!check_extents(ck, ino)) return false;
+
+	// The size of a compressed file is that of its uncompressed data
+	uint64_t blocks = inode_blocks(ck, inode);
+	if (!(inode->flags & A1FS_INODE_COMPRESSED) && inode->size > blocks * A1FS_BLOCK_SIZE) {
+		problem(ck, "truncating file", "inode %u: size %lu is past the end of its %lu blocks",
+		        ino, inode->size, blocks);
+		inode->size = blocks * A1FS_BLOCK_SIZE;
+	}
+	if (inode->links != 1) {
+		problem(ck, "setting it to 1", "inode %u: link count is %u, expected 1", ino, inode->links);
+		inode->links = 1;
+	}
+	claim_inode(ck, inode);
+	__atomic_fetch_add(&ck->files, 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+/**
+ * Check the extents and size of a directory, so that its entries can be
+ * walked. The number of blocks must match the number of entries, since the
+ * last entry is found at the end of the extents.
+ *
+ * @return  false if the directory is not usable and the entry must be removed.
+ */
+static bool check_dir_inode(checker *ck, a1fs_ino_t ino)
+{
+	a1fs_inode *inode = &ck->itable[ino];
+	if (!check_extents(ck, ino)) return false;
+	uint64_t blocks = inode_blocks(ck, inode);
+	if (blocks == 0) return false;
+
+	uint64_t n = inode->size / A1FS_DENTRY_SIZE;
+	if (inode->size % A1FS_DENTRY_SIZE != 0 || n < 2 || n > blocks * DENTRIES_PER_BLOCK) {
+		problem(ck, "truncating directory", "directory %u: size %lu doesn't fit its %lu blocks",
+		        ino, inode->size, blocks);
+		if (n > blocks * DENTRIES_PER_BLOCK) n = blocks * DENTRIES_PER_BLOCK;
+		if (n < 2) n = 2;// "." and ".." are rewritten by check_dir()
+		inode->size = n * A1FS_DENTRY_SIZE;
+	}
+	uint64_t need = align_up(n, DENTRIES_PER_BLOCK) / DENTRIES_PER_BLOCK;
+	if (blocks > need) {
+		problem(ck, "releasing the rest", "directory %u: %lu blocks hold %lu entries", ino, blocks, n);
+		drop_blocks(ck, inode, blocks - need);
+	}
+	return true;
+}
+
+/** Get the entry of a directory at an index. */
+static a1fs_dentry *dentry_at(const checker *ck, const a1fs_inode *inode, uint64_t i)
+{
+	const a1fs_extent *ext = extents_of(ck, inode);
+	uint64_t blk = i / DENTRIES_PER_BLOCK;
+	uint32_t e = 0;
+	for (; blk >= ext[e].count; e++) blk -= ext[e].count;
+	a1fs_dentry *block = (a1fs_dentry *)(ck->data + ((size_t)ext[e].start + blk) * A1FS_BLOCK_SIZE);
+	return &block[i % DENTRIES_PER_BLOCK];
+}
+
+/** Remove a directory entry by moving the last one into its place, as unlink does. */
+static void remove_dentry(checker *ck, a1fs_inode *dir, uint64_t *n, a1fs_dentry *d)
+{
+	a1fs_dentry *last = dentry_at(ck, dir, *n - 1);
+	if (d != last) memcpy(d, last, sizeof(*d));
+	memset(last, 0, sizeof(*last));
+	(*n)--;
+	dir->size = *n * A1FS_DENTRY_SIZE;
+	if (*n % DENTRIES_PER_BLOCK == 0) drop_blocks(ck, dir, 1);
+}
+
+
+static void push(checker *ck, unsigned self, dir_item item)
+{
+	work_deque *q = &ck->deques[self];
+	__atomic_fetch_add(&ck->pending, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&q->lock);
+	if (q->tail == q->cap) {
+		if (q->head > 0) {
+			memmove(q->items, q->items + q->head, (q->tail - q->head) * sizeof(dir_item));
+			__atomic_store_n(&q->tail, q->tail - q->head, __ATOMIC_RELAXED);
+			__atomic_store_n(&q->head, 0, __ATOMIC_RELAXED);
+		} else {
+			size_t cap = q->cap ? q->cap * 2 : 256;
+			dir_item *items = realloc(q->items, cap * sizeof(dir_item));
+			if (items == NULL) {
+				perror("realloc");
+				exit(FSCK_ERROR);
+			}
+			q->items = items;
+			q->cap = cap;
+		}
+	}
+	q->items[q->tail] = item;
+	__atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static bool pop(checker *ck, unsigned self, dir_item *item)
+{
+	work_deque *q = &ck->deques[self];
+	pthread_mutex_lock(&q->lock);
+	bool found = q->tail > q->head;
+	if (found) {
+		*item = q->items[q->tail - 1];
+		__atomic_store_n(&q->tail, q->tail - 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return found;
+}
+
+static bool steal(checker *ck, unsigned self, dir_item *item)
+{
+	for (unsigned k = 1; k < ck->n_workers; k++) {
+		work_deque *q = &ck->deques[(self + k) % ck->n_workers];
+		// Peek without the lock, to skip empty deques cheaply
+		if (__atomic_load_n(&q->tail, __ATOMIC_RELAXED) == __atomic_load_n(&q->head, __ATOMIC_RELAXED)) {
+			continue;
+		}
+		pthread_mutex_lock(&q->lock);
+		bool found = q->tail > q->head;
+		if (found) {
+			*item = q->items[q->head];
+			__atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&q->lock);
+		if (found) return true;
+	}
+	return false;
+}
+
+/**
+ * Check an entry of a directory. A valid entry claims the inode it refers to;
+ * subdirectories are pushed to be walked.
+ *
+ * @return  NULL if the entry is valid; otherwise why it must be removed.
+ */
+static const char *check_dentry(checker *ck, unsigned self, a1fs_ino_t dir, const a1fs_dentry *d,
+                                uint32_t *subdirs)
+{
+	a1fs_ino_t ino = d->ino;
+	if (d->name[0] == '\0' || strcmp(d->name, ".") == 0 || strcmp(d->name, "..") == 0) {
+		return "invalid name";
+	}
+	if (ino == 0) return "refers to the root directory";
+	if (!inode_in_use(ck, ino)) return "refers to a free inode";
+	a1fs_inode *inode = &ck->itable[ino];
+	if (inode->flags & A1FS_INODE_ORPHAN) return "refers to an unlinked inode";
+	if (inode->type > 1) return "refers to an inode of unknown type";
+	if (test_and_set(ck->reached, ino)) return "refers to an inode linked elsewhere";
+
+	if (inode->type == 1) {
+		if (check_file(ck, ino)) return NULL;
+	} else if (check_dir_inode(ck, ino)) {
+		if (inode->parent_ino != dir) {
+			problem(ck, "correcting it", "directory %u: parent is %u, but it is linked in %u",
+			        ino, inode->parent_ino, dir);
+			inode->parent_ino = dir;
+		}
+		(*subdirs)++;
+		push(ck, self, (dir_item){ ino, dir });
+		return NULL;
+	}
+	// Unreachable now, the inode pass frees it
+	atomic_clear(ck->reached, ino);
+	return "refers to an inode without a valid extent block";
+}
+
+/** Check the entries and link count of a directory and claim its blocks. */
+static void check_dir(checker *ck, unsigned self, dir_item item)
+{
+	a1fs_ino_t ino = item.ino;
+	a1fs_inode *inode = &ck->itable[ino];
+	uint64_t n = inode->size / A1FS_DENTRY_SIZE;
+	uint32_t subdirs = 0;
+
+	// Entries may be removed on the way, moving the last one into the
+	// current slot and shrinking the extents; i stops at the new end
+	uint64_t i = 0;
+	a1fs_extent *ext = extents_of(ck, inode);
+	for (uint32_t e = 0; e < n_extents(inode) && i < n; e++) {
+		for (uint32_t b = 0; b < ext[e].count && i < n; b++) {
+			a1fs_dentry *block = (a1fs_dentry *)(ck->data + ((size_t)ext[e].start + b) * A1FS_BLOCK_SIZE);
+			for (uint32_t j = 0; j < DENTRIES_PER_BLOCK && i < n; ) {
+				a1fs_dentry *d = &block[j];
+				bool terminated = memchr(d->name, '\0', A1FS_NAME_MAX) != NULL;
+				if (i < 2) {
+					// "." and ".." are never removed
+					const char *name = (i == 0) ? "." : "..";
+					a1fs_ino_t target = (i == 0) ? ino : item.parent;
+					if (!terminated || strcmp(d->name, name) != 0 || d->ino != target) {
+						problem(ck, "rewriting it", "directory %u: entry %lu is not \"%s\" -> %u",
+						        ino, i, name, target);
+						memset(d, 0, sizeof(*d));
+						strcpy(d->name, name);
+						d->ino = target;
+					}
+					i++, j++;
+					continue;
+				}
+
+				const char *why = terminated ? check_dentry(ck, self, ino, d, &subdirs) : "unterminated name";
+				if (why == NULL) {
+					i++, j++;
+					continue;
+				}
+				problem(ck, "removing it", "directory %u: entry \"%s\" -> %u: %s",
+				        ino, terminated ? d->name : "?", d->ino, why);
+				remove_dentry(ck, inode, &n, d);
+			}
+		}
+	}
+
+	if (inode->links != 2 + subdirs) {
+		problem(ck, "correcting it", "directory %u: link count is %u, expected %u",
+		        ino, inode->links, 2 + subdirs);
+		inode->links = 2 + subdirs;
+	}
+	claim_inode(ck, inode);
+	__atomic_fetch_add(&ck->dirs, 1, __ATOMIC_RELAXED);
+}
+
+/** Pass 1: walk the directory tree. */
+static void *walk_worker(void *arg)
+{
+	worker *w = (worker *)arg;
+	checker *ck = w->ck;
+	dir_item item;
+	for (;;) {
+		if (pop(ck, w->id, &item) || steal(ck, w->id, &item)) {
+			check_dir(ck, w->id, item);
+			__atomic_fetch_sub(&ck->pending, 1, __ATOMIC_RELEASE);
+		} else if (__atomic_load_n(&ck->pending, __ATOMIC_ACQUIRE) == 0) {
+			break;
+		} else {
+			sched_yield();
+		}
+	}
+	return NULL;
+}
+
+/** Pass 2: compare the inode bitmap with the reached inodes. */
+static void *inode_worker(void *arg)
+{
+	checker *ck = ((worker *)arg)->ck;
+	const a1fs_superblock *sb = ck->sb;
+	uint64_t used = 0;
+	uint64_t start;
+	while ((start = __atomic_fetch_add(&ck->next_chunk, 1, __ATOMIC_RELAXED) * INODE_CHUNK) < sb->inodes_count) {
+		uint64_t end = (start + INODE_CHUNK < sb->inodes_count) ? start + INODE_CHUNK : sb->inodes_count;
+		for (uint64_t i = start; i < end; i++) {
+			if (!bit_set(ck->ino_bitmap, i)) continue;
+			if (sb->inodes_init_end != 0 && i >= sb->inodes_init_end) {
+				problem(ck, "freeing it", "inode %lu: in use past the initialized inode table", i);
+			} else if (!bit_set(ck->reached, i)) {
+				problem(ck, "freeing it", "inode %lu: not reachable from the root directory", i);
+			} else {
+				used++;
+				continue;
+			}
+			set_bit_to(ck->ino_bitmap, i, false);
+			__atomic_store_n(&ck->bitmaps_changed, true, __ATOMIC_RELAXED);
+		}
+	}
+	__atomic_fetch_add(&ck->used_inodes, used, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/** Kinds of block problems, reported as runs of blocks. */
+enum { RUN_UNMARKED, RUN_LEAKED, RUN_CROSSLINKED, RUN_REFCOUNT, N_RUNS };
+
+/** A run of consecutive blocks with the same problem. */
+typedef struct block_run {
+	uint64_t start;
+	uint64_t count;
+} block_run;
+
+static void report_run(checker *ck, int kind, block_run *run)
+{
+	static const char *what[N_RUNS] = {
+		"in use but marked free",
+		"marked in use but not referenced",
+		"referenced more than once without a reference count",
+		"reference count is higher than the number of references",
+	};
+	static const char *action[N_RUNS] = { "marking them in use", "marking them free", NULL, "clearing it" };
+	if (run->count == 0) return;
+	problem(ck, action[kind], "blocks %lu-%lu: %s", run->start, run->start + run->count - 1, what[kind]);
+	run->count = 0;
+}
+
+/** Add a block to the run of a kind of problem, reporting the previous run if it ended. */
+static void add_to_run(checker *ck, int kind, block_run *run, uint64_t blk)
+{
+	if (run->count != 0 && run->start + run->count == blk) {
+		run->count++;
+		return;
+	}
+	report_run(ck, kind, run);
+	*run = (block_run){ blk, 1 };
+}
+
+/** Pass 3: compare the block bitmap and reference counts with the referenced blocks. */
+static void *block_worker(void *arg)
+{
+	checker *ck = ((worker *)arg)->ck;
+	const a1fs_superblock *sb = ck->sb;
+	uint64_t used = 0;
+	uint64_t start;
+	while ((start = __atomic_fetch_add(&ck->next_chunk, 1, __ATOMIC_RELAXED) * BLOCK_CHUNK) < sb->blocks_count) {
+		uint64_t end = (start + BLOCK_CHUNK < sb->blocks_count) ? start + BLOCK_CHUNK : sb->blocks_count;
+		block_run runs[N_RUNS] = {{0}};
+		for (uint64_t b = start; b < end; b++) {
+			bool in_use = b < sb->data_start || bit_set(ck->claimed, b);
+			if (in_use != bit_set(ck->blk_bitmap, b)) {
+				add_to_run(ck, in_use ? RUN_UNMARKED : RUN_LEAKED, &runs[in_use ? RUN_UNMARKED : RUN_LEAKED], b);
+				set_bit_to(ck->blk_bitmap, b, in_use);
+				__atomic_store_n(&ck->bitmaps_changed, true, __ATOMIC_RELAXED);
+			}
+			used += in_use;
+
+			// Only whether a block is shared is known, not by how many
+			bool shared = bit_set(ck->shared, b);
+			a1fs_ref_t ref = (ck->refs != NULL) ? ck->refs[b] : 0;
+			if (shared && ref == 0) {
+				add_to_run(ck, RUN_CROSSLINKED, &runs[RUN_CROSSLINKED], b);
+			} else if (!shared && ref != 0) {
+				add_to_run(ck, RUN_REFCOUNT, &runs[RUN_REFCOUNT], b);
+				ck->refs[b] = 0;
+				__atomic_store_n(&ck->bitmaps_changed, true, __ATOMIC_RELAXED);
+			}
+		}
+		for (int k = 0; k < N_RUNS; k++) report_run(ck, k, &runs[k]);
+	}
+	__atomic_fetch_add(&ck->used_blocks, used, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/** Run a pass on all workers. @return  elapsed time in seconds. */
+static double run_pass(checker *ck, void *(*fn)(void *))
+{
+	uint64_t start = stats_begin();
+	ck->next_chunk = 0;
+	worker *workers = calloc(ck->n_workers, sizeof(worker));
+	if (workers == NULL) {
+		perror("calloc");
+		exit(FSCK_ERROR);
+	}
+	for (unsigned i = 0; i < ck->n_workers; i++) {
+		workers[i] = (worker){ .ck = ck, .id = i };
+		if (pthread_create(&workers[i].thread, NULL, fn, &workers[i]) != 0) {
+			perror("pthread_create");
+			exit(FSCK_ERROR);
+		}
+	}
+	for (unsigned i = 0; i < ck->n_workers; i++) pthread_join(workers[i].thread, NULL);
+	free(workers);
+	return (stats_begin() - start) / 1e9;
+}
+
+
+/** Check that an area of metadata, if present, lies between the superblock and the data. */
+static bool area_valid(const a1fs_superblock *sb, uint64_t start, uint64_t blocks)
+{
+	return blocks == 0 || (start >= 1 && start + blocks <= sb->data_start);
+}
+
+/** Validate the superblock, without which nothing else can be checked. */
+static bool check_superblock(const a1fs_superblock *sb, size_t size)
+{
+	if (sb->magic != A1FS_MAGIC) {
+		fprintf(stderr, "Not an a1fs image\n");
+		return false;
+	}
+	const char *bad = NULL;
+	uint64_t itable_blocks = align_up(sb->inodes_count * sizeof(a1fs_inode), A1FS_BLOCK_SIZE) / A1FS_BLOCK_SIZE;
+	if (sb->size != size || sb->blocks_count != size / A1FS_BLOCK_SIZE) {
+		bad = "size";
+	} else if (sb->inodes_count == 0 || sb->ino_bitmap_bytes * 8 < sb->inodes_count ||
+	           sb->blk_bitmap_bytes * 8 < sb->blocks_count)
+	{
+		bad = "bitmap size";
+	} else if (sb->data_start >= sb->blocks_count ||
+	           !area_valid(sb, sb->inode_bitmap_start, align_up(sb->ino_bitmap_bytes, A1FS_BLOCK_SIZE) / A1FS_BLOCK_SIZE) ||
+	           !area_valid(sb, sb->block_bitmap_start, align_up(sb->blk_bitmap_bytes, A1FS_BLOCK_SIZE) / A1FS_BLOCK_SIZE) ||
+	           !area_valid(sb, sb->inode_table_start, itable_blocks) ||
+	           !area_valid(sb, sb->refcount_start, sb->refcount_blocks) ||
+	           !area_valid(sb, sb->journal_start, sb->journal_blocks) ||
+	           !area_valid(sb, sb->summary_start, sb->summary_blocks) ||
+	           (sb->refcount_blocks != 0 &&
+	            (uint64_t)sb->refcount_blocks * A1FS_BLOCK_SIZE / sizeof(a1fs_ref_t) < sb->blocks_count))
+	{
+		bad = "layout";
+	}
+	if (bad != NULL) {
+		fprintf(stderr, "Superblock is corrupt (%s)\n", bad);
+		return false;
+	}
+	return true;
+}
+
+/** Replay committed journal transactions, as a mount does. */
+static bool replay_journal(checker *ck)
+{
+	fs_ctx *fs = calloc(1, sizeof(fs_ctx));
+	if (fs == NULL) {
+		perror("calloc");
+		return false;
+	}
+	fs->image = ck->data;
+	fs->size = ck->size;
+	fs->sb = ck->sb;
+	fs->fd = -1;
+	op_init(fs);
+	bool ok = journal_init(fs);
+	if (ok) journal_destroy(fs);
+	op_destroy(fs);
+	free(fs);
+	return ok;
+}
+
+/** Check the orphan list, ending it at the first invalid entry, and claim the blocks of the orphans. */
+static void check_orphans(checker *ck)
+{
+	a1fs_ino_t *link = &ck->sb->orphan_head;
+	while (*link != 0) {
+		a1fs_ino_t ino = *link;
+		const char *why = NULL;
+		if (!inode_in_use(ck, ino)) {
+			why = "is not in use";
+		} else if (!(ck->itable[ino].flags & A1FS_INODE_ORPHAN)) {
+			why = "is not unlinked";
+		} else if (bit_set(ck->reached, ino)) {
+			why = "is listed twice";
+		} else if (!check_extents(ck, ino)) {
+			why = "has no valid extent block";
+		}
+		if (why != NULL) {
+			problem(ck, "ending the list there", "orphan list: inode %u %s", ino, why);
+			*link = 0;
+			return;
+		}
+		set_bit_to(ck->reached, ino, true);
+		claim_inode(ck, &ck->itable[ino]);
+		link = &ck->itable[ino].next_orphan;
+	}
+}
+
+/** Check the free counts in the superblock. */
+static void check_counts(checker *ck)
+{
+	a1fs_superblock *sb = ck->sb;
+	uint64_t free_inodes = sb->inodes_count - ck->used_inodes;
+	uint64_t free_blocks = sb->blocks_count - ck->used_blocks;
+	if (sb->free_inodes_count != free_inodes) {
+		problem(ck, "correcting it", "superblock: free inode count is %lu, counted %lu",
+		        sb->free_inodes_count, free_inodes);
+		sb->free_inodes_count = free_inodes;
+		__atomic_store_n(&ck->bitmaps_changed, true, __ATOMIC_RELAXED);
+	}
+	if (sb->free_blocks_count != free_blocks) {
+		problem(ck, "correcting it", "superblock: free block count is %lu, counted %lu",
+		        sb->free_blocks_count, free_blocks);
+		sb->free_blocks_count = free_blocks;
+		__atomic_store_n(&ck->bitmaps_changed, true, __ATOMIC_RELAXED);
+	}
+	// The free space summary no longer matches; store_summary() rebuilds it
+	// if everything was repaired, otherwise the next mount does
+	if (ck->bitmaps_changed) sb->state = 0;
+}
+
+/**
+ * Rebuild the free space summary from the block bitmap and mark the image as
+ * cleanly unmounted, as an unmount does.
+ */
+static void store_summary(checker *ck)
+{
+	a1fs_superblock *sb = ck->sb;
+	uint64_t n_regions = (sb->blocks_count + A1FS_REGION_BLOCKS - 1) / A1FS_REGION_BLOCKS;
+	// Images formatted before the summary existed are never marked clean
+	if ((uint64_t)sb->summary_blocks * A1FS_BLOCK_SIZE < n_regions * sizeof(a1fs_region)) return;
+
+	a1fs_region *summary = (a1fs_region *)(ck->data + (size_t)sb->summary_start * A1FS_BLOCK_SIZE);
+	for (uint64_t r = 0; r < n_regions; r++) {
+		uint64_t start = r * A1FS_REGION_BLOCKS;
+		uint64_t end = (sb->blocks_count - start < A1FS_REGION_BLOCKS) ? sb->blocks_count : start + A1FS_REGION_BLOCKS;
+		uint32_t free = 0, longest = 0, run = 0;
+		for (uint64_t blk = start; blk < end; blk++) {
+			if (blk % 8 == 0 && blk + 8 <= end && ck->blk_bitmap[blk / 8] == 0xff) {
+				run = 0;
+				blk += 7;
+			} else if (bit_set(ck->blk_bitmap, blk)) {
+				run = 0;
+			} else {
+				free++;
+				if (++run > longest) longest = run;
+			}
+		}
+		summary[r] = (a1fs_region){ .free = free, .longest = longest };
+	}
+	sb->state = A1FS_STATE_CLEAN;
+}
+
+
+int main(int argc, char *argv[])
+{
+	fsck_opts opts = {0};// defaults are all 0
+	if (!parse_args(argc, argv, &opts)) {
+		// Invalid arguments, print help to stderr
+		print_help(stderr, argv[0]);
+		return FSCK_ERROR;
+	}
+	if (opts.help) {
+		// Help requested, print it to stdout
+		print_help(stdout, argv[0]);
+		return FSCK_OK;
+	}
+
+	checker ck = {0};
+	ck.repair = opts.repair;
+	ck.quiet = opts.quiet;
+	ck.n_workers = opts.threads;
+	// Without -r, repairs only go to copy-on-write pages
+	ck.data = opts.repair ? map_file(opts.img_path, A1FS_BLOCK_SIZE, &ck.size)
+	                      : map_file_private(opts.img_path, A1FS_BLOCK_SIZE, &ck.size);
+	if (ck.data == NULL) return FSCK_ERROR;
+	ck.sb = (a1fs_superblock *)ck.data;
+	if (!check_superblock(ck.sb, ck.size)) return FSCK_ERROR;
+	if (ck.sb->state != A1FS_STATE_CLEAN) {
+		fprintf(stderr, "Image was not cleanly unmounted; make sure it is not mounted\n");
+	}
+	if (!replay_journal(&ck) || !check_superblock(ck.sb, ck.size)) return FSCK_ERROR;
+
+	a1fs_superblock *sb = ck.sb;
+	ck.ino_bitmap = ck.data + (size_t)sb->inode_bitmap_start * A1FS_BLOCK_SIZE;
+	ck.blk_bitmap = ck.data + (size_t)sb->block_bitmap_start * A1FS_BLOCK_SIZE;
+	ck.itable = (a1fs_inode *)(ck.data + (size_t)sb->inode_table_start * A1FS_BLOCK_SIZE);
+	if (sb->refcount_blocks != 0) {
+		ck.refs = (a1fs_ref_t *)(ck.data + (size_t)sb->refcount_start * A1FS_BLOCK_SIZE);
+	}
+	ck.reached = calloc(sb->ino_bitmap_bytes, 1);
+	ck.claimed = calloc(sb->blocks_count / 8 + 1, 1);
+	ck.shared = calloc(sb->blocks_count / 8 + 1, 1);
+	ck.deques = aligned_alloc(64, ck.n_workers * sizeof(work_deque));
+	if (ck.reached == NULL || ck.claimed == NULL || ck.shared == NULL || ck.deques == NULL) {
+		perror("malloc");
+		return FSCK_ERROR;
+	}
+	for (unsigned i = 0; i < ck.n_workers; i++) {
+		ck.deques[i] = (work_deque){ .items = NULL };
+		pthread_mutex_init(&ck.deques[i].lock, NULL);
+	}
+
+	// Without the root directory nothing is reachable; better leave the
+	// image alone than free everything
+	a1fs_inode *root = &ck.itable[0];
+	if (!inode_in_use(&ck, 0) || root->type != 0 || (root->flags & A1FS_INODE_ORPHAN) ||
+	    !check_dir_inode(&ck, 0))
+	{
+		fprintf(stderr, "Root directory is corrupt\n");
+		return FSCK_ERROR;
+	}
+	set_bit_to(ck.reached, 0, true);
+	if (root->parent_ino != 0) {
+		problem(&ck, "correcting it", "directory 0: parent is %u", root->parent_ino);
+		root->parent_ino = 0;
+	}
+	check_orphans(&ck);
+
+	push(&ck, 0, (dir_item){ 0, 0 });
+	double t = run_pass(&ck, walk_worker);
+	printf("Pass 1: %lu directories, %lu files (%.2f s)\n", ck.dirs, ck.files, t);
+	t = run_pass(&ck, inode_worker);
+	printf("Pass 2: %lu inodes in use (%.2f s)\n", ck.used_inodes, t);
+	t = run_pass(&ck, block_worker);
+	printf("Pass 3: %lu blocks in use (%.2f s)\n", ck.used_blocks, t);
+	check_counts(&ck);
+
+	int ret = FSCK_OK;
+	if (ck.problems == 0) {
+		printf("%s: clean\n", opts.img_path);
+	} else if (!opts.repair) {
+		printf("%s: %lu problems found, run with -r to repair\n", opts.img_path, ck.problems);
+		ret = FSCK_UNCORRECTED;
+	} else {
+		printf("%s: %lu problems found, %lu repaired\n", opts.img_path, ck.problems, ck.problems - ck.unfixed);
+		ret = (ck.unfixed == 0) ? FSCK_FIXED : FSCK_UNCORRECTED;
+	}
+	// The image is consistent now, so the next check or mount can trust it
+	if (opts.repair && ck.unfixed == 0) store_summary(&ck);
+
+	if (opts.repair && msync(ck.data, ck.size, MS_SYNC) != 0) {
+		perror("msync");
+		ret = FSCK_ERROR;
+	}
+	munmap(ck.data, ck.size);
+	for (unsigned i = 0; i < ck.n_workers; i++) {
+		pthread_mutex_destroy(&ck.deques[i].lock);
+		free(ck.deques[i].items);
+	}
+	free(ck.deques);
+	free(ck.shared);
+	free(ck.claimed);
+	free(ck.reached);
+	return ret;
+}
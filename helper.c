@@ -10,7 +10,9 @@
 #include <sys/time.h>
 
 #include "a1fs.h"
+#include "compress.h"
 #include "helper.h"
+#include "seqlock.h"
 
 
 /* Helper method to set the proper bit in a bitmap, also update the related information in the superblock
@@ -43,6 +45,9 @@ uint32_t find_free_bit(unsigned char *bitmap, size_t size, int type, a1fs_superb
     if (type == 0) {
         for (int byte = 0; byte < (int)size; byte++){
             for (int bit = 0; bit < 8; bit++){
+                if ((uint64_t)(byte * 8 + bit) >= superblock->inodes_count){
+                    return -1;
+                }
                 if((bitmap[byte] & (1 << bit)) == 0){
                     return (byte * 8 + bit);
                 }
@@ -58,6 +63,10 @@ uint32_t find_free_bit(unsigned char *bitmap, size_t size, int type, a1fs_superb
                 bit = superblock->data_start % 8;
             }
             while (bit < 8){
+                // the last byte of the bitmap may cover bits past the last block
+                if ((uint64_t)(byte * 8 + bit) >= superblock->blocks_count){
+                    return -1;
+                }
                 if((bitmap[byte] & (1 << bit)) == 0){
                     return (byte * 8 + bit);
                 }
@@ -70,27 +79,133 @@ uint32_t find_free_bit(unsigned char *bitmap, size_t size, int type, a1fs_superb
 }
 
 
-/* Get current time and update the mtime in the given inode, also update all its ancestors */
-void update_mtime(a1fs_inode *inode, void *image){
-    a1fs_superblock *superblock = (a1fs_superblock *)image;
+/* Add an inode to the list of inodes with a pending lazytime modification time, unless it is listed.
+ */
+static void lazy_list_add(a1fs_ino_t ino, fs_ctx *fs){
+    unsigned char bit = 1 << (ino % 8);
+    if (__atomic_fetch_or(&fs->lazy_listed[ino / 8], bit, __ATOMIC_RELAXED) & bit) return;
+    pthread_mutex_lock(&fs->lazy_lock);
+    if (fs->n_lazy == fs->cap_lazy){
+        size_t cap = (fs->cap_lazy == 0) ? 256 : fs->cap_lazy * 2;
+        a1fs_ino_t *list = realloc(fs->lazy_list, cap * sizeof(a1fs_ino_t));
+        if (list == NULL){
+            fs->lazy_overflow = true;
+            pthread_mutex_unlock(&fs->lazy_lock);
+            return;
+        }
+        fs->lazy_list = list;
+        fs->cap_lazy = cap;
+    }
+    fs->lazy_list[fs->n_lazy++] = ino;
+    pthread_mutex_unlock(&fs->lazy_lock);
+}
+
+/* Set the pending lazytime modification time of an inode, unless a later one is already pending.
+ */
+static void lazy_touch(a1fs_ino_t ino, uint64_t ns, fs_ctx *fs){
+    uint64_t old = __atomic_load_n(&fs->lazy_mtime[ino], __ATOMIC_RELAXED);
+    while (old < ns){
+        if (__atomic_compare_exchange_n(&fs->lazy_mtime[ino], &old, ns, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+            if (old == 0) lazy_list_add(ino, fs);
+            return;
+        }
+    }
+}
+
+/* Drop the pending lazytime modification time of an inode, if any, and return it (0 if none).
+ * The inode may stay listed; flush_mtimes() then finds nothing to write for it.
+ */
+uint64_t lazy_take(a1fs_ino_t ino, fs_ctx *fs){
+    if (fs->lazy_mtime == NULL) return 0;
+    return __atomic_exchange_n(&fs->lazy_mtime[ino], 0, __ATOMIC_RELAXED);
+}
+
+/* Set the mtime of an inode. The fields are stored atomically, since the mtimes of ancestors are updated
+ * without their locks (see update_mtime()).
+ */
+void set_mtime(a1fs_inode *inode, const struct timespec *time){
+    __atomic_store_n(&inode->mtime.tv_sec, time->tv_sec, __ATOMIC_RELAXED);
+    __atomic_store_n(&inode->mtime.tv_nsec, time->tv_nsec, __ATOMIC_RELAXED);
+}
+
+/* Get current time and update the mtime in the given inode, also update all its ancestors.
+ * The caller holds the lock of the inode. The ancestors are not locked, so that the caller's locks
+ * don't have to be ordered with theirs; only their mtime changes.
+ * In lazytime mode only the inode and its parent are updated, and only in memory, with the coarse
+ * clock; the times are written to the inode table by flush_mtimes().
+ */
+void update_mtime(a1fs_inode *inode, fs_ctx *fs){
+    if (fs->lazy_mtime != NULL){
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME_COARSE, &now);
+        uint64_t ns = (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+        lazy_touch((a1fs_ino_t)(inode - fs->inodes), ns, fs);
+        lazy_touch(inode->parent_ino, ns, fs);
+        return;
+    }
     //update mtime of this inode
-    clock_gettime(CLOCK_REALTIME, &(inode->mtime));
-    //update mtime for all its ancestors
-    if (inode->parent_ino == 0){
-        a1fs_inode *root = (a1fs_inode *)(image + superblock->inode_table_start * A1FS_BLOCK_SIZE );
-        clock_gettime(CLOCK_REALTIME, &(root->mtime));
-    } else{
-        a1fs_inode *parent = (a1fs_inode *)(image + superblock->inode_table_start * A1FS_BLOCK_SIZE + sizeof(a1fs_inode) * inode->parent_ino);
-        update_mtime(parent,image);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    set_mtime(inode, &now);
+    journal_dirty_inode(fs, inode);
+    //update mtime for all its ancestors, the root is its own parent; a concurrent rename may
+    // make the walk see a moved directory under both parents, so it is bounded
+    a1fs_ino_t ino = (a1fs_ino_t)(inode - fs->inodes);
+    for (uint32_t depth = 0; ino != 0 && depth < fs->sb->inodes_count; depth++){
+        ino = __atomic_load_n(&fs->inodes[ino].parent_ino, __ATOMIC_RELAXED);
+        set_mtime(&fs->inodes[ino], &now);
+        journal_dirty(fs, &fs->inodes[ino], sizeof(a1fs_inode));
     }
-    
+}
+
+/* Write the pending lazytime modification time of an inode, if any, to the inode table.
+ * The caller must be in an operation (see op_begin()), so that the inode is not reused meanwhile, and hold
+ * no inode locks.
+ */
+void flush_mtime(a1fs_ino_t ino, fs_ctx *fs){
+    if (fs->lazy_mtime == NULL || __atomic_load_n(&fs->lazy_mtime[ino], __ATOMIC_RELAXED) == 0) return;
+    inode_write_lock(fs, ino);
+    uint64_t ns = lazy_take(ino, fs);
+    if (ns != 0){
+        fs->inodes[ino].mtime.tv_sec = ns / 1000000000;
+        fs->inodes[ino].mtime.tv_nsec = ns % 1000000000;
+    }
+    inode_write_unlock(fs, ino);
+}
+
+/* Write all pending lazytime modification times to the inode table, walking the list of inodes that have one.
+ * The caller must be in an operation (see op_begin()), so that no inode is reused meanwhile, and hold no
+ * inode locks.
+ */
+void flush_mtimes(fs_ctx *fs){
+    if (fs->lazy_mtime == NULL) return;
+    pthread_mutex_lock(&fs->lazy_lock);
+    a1fs_ino_t *list = fs->lazy_list;
+    size_t n = fs->n_lazy;
+    bool overflow = fs->lazy_overflow;
+    fs->lazy_list = NULL;
+    fs->n_lazy = fs->cap_lazy = 0;
+    fs->lazy_overflow = false;
+    //an inode touched again from now on is listed again
+    for (size_t i = 0; i < n; i++){
+        __atomic_fetch_and(&fs->lazy_listed[list[i] / 8], (unsigned char)~(1 << (list[i] % 8)), __ATOMIC_RELAXED);
+    }
+    if (overflow) memset(fs->lazy_listed, 0, fs->sb->inodes_count / 8 + 1);
+    pthread_mutex_unlock(&fs->lazy_lock);
+
+    if (overflow){
+        for (a1fs_ino_t ino = 0; ino < fs->sb->inodes_count; ino++) flush_mtime(ino, fs);
+    } else {
+        for (size_t i = 0; i < n; i++) flush_mtime(list[i], fs);
+    }
+    free(list);
 }
 
 /* Find and return the pointer to the end of the directory entry table.
  * If the end is the end of the block, then allocate a new data block for the new dentry, and update all related infomation.
  */
-a1fs_dentry *find_vacancy(a1fs_inode *inode,void *image){
-    a1fs_superblock *superblock = (a1fs_superblock *)image;
+a1fs_dentry *find_vacancy(a1fs_inode *inode,fs_ctx *fs){
+    void *image = fs->image;
     a1fs_extent *extent_blk = (a1fs_extent *)(image + (inode->block_no) * A1FS_BLOCK_SIZE);
     //calculate how much dentries this inode has
     uint64_t dentry_table_size = inode->size / sizeof(a1fs_dentry);
@@ -100,11 +215,11 @@ a1fs_dentry *find_vacancy(a1fs_inode *inode,void *image){
 
     //if the last existing dentry is the end of this block, we need to get the vacancy in a new block
     if (dentry_table_size % (A1FS_BLOCK_SIZE / A1FS_DENTRY_SIZE) == 0){
-        unsigned char *blk_bitmap = (unsigned char *)(image + superblock->block_bitmap_start * A1FS_BLOCK_SIZE);
-        a1fs_blk_t new_blk = find_free_bit(blk_bitmap, superblock->blk_bitmap_bytes, 1, superblock);
-        assert(new_blk != 0);
-        set_bit(blk_bitmap, 1, new_blk, 1, superblock);
+        a1fs_blk_t new_blk = alloc_block(fs);
+        assert(new_blk != (a1fs_blk_t)-1);
         a1fs_dentry *target = (a1fs_dentry *)(image + new_blk * A1FS_BLOCK_SIZE);
+        //the block may hold stale data, and directory scans stop at the first empty entry
+        memset(target, 0, A1FS_BLOCK_SIZE);
         int existing_extents = 512 - (int)(inode->free_extent_num);
 
         //check if the new block can be add to any existing extent
@@ -146,7 +261,7 @@ a1fs_dentry *find_vacancy(a1fs_inode *inode,void *image){
     int curr_block = 0;
     for (int extent_count = 0; extent_count < 512 - (int)(inode->free_extent_num); extent_count++){
         int curr = 0;
-        int blk_in_extent = (int)((extent_blk + extent_count * sizeof(a1fs_extent))->count);
+        int blk_in_extent = (int)(extent_blk[extent_count].count);
         while (dblock_count != 0 && curr < blk_in_extent){
             dblock_count--;
             if(dblock_count == 0){
@@ -165,53 +280,62 @@ a1fs_dentry *find_vacancy(a1fs_inode *inode,void *image){
 }
 
 
-/* Create a dentry with the given inode number and name, and write it into the data block of its parent inode. 
- * this function will modify the extent block if necessary.
- */
-void write_dentry(const char *name, a1fs_ino_t inode_num, a1fs_ino_t parent_ino,void *image){
+/* Append a dentry to the dentry table of the parent inode without touching any mtime */
+static void put_dentry(const char *name, a1fs_ino_t inode_num, a1fs_inode *parent_inode, fs_ctx *fs){
     //find a place to put the new dentry and update its fields
-    a1fs_superblock *superblock = (a1fs_superblock *)image;
-
-    a1fs_inode *inode_start = (a1fs_inode *)(image + (superblock->inode_table_start) * A1FS_BLOCK_SIZE);
-    assert(inode_start != NULL);
-    a1fs_inode *parent_inode = &inode_start[parent_ino];
-    assert(parent_inode != NULL);
-    a1fs_dentry *new_dentry = find_vacancy(parent_inode,image);
+    a1fs_dentry *new_dentry = find_vacancy(parent_inode,fs);
     assert(new_dentry != NULL);
     new_dentry->ino = inode_num;
     strncpy(new_dentry->name, name, A1FS_NAME_MAX);
+    parent_inode->size += sizeof(a1fs_dentry);
+    journal_dirty(fs, new_dentry, sizeof(a1fs_dentry));
+    journal_dirty_inode(fs, parent_inode);
+}
+
+/* Create a dentry with the given inode number and name, and write it into the data block of its parent inode. 
+ * this function will modify the extent block if necessary.
+ * The caller holds the write lock of the parent directory.
+ */
+void write_dentry(const char *name, a1fs_ino_t inode_num, a1fs_ino_t parent_ino,fs_ctx *fs){
+    a1fs_inode *parent_inode = &fs->inodes[parent_ino];
+    put_dentry(name, inode_num, parent_inode, fs);
 
     //update all related info
-    parent_inode->size += sizeof(a1fs_dentry);
-    update_mtime(parent_inode,image);
+    update_mtime(parent_inode,fs);
 }
 
 
-/* Create the inode with the given information and return the inode number of this inode */
-a1fs_ino_t create_inode(mode_t mode, a1fs_ino_t parent_ino, void *image, uint32_t type){
+/* Create the inode with the given information and return the inode number of this inode,
+ * or (a1fs_ino_t)-1 if there is no free inode or block.
+ * The new inode is not linked into its parent; the caller does that with write_dentry().
+ */
+a1fs_ino_t create_inode(mode_t mode, a1fs_ino_t parent_ino, fs_ctx *fs, uint32_t type){
 
-    a1fs_superblock *superblock = (a1fs_superblock *)image;
     //allocate an inode and update inode bitmap
-    unsigned char * block_bitmap = (unsigned char * )((unsigned char * )image + (superblock->block_bitmap_start) * A1FS_BLOCK_SIZE);
-    unsigned char * inode_bitmap = (unsigned char * )((unsigned char * )image + (superblock->inode_bitmap_start) * A1FS_BLOCK_SIZE);
-
-    a1fs_ino_t inode_num = find_free_bit(inode_bitmap, superblock->ino_bitmap_bytes, 0, superblock);
-    // assert(inode_num == 0);
-    set_bit(inode_bitmap, 0, inode_num, 1, superblock);
+    a1fs_ino_t inode_num = alloc_inode(fs);
+    if (inode_num == (a1fs_ino_t)-1){
+        return inode_num;
+    }
 
     //create inode
-    a1fs_inode *inode_table_start = (a1fs_inode *)(image + (superblock->inode_table_start) * A1FS_BLOCK_SIZE);
+    a1fs_inode *inode_table_start = fs->inodes;
     a1fs_inode *new_inode = &inode_table_start[inode_num];
     assert(new_inode != NULL);
     new_inode->type = type;
     new_inode->mode = (mode_t)mode;
     new_inode->parent_ino = parent_ino;
+    //the compression policy is inherited from the parent directory (the root is its own parent)
+    new_inode->flags = (parent_ino != inode_num) ? (inode_table_start[parent_ino].flags & A1FS_INODE_COMPRESS) : 0;
     clock_gettime(CLOCK_REALTIME, &(new_inode->mtime));
+    //a time left pending by the previous user of the inode number
+    lazy_take(inode_num, fs);
 
     //allocate a block for the extent block and update the block bitmap
-    //unsigned char * block_bitmap = (unsigned char * )(superblock + (superblock->block_bitmap_start) * A1FS_BLOCK_SIZE);
-    a1fs_blk_t extent_blk_num = find_free_bit(block_bitmap, superblock->blk_bitmap_bytes, 1, superblock);
-    set_bit(block_bitmap, 1, extent_blk_num, 1,superblock);
+    a1fs_blk_t extent_blk_num = alloc_block(fs);
+    if (extent_blk_num == (a1fs_blk_t)-1){
+        release_inode(inode_num, fs);
+        return (a1fs_ino_t)-1;
+    }
     new_inode->block_no = extent_blk_num;
     //!!
     new_inode->free_extent_num = 512;
@@ -220,11 +344,13 @@ a1fs_ino_t create_inode(mode_t mode, a1fs_ino_t parent_ino, void *image, uint32_
     if (type == 0) {
         new_inode->links = 2;
         // write . and .. into the directory entry table if the inode is a directory
-        write_dentry(".", inode_num, inode_num, superblock);
-        write_dentry("..", parent_ino, inode_num, superblock);
+        // (the new inode is not visible yet, and its parent may be locked by the caller)
+        put_dentry(".", inode_num, new_inode, fs);
+        put_dentry("..", parent_ino, new_inode, fs);
     } else {
         new_inode->links = 1;
     }
+    journal_dirty_inode(fs, new_inode);
 
     return inode_num;
 }
@@ -232,9 +358,9 @@ a1fs_ino_t create_inode(mode_t mode, a1fs_ino_t parent_ino, void *image, uint32_
 /* Promote the last dentry in the directory entry table to the vacancy during deletion of dentry.
  * This function is a helper for remove functions
  */
-void promote_last_dentry(a1fs_inode *inode, a1fs_dentry *vacancy_ptr, void *image){
+void promote_last_dentry(a1fs_inode *inode, a1fs_dentry *vacancy_ptr, fs_ctx *fs){
     //The address of the block storing extents
-    a1fs_superblock *superblock = (a1fs_superblock *)image;
+    void *image = fs->image;
     a1fs_extent *extent_blk = (a1fs_extent *)(image + (inode->block_no) * A1FS_BLOCK_SIZE);
 
     int max_dentry = (int)(A1FS_BLOCK_SIZE / sizeof(a1fs_dentry));
@@ -255,11 +381,13 @@ void promote_last_dentry(a1fs_inode *inode, a1fs_dentry *vacancy_ptr, void *imag
    if (vacancy_ptr != last_dentry){
     vacancy_ptr->ino = last_dentry->ino;
     strncpy(vacancy_ptr->name, last_dentry->name, A1FS_NAME_MAX);
+    journal_dirty(fs, vacancy_ptr, sizeof(a1fs_dentry));
    }
 
    //clear the last dentry
     last_dentry->ino = 0;
     memset(last_dentry->name, 0, A1FS_NAME_MAX);
+    journal_dirty(fs, last_dentry, sizeof(a1fs_dentry));
 
     //update the inode information
     inode->size -= sizeof(a1fs_dentry);
@@ -268,15 +396,14 @@ void promote_last_dentry(a1fs_inode *inode, a1fs_dentry *vacancy_ptr, void *imag
         last_extent->count -= 1;
 
         //update the block bitmap
-        unsigned char * block_bitmap = (unsigned char * )(image + (superblock->block_bitmap_start) * A1FS_BLOCK_SIZE);
-        set_bit(block_bitmap,1,last_block,0,superblock);
+        release_block(last_block, fs);
 
         if(last_extent->count == 0){ //if the last extent has only one block
             last_extent->start = 0;
             inode->free_extent_num += 1;
         }
     }
-    update_mtime(inode,image);
+    update_mtime(inode,fs);
 }
 
 /* Find the dentry with filename in the current extent.
@@ -285,8 +412,8 @@ void promote_last_dentry(a1fs_inode *inode, a1fs_dentry *vacancy_ptr, void *imag
  *   ENOTDIR       a component of the path prefix is not a directory.
  * We would return -1 if we didn't find the dentry we want in the current extent.
  */
-a1fs_dentry* find_in_extent(a1fs_extent *extent, const char *filename, void *image){
-    //a1fs_superblock *superblock = (a1fs_superblock *)image;
+a1fs_dentry* find_in_extent(a1fs_extent *extent, const char *filename, fs_ctx *fs){
+    void *image = fs->image;
     a1fs_blk_t start = extent->start;
     a1fs_blk_t count = extent->count;
     uint32_t max_dentry_num = A1FS_BLOCK_SIZE * count / A1FS_DENTRY_SIZE;
@@ -312,48 +439,122 @@ a1fs_dentry* find_in_extent(a1fs_extent *extent, const char *filename, void *ima
  *   ENOTDIR       a component of the path prefix is not a directory.
  * we will return -1 for ENOENT and -2 for ENOTDIR
  */
-a1fs_dentry* find_dentry(a1fs_inode *inode, const char *filename, void *image){
+a1fs_dentry* find_dentry(a1fs_inode *inode, const char *filename, fs_ctx *fs){
     
-    //a1fs_superblock *superblock = (a1fs_superblock *)image;
+    void *image = fs->image;
     a1fs_extent *extent = (a1fs_extent *)(image + (inode->block_no) * A1FS_BLOCK_SIZE);
 
     //loop over all extents
     for (uint32_t i = 0; i < 512 - (inode->free_extent_num); i++){
         a1fs_extent *target_extent = &extent[i];
-        if(find_in_extent(target_extent,filename,image)!= NULL){
-            return find_in_extent(target_extent,filename,image);
+        if(find_in_extent(target_extent,filename,fs)!= NULL){
+            return find_in_extent(target_extent,filename,fs);
         }
     }
     return NULL;
 }
 
+/* Copy an inode and its existing extents (extents must have room for 512) without holding the inode lock,
+ * and check that they only describe blocks inside the image, so that the copy can be used safely even if
+ * it turns out to be torn. Return the sequence count to validate the copy with seq_read_retry(); the count
+ * is odd (i.e. the copy must be retried) if the copy is not usable.
+ */
+uint32_t inode_snapshot(a1fs_ino_t ino, a1fs_inode *copy, a1fs_extent *extents, fs_ctx *fs){
+    uint64_t blocks = fs->size / A1FS_BLOCK_SIZE;
+    uint32_t seq = seq_read_begin(&fs->ino_seq[ino]);
+    memcpy(copy, &fs->inodes[ino], sizeof(*copy));
+    if (copy->free_extent_num > 512 || copy->block_no >= blocks){
+        return seq | 1;
+    }
+    int extent_num = 512 - (int)(copy->free_extent_num);
+    memcpy(extents, fs->image + (uint64_t)copy->block_no * A1FS_BLOCK_SIZE, extent_num * sizeof(a1fs_extent));
+    for (int i = 0; i < extent_num; i++){
+        if ((uint64_t)extents[i].start + extents[i].count > blocks){
+            return seq | 1;
+        }
+    }
+    return seq;
+}
+
+/* Search a directory for filename without locking it. Return 1 and set *found if the entry exists,
+ * 0 if it doesn't, -1 if the directory is not a directory and -2 if the directory changed during
+ * the search (the result is unreliable).
+ */
+static int scan_dir(a1fs_ino_t dir, const char *filename, a1fs_ino_t *found, fs_ctx *fs){
+    a1fs_inode copy;
+    a1fs_extent extents[512];
+    uint32_t seq = inode_snapshot(dir, &copy, extents, fs);
+    if (seq_read_retry(&fs->ino_seq[dir], seq)){
+        return -2;
+    }
+    if (copy.type != 0){
+        return -1;
+    }
+
+    int ret = 0;
+    for (int i = 0; i < 512 - (int)copy.free_extent_num && ret == 0; i++){
+        a1fs_dentry *dentry_list = (a1fs_dentry *)(fs->image + (uint64_t)extents[i].start * A1FS_BLOCK_SIZE);
+        uint64_t max_dentry_num = (uint64_t)A1FS_BLOCK_SIZE * extents[i].count / A1FS_DENTRY_SIZE;
+        for (uint64_t j = 0; j < max_dentry_num; j++){
+            a1fs_ino_t ino = dentry_list[j].ino;
+            if (ino == 0 && dentry_list[j].name[0] == '\0'){
+                break;
+            }
+            if (strncmp(dentry_list[j].name, filename, A1FS_NAME_MAX) == 0){
+                //the entry may be torn, the number is only trusted after validation
+                if (ino >= fs->sb->inodes_count){
+                    return -2;
+                }
+                *found = ino;
+                ret = 1;
+                break;
+            }
+        }
+    }
+    return seq_read_retry(&fs->ino_seq[dir], seq) ? -2 : ret;
+}
+
 /* Find the corresponding inode according to the given path. 
     return inode number on success or error.
+    Directories are searched without locking and validated by their sequence counts; a directory
+    that keeps changing is read-locked instead, so the caller must not hold any inode lock.
+    Renames and removals are not detected: the caller validates the namespace sequence count, or is
+    in an operation (see op_begin()), so that the inode found is not freed, and checks the directory
+    entry again under the parent's lock before removing or moving it.
     errors:
     ENOTDIR: return superblock->inodes_count + 1
     ENOENT: return superblock->inodes_count + 2
 */
-a1fs_ino_t find_inode(char *path, a1fs_inode *inode_list, void *image){
-    a1fs_superblock *superblock = (a1fs_superblock *)image;
-    a1fs_inode *curr_inode = &inode_list[0];
+a1fs_ino_t find_inode(char *path, a1fs_inode *inode_list, fs_ctx *fs){
+    a1fs_superblock *superblock = fs->sb;
 
     //if it is the root
     if(strcmp(path,"/") == 0){
         return 0;
     }
-    char *temp = strtok(path, "/");
+    char *saveptr;
+    char *temp = strtok_r(path, "/", &saveptr);
     a1fs_ino_t inode_num = 0;
 
     while (temp != NULL) {
-        if(curr_inode->type != 0){return (superblock->inodes_count + 1);}
-        if(find_dentry(curr_inode,temp,image) == NULL){return (superblock->inodes_count + 2);}
-        a1fs_ino_t parent_num = ((a1fs_dentry*)find_dentry(curr_inode,"..",image))->ino;
-        printf("inode number of .. : %u\n", parent_num);
-        inode_num = ((a1fs_dentry*)find_dentry(curr_inode,temp,image))->ino;
-        printf("inode_num: %u\n",inode_num);
+        a1fs_ino_t next = 0;
+        int ret = -2;
+        for (int attempt = 0; attempt < SEQ_READ_ATTEMPTS && ret == -2; attempt++){
+            ret = scan_dir(inode_num, temp, &next, fs);
+        }
+        if (ret == -2){
+            pthread_rwlock_rdlock(ino_lock(fs, inode_num));
+            a1fs_inode *curr_inode = &inode_list[inode_num];
+            a1fs_dentry *dentry = (curr_inode->type == 0) ? find_dentry(curr_inode,temp,fs) : NULL;
+            ret = (curr_inode->type != 0) ? -1 : (dentry != NULL);
+            next = (dentry != NULL) ? dentry->ino : 0;
+            pthread_rwlock_unlock(ino_lock(fs, inode_num));
+        }
+        if(ret == -1){return (superblock->inodes_count + 1);}
+        if(ret == 0){return (superblock->inodes_count + 2);}
         //update the current inode number
-        curr_inode = &inode_list[inode_num];
-        temp = strtok(NULL, "/");      
+        inode_num = next;
+        temp = strtok_r(NULL, "/", &saveptr);
     } 
     return inode_num;
 }
@@ -362,37 +563,47 @@ a1fs_ino_t find_inode(char *path, a1fs_inode *inode_list, void *image){
 /*
 Free all data blocks in this inode (not including the extent block)
 */
-void free_data(a1fs_inode *inode, unsigned char *block_bitmap,void *image){
+void free_data(a1fs_inode *inode, fs_ctx *fs){
        
-    a1fs_extent *extent = (a1fs_extent *)(image + inode->block_no * A1FS_BLOCK_SIZE);
+    a1fs_extent *extent = (a1fs_extent *)(fs->image + inode->block_no * A1FS_BLOCK_SIZE);
     for (int count = 0; count < 512 - (int)(inode->free_extent_num); count++){
-        free_in_extent(&extent[count],block_bitmap,image);
+        free_in_extent(&extent[count],fs);
     }  
 }
 
 /* Free all data blocks in this extent */
-void free_in_extent(a1fs_extent *extent, unsigned char *block_bitmap, void *image){
+void free_in_extent(a1fs_extent *extent, fs_ctx *fs){
     
-    a1fs_superblock *superblock = (a1fs_superblock *)image;
-    a1fs_blk_t start = extent->start;
-    a1fs_blk_t count = extent->count;
+    release_blocks(extent->start, extent->count, fs);
+}
 
-    for(uint32_t i = start; i < count + start; i++){
-        set_bit(block_bitmap,1,start+i,0,superblock);
+/* Return the reference count entry of the given block, or NULL if the image has no reference count table
+ * (it was formatted before reflink clones were supported). The entry is changed under the allocator lock and
+ * may be read without it.
+ */
+a1fs_ref_t *block_refcount(a1fs_blk_t blk, fs_ctx *fs){
+    void *image = fs->image;
+    a1fs_superblock *superblock = fs->sb;
+    if (superblock->refcount_blocks == 0){
+        return NULL;
     }
+    a1fs_ref_t *table = (a1fs_ref_t *)(image + superblock->refcount_start * A1FS_BLOCK_SIZE);
+    return &table[blk];
 }
 
-/* Add the new block found to the extent block*/
+/* Add the new block found to the extent block.
+ * The new block always becomes the last logical block of the file, so it can only be merged into the
+ * last extent; merging it into an earlier one would reorder the file contents.
+ */
 
 void add_to_extent(a1fs_extent *extent_blk, a1fs_inode *inode, a1fs_blk_t new_blk){
 
     int existing_extents = 512 - (int)(inode->free_extent_num);
-        //check if the new block can be add to any existing extent
-        for (int extent_count = 0; extent_count < existing_extents; extent_count++){
-            a1fs_extent *this_extent = &extent_blk[extent_count];
-            //if can be add to a existing extent
-            if (new_blk == (this_extent->start + this_extent->count)){
-                this_extent->count++;
+        //check if the new block can be add to the last extent
+        if (existing_extents > 0){
+            a1fs_extent *last_extent = &extent_blk[existing_extents - 1];
+            if (new_blk == (last_extent->start + last_extent->count)){
+                last_extent->count++;
                 return;
             }
         }
@@ -404,53 +615,373 @@ void add_to_extent(a1fs_extent *extent_blk, a1fs_inode *inode, a1fs_blk_t new_bl
 }
 
 /*
-Extend the file to the target size.
+Extend the file by size_allocate bytes (rounded up to whole blocks), the new blocks are zeroed.
+Return 0 on success, -ENOSPC if there are not enough free blocks or extents.
 */
-void extend_data(size_t size_allocate, a1fs_inode *inode, void *image){
+int extend_data(size_t size_allocate, a1fs_inode *inode, fs_ctx *fs){
 
-    a1fs_superblock *superblock = (a1fs_superblock *)image;
+    void *image = fs->image;
     a1fs_extent *extent = (a1fs_extent *)(image + inode->block_no * A1FS_BLOCK_SIZE);
 
-    unsigned char *blk_bitmap = (unsigned char *)(image + superblock->block_bitmap_start * A1FS_BLOCK_SIZE);
     int total_block_used = size_allocate / A1FS_BLOCK_SIZE + ((size_allocate % A1FS_BLOCK_SIZE) > 0 ? 1 : 0);
+    if ((uint64_t)total_block_used > free_blocks(fs)){
+        return -ENOSPC;
+    }
     for(int i = 0;i < total_block_used;i++){
-        a1fs_blk_t new_blk = find_free_bit(blk_bitmap, superblock->blk_bitmap_bytes, 1, superblock);
-        set_bit(blk_bitmap,1,new_blk,1,superblock);
+        a1fs_blk_t new_blk = alloc_block(fs);
+        if (new_blk == (a1fs_blk_t)-1){
+            return -ENOSPC;
+        }
+        //the block needs a new extent unless it continues the last one
+        int existing_extents = 512 - (int)(inode->free_extent_num);
+        if (inode->free_extent_num == 0 &&
+            new_blk != extent[existing_extents - 1].start + extent[existing_extents - 1].count){
+            release_block(new_blk, fs);
+            return -ENOSPC;
+        }
         unsigned char *data_start = (unsigned char *)(image + new_blk * A1FS_BLOCK_SIZE);
         memset(data_start, 0, A1FS_BLOCK_SIZE);
+        writeback_dirty(fs, data_start, A1FS_BLOCK_SIZE);
         add_to_extent(extent,inode,new_blk);
     }
+    return 0;
 }
 
 /* 
 Shrink the file to the target size.
+Blocks past the new end of the file are released and the extents are trimmed to match.
 */
-void shrink_data(size_t size, a1fs_inode *inode, void *image){
+void shrink_data(size_t size, a1fs_inode *inode, fs_ctx *fs){
 
-    a1fs_superblock *superblock = (a1fs_superblock *)image;
-    a1fs_extent *extent = (a1fs_extent *)(image + inode->block_no * A1FS_BLOCK_SIZE);
-    unsigned char *blk_bitmap = (unsigned char *)(image + superblock->block_bitmap_start * A1FS_BLOCK_SIZE);
+    a1fs_extent *extent = (a1fs_extent *)(fs->image + inode->block_no * A1FS_BLOCK_SIZE);
 
     // The number of blocks we don't need to free
-    int start_delete = size / A1FS_BLOCK_SIZE + ((size % A1FS_BLOCK_SIZE) > 0 ? 1 : 0);
+    uint64_t keep = size / A1FS_BLOCK_SIZE + ((size % A1FS_BLOCK_SIZE) > 0 ? 1 : 0);
+
+    int existing_extents = 512 - (int)(inode->free_extent_num);
+    int kept_extents = 0;
+    uint64_t counter = 0;
+    for (int extent_count = 0; extent_count < existing_extents; extent_count++){
+        a1fs_extent *curr_extent = &extent[extent_count];
+        a1fs_blk_t count = curr_extent->count;
+
+        if (counter >= keep){
+            //the whole extent is past the new end of the file
+            free_in_extent(curr_extent, fs);
+            curr_extent->start = 0;
+            curr_extent->count = 0;
+        } else {
+            if (counter + count > keep){
+                //only the head of this extent is kept
+                a1fs_blk_t kept = (a1fs_blk_t)(keep - counter);
+                a1fs_extent tail = { .start = curr_extent->start + kept, .count = count - kept };
+                free_in_extent(&tail, fs);
+                curr_extent->count = kept;
+            }
+            kept_extents = extent_count + 1;
+        }
+        counter += count;
+    }
+    inode->free_extent_num = 512 - kept_extents;
+}
 
-    //set the last few blocks
+/* Find the extent holding the logical block lblk of the inode.
+ * Return the index of the extent and store the position of the block within the extent in blk_off,
+ * or return -1 if the file doesn't have that many blocks.
+ */
+int find_lblk(a1fs_inode *inode, uint64_t lblk, a1fs_blk_t *blk_off, fs_ctx *fs){
+    a1fs_extent *extent = (a1fs_extent *)(fs->image + inode->block_no * A1FS_BLOCK_SIZE);
     int existing_extents = 512 - (int)(inode->free_extent_num);
+    for (int extent_count = 0; extent_count < existing_extents; extent_count++){
+        if (lblk < extent[extent_count].count){
+            *blk_off = (a1fs_blk_t)lblk;
+            return extent_count;
+        }
+        lblk -= extent[extent_count].count;
+    }
+    return -1;
+}
 
-    //check if the new block can be add to any existing extent
-    int counter = 0;
-        for (int extent_count = 0; extent_count < existing_extents; extent_count++){
+/* Merge the extent at idx with the following one if they are physically contiguous */
+static void merge_extents(a1fs_extent *extent, a1fs_inode *inode, int idx){
+    int existing_extents = 512 - (int)(inode->free_extent_num);
+    if (idx < 0 || idx + 1 >= existing_extents){
+        return;
+    }
+    if (extent[idx].start + extent[idx].count != extent[idx + 1].start){
+        return;
+    }
+    extent[idx].count += extent[idx + 1].count;
+    memmove(&extent[idx + 1], &extent[idx + 2], (existing_extents - idx - 2) * sizeof(a1fs_extent));
+    extent[existing_extents - 1].start = 0;
+    extent[existing_extents - 1].count = 0;
+    inode->free_extent_num++;
+}
 
-            a1fs_extent *curr_extent = &extent[extent_count];
-            a1fs_blk_t start = curr_extent->start;
-            a1fs_blk_t count = curr_extent->count;
+/* Copy-on-write: give the inode a private copy of its logical block lblk if that block is shared with
+ * another inode by a reflink clone. The extent holding the block is split around the new copy.
+ * Return 0 on success, -ENOSPC if there is no free block or no free extent slot for the split.
+ */
+int unshare_block(a1fs_inode *inode, uint64_t lblk, fs_ctx *fs){
+    void *image = fs->image;
+    a1fs_extent *extent = (a1fs_extent *)(image + inode->block_no * A1FS_BLOCK_SIZE);
 
-            for(uint32_t i = start; i < count + start; i++){
-                if(counter >= start_delete){
-                    set_bit(blk_bitmap,1,start + i,0,superblock);
-                }
-                counter++;
+    a1fs_blk_t blk_off;
+    int idx = find_lblk(inode, lblk, &blk_off, fs);
+    if (idx < 0){
+        return 0;
+    }
+    a1fs_blk_t old_blk = extent[idx].start + blk_off;
+    a1fs_ref_t *ref = block_refcount(old_blk, fs);
+    if (ref == NULL){
+        return 0;
+    }
+    //the block is not shared (any more), it can be written in place
+    if (__atomic_load_n(ref, __ATOMIC_RELAXED) == 0){
+        return 0;
+    }
+
+    //the extent is split into up to three pieces: head, the new copy and tail
+    a1fs_extent pieces[3];
+    int piece_num = 0;
+    int copy_piece = 0;
+    if (blk_off > 0){
+        pieces[piece_num].start = extent[idx].start;
+        pieces[piece_num].count = blk_off;
+        piece_num++;
+    }
+    copy_piece = piece_num++;
+    if (blk_off + 1 < extent[idx].count){
+        pieces[piece_num].start = old_blk + 1;
+        pieces[piece_num].count = extent[idx].count - blk_off - 1;
+        piece_num++;
+    }
+    if ((int)inode->free_extent_num < piece_num - 1){
+        return -ENOSPC;
+    }
+
+    a1fs_blk_t new_blk = alloc_block(fs);
+    if (new_blk == (a1fs_blk_t)-1){
+        return -ENOSPC;
+    }
+    //the other sharers never write the old block in place, so it can be copied while we still hold a reference;
+    //dropping the reference frees the block if the other sharers have released it meanwhile
+    memcpy(image + new_blk * A1FS_BLOCK_SIZE, image + old_blk * A1FS_BLOCK_SIZE, A1FS_BLOCK_SIZE);
+    writeback_dirty(fs, image + new_blk * A1FS_BLOCK_SIZE, A1FS_BLOCK_SIZE);
+    release_block(old_blk, fs);
+    pieces[copy_piece].start = new_blk;
+    pieces[copy_piece].count = 1;
+
+    //make room for the extra pieces and put them in place of the original extent
+    int existing_extents = 512 - (int)(inode->free_extent_num);
+    memmove(&extent[idx + piece_num], &extent[idx + 1], (existing_extents - idx - 1) * sizeof(a1fs_extent));
+    memcpy(&extent[idx], pieces, piece_num * sizeof(a1fs_extent));
+    inode->free_extent_num -= piece_num - 1;
+
+    //the new copy may continue a neighbouring extent (e.g. when overwriting a shared range block by block)
+    merge_extents(extent, inode, idx + copy_piece);
+    merge_extents(extent, inode, idx + copy_piece - 1);
+    return 0;
+}
+
+/* Make the dst file a reflink clone of the src file: dst drops its current data and shares all data blocks
+ * of src, with their reference counts incremented. No data is copied; blocks are copied lazily by
+ * unshare_block() when either file is written to.
+ * Return 0 on success or -errno:
+ *   EOPNOTSUPP  the image has no reference count table.
+ *   EINVAL      src or dst is not a regular file, or they are the same file.
+ *   EMLINK      a block of src already has the maximum number of references.
+ */
+int clone_data(a1fs_inode *src, a1fs_inode *dst, fs_ctx *fs){
+    void *image = fs->image;
+
+    if (fs->sb->refcount_blocks == 0){
+        return -EOPNOTSUPP;
+    }
+    if (src->type != 1 || dst->type != 1 || src == dst){
+        return -EINVAL;
+    }
+
+    a1fs_extent *src_extent = (a1fs_extent *)(image + src->block_no * A1FS_BLOCK_SIZE);
+    a1fs_extent *dst_extent = (a1fs_extent *)(image + dst->block_no * A1FS_BLOCK_SIZE);
+    int existing_extents = 512 - (int)(src->free_extent_num);
+
+    //check all reference counts first so that a failed clone leaves both files untouched
+    pthread_mutex_lock(&fs->alloc_lock);
+    for (int extent_count = 0; extent_count < existing_extents; extent_count++){
+        a1fs_extent *curr_extent = &src_extent[extent_count];
+        for (a1fs_blk_t i = curr_extent->start; i < curr_extent->start + curr_extent->count; i++){
+            if (*block_refcount(i, fs) == A1FS_REF_MAX){
+                pthread_mutex_unlock(&fs->alloc_lock);
+                return -EMLINK;
+            }
+        }
+    }
+    //take the new references before dropping the old ones, dst may already share blocks with src
+    for (int extent_count = 0; extent_count < existing_extents; extent_count++){
+        a1fs_extent *curr_extent = &src_extent[extent_count];
+        for (a1fs_blk_t i = curr_extent->start; i < curr_extent->start + curr_extent->count; i++){
+            __atomic_fetch_add(block_refcount(i, fs), 1, __ATOMIC_RELAXED);
+            journal_dirty(fs, block_refcount(i, fs), sizeof(a1fs_ref_t));
+        }
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    free_data(dst, fs);
+    memcpy(dst_extent, src_extent, existing_extents * sizeof(a1fs_extent));
+    dst->free_extent_num = src->free_extent_num;
+    dst->size = src->size;
+    //the shared blocks are in the source's storage format
+    dst->flags = (dst->flags & ~A1FS_INODE_COMPRESSED) | (src->flags & A1FS_INODE_COMPRESSED);
+    dst->chunk_table = src->chunk_table;
+    update_mtime(dst, fs);
+    return 0;
+}
+
+/* Return the number of data blocks allocated to the inode, i.e. its physical size (without the extent block) */
+uint64_t inode_blocks(a1fs_inode *inode, fs_ctx *fs){
+    a1fs_extent *extent = (a1fs_extent *)(fs->image + inode->block_no * A1FS_BLOCK_SIZE);
+    uint64_t blocks = 0;
+    for (int extent_count = 0; extent_count < 512 - (int)(inode->free_extent_num); extent_count++){
+        blocks += extent[extent_count].count;
+    }
+    return blocks;
+}
+
+/* Copy len bytes between buf and the data blocks described by the extents, starting at byte offset off of the data */
+static void extents_copy(a1fs_extent *extent, int extent_num, uint64_t off, void *buf, size_t len, fs_ctx *fs, bool to_blocks){
+    size_t done = 0;
+    for (int extent_count = 0; extent_count < extent_num && done < len; extent_count++){
+        uint64_t extent_bytes = (uint64_t)extent[extent_count].count * A1FS_BLOCK_SIZE;
+        //skip whole extents before the offset
+        if (off >= extent_bytes){
+            off -= extent_bytes;
+            continue;
+        }
+        size_t chunk = extent_bytes - off;
+        if (chunk > len - done){
+            chunk = len - done;
+        }
+        char *blocks = (char *)fs->image + (uint64_t)extent[extent_count].start * A1FS_BLOCK_SIZE + off;
+        if (to_blocks){
+            memcpy(blocks, (char *)buf + done, chunk);
+            writeback_dirty(fs, blocks, chunk);
+        } else {
+            memcpy((char *)buf + done, blocks, chunk);
+        }
+        done += chunk;
+        off = 0;
+    }
+}
+
+/* Read len bytes at byte offset off of the data described by the extents (the stored data, ignoring compression) */
+void extents_read(a1fs_extent *extent, int extent_num, uint64_t off, void *buf, size_t len, fs_ctx *fs){
+    extents_copy(extent, extent_num, off, buf, len, fs, false);
+}
+
+/* Write len bytes at byte offset off of the data described by the extents; the blocks must already be allocated */
+void extents_write(a1fs_extent *extent, int extent_num, uint64_t off, const void *buf, size_t len, fs_ctx *fs){
+    extents_copy(extent, extent_num, off, (void *)buf, len, fs, true);
+}
+
+/* Set the size of a regular file, allocating zeroed blocks or releasing blocks as needed.
+ * Only the chunks at the end of a compressed file are changed.
+ * Return 0 on success or -errno.
+ */
+int resize_data(uint64_t size, a1fs_inode *inode, fs_ctx *fs){
+    static const char zeros[A1FS_BLOCK_SIZE];
+    a1fs_extent *extent = (a1fs_extent *)(fs->image + inode->block_no * A1FS_BLOCK_SIZE);
+    int ret;
+
+    if (inode->flags & A1FS_INODE_COMPRESSED){
+        ret = resize_compressed(inode, size, fs);
+        if (ret == 0){
+            update_mtime(inode, fs);
+        }
+        return ret;
+    }
+    uint64_t allocated = inode_blocks(inode, fs) * A1FS_BLOCK_SIZE;
+
+    if (size > inode->size){
+        //the rest of the last block may hold stale data from before a shrink
+        if (inode->size % A1FS_BLOCK_SIZE != 0){
+            ret = unshare_block(inode, inode->size / A1FS_BLOCK_SIZE, fs);
+            if (ret != 0){
+                return ret;
+            }
+            uint64_t tail_end = inode->size - inode->size % A1FS_BLOCK_SIZE + A1FS_BLOCK_SIZE;
+            if (tail_end > size){
+                tail_end = size;
+            }
+            extents_write(extent, 512 - (int)(inode->free_extent_num), inode->size, zeros, tail_end - inode->size, fs);
+        }
+        if (size > allocated){
+            ret = extend_data(size - allocated, inode, fs);
+            if (ret != 0){
+                return ret;
             }
         }
- 
+    } else if (size < inode->size){
+        shrink_data(size, inode, fs);
+    }
+
+    inode->size = size;
+    update_mtime(inode, fs);
+    return 0;
+}
+
+/* Read up to size bytes of file data at offset into buf; compressed files are decompressed on the fly.
+ * Return the number of bytes read (0 at or past the end of the file) or -errno.
+ */
+long read_data(a1fs_inode *inode, char *buf, size_t size, uint64_t offset, fs_ctx *fs){
+    if (offset >= inode->size){
+        return 0;
+    }
+    if (size > inode->size - offset){
+        size = inode->size - offset;
+    }
+    if (inode->flags & A1FS_INODE_COMPRESSED){
+        return read_compressed(inode, buf, size, offset, fs);
+    }
+    a1fs_extent *extent = (a1fs_extent *)(fs->image + inode->block_no * A1FS_BLOCK_SIZE);
+    extents_read(extent, 512 - (int)(inode->free_extent_num), offset, buf, size, fs);
+    return size;
+}
+
+/* Write size bytes from buf at offset, extending the file if needed (a gap past the old end reads as zeros).
+ * Blocks shared with a reflink clone are copied first. In a compressed file only the chunks written to are
+ * rewritten, uncompressed until the file is flushed.
+ * Return the number of bytes written or -errno.
+ */
+long write_data(a1fs_inode *inode, const char *buf, size_t size, uint64_t offset, fs_ctx *fs){
+    if (size == 0){
+        return 0;
+    }
+    int ret;
+    if (inode->flags & A1FS_INODE_COMPRESSED){
+        ret = write_compressed(inode, buf, size, offset, fs);
+        if (ret != 0){
+            return ret;
+        }
+        update_mtime(inode, fs);
+        return size;
+    }
+    uint64_t end = offset + size;
+    ret = (end > inode->size) ? resize_data(end, inode, fs) : 0;
+    if (ret != 0){
+        return ret;
+    }
+
+    //copy-on-write: blocks shared with a reflink clone must not be modified in place
+    for (uint64_t lblk = offset / A1FS_BLOCK_SIZE; lblk <= (end - 1) / A1FS_BLOCK_SIZE; lblk++){
+        ret = unshare_block(inode, lblk, fs);
+        if (ret != 0){
+            return ret;
+        }
+    }
+
+    a1fs_extent *extent = (a1fs_extent *)(fs->image + inode->block_no * A1FS_BLOCK_SIZE);
+    extents_write(extent, 512 - (int)(inode->free_extent_num), offset, buf, size, fs);
+    update_mtime(inode, fs);
+    return size;
 }
@@ -12,6 +12,8 @@
 #include <sys/time.h>
 
 #include "a1fs.h"
+#include "alloc.h"
+#include "fs_ctx.h"
 
 /* Following are the global varibles for the whole file system
 */
@@ -21,30 +23,60 @@ void set_bit(unsigned char *bitmap, int type, int bit, int val,a1fs_superblock *
 
 uint32_t find_free_bit(unsigned char *bitmap, size_t size, int type, a1fs_superblock *superblock);
 
-void update_mtime(a1fs_inode *inode, void *image);
+void set_mtime(a1fs_inode *inode, const struct timespec *time);
 
-a1fs_dentry *find_vacancy(a1fs_inode *inode,void *image);
+void update_mtime(a1fs_inode *inode, fs_ctx *fs);
 
-void write_dentry(const char *name, a1fs_ino_t inode_num, a1fs_ino_t parent_ino,void *image);
+uint64_t lazy_take(a1fs_ino_t ino, fs_ctx *fs);
 
-a1fs_ino_t create_inode(mode_t mode, a1fs_ino_t parent_ino, void *image, uint32_t type);
+void flush_mtime(a1fs_ino_t ino, fs_ctx *fs);
 
-void promote_last_dentry(a1fs_inode *inode, a1fs_dentry *vacancy_ptr, void *image);
+void flush_mtimes(fs_ctx *fs);
 
-a1fs_dentry* find_dentry(a1fs_inode *inode, const char *filename, void *image);
+a1fs_dentry *find_vacancy(a1fs_inode *inode,fs_ctx *fs);
 
-a1fs_dentry* find_in_extent(a1fs_extent *extent, const char *filename, void *image);
+void write_dentry(const char *name, a1fs_ino_t inode_num, a1fs_ino_t parent_ino,fs_ctx *fs);
 
-a1fs_ino_t find_inode(char *path, a1fs_inode *root, void *image);
+a1fs_ino_t create_inode(mode_t mode, a1fs_ino_t parent_ino, fs_ctx *fs, uint32_t type);
 
-void free_data(a1fs_inode *inode, unsigned char *block_bitmap,void *image);
+void promote_last_dentry(a1fs_inode *inode, a1fs_dentry *vacancy_ptr, fs_ctx *fs);
 
-void free_in_extent(a1fs_extent *extent, unsigned char *block_bitmap, void *image);
+a1fs_dentry* find_dentry(a1fs_inode *inode, const char *filename, fs_ctx *fs);
 
-void shrink_data(size_t size_cut, a1fs_inode *inode, void *image);
+a1fs_dentry* find_in_extent(a1fs_extent *extent, const char *filename, fs_ctx *fs);
+
+uint32_t inode_snapshot(a1fs_ino_t ino, a1fs_inode *copy, a1fs_extent *extents, fs_ctx *fs);
+
+a1fs_ino_t find_inode(char *path, a1fs_inode *root, fs_ctx *fs);
+
+void free_data(a1fs_inode *inode, fs_ctx *fs);
+
+void free_in_extent(a1fs_extent *extent, fs_ctx *fs);
+
+void shrink_data(size_t size, a1fs_inode *inode, fs_ctx *fs);
 
 void add_to_extent(a1fs_extent *extent_blk, a1fs_inode *inode, a1fs_blk_t new_blk);
 
-void extend_data(size_t size_allocate, a1fs_inode *inode, void *image);
+int extend_data(size_t size_allocate, a1fs_inode *inode, fs_ctx *fs);
+
+a1fs_ref_t *block_refcount(a1fs_blk_t blk, fs_ctx *fs);
+
+int find_lblk(a1fs_inode *inode, uint64_t lblk, a1fs_blk_t *blk_off, fs_ctx *fs);
+
+int unshare_block(a1fs_inode *inode, uint64_t lblk, fs_ctx *fs);
+
+int clone_data(a1fs_inode *src, a1fs_inode *dst, fs_ctx *fs);
+
+uint64_t inode_blocks(a1fs_inode *inode, fs_ctx *fs);
+
+void extents_read(a1fs_extent *extent, int extent_num, uint64_t off, void *buf, size_t len, fs_ctx *fs);
+
+void extents_write(a1fs_extent *extent, int extent_num, uint64_t off, const void *buf, size_t len, fs_ctx *fs);
+
+int resize_data(uint64_t size, a1fs_inode *inode, fs_ctx *fs);
+
+long read_data(a1fs_inode *inode, char *buf, size_t size, uint64_t offset, fs_ctx *fs);
+
+long write_data(a1fs_inode *inode, const char *buf, size_t size, uint64_t offset, fs_ctx *fs);
 
-#endif /* helper_h */
\ No newline at end of file
+#endif /* helper_h */
\ No newline at end of file
@@ -0,0 +1,650 @@
+/**
+ * a1fs bulk import tool.
+ *
+ * Copies a host directory tree into an unmounted image by mapping it directly
+ * instead of writing through FUSE. The tree is walked depth first by a single
+ * thread that builds the namespace: for each directory it creates the inodes
+ * of all entries, allocates the data of every file up front from its size, as
+ * a single contiguous run where the free space allows (see alloc_run()), and
+ * appends all entries to the directory at once, writing whole dentry blocks.
+ * Since allocations follow each other, files are laid out in the order of
+ * their directory entries. File contents are read into the image by a pool of
+ * reader threads while the walk goes on.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "alloc.h"
+#include "fs_ctx.h"
+#include "helper.h"
+#include "journal.h"
+#include "map.h"
+#include "stats.h"
+#include "util.h"
+
+
+/** Command line options. */
+typedef struct import_opts {
+	/** File system image file path. */
+	const char *img_path;
+	/** Host directory to import. */
+	const char *src_path;
+	/** Directory of the image to import into. */
+	const char *dest;
+	/** Number of reader threads. */
+	size_t n_threads;
+
+	/** Print help and exit. */
+	bool help;
+	/** Sync memory-mapped image file contents to disk. */
+	bool sync;
+	/** Verbose output. */
+	bool verbose;
+
+} import_opts;
+
+static const char *help_str = "\
+Usage: %s options image source\n\
+\n\
+Copy a host directory tree into an unmounted a1fs image without going through\n\
+FUSE. The contents of the source directory are added to the destination\n\
+directory of the image; names that already exist there are skipped. Only\n\
+regular files and directories are imported, with their permissions and\n\
+modification times. Each file is allocated up front, as a single extent where\n\
+the free space allows, in the order of the directory entries.\n\
+\n\
+Options:\n\
+    -d path  destination directory in the image (default: /)\n\
+    -j num   number of reader threads (default: number of CPUs)\n\
+    -h       print help and exit\n\
+    -s       sync image file contents to disk\n\
+    -v       verbose output - print every imported path\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+	fprintf(f, help_str, progname);
+}
+
+
+static bool parse_args(int argc, char *argv[], import_opts *opts)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	opts->n_threads = (cpus > 0) ? (size_t)cpus : 1;
+	opts->dest = "/";
+
+	int o;
+	while ((o = getopt(argc, argv, "d:j:hsv")) != -1) {
+		switch (o) {
+			case 'd': opts->dest = optarg; break;
+			case 'j': opts->n_threads = strtoul(optarg, NULL, 10); break;
+
+			case 'h': opts->help = true; return true;// skip other arguments
+			case 's': opts->sync = true; break;
+			case 'v': opts->verbose = true; break;
+
+			case '?': return false;
+			default : assert(false);
+		}
+	}
+
+	if (opts->n_threads == 0) {
+		fprintf(stderr, "Invalid number of threads\n");
+		return false;
+	}
+	if (optind + 2 > argc) {
+		fprintf(stderr, "Missing image or source path\n");
+		return false;
+	}
+	opts->img_path = argv[optind];
+	opts->src_path = argv[optind + 1];
+	return true;
+}
+
+
+#define MAX_EXTENTS (A1FS_BLOCK_SIZE / sizeof(a1fs_extent))
+#define DENTRIES_PER_BLOCK (A1FS_BLOCK_SIZE / A1FS_DENTRY_SIZE)
+
+/** File whose contents are copied by a reader thread. */
+typedef struct copy_job {
+	/** Host path, malloc()ed. */
+	char *path;
+	a1fs_ino_t ino;
+} copy_job;
+
+/** Files queued by the namespace walk for the reader threads. */
+typedef struct job_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	copy_job *jobs;
+	size_t n;
+	size_t cap;
+	/** Next job to hand out. */
+	size_t next;
+	/** The walk is over, no more jobs are added. */
+	bool done;
+} job_queue;
+
+/** Import state. */
+typedef struct importer {
+	fs_ctx *fs;
+	const import_opts *opts;
+	/** The image file, not to be imported into itself. */
+	struct stat image_st;
+	job_queue queue;
+
+	uint64_t dirs;
+	uint64_t files;
+	uint64_t bytes;
+	uint64_t skipped;
+	/** Files that could not be read completely; updated by the readers. */
+	uint64_t read_errors;
+	/** The image ran out of inodes or blocks; the walk stops. */
+	bool full;
+} importer;
+
+/** Entry of a host directory being imported. */
+typedef struct host_entry {
+	char *name;
+	struct stat st;
+	a1fs_ino_t ino;
+} host_entry;
+
+
+static void queue_push(job_queue *q, char *path, a1fs_ino_t ino)
+{
+	pthread_mutex_lock(&q->lock);
+	if (q->n == q->cap) {
+		size_t cap = q->cap ? q->cap * 2 : 1024;
+		copy_job *jobs = realloc(q->jobs, cap * sizeof(copy_job));
+		if (jobs == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+		q->jobs = jobs;
+		q->cap = cap;
+	}
+	q->jobs[q->n++] = (copy_job){ path, ino };
+	pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/** Wait for the next job. @return  false once the queue is drained and done. */
+static bool queue_pop(job_queue *q, copy_job *job)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->next == q->n && !q->done) pthread_cond_wait(&q->cond, &q->lock);
+	bool found = q->next < q->n;
+	if (found) *job = q->jobs[q->next++];
+	pthread_mutex_unlock(&q->lock);
+	return found;
+}
+
+static void queue_finish(job_queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->done = true;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+
+static a1fs_extent *extents_of(fs_ctx *fs, const a1fs_inode *inode)
+{
+	return (a1fs_extent *)((char *)fs->image + (size_t)inode->block_no * A1FS_BLOCK_SIZE);
+}
+
+/** Read up to len bytes, retrying short reads. @return  bytes read; -1 on error. */
+static ssize_t read_full(int fd, char *buf, size_t len)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t n = read(fd, buf + done, len - done);
+		if (n < 0) return -1;
+		if (n == 0) break;
+		done += n;
+	}
+	return done;
+}
+
+/**
+ * Read the contents of a host file straight into the blocks allocated for it.
+ * A file that shrank since it was listed is padded with zeros, one that grew
+ * is cut at the listed size.
+ */
+static void copy_file(importer *im, const copy_job *job)
+{
+	fs_ctx *fs = im->fs;
+	const a1fs_inode *inode = &fs->inodes[job->ino];
+	const a1fs_extent *ext = extents_of(fs, inode);
+	uint32_t n = MAX_EXTENTS - inode->free_extent_num;
+
+	int fd = open(job->path, O_RDONLY);
+	if (fd < 0) perror(job->path);
+	if (fd >= 0) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	bool complete = fd >= 0;
+	uint64_t off = 0;
+	for (uint32_t i = 0; i < n; i++) {
+		char *dst = (char *)fs->image + (size_t)ext[i].start * A1FS_BLOCK_SIZE;
+		size_t room = (size_t)ext[i].count * A1FS_BLOCK_SIZE;
+		size_t len = (inode->size - off < room) ? inode->size - off : room;
+		ssize_t got = complete ? read_full(fd, dst, len) : 0;
+		if (got < 0) {
+			perror(job->path);
+			got = 0;
+		}
+		if ((size_t)got < len) complete = false;
+		// Also clears the rest of the last block, which may hold stale data
+		memset(dst + got, 0, room - got);
+		off += len;
+	}
+	if (fd >= 0) close(fd);
+	if (!complete) {
+		if (fd >= 0) fprintf(stderr, "%s: changed while being imported\n", job->path);
+		__atomic_fetch_add(&im->read_errors, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void *reader_thread(void *arg)
+{
+	importer *im = (importer *)arg;
+	copy_job job;
+	while (queue_pop(&im->queue, &job)) {
+		copy_file(im, &job);
+		free(job.path);
+	}
+	return NULL;
+}
+
+
+/**
+ * Allocate blocks at the end of the extents of an inode, in as few runs as
+ * the free space allows. A run that follows the last extent is merged into it.
+ *
+ * @return  false if the image is full or the inode runs out of extents; the
+ *          inode is left unchanged.
+ */
+static bool append_blocks(fs_ctx *fs, a1fs_inode *inode, uint64_t count)
+{
+	a1fs_extent *ext = extents_of(fs, inode);
+	uint32_t old_free = inode->free_extent_num;
+	uint32_t old_n = MAX_EXTENTS - old_free;
+	a1fs_blk_t old_count = (old_n > 0) ? ext[old_n - 1].count : 0;
+
+	while (count > 0) {
+		a1fs_blk_t start;
+		a1fs_blk_t len = alloc_run(fs, (count < UINT32_MAX) ? (a1fs_blk_t)count : UINT32_MAX, &start);
+		if (len == 0) goto fail;
+		uint32_t n = MAX_EXTENTS - inode->free_extent_num;
+		if (n > 0 && ext[n - 1].start + ext[n - 1].count == start) {
+			ext[n - 1].count += len;
+		} else if (inode->free_extent_num > 0) {
+			ext[n] = (a1fs_extent){ .start = start, .count = len };
+			inode->free_extent_num--;
+		} else {
+			release_blocks(start, len, fs);
+			goto fail;
+		}
+		count -= len;
+	}
+	return true;
+
+fail:
+	for (uint32_t i = old_n; i < MAX_EXTENTS - inode->free_extent_num; i++) {
+		release_blocks(ext[i].start, ext[i].count, fs);
+	}
+	if (old_n > 0 && ext[old_n - 1].count > old_count) {
+		release_blocks(ext[old_n - 1].start + old_count, ext[old_n - 1].count - old_count, fs);
+		ext[old_n - 1].count = old_count;
+	}
+	inode->free_extent_num = old_free;
+	return false;
+}
+
+/** Free an inode that was created but not linked, with all its blocks. */
+static void discard_inode(fs_ctx *fs, a1fs_ino_t ino)
+{
+	a1fs_inode *inode = &fs->inodes[ino];
+	free_data(inode, fs);
+	release_block(inode->block_no, fs);
+	release_inode(ino, fs);
+}
+
+/**
+ * Append entries to a directory in bulk: the free slots of its last dentry
+ * block are filled first, then blocks for the rest are allocated together and
+ * written whole.
+ *
+ * @return  false if the image is full; the directory is left unchanged.
+ */
+static bool add_dentries(fs_ctx *fs, a1fs_ino_t dir, const host_entry *entries, size_t n)
+{
+	if (n == 0) return true;
+	a1fs_inode *inode = &fs->inodes[dir];
+	uint64_t used = inode->size / A1FS_DENTRY_SIZE;
+	uint64_t slots = align_up(used, DENTRIES_PER_BLOCK) - used;
+	uint64_t rest = (n > slots) ? n - slots : 0;
+	if (!append_blocks(fs, inode, align_up(rest, DENTRIES_PER_BLOCK) / DENTRIES_PER_BLOCK)) return false;
+
+	// Walk the dentry blocks from the one holding the first new entry
+	a1fs_extent *ext = extents_of(fs, inode);
+	uint64_t blk = used / DENTRIES_PER_BLOCK;
+	uint32_t e = 0;
+	for (; blk >= ext[e].count; e++) blk -= ext[e].count;
+
+	size_t i = 0;
+	uint64_t slot = used % DENTRIES_PER_BLOCK;
+	while (i < n) {
+		a1fs_dentry *block = (a1fs_dentry *)((char *)fs->image + ((size_t)ext[e].start + blk) * A1FS_BLOCK_SIZE);
+		if (slot == 0) memset(block, 0, A1FS_BLOCK_SIZE);
+		a1fs_dentry *first = &block[slot];
+		for (; slot < DENTRIES_PER_BLOCK && i < n; slot++, i++) {
+			block[slot].ino = entries[i].ino;
+			strncpy(block[slot].name, entries[i].name, A1FS_NAME_MAX);
+		}
+		journal_dirty(fs, first, (char *)&block[slot] - (char *)first);
+		slot = 0;
+		if (++blk == ext[e].count) {
+			e++;
+			blk = 0;
+		}
+	}
+	inode->size += n * A1FS_DENTRY_SIZE;
+	journal_dirty_inode(fs, inode);
+	return true;
+}
+
+static int cmp_entry(const void *a, const void *b)
+{
+	return strcmp(((const host_entry *)a)->name, ((const host_entry *)b)->name);
+}
+
+/**
+ * List the regular files and subdirectories of a host directory, sorted by
+ * name. Other entries, and names too long for a1fs, are skipped.
+ *
+ * @return  malloc()ed entries; NULL if the directory can't be read.
+ */
+static host_entry *list_dir(importer *im, const char *path, size_t *count)
+{
+	DIR *d = opendir(path);
+	if (d == NULL) {
+		perror(path);
+		return NULL;
+	}
+	host_entry *entries = NULL;
+	size_t n = 0, cap = 0;
+	struct dirent *de;
+	while ((de = readdir(d)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+		struct stat st;
+		if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+			fprintf(stderr, "%s/%s: %s\n", path, de->d_name, strerror(errno));
+			im->skipped++;
+			continue;
+		}
+		const char *why = NULL;
+		if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+			why = "not a regular file or directory";
+		} else if (strlen(de->d_name) >= A1FS_NAME_MAX) {
+			why = "name too long";
+		} else if (st.st_dev == im->image_st.st_dev && st.st_ino == im->image_st.st_ino) {
+			why = "the image itself";
+		}
+		if (why != NULL) {
+			fprintf(stderr, "%s/%s: skipped, %s\n", path, de->d_name, why);
+			im->skipped++;
+			continue;
+		}
+
+		if (n == cap) {
+			cap = cap ? cap * 2 : 64;
+			host_entry *tmp = realloc(entries, cap * sizeof(host_entry));
+			if (tmp == NULL) {
+				perror("realloc");
+				exit(1);
+			}
+			entries = tmp;
+		}
+		entries[n++] = (host_entry){ .name = strdup(de->d_name), .st = st };
+	}
+	closedir(d);
+	if (entries == NULL && (entries = malloc(sizeof(host_entry))) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	qsort(entries, n, sizeof(host_entry), cmp_entry);
+	*count = n;
+	return entries;
+}
+
+/**
+ * Create the inode of a directory entry; a file gets all its blocks.
+ *
+ * @return  false if the image is full.
+ */
+static bool create_entry(importer *im, a1fs_ino_t dir, host_entry *entry)
+{
+	fs_ctx *fs = im->fs;
+	bool is_dir = S_ISDIR(entry->st.st_mode);
+	entry->ino = create_inode(entry->st.st_mode & 07777, dir, fs, is_dir ? 0 : 1);
+	if (entry->ino == (a1fs_ino_t)-1) return false;
+
+	a1fs_inode *inode = &fs->inodes[entry->ino];
+	if (!is_dir) {
+		uint64_t size = entry->st.st_size;
+		if (!append_blocks(fs, inode, align_up(size, A1FS_BLOCK_SIZE) / A1FS_BLOCK_SIZE)) {
+			discard_inode(fs, entry->ino);
+			return false;
+		}
+		inode->size = size;
+	}
+	inode->mtime = entry->st.st_mtim;
+	journal_dirty_inode(fs, inode);
+	return true;
+}
+
+/**
+ * Import the contents of a host directory into a directory of the image and
+ * recurse into its subdirectories.
+ *
+ * @param path      host directory path.
+ * @param dir       image directory.
+ * @param existing  the directory may already have entries, whose names are
+ *                  skipped.
+ */
+static void import_dir(importer *im, const char *path, a1fs_ino_t dir, bool existing)
+{
+	fs_ctx *fs = im->fs;
+	size_t n;
+	host_entry *entries = list_dir(im, path, &n);
+	if (entries == NULL) {
+		im->skipped++;
+		return;
+	}
+
+	// Inodes and file blocks first, in entry order
+	host_entry *made = malloc((n + 1) * sizeof(host_entry));
+	if (made == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	size_t created = 0;
+	uint32_t subdirs = 0;
+	for (size_t i = 0; i < n && !im->full; i++) {
+		host_entry *entry = &entries[i];
+		if (existing && find_dentry(&fs->inodes[dir], entry->name, fs) != NULL) {
+			fprintf(stderr, "%s/%s: skipped, already exists\n", path, entry->name);
+			im->skipped++;
+			continue;
+		}
+		if (!create_entry(im, dir, entry)) {
+			im->full = true;
+			break;
+		}
+		if (S_ISDIR(entry->st.st_mode)) subdirs++;
+		made[created++] = *entry;
+	}
+
+	// Then all entries at once
+	if (!add_dentries(fs, dir, made, created)) {
+		im->full = true;
+		for (size_t i = 0; i < created; i++) discard_inode(fs, made[i].ino);
+		created = 0;
+		subdirs = 0;
+	}
+	fs->inodes[dir].links += subdirs;
+	journal_dirty_inode(fs, &fs->inodes[dir]);
+
+	for (size_t i = 0; i < created; i++) {
+		host_entry *entry = &made[i];
+		char *child = NULL;
+		if (asprintf(&child, "%s/%s", path, entry->name) < 0) {
+			perror("asprintf");
+			exit(1);
+		}
+		if (im->opts->verbose) printf("%s\n", child);
+		if (S_ISDIR(entry->st.st_mode)) {
+			im->dirs++;
+			import_dir(im, child, entry->ino, false);
+			free(child);
+			// Set after its entries were added
+			fs->inodes[entry->ino].mtime = entry->st.st_mtim;
+			journal_dirty_inode(fs, &fs->inodes[entry->ino]);
+		} else {
+			im->files++;
+			im->bytes += entry->st.st_size;
+			if (entry->st.st_size > 0) {
+				queue_push(&im->queue, child, entry->ino);
+			} else {
+				free(child);
+			}
+		}
+	}
+
+	free(made);
+	for (size_t i = 0; i < n; i++) free(entries[i].name);
+	free(entries);
+}
+
+static int import(fs_ctx *fs, const import_opts *opts, importer *im)
+{
+	char dest[PATH_MAX];
+	snprintf(dest, sizeof(dest), "%s", opts->dest);
+	a1fs_ino_t dir = find_inode(dest, fs->inodes, fs);
+	if (dir >= fs->sb->inodes_count || fs->inodes[dir].type != 0) {
+		fprintf(stderr, "%s: no such directory in the image\n", opts->dest);
+		return -1;
+	}
+
+	pthread_t *readers = malloc(opts->n_threads * sizeof(pthread_t));
+	if (readers == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	for (size_t i = 0; i < opts->n_threads; i++) {
+		if (pthread_create(&readers[i], NULL, reader_thread, im) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+
+	import_dir(im, opts->src_path, dir, true);
+	update_mtime(&fs->inodes[dir], fs);
+
+	queue_finish(&im->queue);
+	for (size_t i = 0; i < opts->n_threads; i++) pthread_join(readers[i], NULL);
+	free(readers);
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	import_opts opts = {0};// defaults are all 0
+	if (!parse_args(argc, argv, &opts)) {
+		// Invalid arguments, print help to stderr
+		print_help(stderr, argv[0]);
+		return 1;
+	}
+	if (opts.help) {
+		// Help requested, print it to stdout
+		print_help(stdout, argv[0]);
+		return 0;
+	}
+
+	importer im = {0};
+	im.opts = &opts;
+	if (stat(opts.img_path, &im.image_st) != 0) {
+		perror(opts.img_path);
+		return 1;
+	}
+	struct stat src_st;
+	if (stat(opts.src_path, &src_st) != 0 || !S_ISDIR(src_st.st_mode)) {
+		fprintf(stderr, "%s: not a directory\n", opts.src_path);
+		return 1;
+	}
+
+	// Map image file into memory
+	size_t size;
+	void *image = map_file(opts.img_path, A1FS_BLOCK_SIZE, &size);
+	if (image == NULL) return 1;
+
+	int ret = 1;
+	a1fs_superblock *superblock = (a1fs_superblock *)image;
+	if (superblock->magic != A1FS_MAGIC) {
+		fprintf(stderr, "Image does not contain a1fs\n");
+		goto end;
+	}
+
+	fs_ctx fs;
+	if (!fs_ctx_init(&fs, image, size, -1, NULL)) goto end;
+	// Finish freeing files unlinked before an unclean unmount
+	orphan_reclaim_all(&fs);
+	im.fs = &fs;
+	pthread_mutex_init(&im.queue.lock, NULL);
+	pthread_cond_init(&im.queue.cond, NULL);
+	uint64_t start = stats_begin();
+	int err = import(&fs, &opts, &im);
+	double time = (stats_begin() - start) / 1e9;
+	fs_ctx_destroy(&fs);
+	pthread_mutex_destroy(&im.queue.lock);
+	pthread_cond_destroy(&im.queue.cond);
+	free(im.queue.jobs);
+	if (err != 0) goto end;
+
+	printf("directories:       %lu\n", im.dirs);
+	printf("files:             %lu\n", im.files);
+	printf("bytes:             %lu\n", im.bytes);
+	printf("skipped:           %lu\n", im.skipped);
+	printf("time:              %.3f s (%zu threads, %.1f MiB/s)\n", time, opts.n_threads,
+	       time > 0 ? im.bytes / time / (1 << 20) : 0.0);
+	if (im.full) fprintf(stderr, "Image is full, the import is incomplete\n");
+	if (im.read_errors != 0) fprintf(stderr, "%lu files could not be read completely\n", im.read_errors);
+
+	// Sync to disk if requested
+	if (opts.sync && (msync(image, size, MS_SYNC) < 0)) {
+		perror("msync");
+		goto end;
+	}
+
+	ret = (im.full || im.read_errors != 0) ? 1 : 0;
+end:
+	munmap(image, size);
+	return ret;
+}
@@ -0,0 +1,475 @@
+/**
+ * a1fs metadata journal implementation.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "fs_ctx.h"
+#include "journal.h"
+#include "trace.h"
+
+
+/** Get a block of the journal area. */
+static void *jblock(fs_ctx *fs, uint32_t i)
+{
+	return (char *)fs->image + ((size_t)fs->sb->journal_start + i) * A1FS_BLOCK_SIZE;
+}
+
+/** Get the home location of a block. */
+static void *home(fs_ctx *fs, a1fs_blk_t blk)
+{
+	return (char *)fs->image + (size_t)blk * A1FS_BLOCK_SIZE;
+}
+
+/** Accumulate the checksum of a log block. */
+static uint64_t checksum(uint64_t sum, const void *block)
+{
+	const uint64_t *w = (const uint64_t *)block;
+	for (size_t i = 0; i < A1FS_BLOCK_SIZE / sizeof(uint64_t); i++) {
+		sum = (sum ^ w[i]) * 0x100000001B3ul;
+		sum ^= sum >> 29;
+	}
+	return sum;
+}
+
+static int cmp_blk(const void *a, const void *b)
+{
+	a1fs_blk_t x = *(const a1fs_blk_t *)a;
+	a1fs_blk_t y = *(const a1fs_blk_t *)b;
+	return (x > y) - (x < y);
+}
+
+/** Write back the home locations of a set of blocks, coalesced into ranges. */
+static int sync_blocks(fs_ctx *fs, a1fs_blk_t *blocks, size_t n)
+{
+	qsort(blocks, n, sizeof(a1fs_blk_t), cmp_blk);
+	for (size_t i = 0; i < n; ) {
+		size_t end = i + 1;
+		while (end < n && blocks[end] <= blocks[end - 1] + 1) end++;
+		int ret = writeback_write(fs, blocks[i], home(fs, blocks[i]), blocks[end - 1] - blocks[i] + 1);
+		if (ret != 0) return ret;
+		i = end;
+	}
+	return writeback_flush(fs);
+}
+
+/** Write the journal area from a log block on to the file. */
+static int write_log(fs_ctx *fs, uint32_t pos, uint32_t count)
+{
+	int ret = writeback_write(fs, fs->sb->journal_start + pos, jblock(fs, pos), count);
+	return (ret != 0) ? ret : writeback_flush(fs);
+}
+
+/**
+ * Rebuild the dirty block list from the bitmap, after some blocks didn't fit
+ * in it. Operations are quiesced.
+ */
+static int list_from_bitmap(fs_ctx *fs)
+{
+	journal *j = fs->journal;
+	a1fs_blk_t blocks = fs->sb->blocks_count;
+	size_t n = 0;
+	for (a1fs_blk_t blk = 0; blk < blocks; blk++) {
+		if (j->dirty[blk / 8] & (1 << (blk % 8))) n++;
+	}
+	a1fs_blk_t *list = malloc((n + 1) * sizeof(a1fs_blk_t));
+	if (list == NULL) return -ENOMEM;
+	n = 0;
+	for (a1fs_blk_t blk = 0; blk < blocks; blk++) {
+		if (j->dirty[blk / 8] & (1 << (blk % 8))) list[n++] = blk;
+	}
+	free(j->list);
+	j->list = list;
+	j->n_list = j->cap_list = n;
+	j->overflow = false;
+	return 0;
+}
+
+/** Check that a logged block may be written to its home location. */
+static bool valid_home(fs_ctx *fs, a1fs_blk_t blk)
+{
+	a1fs_superblock *sb = fs->sb;
+	return blk < sb->blocks_count &&
+	       (blk < sb->journal_start || blk >= sb->journal_start + sb->journal_blocks);
+}
+
+/**
+ * Write the logged copies of the blocks in the log to their home locations,
+ * oldest first, so that each block ends up with its last committed contents.
+ * Used when the image is mapped privately and the home locations in memory
+ * may hold changes that are not committed yet.
+ */
+static int write_logged(fs_ctx *fs)
+{
+	journal *j = fs->journal;
+	for (uint32_t pos = 1; pos < j->head; ) {
+		a1fs_journal_desc *d = jblock(fs, pos);
+		if (d->magic != A1FS_JDESC_MAGIC) {
+			pos++;// commit block
+			continue;
+		}
+		for (uint32_t i = 0; i < d->count; i++) {
+			if (!valid_home(fs, d->blocks[i])) continue;
+			int ret = writeback_write(fs, d->blocks[i], jblock(fs, pos + 1 + i), 1);
+			if (ret != 0) return ret;
+		}
+		pos += 1 + d->count;
+	}
+	return writeback_flush(fs);
+}
+
+/** Write back the home locations of all blocks in the log, as they are in the shared mapping. */
+static int sync_logged(fs_ctx *fs)
+{
+	journal *j = fs->journal;
+
+	// Collect the blocks listed by the descriptors of the log
+	size_t n = 0;
+	a1fs_blk_t *blocks = malloc((size_t)j->head * sizeof(a1fs_blk_t));
+	if (blocks == NULL) return -ENOMEM;
+	for (uint32_t pos = 1; pos < j->head; ) {
+		a1fs_journal_desc *d = jblock(fs, pos);
+		if (d->magic != A1FS_JDESC_MAGIC) {
+			pos++;// commit block
+			continue;
+		}
+		for (uint32_t i = 0; i < d->count; i++) {
+			if (valid_home(fs, d->blocks[i])) blocks[n++] = d->blocks[i];
+		}
+		pos += 1 + d->count;
+	}
+	int ret = sync_blocks(fs, blocks, n);
+	free(blocks);
+	return ret;
+}
+
+/**
+ * Write back the home locations of all blocks in the log and empty it. The
+ * caller holds the commit lock.
+ */
+static int checkpoint(fs_ctx *fs)
+{
+	journal *j = fs->journal;
+
+	if (j->head > 1) {
+		int ret = (fs->fd >= 0) ? write_logged(fs) : sync_logged(fs);
+		if (ret != 0) return ret;
+	}
+
+	// Transactions left in the log no longer continue the sequence
+	a1fs_journal_sb *jsb = jblock(fs, 0);
+	jsb->seq = j->seq;
+	j->head = 1;
+	int ret = write_log(fs, 0, 1);
+	// Blocks freed before the open transaction are now free in the image
+	// file, and no log replays their old contents over them
+	if (ret == 0) __atomic_store_n(&j->ckpt_tx, __atomic_load_n(&j->open_tx, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	return ret;
+}
+
+/**
+ * Find the commit block of a complete transaction.
+ *
+ * @param pos  log block where the transaction starts.
+ * @param seq  expected sequence number.
+ * @return     log block of the commit block; 0 if there is no complete
+ *             transaction with this sequence number at pos.
+ */
+static uint32_t find_commit(fs_ctx *fs, uint32_t pos, uint64_t seq)
+{
+	uint32_t jblocks = fs->sb->journal_blocks;
+	uint32_t start = pos;
+	uint64_t sum = 0;
+
+	while (pos < jblocks) {
+		a1fs_journal_desc *d = jblock(fs, pos);
+		if (d->seq != seq) return 0;
+		if (d->magic == A1FS_JCOMMIT_MAGIC) {
+			a1fs_journal_commit *c = (a1fs_journal_commit *)d;
+			return (pos > start && c->nblocks == pos - start && c->checksum == sum) ? pos : 0;
+		}
+		if (d->magic != A1FS_JDESC_MAGIC || d->count > A1FS_JDESC_MAX || d->count >= jblocks - pos) {
+			return 0;
+		}
+		for (uint32_t i = 0; i <= d->count; i++) {
+			sum = checksum(sum, jblock(fs, pos + i));
+		}
+		pos += 1 + d->count;
+	}
+	return 0;
+}
+
+/** Copy the blocks of a complete transaction to their home locations. */
+static void apply(fs_ctx *fs, uint32_t pos, uint32_t commit)
+{
+	while (pos < commit) {
+		a1fs_journal_desc *d = jblock(fs, pos);
+		for (uint32_t i = 0; i < d->count; i++) {
+			if (valid_home(fs, d->blocks[i])) {
+				memcpy(home(fs, d->blocks[i]), jblock(fs, pos + 1 + i), A1FS_BLOCK_SIZE);
+			}
+		}
+		pos += 1 + d->count;
+	}
+}
+
+/** Replay the committed transactions in the log and checkpoint them. */
+static int replay(fs_ctx *fs)
+{
+	journal *j = fs->journal;
+	a1fs_journal_sb *jsb = jblock(fs, 0);
+
+	uint32_t pos = 1;
+	uint64_t seq = jsb->seq;
+	uint32_t commit;
+	while ((commit = find_commit(fs, pos, seq)) != 0) {
+		apply(fs, pos, commit);
+		pos = commit + 1;
+		seq++;
+	}
+	if (seq != jsb->seq) {
+		fprintf(stderr, "Replayed %lu journal transactions\n", (unsigned long)(seq - jsb->seq));
+	}
+	j->head = pos;
+	j->seq = seq;
+	return checkpoint(fs);
+}
+
+
+bool journal_init(fs_ctx *fs)
+{
+	a1fs_superblock *sb = fs->sb;
+	fs->journal = NULL;
+	if (sb->journal_blocks < 2) return true;// no journal
+	if ((uint64_t)sb->journal_start + sb->journal_blocks > sb->blocks_count) {
+		fprintf(stderr, "Invalid journal location\n");
+		return false;
+	}
+
+	journal *j = calloc(1, sizeof(journal));
+	if (j != NULL) {
+		j->dirty = calloc(sb->blocks_count / 8 + 1, 1);
+		j->freed = calloc(sb->blocks_count, sizeof(uint64_t));
+	}
+	if (j == NULL || j->dirty == NULL || j->freed == NULL) {
+		perror("calloc");
+		if (j != NULL) {
+			free(j->dirty);
+			free(j->freed);
+		}
+		free(j);
+		return false;
+	}
+	j->open_tx = 1;
+	j->ckpt_tx = 1;
+	pthread_mutex_init(&j->commit_lock, NULL);
+	pthread_mutex_init(&j->dirty_lock, NULL);
+	fs->journal = j;
+
+	a1fs_journal_sb *jsb = jblock(fs, 0);
+	if (jsb->magic != A1FS_JOURNAL_MAGIC) {
+		// Freshly formatted
+		jsb->magic = A1FS_JOURNAL_MAGIC;
+		jsb->seq = 1;
+	}
+	// A failed write back is retried by the next checkpoint
+	replay(fs);
+	return true;
+}
+
+void journal_destroy(fs_ctx *fs)
+{
+	journal *j = fs->journal;
+	if (j == NULL) return;
+
+	journal_commit(fs);
+	pthread_mutex_lock(&j->commit_lock);
+	checkpoint(fs);
+	pthread_mutex_unlock(&j->commit_lock);
+
+	pthread_mutex_destroy(&j->commit_lock);
+	pthread_mutex_destroy(&j->dirty_lock);
+	free(j->list);
+	free(j->dirty);
+	free(j->freed);
+	free(j);
+	fs->journal = NULL;
+}
+
+void journal_dirty(fs_ctx *fs, const void *addr, size_t len)
+{
+	journal *j = fs->journal;
+	// Journaled blocks are only written back to their home locations by a
+	// checkpoint
+	if (j == NULL) writeback_dirty(fs, addr, len);
+	if (j == NULL || len == 0) return;
+
+	size_t off = (const char *)addr - (const char *)fs->image;
+	for (size_t blk = off / A1FS_BLOCK_SIZE; blk <= (off + len - 1) / A1FS_BLOCK_SIZE; blk++) {
+		unsigned char bit = 1 << (blk % 8);
+		// Only the first change since the last commit needs the list
+		if (__atomic_load_n(&j->dirty[blk / 8], __ATOMIC_RELAXED) & bit) continue;
+		if (__atomic_fetch_or(&j->dirty[blk / 8], bit, __ATOMIC_RELAXED) & bit) continue;
+
+		pthread_mutex_lock(&j->dirty_lock);
+		if (j->n_list == j->cap_list) {
+			size_t cap = (j->cap_list == 0) ? 1024 : j->cap_list * 2;
+			a1fs_blk_t *list = realloc(j->list, cap * sizeof(a1fs_blk_t));
+			if (list == NULL) {
+				// The next commit finds the block in the bitmap instead
+				perror("realloc");
+				j->overflow = true;
+				pthread_mutex_unlock(&j->dirty_lock);
+				continue;
+			}
+			j->list = list;
+			j->cap_list = cap;
+		}
+		j->list[j->n_list++] = (a1fs_blk_t)blk;
+		pthread_mutex_unlock(&j->dirty_lock);
+	}
+}
+
+void journal_dirty_inode(fs_ctx *fs, const a1fs_inode *inode)
+{
+	journal_dirty(fs, inode, sizeof(*inode));
+	if (inode->block_no != 0 && inode->block_no < fs->sb->blocks_count) {
+		journal_dirty(fs, home(fs, inode->block_no), A1FS_BLOCK_SIZE);
+	}
+}
+
+void journal_release(fs_ctx *fs, a1fs_blk_t blk)
+{
+	journal *j = fs->journal;
+	if (j == NULL) return;
+	__atomic_store_n(&j->freed[blk], __atomic_load_n(&j->open_tx, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+bool journal_pinned(fs_ctx *fs, a1fs_blk_t blk)
+{
+	journal *j = fs->journal;
+	// In a shared mapping, the kernel may write the block back anyway
+	if (j == NULL || fs->fd < 0) return false;
+	return __atomic_load_n(&j->freed[blk], __ATOMIC_RELAXED) >= __atomic_load_n(&j->ckpt_tx, __ATOMIC_RELAXED);
+}
+
+int journal_checkpoint(fs_ctx *fs)
+{
+	journal *j = fs->journal;
+	if (j == NULL) return 0;
+
+	int ret = journal_commit(fs);
+	pthread_mutex_lock(&j->commit_lock);
+	int err = checkpoint(fs);
+	pthread_mutex_unlock(&j->commit_lock);
+	return (ret != 0) ? ret : err;
+}
+
+int journal_commit(fs_ctx *fs)
+{
+	journal *j = fs->journal;
+	if (j == NULL) return 0;
+	uint32_t jblocks = fs->sb->journal_blocks;
+
+	TRACE_START(start);
+	a1fs_blk_t *blocks = NULL;
+	size_t logged = 0;
+	pthread_mutex_lock(&j->commit_lock);
+	// Make room before holding up operations while the log is half full
+	int ret = (j->head > jblocks / 2) ? checkpoint(fs) : 0;
+	if (ret != 0) goto end;
+
+	// Wait for the operations in progress so that the transaction only
+	// contains complete ones; new ones wait until the blocks are captured
+	op_quiesce(fs);
+	if (fs->pools != NULL) alloc_sync(fs);
+	if (j->overflow && (ret = list_from_bitmap(fs)) != 0) {
+		op_resume(fs);
+		goto end;
+	}
+	blocks = j->list;
+	size_t n = j->n_list;
+	logged = n;
+	j->list = NULL;
+	j->n_list = j->cap_list = 0;
+	for (size_t i = 0; i < n; i++) {
+		j->dirty[blocks[i] / 8] &= ~(1 << (blocks[i] % 8));
+	}
+	if (n == 0) {
+		op_resume(fs);
+		goto end;
+	}
+
+	size_t need = n + (n + A1FS_JDESC_MAX - 1) / A1FS_JDESC_MAX + 1;
+	if (need > jblocks - 1) {
+		// Too large for the log, write the blocks back in place instead. The
+		// log goes first, so that replay can't bring back older contents over
+		// them; operations wait so that only complete ones are written
+		ret = checkpoint(fs);
+		if (ret == 0) ret = sync_blocks(fs, blocks, n);
+		if (ret == 0) {
+			__atomic_store_n(&j->open_tx, j->open_tx + 1, __ATOMIC_RELAXED);
+			__atomic_store_n(&j->ckpt_tx, j->open_tx, __ATOMIC_RELAXED);
+		}
+		op_resume(fs);
+		goto end;
+	}
+	if (j->head + need > jblocks && (ret = checkpoint(fs)) != 0) {
+		op_resume(fs);
+		goto end;
+	}
+
+	// Capture the block contents
+	uint32_t pos = j->head;
+	for (size_t i = 0; i < n; i += A1FS_JDESC_MAX) {
+		uint32_t count = (n - i < A1FS_JDESC_MAX) ? (uint32_t)(n - i) : (uint32_t)A1FS_JDESC_MAX;
+		a1fs_journal_desc *d = jblock(fs, pos);
+		memset(d, 0, A1FS_BLOCK_SIZE);
+		d->magic = A1FS_JDESC_MAGIC;
+		d->count = count;
+		d->seq = j->seq;
+		memcpy(d->blocks, &blocks[i], count * sizeof(a1fs_blk_t));
+		for (uint32_t k = 0; k < count; k++) {
+			memcpy(jblock(fs, pos + 1 + k), home(fs, blocks[i + k]), A1FS_BLOCK_SIZE);
+		}
+		pos += 1 + count;
+	}
+	// Blocks freed from here on belong to the next transaction
+	__atomic_store_n(&j->open_tx, j->open_tx + 1, __ATOMIC_RELAXED);
+	op_resume(fs);
+
+	uint64_t sum = 0;
+	for (uint32_t i = j->head; i < pos; i++) {
+		sum = checksum(sum, jblock(fs, i));
+	}
+	a1fs_journal_commit *c = jblock(fs, pos);
+	memset(c, 0, A1FS_BLOCK_SIZE);
+	c->magic = A1FS_JCOMMIT_MAGIC;
+	c->nblocks = pos - j->head;
+	c->seq = j->seq;
+	c->checksum = sum;
+
+	// One sequential write for the whole group of operations
+	ret = write_log(fs, j->head, pos + 1 - j->head);
+	if (ret == 0) {
+		j->head = pos + 1;
+		j->seq++;
+	}
+
+end:
+	// The next commit retries the blocks of a failed one
+	if (ret != 0 && blocks != NULL) {
+		for (size_t i = 0; i < logged; i++) {
+			journal_dirty(fs, home(fs, blocks[i]), A1FS_BLOCK_SIZE);
+		}
+	}
+	pthread_mutex_unlock(&j->commit_lock);
+	free(blocks);
+	TRACE(TRACE_JOURNAL_COMMIT, start, (a1fs_ino_t)-1, logged, 0, ret);
+	(void)logged;// unused without tracing
+	return ret;
+}
@@ -0,0 +1,150 @@
+/**
+ * a1fs metadata journal.
+ *
+ * Every change to a metadata block (superblock, bitmaps, inode table,
+ * reference counts, extent and directory blocks) is recorded with
+ * journal_dirty(). journal_commit() writes the current contents of all blocks
+ * changed since the previous commit to the log as a single transaction, so
+ * the operations of all requests since then are committed together with one
+ * sequential write of the journal area. Blocks are written back to their home
+ * locations (checkpointed) when the log fills up, on unmount and after a
+ * replay; until then the log holds their committed contents.
+ *
+ * On mount, committed transactions are replayed, bringing every block that was
+ * changed up to the last commit to its committed contents.
+ *
+ * A mounted image is mapped privately (see a1fs_open()), so metadata changed
+ * in memory only reaches the image file through the journal: the log gets the
+ * contents captured at commit, and a checkpoint writes those logged copies,
+ * not the blocks in memory, to their home locations. Writeback leaves
+ * journaled blocks alone. A crash therefore loses the operations since the
+ * last commit as a whole, and never leaves part of one in the image. The
+ * exception is a transaction larger than the whole log: it is written back in
+ * place after a checkpoint, and a crash in the middle of that leaves it
+ * partly applied. Blocks freed by a transaction are pinned (see
+ * journal_pinned()) until it is checkpointed, so that neither the old owner's
+ * committed contents nor a replay of them is overwritten by file data.
+ *
+ * The offline tools and a1fs_open_mem() change a shared mapping instead, which
+ * the kernel may write back at any time. There the journal makes committed
+ * changes durable but not atomic: after a crash, a block marked used in the
+ * bitmap that no extent refers to yet, or a directory entry whose inode is not
+ * yet initialized, may have reached the image; a1fs-fsck repairs them.
+ *
+ * File data is not journaled. COW copies of the privately mapped blocks stay
+ * in memory until the image is closed, except for the file data that fsync()
+ * writes back.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "a1fs.h"
+
+
+struct fs_ctx;
+
+/** Runtime journal state. */
+typedef struct journal {
+	/** Serializes commits and checkpoints. */
+	pthread_mutex_t commit_lock;
+	/** Protects the dirty block list. */
+	pthread_mutex_t dirty_lock;
+	/** One bit per block, set if the block changed since the last commit. */
+	unsigned char *dirty;
+	/** Blocks with their dirty bit set. */
+	a1fs_blk_t *list;
+	size_t n_list;
+	size_t cap_list;
+	/** Some dirty blocks are missing from the list, which ran out of memory. */
+	bool overflow;
+	/** Log block (relative to the journal start) for the next transaction. */
+	uint32_t head;
+	/** Sequence number of the next transaction. */
+	uint64_t seq;
+	/**
+	 * Number of the transaction that operations in progress belong to. Unlike
+	 * seq, it also counts transactions that were written back in place.
+	 */
+	uint64_t open_tx;
+	/** First transaction that may still be in the log. */
+	uint64_t ckpt_tx;
+	/** For every block, the transaction that last freed it; 0 if none. */
+	uint64_t *freed;
+} journal;
+
+/**
+ * Replay the journal of the image, if it has one, and set up the runtime
+ * state.
+ *
+ * @param fs  file system context.
+ * @return    true on success; false if out of memory.
+ */
+bool journal_init(struct fs_ctx *fs);
+
+/**
+ * Commit outstanding changes, checkpoint the log and free the runtime state.
+ *
+ * @param fs  file system context.
+ */
+void journal_destroy(struct fs_ctx *fs);
+
+/**
+ * Record a change to the metadata blocks overlapping a range of the image.
+ *
+ * @param fs    file system context.
+ * @param addr  start of the changed range in the image.
+ * @param len   length of the range in bytes.
+ */
+void journal_dirty(struct fs_ctx *fs, const void *addr, size_t len);
+
+/**
+ * Record a change to an inode and its extent block.
+ *
+ * @param fs     file system context.
+ * @param inode  changed inode.
+ */
+void journal_dirty_inode(struct fs_ctx *fs, const a1fs_inode *inode);
+
+/**
+ * Record that a block was freed by the open transaction. The caller is in an
+ * operation (see op_begin()).
+ *
+ * @param fs   file system context.
+ * @param blk  freed block.
+ */
+void journal_release(struct fs_ctx *fs, a1fs_blk_t blk);
+
+/**
+ * Check if a block was freed by a transaction that is not checkpointed yet.
+ * Its home location in the image file then still belongs to its old owner, or
+ * the log holds older contents that replay would write over it, so whatever
+ * the block holds now must not be written back yet.
+ *
+ * @param fs   file system context.
+ * @param blk  block number.
+ * @return     true if the block must not be written back.
+ */
+bool journal_pinned(struct fs_ctx *fs, a1fs_blk_t blk);
+
+/**
+ * Commit outstanding changes and checkpoint the log, unpinning the blocks
+ * freed so far. Must not be called from within an operation.
+ *
+ * @param fs  file system context.
+ * @return    0 on success; -errno on failure.
+ */
+int journal_checkpoint(struct fs_ctx *fs);
+
+/**
+ * Write all changes recorded since the last commit to the log and make them
+ * durable. Waits for operations in progress to end, so that the transaction
+ * is consistent. Must not be called from within an operation (see op_begin()).
+ *
+ * @param fs  file system context.
+ * @return    0 on success; -errno on failure.
+ */
+int journal_commit(struct fs_ctx *fs);
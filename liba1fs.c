@@ -0,0 +1,1296 @@
+/**
+ * liba1fs - a1fs file system operations, usable in-process.
+ *
+ * The FUSE driver (a1fs.c) is a thin wrapper around these functions. Tools and
+ * batch jobs can link the library directly and work on an image without going
+ * through the kernel.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "a1fs_ioctl.h"
+#include "compress.h"
+#include "helper.h"
+#include "fs_ctx.h"
+#include "liba1fs.h"
+#include "record.h"
+#include "seqlock.h"
+#include "stats.h"
+#include "trace.h"
+#include "map.h"
+
+
+//NOTE: All path arguments are absolute paths within the a1fs file system and
+// start with a '/' that corresponds to the a1fs root directory.
+//
+// For example, if a1fs is mounted at "~/my_csc369_repo/a1b/mnt/", the path to a
+// file at "~/my_csc369_repo/a1b/mnt/dir/file" (as seen by the OS) will be
+// passed to FUSE callbacks as "/dir/file".
+//
+// Paths to directories (except for the root directory - "/") do not end in a
+// trailing '/'. For example, "~/my_csc369_repo/a1b/mnt/dir/" will be passed to
+// FUSE callbacks as "/dir".
+
+
+/** Open an image in memory; fd as for fs_ctx_init(). */
+static fs_ctx *open_ctx(void *image, size_t size, int fd, a1fs_opts *opts)
+{
+	fs_ctx *fs = calloc(1, sizeof(fs_ctx));
+	if (fs == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	if (!fs_ctx_init(fs, image, size, fd, opts)) {
+		free(fs);
+		return NULL;
+	}
+	dcache_load(fs);
+	return fs;
+}
+
+fs_ctx *a1fs_open_mem(void *image, size_t size, a1fs_opts *opts)
+{
+	return open_ctx(image, size, -1, opts);
+}
+
+/**
+ * Map an image file and open it. An image with a journal is mapped privately,
+ * so that its metadata only reaches the file from committed transactions (see
+ * journal.h); the descriptor is then kept to write to the file, otherwise it
+ * is closed.
+ */
+static fs_ctx *open_file(int fd, a1fs_opts *opts)
+{
+	a1fs_superblock sb;
+	bool journaled = pread(fd, &sb, sizeof(sb), 0) == sizeof(sb) &&
+	                 sb.magic == A1FS_MAGIC && sb.journal_blocks >= 2;
+	size_t size;
+	void *image = journaled ? map_fd_private(fd, A1FS_BLOCK_SIZE, &size) : map_fd(fd, A1FS_BLOCK_SIZE, &size);
+	if (!journaled || image == NULL) {
+		close(fd);
+		fd = -1;
+	}
+	if (image == NULL) return NULL;
+
+	fs_ctx *fs = open_ctx(image, size, fd, opts);
+	if (fs == NULL) {
+		munmap(image, size);
+		if (fd >= 0) close(fd);
+		return NULL;
+	}
+	fs->own_image = true;
+	return fs;
+}
+
+fs_ctx *a1fs_open_fd(int fd, a1fs_opts *opts)
+{
+	int own_fd = dup(fd);
+	if (own_fd < 0) {
+		perror("dup");
+		return NULL;
+	}
+	return open_file(own_fd, opts);
+}
+
+fs_ctx *a1fs_open(const char *img_path, a1fs_opts *opts)
+{
+	int fd = open(img_path, O_RDWR);
+	if (fd < 0) {
+		perror(img_path);
+		return NULL;
+	}
+	return open_file(fd, opts);
+}
+
+void a1fs_start(fs_ctx *fs)
+{
+	// Unlinked files are then only reclaimed on close
+	if (!orphan_start(fs)) fprintf(stderr, "Failed to start the orphan reclaimer\n");
+	// The writeback settings are only filled in by a1fs_opt_parse()
+	if (fs->opts == NULL || fs->opts->writeback_interval == 0) return;
+	// Dirty blocks are then only written back by fsync, close and, unless the
+	// image is mapped privately, the kernel
+	if (!writeback_start(fs)) fprintf(stderr, "Failed to start the writeback thread\n");
+}
+
+void a1fs_close(fs_ctx *fs)
+{
+	op_begin(fs);
+	flush_mtimes(fs);
+	op_end(fs);
+	dcache_save(fs);
+	fs_ctx_destroy(fs);
+	if (fs->own_image) munmap(fs->image, fs->size);
+	if (fs->fd >= 0) close(fs->fd);
+	free(fs);
+}
+
+
+/**
+ * Look up the inode for given path.
+ *
+ * The caller must be in an operation (see op_begin()) and hold no inode locks.
+ *
+ * @param fs    file system context.
+ * @param path  path to a file or directory.
+ * @return      inode number on success; -errno on error.
+ */
+static long lookup(fs_ctx *fs, const char *path)
+{
+	TRACE_START(start);
+	stats_count(fs, STATS_LOOKUPS, 1);
+	// A cached result is only valid while the namespace is unchanged
+	uint32_t ns = seq_read_begin(&fs->ns_seq);
+	long cached = dcache_lookup(fs, path, ns);
+	if (cached >= 0) {
+		stats_count(fs, STATS_LOOKUP_HITS, 1);
+		TRACE(TRACE_LOOKUP, start, (a1fs_ino_t)cached, 1, 0, 0);
+		return cached;
+	}
+
+	//find_inode() modifies the path, so search a copy
+	char *path_cpy = strdup(path);
+	if (path_cpy == NULL) return -ENOMEM;
+	a1fs_ino_t ino = find_inode(path_cpy, fs->inodes, fs);
+	free(path_cpy);
+
+	long ret = ino;
+	if (ino == (fs->sb->inodes_count + 1)) ret = -ENOTDIR;
+	if (ino == (fs->sb->inodes_count + 2)) ret = -ENOENT;
+	TRACE(TRACE_LOOKUP, start, (ret < 0) ? (a1fs_ino_t)-1 : ino, 0, 0, (ret < 0) ? ret : 0);
+	if (ret >= 0) dcache_insert(fs, path, ino, ns);
+	return ret;
+}
+
+/**
+ * Check whether an operation that ran out of space is worth retrying: removed
+ * files are freed in the background (see orphan.h), so wait for the ones still
+ * pending. Called outside of an operation.
+ *
+ * @param fs   file system context.
+ * @param ret  result of the operation.
+ * @return     true if the operation should be retried.
+ */
+static bool retry_nospc(fs_ctx *fs, int ret)
+{
+	return ret == -ENOSPC && orphan_wait(fs);
+}
+
+
+static int do_statfs(fs_ctx *fs, struct statvfs *st)
+{
+
+	assert(fs != NULL);
+	assert(fs->image != NULL);
+
+	void *image = (void*)(fs->image);
+	a1fs_superblock *superblock = (a1fs_superblock *)image;
+	memset(st, 0, sizeof(*st));
+
+	//fold the per-CPU free counters into the superblock
+	alloc_sync(fs);
+	//TODO: fill in the rest of required fields based on the information stored
+	// in the superblock
+	st->f_bsize   = A1FS_BLOCK_SIZE; /* File system block size*/
+	st->f_frsize  = A1FS_BLOCK_SIZE; /* Fragment size */
+	st->f_bfree   = superblock->free_blocks_count;
+	st->f_bavail  = superblock->free_blocks_count;
+	st->f_files   = superblock->inodes_count;
+	st->f_ffree   = superblock->free_inodes_count;
+	st->f_favail  = superblock->free_inodes_count;
+	st->f_namemax = A1FS_NAME_MAX;
+
+	return 0;
+}
+
+int a1fs_statfs(fs_ctx *fs, struct statvfs *st)
+{
+	uint64_t start = stats_begin();
+	int ret = do_statfs(fs, st);
+	stats_end(fs, STATS_STATFS, start, ret);
+	TRACE_OP(STATS_STATFS, start, 0, 0, ret);
+	RECORD(fs, STATS_STATFS, start, "/", NULL, 0, 0, ret);
+	return ret;
+}
+
+/** Fill in the attributes of a file from its inode and extent count. */
+static void fill_stat(struct stat *st, const a1fs_inode *inode, uint64_t blocks)
+{
+	//if the current inode is a dir
+	if(inode->type == 0){
+		st->st_mode = S_IFDIR | inode->mode;
+	}else if(inode->type == 1){
+		//if the current inode is a file
+		st->st_mode = S_IFREG | inode->mode;
+	}
+
+	//st_size is the logical size, st_blocks the space actually allocated
+	// (smaller than the size for compressed files)
+	st->st_size = inode->size;
+	st->st_blocks = blocks * (A1FS_BLOCK_SIZE / 512);
+	st->st_nlink = inode->links;
+	st->st_mtime = inode->mtime.tv_sec;
+}
+
+/**
+ * Report the pending modification time of a --lazytime mount (see
+ * update_mtime()) instead of the one in the inode table. The caller must hold
+ * the inode lock, or validate the inode sequence count afterwards, since a
+ * flush moves the time from one to the other.
+ */
+static void lazy_stat(struct stat *st, a1fs_ino_t ino, fs_ctx *fs)
+{
+	if (fs->lazy_mtime == NULL) return;
+	uint64_t ns = __atomic_load_n(&fs->lazy_mtime[ino], __ATOMIC_RELAXED);
+	if (ns != 0) st->st_mtime = ns / 1000000000;
+}
+
+/**
+ * Look up a file and take a snapshot of its inode and extents without
+ * locking (see inode_snapshot()).
+ *
+ * @param fs       file system context.
+ * @param path     path to the file.
+ * @param copy     inode copy.
+ * @param extents  extents copy, room for 512 extents.
+ * @param ns       namespace sequence count to validate.
+ * @param seq      inode sequence count to validate.
+ * @return         inode number on success; -errno if the lookup failed.
+ */
+static long lookup_snapshot(fs_ctx *fs, const char *path, a1fs_inode *copy,
+                            a1fs_extent *extents, uint32_t *ns, uint32_t *seq)
+{
+	*ns = seq_read_begin(&fs->ns_seq);
+	long ino = lookup(fs, path);
+	if (ino >= 0) {
+		*seq = inode_snapshot((a1fs_ino_t)ino, copy, extents, fs);
+	}
+	return ino;
+}
+
+/**
+ * Check that the result of lookup_snapshot() is consistent.
+ *
+ * @return  true if the lookup must be retried.
+ */
+static bool snapshot_retry(fs_ctx *fs, long ino, uint32_t ns, uint32_t seq)
+{
+	if (ino >= 0 && seq_read_retry(&fs->ino_seq[ino], seq)) return true;
+	return seq_read_retry(&fs->ns_seq, ns);
+}
+
+static int do_stat(fs_ctx *fs, const char *path, struct stat *st)
+{
+	if (strlen(path) >= A1FS_PATH_MAX) return -ENAMETOOLONG;
+    
+	//TODO: lookup the inode for given path and, if it exists, fill in the
+	// required fields based on the information stored in the inode
+    a1fs_inode *root = fs->inodes;
+
+    //initialize all the field of st
+	memset(st, 0, sizeof(*st));
+
+	//optimistic lock-free attempts first, so that concurrent stats don't
+	// contend on the namespace and inode locks
+	a1fs_inode copy;
+	a1fs_extent extents[512];
+	for (int attempt = 0; attempt < SEQ_READ_ATTEMPTS; attempt++) {
+		uint32_t ns, seq;
+		long ino = lookup_snapshot(fs, path, &copy, extents, &ns, &seq);
+		uint64_t blocks = 0;
+		if (ino >= 0) {
+			for (int i = 0; i < 512 - (int)copy.free_extent_num; i++) {
+				blocks += extents[i].count;
+			}
+			fill_stat(st, &copy, blocks);
+			st->st_ino = ino;
+			lazy_stat(st, (a1fs_ino_t)ino, fs);
+		}
+		if (snapshot_retry(fs, ino, ns, seq)) continue;
+		if (ino < 0) return (int)ino;
+		return 0;
+	}
+
+	op_begin(fs);
+	long inode_num_found = lookup(fs, path);
+	if (inode_num_found < 0) {
+		op_end(fs);
+		return (int)inode_num_found;
+	}
+	
+    a1fs_inode *curr_inode = &root[inode_num_found];
+	pthread_rwlock_rdlock(ino_lock(fs, inode_num_found));
+	fill_stat(st, curr_inode, inode_blocks(curr_inode, fs));
+	st->st_ino = inode_num_found;
+	lazy_stat(st, (a1fs_ino_t)inode_num_found, fs);
+	pthread_rwlock_unlock(ino_lock(fs, inode_num_found));
+	op_end(fs);
+
+	return 0;
+}
+
+int a1fs_stat(fs_ctx *fs, const char *path, struct stat *st)
+{
+	uint64_t start = stats_begin();
+	int ret = do_stat(fs, path, st);
+	stats_end(fs, STATS_STAT, start, ret);
+	TRACE_OP(STATS_STAT, start, 0, 0, ret);
+	RECORD(fs, STATS_STAT, start, path, NULL, 0, 0, ret);
+	return ret;
+}
+
+static int do_readdir(fs_ctx *fs, const char *path, void *buf, a1fs_filler_t filler)
+{
+
+
+	//NOTE: This is just a placeholder that allows the file system to be mounted
+	// without errors. You should remove this from your implementation.
+	// if (strcmp(path, "/") == 0) {
+	// 	filler(buf, "." , NULL, 0);
+	// 	filler(buf, "..", NULL, 0);
+	// 	return 0;
+	// }
+
+	//TODO: lookup the directory inode for given path and iterate through its
+	// directory entries
+	void*image = (void*)(fs->image);
+	a1fs_inode *root = fs->inodes;
+
+	op_begin(fs);
+	long inode_num_found = lookup(fs, path);
+	if (inode_num_found < 0) {
+		op_end(fs);
+		return (int)inode_num_found;
+	}
+	pthread_rwlock_rdlock(ino_lock(fs, inode_num_found));
+	int ret = 0;
+	
+    a1fs_inode *target_inode = &root[inode_num_found];
+	if (target_inode->type != 0) {
+		ret = -ENOTDIR;
+		goto end;
+	}
+	a1fs_extent *extent_blk = (a1fs_extent *)(image + target_inode->block_no * A1FS_BLOCK_SIZE);
+	// how many dentry in this inode
+    uint64_t dentry_num = target_inode->size / sizeof(a1fs_dentry);
+	//how many blocks the dentry table occupied
+    uint64_t dblock_count = target_inode->size / A1FS_BLOCK_SIZE + (target_inode->size % A1FS_BLOCK_SIZE > 0 ? 1 : 0);
+    int dentries_inlastblk = (int)dentry_num % (A1FS_BLOCK_SIZE / sizeof(a1fs_dentry));
+	//loop over all extents
+    for (int extent_count = 0; extent_count < 512 - (int)(target_inode->free_extent_num); extent_count++){
+        a1fs_blk_t start_blk_no = extent_blk[extent_count].start;
+        char *start_blk_ptr = (char *)image + (size_t)A1FS_BLOCK_SIZE * start_blk_no;
+        int blk_in_extent = (int)extent_blk[extent_count].count;
+        //loop over all blocks in this extent
+        for (int curr = 0; curr < blk_in_extent; curr++){
+			dblock_count--;
+            a1fs_dentry *start_dentry = (a1fs_dentry *)(start_blk_ptr + (size_t)curr * A1FS_BLOCK_SIZE);
+            int dentry_count = (int)(A1FS_BLOCK_SIZE/sizeof(a1fs_dentry));
+            //check whether we are at the last block and the block is not full of dentries
+            if (dblock_count == 0 && dentries_inlastblk != 0){
+                dentry_count = dentries_inlastblk;
+            }
+            //loop over all dentries in this block
+            for (int count = 0; count < dentry_count; count ++){
+                a1fs_dentry *curr_dentry = (a1fs_dentry *)(&start_dentry[count]);
+				//check if the dentry is . or ..
+				// if (strcmp(curr_dentry->name, ".") == 0 || strcmp(curr_dentry->name, "..") == 0){
+				// 	continue;
+				// }
+				int err_no = filler(buf, curr_dentry->name);
+                if (err_no != 0) {
+					ret = err_no;
+					goto end;
+				}
+            }
+        }
+    }
+
+end:
+	pthread_rwlock_unlock(ino_lock(fs, inode_num_found));
+	op_end(fs);
+	return ret;
+}
+
+int a1fs_readdir(fs_ctx *fs, const char *path, void *buf, a1fs_filler_t filler)
+{
+	uint64_t start = stats_begin();
+	int ret = do_readdir(fs, path, buf, filler);
+	stats_end(fs, STATS_READDIR, start, ret);
+	TRACE_OP(STATS_READDIR, start, 0, 0, ret);
+	RECORD(fs, STATS_READDIR, start, path, NULL, 0, 0, ret);
+	return ret;
+}
+
+
+/**
+ * Check that an entry can be added to a directory. The caller must be in an
+ * operation; whether the directory still exists is checked under its lock.
+ *
+ * @param fs          file system context.
+ * @param parent_ino  result of looking up the directory.
+ * @param name        name of the new entry.
+ * @return            0 if the entry can be added; -errno otherwise.
+ */
+static int check_new_entry(fs_ctx *fs, long parent_ino, const char *name)
+{
+	if (parent_ino < 0) return (int)parent_ino;
+	if (fs->inodes[parent_ino].type != 0) return -ENOTDIR;
+	//the root directory itself
+	if (strcmp(name, "/") == 0) return -EEXIST;
+	if (strlen(name) >= A1FS_NAME_MAX) return -ENAMETOOLONG;
+	return 0;
+}
+
+static int do_mkdir(fs_ctx *fs, const char *path, mode_t mode)
+{
+	assert(fs != NULL);
+	assert(fs->image != NULL);
+	
+	//get the image 
+	void* image = (void*)(fs->image);
+	a1fs_superblock *superblock = (a1fs_superblock *)image; 
+
+	a1fs_inode *root = (a1fs_inode *)(image + (superblock->inode_table_start) * A1FS_BLOCK_SIZE);
+	//the name of the directory we need to create
+	char path_cpy[strlen(path)+1];
+	strncpy(path_cpy,path,strlen(path)+1);
+	// if(path_cpy == NULL) {return -ENOMEM;}
+	char *filename = basename((char*)path);
+	char *parent_dir = dirname((char*)path_cpy);
+
+	//find the inode number of the parent directory according to the given path
+	op_begin(fs);
+	long parent_ino = lookup(fs, parent_dir);
+	int err = check_new_entry(fs, parent_ino, filename);
+	if (err != 0) {
+		op_end(fs);
+		return err;
+	}
+
+	//the parent directory is locked while its dentry table is changed
+	inode_write_lock(fs, parent_ino);
+	int ret = 0;
+	//the directory may have been removed since it was looked up
+	if (root[parent_ino].links == 0) {
+		ret = -ENOENT;
+		goto end;
+	}
+	if (find_dentry(&root[parent_ino], filename, fs) != NULL) {
+		ret = -EEXIST;
+		goto end;
+	}
+	//create the new directory at given path with given mode
+	a1fs_ino_t new_ino = create_inode(mode, parent_ino, fs, 0);
+	if (new_ino == (a1fs_ino_t)-1) {
+		ret = -ENOSPC;
+		goto end;
+	}
+	write_dentry(filename, new_ino, parent_ino, fs);
+	//update parent links
+	root[parent_ino].links += 1;
+
+end:
+	inode_write_unlock(fs, parent_ino);
+	op_end(fs);
+	return ret;
+}
+
+int a1fs_mkdir(fs_ctx *fs, const char *path, mode_t mode)
+{
+	uint64_t start = stats_begin();
+	int ret = do_mkdir(fs, path, mode);
+	if (retry_nospc(fs, ret)) ret = do_mkdir(fs, path, mode);
+	stats_end(fs, STATS_MKDIR, start, ret);
+	TRACE_OP(STATS_MKDIR, start, 0, 0, ret);
+	RECORD(fs, STATS_MKDIR, start, path, NULL, 0, mode, ret);
+	return ret;
+}
+
+/**
+ * Check, with the directory locked, that an entry found by a lookup is still
+ * there and still refers to the same inode.
+ *
+ * @param fs          file system context.
+ * @param parent_ino  inode number of the directory.
+ * @param name        name of the entry.
+ * @param ino         inode number the lookup found; 0 if it found no entry.
+ * @return            0 if the entry is unchanged; 1 if it changed and the
+ *                    lookup must be retried; -ENOENT if the directory was
+ *                    removed.
+ */
+static int check_entry(fs_ctx *fs, a1fs_ino_t parent_ino, const char *name, a1fs_ino_t ino)
+{
+	if (fs->inodes[parent_ino].links == 0) return -ENOENT;
+	a1fs_dentry *dentry = find_dentry(&fs->inodes[parent_ino], name, fs);
+	a1fs_ino_t found = (dentry != NULL) ? dentry->ino : 0;
+	return (found == ino) ? 0 : 1;
+}
+
+/**
+ * Look up an entry to be removed and lock it together with its directory. The
+ * caller must be in an operation.
+ *
+ * @param fs          file system context.
+ * @param path        path of the entry.
+ * @param parent_dir  path of its directory.
+ * @param name        name of the entry.
+ * @param inos        set to the inode numbers of the directory and the entry,
+ *                    locked with inodes_write_lock() on success.
+ * @return            0 on success; -errno otherwise.
+ */
+static int lock_entry(fs_ctx *fs, const char *path, const char *parent_dir, const char *name,
+                      a1fs_ino_t inos[2])
+{
+	while (true) {
+		long ino = lookup(fs, path);
+		if (ino < 0) return (int)ino;
+		if (ino == 0) return -EBUSY;
+		long parent_ino = lookup(fs, parent_dir);
+		if (parent_ino < 0) return (int)parent_ino;
+
+		//the entry may have been removed or replaced since it was looked up
+		inos[0] = (a1fs_ino_t)parent_ino;
+		inos[1] = (a1fs_ino_t)ino;
+		inodes_write_lock(fs, inos, 2);
+		int ret = check_entry(fs, inos[0], name, inos[1]);
+		if (ret == 0) return 0;
+		inodes_write_unlock(fs, inos, 2);
+		if (ret < 0) return ret;
+	}
+}
+
+/** Body of a1fs_rmdir(), called in an operation. */
+static int do_rmdir(fs_ctx *fs, const char *path)
+{
+	//the name of the directory we need to remove
+	char *name_cpy = strdup(path);
+	char *parent_cpy = strdup(path);
+	if (name_cpy == NULL || parent_cpy == NULL) {
+		free(name_cpy);
+		free(parent_cpy);
+		return -ENOMEM;
+	}
+	char *filename = basename(name_cpy);
+	char *parent_dir = dirname(parent_cpy);
+
+	//lock the parent directory and the directory itself
+	a1fs_ino_t inos[2];
+	int ret = lock_entry(fs, path, parent_dir, filename, inos);
+	free(parent_cpy);
+	if (ret != 0) {
+		free(name_cpy);
+		return ret;
+	}
+	a1fs_inode *parent_inode = &fs->inodes[inos[0]];
+	a1fs_inode *target_inode = &fs->inodes[inos[1]];
+
+	if (target_inode->type != 0) {
+		ret = -ENOTDIR;
+	//check if the directory is not empty
+	} else if (target_inode->size > 2 * sizeof(a1fs_dentry)) {
+		ret = -ENOTEMPTY;
+	} else {
+		ns_write_lock(fs);
+		//promote the last dentry in parent inode to offset the target_dentry
+		promote_last_dentry(parent_inode, find_dentry(parent_inode, filename, fs), fs);
+		//update parent links
+		parent_inode->links -= 1;
+		//no entries can be added to the directory any more; it is freed
+		// once the operations that may have looked it up have ended
+		target_inode->links = 0;
+		orphan_add(fs, inos[1]);
+		ns_write_unlock(fs);
+	}
+
+	inodes_write_unlock(fs, inos, 2);
+	free(name_cpy);
+	return ret;
+}
+
+int a1fs_rmdir(fs_ctx *fs, const char *path)
+{
+	uint64_t start = stats_begin();
+	op_begin(fs);
+	int ret = do_rmdir(fs, path);
+	op_end(fs);
+	stats_end(fs, STATS_RMDIR, start, ret);
+	TRACE_OP(STATS_RMDIR, start, 0, 0, ret);
+	RECORD(fs, STATS_RMDIR, start, path, NULL, 0, 0, ret);
+	return ret;
+}
+
+static int do_create(fs_ctx *fs, const char *path, mode_t mode)
+{
+	//get the image 
+	void* image = (void*)(fs->image);
+	a1fs_superblock *superblock = (a1fs_superblock *)image; 
+
+	a1fs_inode *root = (a1fs_inode *)(image + (superblock->inode_table_start) * A1FS_BLOCK_SIZE);
+
+	//the name of the file we need to create
+	char *path_cpy = strdup(path);
+	if(path_cpy == NULL) {return -ENOMEM;}
+	char *filename = basename((char*)path);
+	char *parent_dir = dirname(path_cpy);
+
+	//find the inode number of the parent directory according to the given path
+	op_begin(fs);
+	long parent_ino = lookup(fs, parent_dir);
+	int err = check_new_entry(fs, parent_ino, filename);
+	free(path_cpy);
+	if (err != 0) {
+		op_end(fs);
+		return err;
+	}
+
+	//the parent directory is locked while its dentry table is changed
+	inode_write_lock(fs, parent_ino);
+	int ret = 0;
+	//the directory may have been removed since it was looked up
+	if (root[parent_ino].links == 0) {
+		ret = -ENOENT;
+		goto end;
+	}
+	if (find_dentry(&root[parent_ino], filename, fs) != NULL) {
+		ret = -EEXIST;
+		goto end;
+	}
+	//create the new file at given path with given mode
+	a1fs_ino_t new_ino = create_inode(mode, parent_ino, fs, 1);
+	if (new_ino == (a1fs_ino_t)-1) {
+		ret = -ENOSPC;
+		goto end;
+	}
+	write_dentry(filename, new_ino, parent_ino, fs);
+
+end:
+	inode_write_unlock(fs, parent_ino);
+	op_end(fs);
+	return ret;
+}
+
+int a1fs_create(fs_ctx *fs, const char *path, mode_t mode)
+{
+	uint64_t start = stats_begin();
+	int ret = do_create(fs, path, mode);
+	if (retry_nospc(fs, ret)) ret = do_create(fs, path, mode);
+	stats_end(fs, STATS_CREATE, start, ret);
+	TRACE_OP(STATS_CREATE, start, 0, 0, ret);
+	RECORD(fs, STATS_CREATE, start, path, NULL, 0, mode, ret);
+	return ret;
+}
+
+/** Body of a1fs_unlink(), called in an operation. */
+static int do_unlink(fs_ctx *fs, const char *path)
+{
+	//the name of the file we need to remove
+	char *name_cpy = strdup(path);
+	char *parent_cpy = strdup(path);
+	if (name_cpy == NULL || parent_cpy == NULL) {
+		free(name_cpy);
+		free(parent_cpy);
+		return -ENOMEM;
+	}
+	char *filename = basename(name_cpy);
+	char *parent_dir = dirname(parent_cpy);
+
+	//lock the parent directory and the file
+	a1fs_ino_t inos[2];
+	int ret = lock_entry(fs, path, parent_dir, filename, inos);
+	free(parent_cpy);
+	if (ret != 0) {
+		free(name_cpy);
+		return (ret == -EBUSY) ? -EISDIR : ret;
+	}
+	a1fs_inode *parent_inode = &fs->inodes[inos[0]];
+
+	if (fs->inodes[inos[1]].type == 0) {
+		ret = -EISDIR;
+	} else {
+		ns_write_lock(fs);
+		//promote the last dentry in parent inode to offset the target_dentry
+		promote_last_dentry(parent_inode, find_dentry(parent_inode, filename, fs), fs);
+		//free the inode, its extent block and all its data blocks (blocks
+		// shared with a reflink clone only lose a reference) in the
+		// background, once no operation can be using it
+		orphan_add(fs, inos[1]);
+		ns_write_unlock(fs);
+	}
+
+	inodes_write_unlock(fs, inos, 2);
+	free(name_cpy);
+	return ret;
+}
+
+int a1fs_unlink(fs_ctx *fs, const char *path)
+{
+	uint64_t start = stats_begin();
+	op_begin(fs);
+	int ret = do_unlink(fs, path);
+	op_end(fs);
+	stats_end(fs, STATS_UNLINK, start, ret);
+	TRACE_OP(STATS_UNLINK, start, 0, 0, ret);
+	RECORD(fs, STATS_UNLINK, start, path, NULL, 0, 0, ret);
+	return ret;
+}
+
+/**
+ * Look up the inodes a rename works on and check that it can be done. The
+ * caller must be in an operation; the entries are checked again under the
+ * inode locks.
+ *
+ * @param fs    file system context.
+ * @param from  original path.
+ * @param to    new path.
+ * @param inos  set to the inode numbers of the source's directory, the
+ *              source, the destination's directory and the destination (0 if
+ *              there is none).
+ * @return      0 if the rename can be done; 1 if there is nothing to do;
+ *              -errno otherwise.
+ */
+static int check_rename(fs_ctx *fs, const char *from, const char *to, a1fs_ino_t inos[4])
+{
+	long src_ino = lookup(fs, from);
+	if (src_ino < 0) return (int)src_ino;
+	if (src_ino == 0 || strcmp(to, "/") == 0) return -EBUSY;
+	if (strcmp(from, to) == 0) return 1;
+	//a directory can't be moved into itself
+	size_t len = strlen(from);
+	if (strncmp(to, from, len) == 0 && to[len] == '/') return -EINVAL;
+
+	char *to_cpy = strdup(to);
+	if (to_cpy == NULL) return -ENOMEM;
+	char *name = basename(to_cpy);
+	if (strlen(name) >= A1FS_NAME_MAX) {
+		free(to_cpy);
+		return -ENAMETOOLONG;
+	}
+	char *parent_cpy = strdup(to);
+	if (parent_cpy == NULL) {
+		free(to_cpy);
+		return -ENOMEM;
+	}
+	long parent_ino = lookup(fs, dirname(parent_cpy));
+	free(parent_cpy);
+	free(to_cpy);
+	if (parent_ino < 0) return (int)parent_ino;
+	if (fs->inodes[parent_ino].type != 0) return -ENOTDIR;
+
+	char *from_cpy = strdup(from);
+	if (from_cpy == NULL) return -ENOMEM;
+	long src_parent_ino = lookup(fs, dirname(from_cpy));
+	free(from_cpy);
+	if (src_parent_ino < 0) return (int)src_parent_ino;
+
+	long dst_ino = lookup(fs, to);
+	if (dst_ino == -ENOENT) {
+		dst_ino = 0;
+	} else if (dst_ino < 0) {
+		return (int)dst_ino;
+	} else if (fs->inodes[src_ino].type == 0 && fs->inodes[dst_ino].type != 0) {
+		return -ENOTDIR;
+	} else if (fs->inodes[src_ino].type != 0 && fs->inodes[dst_ino].type == 0) {
+		return -EISDIR;
+	}
+	inos[0] = (a1fs_ino_t)src_parent_ino;
+	inos[1] = (a1fs_ino_t)src_ino;
+	inos[2] = (a1fs_ino_t)parent_ino;
+	inos[3] = (a1fs_ino_t)dst_ino;
+	return 0;
+}
+
+/**
+ * Check whether a directory is an inode or one of its ancestors. The caller
+ * holds the rename lock, so that no directory changes its parent meanwhile.
+ */
+static bool is_ancestor(fs_ctx *fs, a1fs_ino_t dir, a1fs_ino_t ino)
+{
+	for (uint32_t depth = 0; depth < fs->sb->inodes_count; depth++) {
+		if (ino == dir) return true;
+		if (ino == 0) return false;
+		ino = fs->inodes[ino].parent_ino;
+	}
+	return false;
+}
+
+/**
+ * Move a directory entry, replacing the destination if there is one. The
+ * caller holds the locks of the inodes in inos (see check_rename()) and has
+ * checked that the entries are unchanged.
+ */
+static int move_entry(fs_ctx *fs, const a1fs_ino_t inos[4], const char *src_name, const char *dest_name)
+{
+	a1fs_inode *src_parent_inode = &fs->inodes[inos[0]];
+	a1fs_inode *src_inode = &fs->inodes[inos[1]];
+	a1fs_inode *dest_parent_inode = &fs->inodes[inos[2]];
+	a1fs_inode *dest_inode = (inos[3] != 0) ? &fs->inodes[inos[3]] : NULL;
+
+	// check if the destination is not empty directory
+	if (dest_inode != NULL && dest_inode->type == 0 && dest_inode->size > 2 * sizeof(a1fs_dentry)) {
+		return -ENOTEMPTY;
+	}
+
+	ns_write_lock(fs);
+	if (dest_inode == NULL) {
+		// write the source inode to the destination directory with the new name
+		write_dentry(dest_name, inos[1], inos[2], fs);
+	} else {
+		// replace the inode in the destination dentry with the source
+		a1fs_dentry *dest_dentry = find_dentry(dest_parent_inode, dest_name, fs);
+		dest_dentry->ino = inos[1];
+		journal_dirty(fs, dest_dentry, sizeof(a1fs_dentry));
+	}
+	//find the src_inode in its parent and delete the entry
+	promote_last_dentry(src_parent_inode, find_dentry(src_parent_inode, src_name, fs), fs);
+
+	if (inos[0] != inos[2]) {
+		//ancestors' mtimes are updated through parent_ino without locks
+		__atomic_store_n(&src_inode->parent_ino, inos[2], __ATOMIC_RELAXED);
+		if (src_inode->type == 0) {
+			//update the .. dentry of the src_inode and the links of both parents
+			a1fs_dentry *parent_dentry = find_dentry(src_inode, "..", fs);
+			parent_dentry->ino = inos[2];
+			journal_dirty(fs, parent_dentry, sizeof(a1fs_dentry));
+			src_parent_inode->links -= 1;
+			dest_parent_inode->links += 1;
+		}
+	}
+
+	//the replaced inode is freed in the background once no operation can be
+	// using it; a replaced directory takes no new entries meanwhile
+	if (dest_inode != NULL) {
+		if (dest_inode->type == 0) {
+			dest_parent_inode->links -= 1;
+			dest_inode->links = 0;
+		}
+		orphan_add(fs, inos[3]);
+	}
+	ns_write_unlock(fs);
+	return 0;
+}
+
+/** Body of a1fs_rename(), called in an operation. */
+static int do_rename(fs_ctx *fs, const char *from, const char *to)
+{
+	//check if there's enough memory
+	if (free_inodes(fs) == 0 && free_blocks(fs) == 0) {return -ENOSPC;}
+
+	char *src_base = strdup(from);
+	char *dest_base = strdup(to);
+	if (src_base == NULL || dest_base == NULL) {
+		free(src_base);
+		free(dest_base);
+		return -ENOMEM;
+	}
+	char *src_target = basename(src_base);
+	char *dest_target = basename(dest_base);
+
+	bool moving = false;
+	int ret;
+	while (true) {
+		a1fs_ino_t inos[4];
+		ret = check_rename(fs, from, to, inos);
+		if (ret != 0) break;
+		//moving a directory to another parent changes the tree, which one
+		// rename at a time does; look up again once no other can
+		if (fs->inodes[inos[1]].type == 0 && inos[0] != inos[2]) {
+			if (!moving) {
+				pthread_mutex_lock(&fs->rename_lock);
+				moving = true;
+				continue;
+			}
+			//a directory can't be moved into itself
+			if (is_ancestor(fs, inos[1], inos[2])) {
+				ret = -EINVAL;
+				break;
+			}
+		}
+
+		//the entries may have been removed or replaced since they were looked up
+		int n = (inos[3] != 0) ? 4 : 3;
+		inodes_write_lock(fs, inos, n);
+		ret = check_entry(fs, inos[0], src_target, inos[1]);
+		if (ret == 0) ret = check_entry(fs, inos[2], dest_target, inos[3]);
+		if (ret == 0) ret = move_entry(fs, inos, src_target, dest_target);
+		inodes_write_unlock(fs, inos, n);
+		if (ret != 1) break;
+	}
+	if (moving) pthread_mutex_unlock(&fs->rename_lock);
+
+	free(src_base);
+	free(dest_base);
+	return (ret > 0) ? 0 : ret;
+}
+
+int a1fs_rename(fs_ctx *fs, const char *from, const char *to)
+{
+	uint64_t start = stats_begin();
+	op_begin(fs);
+	int ret = do_rename(fs, from, to);
+	op_end(fs);
+	stats_end(fs, STATS_RENAME, start, ret);
+	TRACE_OP(STATS_RENAME, start, 0, 0, ret);
+	RECORD(fs, STATS_RENAME, start, from, to, 0, 0, ret);
+	return ret;
+}
+
+
+static int do_utimens(fs_ctx *fs, const char *path, const struct timespec tv[2])
+{
+	assert(fs != NULL);
+	assert(fs->image != NULL);
+	a1fs_inode *root = fs->inodes;
+
+	//TODO: update the modification timestamp (mtime) in the inode for given
+	// path with either the time passed as argument or the current time,
+	// according to the utimensat man page
+	//find the inode number according to the given path
+	op_begin(fs);
+	long inode_number = lookup(fs, path);
+	if (inode_number < 0) {
+		op_end(fs);
+		return (int)inode_number;
+	}
+	a1fs_inode * inode_ptr = &root[inode_number];
+
+	inode_write_lock(fs, inode_number);
+	lazy_take((a1fs_ino_t)inode_number, fs);
+	set_mtime(inode_ptr, &tv[1]);
+	inode_write_unlock(fs, inode_number);
+	op_end(fs);
+
+	return 0;
+}
+
+int a1fs_utimens(fs_ctx *fs, const char *path, const struct timespec tv[2])
+{
+	uint64_t start = stats_begin();
+	int ret = do_utimens(fs, path, tv);
+	stats_end(fs, STATS_UTIMENS, start, ret);
+	TRACE_OP(STATS_UTIMENS, start, 0, 0, ret);
+	RECORD(fs, STATS_UTIMENS, start, path, NULL, tv[1].tv_sec, tv[1].tv_nsec, ret);
+	return ret;
+}
+
+
+static int do_truncate(fs_ctx *fs, const char *path, off_t size)
+{
+	assert(fs != NULL);
+	assert(fs->image != NULL);
+	a1fs_inode *root = fs->inodes;
+
+	op_begin(fs);
+	long inode_num = lookup(fs, path);
+	if (inode_num < 0) {
+		op_end(fs);
+		return (int)inode_num;
+	}
+	a1fs_inode *inode = &root[inode_num];
+
+	//if it is not a file
+	int ret = -EISDIR;
+	inode_write_lock(fs, inode_num);
+	if (inode->type != 0) {
+		//set new file size, "zeroing out" the uninitialized range
+		ret = resize_data((uint64_t)size, inode, fs);
+	}
+	inode_write_unlock(fs, inode_num);
+	op_end(fs);
+	return ret;
+}
+
+int a1fs_truncate(fs_ctx *fs, const char *path, off_t size)
+{
+	uint64_t start = stats_begin();
+	int ret = do_truncate(fs, path, size);
+	if (retry_nospc(fs, ret)) ret = do_truncate(fs, path, size);
+	stats_end(fs, STATS_TRUNCATE, start, ret);
+	TRACE_OP(STATS_TRUNCATE, start, 0, size, ret);
+	RECORD(fs, STATS_TRUNCATE, start, path, NULL, 0, size, ret);
+	return ret;
+}
+
+
+static int do_read(fs_ctx *fs, const char *path, char *buf, size_t size, off_t offset)
+{
+	a1fs_inode *root = fs->inodes;
+
+	//optimistic lock-free attempts first; compressed files are always read
+	// under the lock since their chunk index can't be validated cheaply
+	a1fs_inode copy;
+	a1fs_extent extents[512];
+	for (int attempt = 0; attempt < SEQ_READ_ATTEMPTS; attempt++) {
+		uint32_t ns, seq;
+		long ino = lookup_snapshot(fs, path, &copy, extents, &ns, &seq);
+		bool usable = ino >= 0 && !(seq & 1) && copy.type != 0;
+		if (usable && (copy.flags & A1FS_INODE_COMPRESSED)) break;
+
+		long read_len = 0;
+		if (usable && (uint64_t)offset < copy.size) {
+			read_len = (long)size;
+			if ((uint64_t)read_len > copy.size - offset) {
+				read_len = (long)(copy.size - offset);
+			}
+			extents_read(extents, 512 - (int)copy.free_extent_num,
+			             (uint64_t)offset, buf, read_len, fs);
+		}
+		if (snapshot_retry(fs, ino, ns, seq)) continue;
+		if (ino < 0) return (int)ino;
+		if (copy.type == 0) return -EISDIR;
+
+		memset(&buf[read_len], 0, size - read_len);
+		return (int)read_len;
+	}
+
+	//find the inode number of the target file according to the given path
+	op_begin(fs);
+	long target_ino = lookup(fs, path);
+	if (target_ino < 0) {
+		op_end(fs);
+		return (int)target_ino;
+	}
+	a1fs_inode *inode = &root[target_ino];
+
+	//compressed files are decompressed on the fly
+	pthread_rwlock_rdlock(ino_lock(fs, target_ino));
+	long read_len = (inode->type == 0) ? -EISDIR : read_data(inode, buf, size, (uint64_t)offset, fs);
+	pthread_rwlock_unlock(ino_lock(fs, target_ino));
+	op_end(fs);
+	if (read_len < 0) return (int)read_len;
+
+	//add 0's to the end of the buffer past EOF
+	memset(&buf[read_len], 0, size - read_len);
+	return (int)read_len;
+}
+
+int a1fs_read(fs_ctx *fs, const char *path, char *buf, size_t size, off_t offset)
+{
+	uint64_t start = stats_begin();
+	int ret = do_read(fs, path, buf, size, offset);
+	stats_end(fs, STATS_READ, start, ret);
+	TRACE_OP(STATS_READ, start, offset, size, ret);
+	RECORD(fs, STATS_READ, start, path, NULL, offset, size, ret);
+	if (ret > 0) stats_count(fs, STATS_BYTES_READ, ret);
+	return ret;
+}
+
+static int do_write(fs_ctx *fs, const char *path, const char *buf, size_t size, off_t offset)
+{
+	a1fs_inode *root = fs->inodes;
+
+	//find the inode number of the target file according to the given path
+	op_begin(fs);
+	long target_ino = lookup(fs, path);
+	if (target_ino < 0) {
+		op_end(fs);
+		return (int)target_ino;
+	}
+	a1fs_inode *inode = &root[target_ino];
+
+	//write data from the buffer into the file at given offset, "zeroing out"
+	// the uninitialized range and copying blocks shared with reflink clones
+	inode_write_lock(fs, target_ino);
+	long ret = (inode->type == 0) ? -EISDIR : write_data(inode, buf, size, (uint64_t)offset, fs);
+	inode_write_unlock(fs, target_ino);
+	op_end(fs);
+	return (int)ret;
+}
+
+int a1fs_write(fs_ctx *fs, const char *path, const char *buf, size_t size, off_t offset)
+{
+	uint64_t start = stats_begin();
+	int ret = do_write(fs, path, buf, size, offset);
+	if (retry_nospc(fs, ret)) ret = do_write(fs, path, buf, size, offset);
+	stats_end(fs, STATS_WRITE, start, ret);
+	TRACE_OP(STATS_WRITE, start, offset, size, ret);
+	RECORD(fs, STATS_WRITE, start, path, NULL, offset, size, ret);
+	if (ret > 0) stats_count(fs, STATS_BYTES_WRITTEN, ret);
+	return ret;
+}
+
+static int do_flush(fs_ctx *fs, const char *path)
+{
+	a1fs_inode *root = fs->inodes;
+
+	op_begin(fs);
+	long target_ino = lookup(fs, path);
+	if (target_ino < 0) {
+		op_end(fs);
+		return 0;
+	}
+
+	a1fs_inode *inode = &root[target_ino];
+	int ret = 0;
+	inode_write_lock(fs, target_ino);
+	if (inode->flags & A1FS_INODE_COMPRESS) {
+		ret = compress_file(inode, fs);
+	}
+	inode_write_unlock(fs, target_ino);
+	op_end(fs);
+	return ret;
+}
+
+int a1fs_flush(fs_ctx *fs, const char *path)
+{
+	uint64_t start = stats_begin();
+	int ret = do_flush(fs, path);
+	stats_end(fs, STATS_FLUSH, start, ret);
+	TRACE_OP(STATS_FLUSH, start, 0, 0, ret);
+	RECORD(fs, STATS_FLUSH, start, path, NULL, 0, 0, ret);
+	return ret;
+}
+
+static int do_fsync(fs_ctx *fs, const char *path)
+{
+	for (int pass = 0; ; pass++) {
+		op_begin(fs);
+		long ino = lookup(fs, path);
+		if (ino < 0) {
+			op_end(fs);
+			return (int)ino;
+		}
+		// Only the file's own pending time and its directory's are made durable
+		flush_mtime((a1fs_ino_t)ino, fs);
+		flush_mtime(fs->inodes[ino].parent_ino, fs);
+		pthread_rwlock_rdlock(ino_lock(fs, ino));
+		int ret = writeback_inode(fs, ino);
+		pthread_rwlock_unlock(ino_lock(fs, ino));
+		op_end(fs);
+
+		// The commit includes the changes of all requests completed so far
+		int err = journal_commit(fs);
+		if (ret == -EAGAIN && pass == 0) {
+			// Blocks the file reused from recently freed ones can be written
+			// once the frees are checkpointed
+			err = journal_checkpoint(fs);
+			if (err != 0) return err;
+			continue;
+		}
+		if (ret == -EAGAIN) ret = 0;
+		return (ret != 0) ? ret : err;
+	}
+}
+
+int a1fs_fsync(fs_ctx *fs, const char *path)
+{
+	uint64_t start = stats_begin();
+	int ret = do_fsync(fs, path);
+	stats_end(fs, STATS_FSYNC, start, ret);
+	TRACE_OP(STATS_FSYNC, start, 0, 0, ret);
+	RECORD(fs, STATS_FSYNC, start, path, NULL, 0, 0, ret);
+	return ret;
+}
+
+
+static int do_ioctl(fs_ctx *fs, const char *path, unsigned int cmd, void *data)
+{
+	a1fs_inode *root = fs->inodes;
+	int ret;
+
+	op_begin(fs);
+	if (cmd == A1FS_IOC_GETFLAGS || cmd == A1FS_IOC_SETFLAGS) {
+		long ino = lookup(fs, path);
+		if (ino < 0) {
+			ret = (int)ino;
+			goto end;
+		}
+		a1fs_inode *inode = &root[ino];
+
+		uint32_t *iflags = (uint32_t *)data;
+		if (cmd == A1FS_IOC_GETFLAGS) {
+			pthread_rwlock_rdlock(ino_lock(fs, ino));
+			*iflags = inode->flags;
+			pthread_rwlock_unlock(ino_lock(fs, ino));
+			ret = 0;
+			goto end;
+		}
+		if (*iflags & ~A1FS_INODE_COMPRESS) {
+			ret = -EINVAL;
+			goto end;
+		}
+		inode_write_lock(fs, ino);
+		if (*iflags & A1FS_INODE_COMPRESS) {
+			inode->flags |= A1FS_INODE_COMPRESS;
+			ret = compress_file(inode, fs);
+		} else {
+			inode->flags &= ~A1FS_INODE_COMPRESS;
+			ret = decompress_file(inode, fs);
+		}
+		inode_write_unlock(fs, ino);
+		goto end;
+	}
+	if (cmd != A1FS_IOC_CLONE) {
+		ret = -ENOTTY;
+		goto end;
+	}
+
+	a1fs_clone_args *args = (a1fs_clone_args *)data;
+	args->src[A1FS_PATH_MAX - 1] = '\0';
+	if (args->src[0] != '/') {
+		ret = -EINVAL;
+		goto end;
+	}
+
+	long src_ino = lookup(fs, args->src);
+	if (src_ino < 0) {
+		ret = (int)src_ino;
+		goto end;
+	}
+	long dst_ino = lookup(fs, path);
+	if (dst_ino < 0) {
+		ret = -ENOENT;
+		goto end;
+	}
+	if (src_ino == dst_ino) {
+		ret = -EINVAL;
+		goto end;
+	}
+
+	//lock both files in the order of their locks, which they may share
+	pthread_rwlock_t *src_lock = ino_lock(fs, src_ino);
+	pthread_rwlock_t *dst_lock = ino_lock(fs, dst_ino);
+	if (src_lock < dst_lock) pthread_rwlock_rdlock(src_lock);
+	inode_write_lock(fs, dst_ino);
+	if (src_lock > dst_lock) pthread_rwlock_rdlock(src_lock);
+	ret = clone_data(&root[src_ino], &root[dst_ino], fs);
+	if (src_lock != dst_lock) pthread_rwlock_unlock(src_lock);
+	inode_write_unlock(fs, dst_ino);
+
+end:
+	op_end(fs);
+	return ret;
+}
+
+int a1fs_ioctl(fs_ctx *fs, const char *path, unsigned int cmd, void *data)
+{
+	uint64_t start = stats_begin();
+	int ret = do_ioctl(fs, path, cmd, data);
+	stats_end(fs, STATS_IOCTL, start, ret);
+	TRACE_OP(STATS_IOCTL, start, 0, 0, ret);
+	if (fs->record != NULL) {
+		uint32_t flags = (cmd == A1FS_IOC_SETFLAGS) ? *(uint32_t *)data : 0;
+		const char *src = (cmd == A1FS_IOC_CLONE) ? ((a1fs_clone_args *)data)->src : NULL;
+		record_add(fs->record, STATS_IOCTL, start, path, src, cmd, flags, ret);
+	}
+	return ret;
+}
+
+
+char *a1fs_stats(fs_ctx *fs)
+{
+	return stats_format(fs);
+}
+
+char *a1fs_trace(void)
+{
+	return trace_export();
+}
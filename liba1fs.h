@@ -0,0 +1,334 @@
+/**
+ * liba1fs - a1fs file system operations, usable in-process.
+ *
+ * Every operation of the FUSE driver is available as a function on an open
+ * image, so that tools and batch jobs can read and change an image at memory
+ * speed, without a mount and the kernel crossings of every request. The
+ * image can be a file, a file descriptor (e.g. a memfd) or memory the caller
+ * has mapped (e.g. anonymous memory holding a copy of an image).
+ *
+ * All paths are absolute paths within the file system, starting with '/', with
+ * no trailing '/' except for the root directory itself. All operations return
+ * 0 (or a byte count) on success and -errno on error, like the FUSE callbacks,
+ * and can be called from multiple threads at once.
+ *
+ * The library doesn't format images, see mkfs.a1fs.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "options.h"
+
+
+/** Open a1fs image (file system context, see fs_ctx.h). */
+typedef struct fs_ctx fs_ctx;
+
+/**
+ * Called by a1fs_readdir() for each directory entry.
+ *
+ * @param buf   buffer passed to a1fs_readdir().
+ * @param name  entry name, including "." and "..".
+ * @return      0 to continue; non-zero to stop reading the directory.
+ */
+typedef int (*a1fs_filler_t)(void *buf, const char *name);
+
+
+/**
+ * Open an image file. Changes are made durable by a1fs_fsync() and
+ * a1fs_close(). An image with a journal is mapped privately, so that nothing
+ * reaches the file but file data and committed metadata (see journal.h);
+ * otherwise changes are written to the file through a shared mapping.
+ *
+ * @param img_path  image file path.
+ * @param opts      driver options (see options.h), kept until a1fs_close();
+ *                  NULL for the defaults (no lookup cache file, no lazytime).
+ * @return          image handle on success; NULL on failure.
+ */
+fs_ctx *a1fs_open(const char *img_path, a1fs_opts *opts);
+
+/**
+ * Open an image from a file descriptor, e.g. a memfd. The descriptor is not
+ * closed and can be closed right away.
+ *
+ * @param fd    file descriptor open for reading and writing.
+ * @param opts  driver options, see a1fs_open().
+ * @return      image handle on success; NULL on failure.
+ */
+fs_ctx *a1fs_open_fd(int fd, a1fs_opts *opts);
+
+/**
+ * Open an image already in memory. The memory must stay mapped until
+ * a1fs_close(), which doesn't unmap it. Changes are written back with msync(),
+ * so with a shared mapping the kernel may write metadata before it is
+ * committed.
+ *
+ * @param image  page aligned start of the image, e.g. from mmap().
+ * @param size   image size in bytes.
+ * @param opts   driver options, see a1fs_open().
+ * @return       image handle on success; NULL on failure.
+ */
+fs_ctx *a1fs_open_mem(void *image, size_t size, a1fs_opts *opts);
+
+/**
+ * Start the background threads: the orphan reclaimer and, if opts came from
+ * a1fs_opt_parse() and allow it, the writeback thread. Optional; without them,
+ * unlinked files are freed and dirty blocks written back on a1fs_close().
+ *
+ * @param fs  image handle.
+ */
+void a1fs_start(fs_ctx *fs);
+
+/**
+ * Write back all pending changes and close an image.
+ *
+ * @param fs  image handle; invalid afterwards.
+ */
+void a1fs_close(fs_ctx *fs);
+
+
+/**
+ * Get file system statistics, see statvfs(2). Only f_bsize, f_frsize, f_bfree,
+ * f_bavail, f_files, f_ffree, f_favail and f_namemax are set.
+ *
+ * @param fs  image handle.
+ * @param st  receives the result.
+ * @return    0.
+ */
+int a1fs_statfs(fs_ctx *fs, struct statvfs *st);
+
+/**
+ * Get file or directory attributes, see stat(2). Only st_ino (the a1fs inode
+ * number), st_mode, st_size, st_blocks (in 512-byte units), st_nlink and
+ * st_mtime are set.
+ *
+ * Errors:
+ *   ENAMETOOLONG  the path is too long.
+ *   ENOENT        a component of the path does not exist.
+ *   ENOTDIR       a component of the path prefix is not a directory.
+ *
+ * @param fs    image handle.
+ * @param path  path to a file or directory.
+ * @param st    receives the result.
+ * @return      0 on success; -errno on error.
+ */
+int a1fs_stat(fs_ctx *fs, const char *path, struct stat *st);
+
+/**
+ * Read a directory, calling filler() for each entry.
+ *
+ * Errors:
+ *   ENOENT   a component of the path does not exist.
+ *   ENOTDIR  the path or a component of its prefix is not a directory.
+ *
+ * @param fs      image handle.
+ * @param path    path to the directory.
+ * @param buf     passed to filler().
+ * @param filler  called for each directory entry.
+ * @return        0 on success; the non-zero value returned by filler();
+ *                -errno on error.
+ */
+int a1fs_readdir(fs_ctx *fs, const char *path, void *buf, a1fs_filler_t filler);
+
+/**
+ * Create a directory, see mkdir(2).
+ *
+ * Errors:
+ *   EEXIST        "path" already exists.
+ *   ENOENT        the parent directory does not exist.
+ *   ENOTDIR       the parent is not a directory.
+ *   ENAMETOOLONG  the name of the new directory is too long.
+ *   ENOSPC        not enough free space in the file system.
+ *
+ * @param fs    image handle.
+ * @param path  path to the directory to create.
+ * @param mode  permission bits.
+ * @return      0 on success; -errno on error.
+ */
+int a1fs_mkdir(fs_ctx *fs, const char *path, mode_t mode);
+
+/**
+ * Remove an empty directory, see rmdir(2).
+ *
+ * Errors:
+ *   ENOENT     "path" does not exist.
+ *   ENOTDIR    "path" is not a directory.
+ *   ENOTEMPTY  the directory is not empty.
+ *   EBUSY      "path" is the root directory.
+ *
+ * @param fs    image handle.
+ * @param path  path to the directory to remove.
+ * @return      0 on success; -errno on error.
+ */
+int a1fs_rmdir(fs_ctx *fs, const char *path);
+
+/**
+ * Create an empty file, see creat(2).
+ *
+ * Errors:
+ *   EEXIST        "path" already exists.
+ *   ENOENT        the parent directory does not exist.
+ *   ENOTDIR       the parent is not a directory.
+ *   ENAMETOOLONG  the name of the new file is too long.
+ *   ENOSPC        not enough free space in the file system.
+ *
+ * @param fs    image handle.
+ * @param path  path to the file to create.
+ * @param mode  permission bits.
+ * @return      0 on success; -errno on error.
+ */
+int a1fs_create(fs_ctx *fs, const char *path, mode_t mode);
+
+/**
+ * Remove a file, see unlink(2).
+ *
+ * Errors:
+ *   ENOENT  "path" does not exist.
+ *   EISDIR  "path" is a directory.
+ *
+ * @param fs    image handle.
+ * @param path  path to the file to remove.
+ * @return      0 on success; -errno on error.
+ */
+int a1fs_unlink(fs_ctx *fs, const char *path);
+
+/**
+ * Rename a file or directory, see rename(2). An existing destination is
+ * replaced if it's a file or an empty directory.
+ *
+ * Errors:
+ *   ENOENT     "from" or the parent directory of "to" does not exist.
+ *   ENOTDIR    the parent of "to" is not a directory, or "from" is a directory
+ *              and "to" is not.
+ *   EISDIR     "to" is a directory and "from" is not.
+ *   ENOTEMPTY  "to" is a non-empty directory.
+ *   EINVAL     "to" is inside "from".
+ *   EBUSY      "from" or "to" is the root directory.
+ *   ENOMEM     not enough memory.
+ *   ENOSPC     not enough free space in the file system.
+ *
+ * @param fs    image handle.
+ * @param from  original path.
+ * @param to    new path.
+ * @return      0 on success; -errno on error.
+ */
+int a1fs_rename(fs_ctx *fs, const char *from, const char *to);
+
+/**
+ * Set the modification time of a file or directory to tv[1]; tv[0] (the
+ * access time) is ignored.
+ *
+ * @param fs    image handle.
+ * @param path  path to the file or directory.
+ * @param tv    access and modification times.
+ * @return      0 on success; -errno on error.
+ */
+int a1fs_utimens(fs_ctx *fs, const char *path, const struct timespec tv[2]);
+
+/**
+ * Change the size of a file, see truncate(2). An extended range reads as zeros.
+ *
+ * Errors:
+ *   EISDIR  "path" is a directory.
+ *   ENOSPC  not enough free space in the file system.
+ *
+ * @param fs    image handle.
+ * @param path  path to the file.
+ * @param size  new size in bytes.
+ * @return      0 on success; -errno on error.
+ */
+int a1fs_truncate(fs_ctx *fs, const char *path, off_t size);
+
+/**
+ * Read data from a file, see pread(2). The part of the buffer past the end of
+ * the file is filled with zeros.
+ *
+ * Errors:
+ *   EISDIR  "path" is a directory.
+ *
+ * @param fs      image handle.
+ * @param path    path to the file.
+ * @param buf     receives the data.
+ * @param size    number of bytes to read.
+ * @param offset  file offset to read from.
+ * @return        number of bytes read; 0 at or beyond the end of the file;
+ *                -errno on error.
+ */
+int a1fs_read(fs_ctx *fs, const char *path, char *buf, size_t size, off_t offset);
+
+/**
+ * Write data to a file, see pwrite(2), extending it if needed. A hole created
+ * by writing past the end of the file reads as zeros.
+ *
+ * Errors:
+ *   EISDIR  "path" is a directory.
+ *   ENOSPC  not enough free space in the file system.
+ *
+ * @param fs      image handle.
+ * @param path    path to the file.
+ * @param buf     data to write.
+ * @param size    number of bytes to write.
+ * @param offset  file offset to write at.
+ * @return        number of bytes written on success; -errno on error.
+ */
+int a1fs_write(fs_ctx *fs, const char *path, const char *buf, size_t size, off_t offset);
+
+/**
+ * Finish writing a file, like close(2): files with the compression policy
+ * (A1FS_INODE_COMPRESS) are written raw and compressed here.
+ *
+ * @param fs    image handle.
+ * @param path  path to the file.
+ * @return      0 on success or if the file no longer exists; -errno on error.
+ */
+int a1fs_flush(fs_ctx *fs, const char *path);
+
+/**
+ * Synchronize a file or directory, see fsync(2): write back its dirty blocks
+ * and commit the journal.
+ *
+ * @param fs    image handle.
+ * @param path  path to the file or directory.
+ * @return      0 on success; -errno on error.
+ */
+int a1fs_fsync(fs_ctx *fs, const char *path);
+
+/**
+ * Perform an a1fs specific operation (A1FS_IOC_*, see a1fs_ioctl.h) on a file.
+ *
+ * @param fs    image handle.
+ * @param path  path to the file.
+ * @param cmd   ioctl command.
+ * @param data  ioctl argument.
+ * @return      0 on success; -errno on error.
+ */
+int a1fs_ioctl(fs_ctx *fs, const char *path, unsigned int cmd, void *data);
+
+
+/**
+ * Format the operation statistics of an image since it was opened: calls,
+ * errors and average, p50, p99 and p999 latencies of each operation above,
+ * followed by counters of path lookups (and lookup cache hits), allocated and
+ * freed blocks and inodes, allocation pool refills, and bytes read and
+ * written. Latencies are in microseconds and accurate to within 25%.
+ *
+ * @param fs  image handle.
+ * @return    malloc()ed text the caller frees; NULL if out of memory.
+ */
+char *a1fs_stats(fs_ctx *fs);
+
+/**
+ * Export the recent events of the trace points (see trace.h) of all threads
+ * as Chrome trace event JSON, for chrome://tracing or Perfetto. The trace
+ * points are only compiled in with make TRACE=1.
+ *
+ * @return  malloc()ed text the caller frees; NULL if out of memory or if
+ *          built without tracing (errno is ENOSYS then).
+ */
+char *a1fs_trace(void);
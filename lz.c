@@ -0,0 +1,155 @@
+/**
+ * a1fs LZ codec implementation.
+ */
+
+#include <string.h>
+
+#include "lz.h"
+
+
+/** Number of entries in the match finder hash table (log2). */
+#define LZ_HASH_BITS 12
+
+/** Inputs shorter than this are stored as literals only. */
+#define LZ_MIN_INPUT 16
+
+static inline uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t hash4(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/** Write an extended length (the part past the 15 in a token nibble). */
+static uint8_t *write_length(uint8_t *op, const uint8_t *oend, size_t len)
+{
+	while (len >= 255) {
+		if (op >= oend) return NULL;
+		*op++ = 255;
+		len -= 255;
+	}
+	if (op >= oend) return NULL;
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+/** Emit one sequence; match_len is 0 for the final literals-only sequence. */
+static uint8_t *write_sequence(uint8_t *op, const uint8_t *oend,
+                               const uint8_t *lit, size_t lit_len,
+                               size_t offset, size_t match_len)
+{
+	if (op >= oend) return NULL;
+	uint8_t *token = op++;
+	size_t ml = (match_len > 0) ? match_len - LZ_MIN_MATCH : 0;
+
+	*token = (uint8_t)(((lit_len < 15) ? lit_len : 15) << 4);
+	if (lit_len >= 15 && (op = write_length(op, oend, lit_len - 15)) == NULL) return NULL;
+	if ((size_t)(oend - op) < lit_len) return NULL;
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+	if (match_len == 0) return op;
+
+	if (oend - op < 2) return NULL;
+	*op++ = (uint8_t)(offset & 0xFF);
+	*op++ = (uint8_t)(offset >> 8);
+	*token |= (uint8_t)((ml < 15) ? ml : 15);
+	if (ml >= 15 && (op = write_length(op, oend, ml - 15)) == NULL) return NULL;
+	return op;
+}
+
+size_t lz_compress(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_cap)
+{
+	uint32_t table[1 << LZ_HASH_BITS];
+	const uint8_t *ip = src;
+	const uint8_t *anchor = src;
+	const uint8_t *iend = src + src_len;
+	uint8_t *op = dst;
+	uint8_t *oend = dst + dst_cap;
+
+	if (src_len >= LZ_MIN_INPUT) {
+		// Positions are stored +1 so that 0 means "empty"
+		memset(table, 0, sizeof(table));
+		// Leave room for a full read32() at the last match candidate
+		const uint8_t *mflimit = iend - LZ_MIN_MATCH;
+
+		while (ip < mflimit) {
+			uint32_t seq = read32(ip);
+			uint32_t h = hash4(seq);
+			const uint8_t *ref = src + table[h] - 1;
+			uint32_t prev = table[h];
+			table[h] = (uint32_t)(ip - src) + 1;
+
+			if (prev == 0 || ip - ref > 0xFFFF || read32(ref) != seq) {
+				ip++;
+				continue;
+			}
+
+			// Extend the match forward
+			size_t len = LZ_MIN_MATCH;
+			while (ip + len < iend && ref[len] == ip[len]) len++;
+
+			op = write_sequence(op, oend, anchor, ip - anchor, ip - ref, len);
+			if (op == NULL) return 0;
+			ip += len;
+			anchor = ip;
+		}
+	}
+
+	op = write_sequence(op, oend, anchor, iend - anchor, 0, 0);
+	return (op == NULL) ? 0 : (size_t)(op - dst);
+}
+
+/** Read an extended length; returns 0 on truncated input. */
+static int read_length(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+	uint8_t b;
+	do {
+		if (*ip >= iend) return 0;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+	return 1;
+}
+
+long lz_decompress(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_cap)
+{
+	const uint8_t *ip = src;
+	const uint8_t *iend = src + src_len;
+	uint8_t *op = dst;
+	uint8_t *oend = dst + dst_cap;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+
+		size_t lit_len = token >> 4;
+		if (lit_len == 15 && !read_length(&ip, iend, &lit_len)) return -1;
+		if ((size_t)(iend - ip) < lit_len || (size_t)(oend - op) < lit_len) return -1;
+		memcpy(op, ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+
+		// The last sequence has no match part
+		if (ip == iend) break;
+
+		if (iend - ip < 2) return -1;
+		size_t offset = ip[0] | ((size_t)ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - dst)) return -1;
+
+		size_t match_len = token & 0x0F;
+		if (match_len == 15 && !read_length(&ip, iend, &match_len)) return -1;
+		match_len += LZ_MIN_MATCH;
+		if ((size_t)(oend - op) < match_len) return -1;
+
+		// Byte by byte: the match may overlap the bytes being written
+		const uint8_t *ref = op - offset;
+		for (size_t i = 0; i < match_len; i++) op[i] = ref[i];
+		op += match_len;
+	}
+	return (long)(op - dst);
+}
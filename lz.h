@@ -0,0 +1,49 @@
+/**
+ * a1fs LZ codec - a small, fast LZ77 compressor in the spirit of LZ4.
+ *
+ * The compressed stream is a sequence of (literals, match) pairs. Each pair
+ * starts with a token byte: the high nibble is the literal count and the low
+ * nibble is the match length minus LZ_MIN_MATCH. A nibble of 15 is followed by
+ * extra length bytes that are added to it until a byte other than 255. The
+ * literals follow the token, then a 2-byte little-endian match offset. The
+ * last pair of a stream has literals only.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/** Shortest match that is encoded as a back reference. */
+#define LZ_MIN_MATCH 4
+
+/** Maximum compressed size of n bytes of input (incompressible data). */
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+/**
+ * Compress a buffer.
+ *
+ * @param src      input data.
+ * @param src_len  input size in bytes.
+ * @param dst      output buffer.
+ * @param dst_cap  output buffer size in bytes.
+ * @return         compressed size on success; 0 if the output doesn't fit into
+ *                 dst_cap bytes.
+ */
+size_t lz_compress(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_cap);
+
+/**
+ * Decompress a buffer produced by lz_compress().
+ *
+ * All reads and writes are bounds checked, so corrupted input can't overflow
+ * either buffer.
+ *
+ * @param src      compressed data.
+ * @param src_len  compressed size in bytes.
+ * @param dst      output buffer.
+ * @param dst_cap  output buffer size in bytes.
+ * @return         decompressed size on success; -1 if the input is malformed
+ *                 or doesn't fit into dst_cap bytes.
+ */
+long lz_decompress(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_cap);
@@ -0,0 +1,644 @@
+/**
+ * a1fs macrobenchmark.
+ *
+ * Mounts an image and runs mixed workloads on it from a configurable number
+ * of client threads, through ordinary system calls: small file churn
+ * (create, stat, unlink), large sequential writes and reads, random 4 KiB
+ * reads and writes, and lookups deep in a directory tree. Each operation's
+ * throughput and latency percentiles are reported per workload and thread
+ * count, so that the single-threaded (-s) and the multi-threaded mount can be
+ * compared, as well as any concurrency work later.
+ *
+ * Latencies are kept in the log-linear histograms of stats.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+
+/** Operations, timed separately. */
+typedef enum mb_op {
+	OP_CREATE,
+	OP_STAT,
+	OP_UNLINK,
+	OP_SEQ_WRITE,
+	OP_SEQ_READ,
+	OP_RAND_READ,
+	OP_RAND_WRITE,
+	OP_LOOKUP,
+	N_OPS
+} mb_op;
+
+static const char *op_names[N_OPS] = {
+	"create", "stat", "unlink", "seq_write", "seq_read", "rand_read", "rand_write", "lookup",
+};
+
+/** Workloads; a phase runs one or more of them mixed. */
+enum {
+	W_SMALLFILE = 1 << 0,
+	W_SEQWRITE  = 1 << 1,
+	W_SEQREAD   = 1 << 2,
+	W_RANDOM    = 1 << 3,
+	W_LOOKUP    = 1 << 4,
+	N_WORKLOADS = 5
+};
+
+static const char *workload_names[N_WORKLOADS] = {
+	"smallfile", "seqwrite", "seqread", "random", "lookup",
+};
+
+/** Workloads that work on a large file per thread. */
+#define W_LARGE (W_SEQWRITE | W_SEQREAD | W_RANDOM)
+
+/** Maximum number of phases and of thread counts. */
+#define MAX_PHASES 16
+#define MAX_RUNS   16
+
+
+/** Command line options. */
+typedef struct mb_opts {
+	/** Image file path; NULL if the file system is already mounted. */
+	const char *img_path;
+	/** Mount point. */
+	const char *mount;
+	/** a1fs executable. */
+	const char *a1fs;
+	/** Extra arguments for a1fs (after "--"). */
+	char **a1fs_args;
+	int n_a1fs_args;
+
+	/** Phases: bit masks of workloads, and their names. */
+	unsigned int phases[MAX_PHASES];
+	const char *phase_names[MAX_PHASES];
+	int n_phases;
+	/** Numbers of client threads to run each phase with. */
+	size_t threads[MAX_RUNS];
+	int n_runs;
+	/** Duration of each run in milliseconds. */
+	long duration_ms;
+
+	/** Number of small files per thread. */
+	size_t n_small;
+	/** Size of a small file in bytes. */
+	size_t small_size;
+	/** Size of the large file of each thread in bytes. */
+	size_t large_size;
+	/** Size of each sequential read or write in bytes. */
+	size_t io_size;
+	/** Percentage of random I/O that reads. */
+	unsigned int read_pct;
+	/** Depth and number of the directory chains of the lookup tree. */
+	size_t depth;
+	size_t chains;
+
+	/** Print help and exit. */
+	bool help;
+
+} mb_opts;
+
+static const char *help_str = "\
+Usage: %s options image mountpoint [-- a1fs options]\n\
+       %s -M options mountpoint\n\
+\n\
+Mount an a1fs image (with the a1fs options given after --, e.g. -s for a\n\
+single-threaded mount) and run workloads on it from client threads. Prints a\n\
+line per workload, thread count and operation: operations, operations per\n\
+second, MiB/s, average, p50, p99 and p999 latencies in microseconds and\n\
+errors, separated by tabs. Files are created under mountpoint/bench; use a\n\
+scratch image large enough for a large file per thread.\n\
+\n\
+Workloads:\n\
+    smallfile  create small files, stat and unlink them\n\
+    seqwrite   write a large file sequentially\n\
+    seqread    read a large file sequentially\n\
+    random     read and write 4 KiB blocks of a large file at random\n\
+    lookup     stat paths at random depths of a tree of directory chains\n\
+\n\
+Options:\n\
+    -w list  comma-separated phases, each a workload or several joined by '+'\n\
+             to mix them (default: smallfile,seqwrite,seqread,random,lookup)\n\
+    -j list  comma-separated numbers of client threads (default: 1)\n\
+    -t ms    duration of each run (default: 5000)\n\
+    -n num   number of small files per thread (default: 1000)\n\
+    -f bytes size of a small file (default: 4096)\n\
+    -S MiB   size of the large file of each thread (default: 64)\n\
+    -b KiB   size of each sequential read or write (default: 1024)\n\
+    -r pct   share of random I/O that reads (default: 70)\n\
+    -d num   depth of the lookup tree (default: 8)\n\
+    -c num   number of directory chains in the lookup tree (default: 16)\n\
+    -a path  a1fs executable (default: ./a1fs)\n\
+    -M       the file system is already mounted at mountpoint\n\
+    -h       print help and exit\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+	fprintf(f, help_str, progname, progname);
+}
+
+
+/** Parse a comma-separated list of phases. */
+static bool parse_phases(char *list, mb_opts *opts)
+{
+	opts->n_phases = 0;
+	for (char *save, *phase = strtok_r(list, ",", &save); phase != NULL;
+	     phase = strtok_r(NULL, ",", &save))
+	{
+		if (opts->n_phases == MAX_PHASES) {
+			fprintf(stderr, "Too many phases\n");
+			return false;
+		}
+		opts->phase_names[opts->n_phases] = strdup(phase);
+		unsigned int mask = 0;
+		for (char *save2, *w = strtok_r(phase, "+", &save2); w != NULL;
+		     w = strtok_r(NULL, "+", &save2))
+		{
+			int i = 0;
+			while (i < N_WORKLOADS && strcmp(w, workload_names[i]) != 0) i++;
+			if (i == N_WORKLOADS) {
+				fprintf(stderr, "Unknown workload %s\n", w);
+				return false;
+			}
+			mask |= 1u << i;
+		}
+		opts->phases[opts->n_phases++] = mask;
+	}
+	return opts->n_phases > 0;
+}
+
+/** Parse a comma-separated list of thread counts. */
+static bool parse_threads(char *list, mb_opts *opts)
+{
+	opts->n_runs = 0;
+	for (char *save, *n = strtok_r(list, ",", &save); n != NULL; n = strtok_r(NULL, ",", &save)) {
+		if (opts->n_runs == MAX_RUNS) {
+			fprintf(stderr, "Too many thread counts\n");
+			return false;
+		}
+		size_t threads = strtoul(n, NULL, 10);
+		if (threads == 0) {
+			fprintf(stderr, "Invalid thread count %s\n", n);
+			return false;
+		}
+		opts->threads[opts->n_runs++] = threads;
+	}
+	return opts->n_runs > 0;
+}
+
+static bool parse_args(int argc, char *argv[], mb_opts *opts)
+{
+	static char default_phases[] = "smallfile,seqwrite,seqread,random,lookup";
+	static char default_threads[] = "1";
+	char *phases = default_phases, *threads = default_threads;
+	bool mounted = false;
+	opts->read_pct = 70;// 0 is valid
+
+	int o;
+	while ((o = getopt(argc, argv, "w:j:t:n:f:S:b:r:d:c:a:Mh")) != -1) {
+		switch (o) {
+			case 'w': phases = optarg; break;
+			case 'j': threads = optarg; break;
+			case 't': opts->duration_ms = strtol(optarg, NULL, 10); break;
+			case 'n': opts->n_small     = strtoul(optarg, NULL, 10); break;
+			case 'f': opts->small_size  = strtoul(optarg, NULL, 10); break;
+			case 'S': opts->large_size  = strtoul(optarg, NULL, 10) << 20; break;
+			case 'b': opts->io_size     = strtoul(optarg, NULL, 10) << 10; break;
+			case 'r': opts->read_pct    = strtoul(optarg, NULL, 10); break;
+			case 'd': opts->depth       = strtoul(optarg, NULL, 10); break;
+			case 'c': opts->chains      = strtoul(optarg, NULL, 10); break;
+			case 'a': opts->a1fs        = optarg; break;
+
+			case 'M': mounted    = true; break;
+			case 'h': opts->help = true; return true;// skip other arguments
+
+			case '?': return false;
+			default : assert(false);
+		}
+	}
+
+	int n_paths = mounted ? 1 : 2;
+	if (optind + n_paths > argc) {
+		fprintf(stderr, mounted ? "Missing mount point\n" : "Missing image or mount point\n");
+		return false;
+	}
+	if (!mounted) opts->img_path = argv[optind];
+	opts->mount = argv[optind + n_paths - 1];
+	optind += n_paths;
+	// getopt() stops at "--" and skips it
+	opts->a1fs_args = &argv[optind];
+	opts->n_a1fs_args = argc - optind;
+	if (mounted && opts->n_a1fs_args > 0) {
+		fprintf(stderr, "a1fs options don't apply with -M\n");
+		return false;
+	}
+
+	if (!parse_phases(phases, opts) || !parse_threads(threads, opts)) return false;
+	if (opts->duration_ms <= 0) opts->duration_ms = 5000;
+	if (opts->n_small == 0) opts->n_small = 1000;
+	if (opts->small_size == 0) opts->small_size = 4096;
+	if (opts->large_size == 0) opts->large_size = 64 << 20;
+	if (opts->io_size == 0) opts->io_size = 1 << 20;
+	if (opts->depth == 0) opts->depth = 8;
+	if (opts->chains == 0) opts->chains = 16;
+	if (opts->a1fs == NULL) opts->a1fs = "./a1fs";
+	if (opts->read_pct > 100) opts->read_pct = 100;
+	if (opts->large_size < opts->io_size || opts->large_size < 4096) {
+		fprintf(stderr, "The large file must hold at least one sequential I/O and 4 KiB\n");
+		return false;
+	}
+	return true;
+}
+
+
+/** Counters of an operation. */
+typedef struct op_stats {
+	uint64_t ops;
+	uint64_t errors;
+	uint64_t bytes;
+	uint64_t total_ns;
+	uint64_t hist[STATS_BUCKETS];
+} op_stats;
+
+/** State of a client thread. */
+typedef struct mb_thread {
+	pthread_t thread;
+	const mb_opts *opts;
+	/** Workloads to run. */
+	unsigned int mask;
+	/** Set by the main thread when the run is over. */
+	const bool *stop;
+
+	/** Directory of the thread's files; leaves room for their names. */
+	char dir[PATH_MAX - 64];
+	/** Large file, open for reading and writing. */
+	int fd;
+	/** Offset of the next sequential read or write. */
+	uint64_t seq_offset;
+	/** Which small files exist. */
+	bool *small;
+	uint64_t iter;
+	uint64_t rng;
+	char *buf;
+
+	op_stats stats[N_OPS];
+} __attribute__((aligned(64))) mb_thread;
+
+static uint64_t rnd(mb_thread *t)
+{
+	t->rng ^= t->rng >> 12;
+	t->rng ^= t->rng << 25;
+	t->rng ^= t->rng >> 27;
+	return t->rng * 0x2545F4914F6CDD1Dul;
+}
+
+/** Account for a completed operation. */
+static void done(mb_thread *t, mb_op op, uint64_t start, long ret)
+{
+	uint64_t ns = stats_begin() - start;
+	op_stats *s = &t->stats[op];
+	s->ops++;
+	s->total_ns += ns;
+	s->hist[stats_bucket(ns)]++;
+	if (ret < 0) {
+		s->errors++;
+	} else if (op >= OP_SEQ_WRITE && op <= OP_RAND_WRITE) {
+		s->bytes += ret;
+	}
+}
+
+static void small_path(const mb_thread *t, size_t i, char *path)
+{
+	snprintf(path, PATH_MAX, "%s/s%zu", t->dir, i);
+}
+
+/** Create the next small file, or stat and unlink it if it exists. */
+static void do_smallfile(mb_thread *t)
+{
+	size_t i = t->iter % t->opts->n_small;
+	char path[PATH_MAX];
+	small_path(t, i, path);
+
+	uint64_t start = stats_begin();
+	if (!t->small[i]) {
+		int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+		long ret = -1;
+		if (fd >= 0) {
+			ret = write(fd, t->buf, t->opts->small_size);
+			if (close(fd) < 0) ret = -1;
+		}
+		done(t, OP_CREATE, start, ret < 0 ? -1 : 0);
+		t->small[i] = fd >= 0;
+		return;
+	}
+	struct stat st;
+	done(t, OP_STAT, start, stat(path, &st));
+	start = stats_begin();
+	done(t, OP_UNLINK, start, unlink(path));
+	t->small[i] = false;
+}
+
+static void do_seq(mb_thread *t, bool write)
+{
+	if (t->seq_offset + t->opts->io_size > t->opts->large_size) t->seq_offset = 0;
+	uint64_t start = stats_begin();
+	long ret = write ? pwrite(t->fd, t->buf, t->opts->io_size, t->seq_offset)
+	                 : pread(t->fd, t->buf, t->opts->io_size, t->seq_offset);
+	done(t, write ? OP_SEQ_WRITE : OP_SEQ_READ, start, ret);
+	t->seq_offset += t->opts->io_size;
+}
+
+static void do_random(mb_thread *t)
+{
+	uint64_t offset = (rnd(t) % (t->opts->large_size / 4096)) * 4096;
+	bool read = rnd(t) % 100 < t->opts->read_pct;
+	uint64_t start = stats_begin();
+	long ret = read ? pread(t->fd, t->buf, 4096, offset) : pwrite(t->fd, t->buf, 4096, offset);
+	done(t, read ? OP_RAND_READ : OP_RAND_WRITE, start, ret);
+}
+
+/** Path of the directory at a depth of a chain of the lookup tree. */
+static void tree_path(const mb_opts *opts, size_t chain, size_t depth, char *path)
+{
+	int len = snprintf(path, PATH_MAX, "%s/bench/tree/c%zu", opts->mount, chain);
+	for (size_t i = 0; i < depth && len < PATH_MAX; i++) {
+		len += snprintf(path + len, PATH_MAX - len, "/l%zu", i);
+	}
+}
+
+static void do_lookup(mb_thread *t)
+{
+	char path[PATH_MAX];
+	tree_path(t->opts, rnd(t) % t->opts->chains, 1 + rnd(t) % t->opts->depth, path);
+	struct stat st;
+	uint64_t start = stats_begin();
+	done(t, OP_LOOKUP, start, stat(path, &st));
+}
+
+static void *client_loop(void *arg)
+{
+	mb_thread *t = (mb_thread *)arg;
+	unsigned int workloads[N_WORKLOADS];
+	int n = 0;
+	for (int i = 0; i < N_WORKLOADS; i++) {
+		if (t->mask & (1u << i)) workloads[n++] = 1u << i;
+	}
+
+	while (!__atomic_load_n(t->stop, __ATOMIC_RELAXED)) {
+		unsigned int w = (n == 1) ? workloads[0] : workloads[rnd(t) % n];
+		switch (w) {
+			case W_SMALLFILE: do_smallfile(t); break;
+			case W_SEQWRITE:  do_seq(t, true); break;
+			case W_SEQREAD:   do_seq(t, false); break;
+			case W_RANDOM:    do_random(t); break;
+			case W_LOOKUP:    do_lookup(t); break;
+			default: assert(false);
+		}
+		t->iter++;
+	}
+	return NULL;
+}
+
+
+/** Create a directory unless it exists. */
+static bool make_dir(const char *path)
+{
+	if (mkdir(path, 0755) == 0 || errno == EEXIST) return true;
+	perror(path);
+	return false;
+}
+
+/** Create the lookup tree, if it doesn't exist yet. */
+static bool tree_create(const mb_opts *opts)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/bench/tree", opts->mount);
+	if (!make_dir(path)) return false;
+	for (size_t c = 0; c < opts->chains; c++) {
+		for (size_t d = 0; d <= opts->depth; d++) {
+			tree_path(opts, c, d, path);
+			if (!make_dir(path)) return false;
+		}
+	}
+	return true;
+}
+
+/** Prepare the files of a client thread; untimed. */
+static bool thread_setup(mb_thread *t, size_t id)
+{
+	const mb_opts *opts = t->opts;
+	snprintf(t->dir, sizeof(t->dir), "%s/bench/t%zu", opts->mount, id);
+	if (!make_dir(t->dir)) return false;
+	t->fd = -1;
+	t->rng = 0x9E3779B97F4A7C15ul * (id + 1);
+	size_t buf_size = opts->io_size;
+	if (opts->small_size > buf_size) buf_size = opts->small_size;
+	t->buf = malloc(buf_size);
+	t->small = calloc(opts->n_small, sizeof(bool));
+	if (t->buf == NULL || t->small == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return false;
+	}
+	for (size_t i = 0; i < buf_size; i++) t->buf[i] = (char)rnd(t);
+
+	if (!(t->mask & W_LARGE)) return true;
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/large", t->dir);
+	t->fd = open(path, O_CREAT | O_RDWR, 0644);
+	if (t->fd < 0) {
+		perror(path);
+		return false;
+	}
+	// Reads need data to read
+	struct stat st;
+	if (fstat(t->fd, &st) < 0) return false;
+	for (uint64_t off = st.st_size; off < opts->large_size; off += opts->io_size) {
+		size_t n = opts->large_size - off < opts->io_size ? opts->large_size - off : opts->io_size;
+		if (pwrite(t->fd, t->buf, n, off) < 0) {
+			perror(path);
+			return false;
+		}
+	}
+	return true;
+}
+
+/** Remove the small files of a client thread and free it; untimed. */
+static void thread_cleanup(mb_thread *t)
+{
+	char path[PATH_MAX];
+	for (size_t i = 0; t->small != NULL && i < t->opts->n_small; i++) {
+		if (!t->small[i]) continue;
+		small_path(t, i, path);
+		unlink(path);
+	}
+	if (t->fd >= 0) close(t->fd);
+	free(t->small);
+	free(t->buf);
+}
+
+/** Run a phase with n client threads and print the results. */
+static bool run(const mb_opts *opts, int phase, size_t n)
+{
+	unsigned int mask = opts->phases[phase];
+	mb_thread *threads = aligned_alloc(_Alignof(mb_thread), n * sizeof(mb_thread));
+	if (threads == NULL) {
+		perror("aligned_alloc");
+		return false;
+	}
+	memset(threads, 0, n * sizeof(mb_thread));
+	bool ok = !(mask & W_LOOKUP) || tree_create(opts);
+	for (size_t i = 0; i < n; i++) {
+		threads[i].opts = opts;
+		threads[i].mask = mask;
+		threads[i].fd = -1;
+		if (ok) ok = thread_setup(&threads[i], i);
+	}
+	if (!ok) goto end;
+	// Write back what the setup wrote, so that it doesn't slow down the run
+	sync();
+
+	bool stop = false;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	size_t started = 0;
+	for (; started < n; started++) {
+		threads[started].stop = &stop;
+		if ((errno = pthread_create(&threads[started].thread, NULL, client_loop,
+		                            &threads[started])) != 0) {
+			perror("pthread_create");
+			break;
+		}
+	}
+	struct timespec delay = {
+		.tv_sec = opts->duration_ms / 1000,
+		.tv_nsec = (opts->duration_ms % 1000) * 1000000,
+	};
+	nanosleep(&delay, NULL);
+	__atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+	for (size_t i = 0; i < started; i++) {
+		pthread_join(threads[i].thread, NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (started < n) {
+		ok = false;
+		goto end;
+	}
+
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	for (int op = 0; op < N_OPS; op++) {
+		op_stats sum = {0};
+		for (size_t i = 0; i < n; i++) {
+			op_stats *s = &threads[i].stats[op];
+			sum.ops += s->ops;
+			sum.errors += s->errors;
+			sum.bytes += s->bytes;
+			sum.total_ns += s->total_ns;
+			for (int k = 0; k < STATS_BUCKETS; k++) sum.hist[k] += s->hist[k];
+		}
+		if (sum.ops == 0) continue;
+		printf("%s\t%zu\t%s\t%lu\t%.0f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%lu\n",
+		       opts->phase_names[phase], n, op_names[op], sum.ops, sum.ops / secs,
+		       sum.bytes / secs / (1 << 20), sum.total_ns / 1000.0 / sum.ops,
+		       stats_percentile(sum.hist, sum.ops, 0.5) / 1000.0,
+		       stats_percentile(sum.hist, sum.ops, 0.99) / 1000.0,
+		       stats_percentile(sum.hist, sum.ops, 0.999) / 1000.0, sum.errors);
+	}
+	fflush(stdout);
+
+end:
+	for (size_t i = 0; i < n; i++) thread_cleanup(&threads[i]);
+	free(threads);
+	return ok;
+}
+
+
+/** Run a program and wait for it; true if it exited with status 0. */
+static bool run_program(char *const argv[])
+{
+	pid_t pid = fork();
+	if (pid == 0) {
+		execvp(argv[0], argv);
+		perror(argv[0]);
+		_exit(127);
+	}
+	int status;
+	return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+	       WEXITSTATUS(status) == 0;
+}
+
+/** Mount the image; a1fs daemonizes once the mount is up. */
+static bool mount_image(const mb_opts *opts)
+{
+	char **argv = calloc(opts->n_a1fs_args + 4, sizeof(char *));
+	if (argv == NULL) return false;
+	argv[0] = (char *)opts->a1fs;
+	argv[1] = (char *)opts->img_path;
+	argv[2] = (char *)opts->mount;
+	memcpy(&argv[3], opts->a1fs_args, opts->n_a1fs_args * sizeof(char *));
+	bool ok = run_program(argv);
+	free(argv);
+	if (!ok) fprintf(stderr, "Failed to mount %s\n", opts->img_path);
+	return ok;
+}
+
+static void unmount_image(const mb_opts *opts)
+{
+	char *argv[] = { "fusermount", "-u", (char *)opts->mount, NULL };
+	if (!run_program(argv)) fprintf(stderr, "Failed to unmount %s\n", opts->mount);
+}
+
+
+int main(int argc, char *argv[])
+{
+	mb_opts opts = {0};// defaults are all 0
+	if (!parse_args(argc, argv, &opts)) {
+		// Invalid arguments, print help to stderr
+		print_help(stderr, argv[0]);
+		return 1;
+	}
+	if (opts.help) {
+		// Help requested, print it to stdout
+		print_help(stdout, argv[0]);
+		return 0;
+	}
+
+	if (opts.img_path != NULL && !mount_image(&opts)) return 1;
+
+	int ret = 1;
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/bench", opts.mount);
+	if (!make_dir(path)) goto end;
+
+	printf("# mount=%s", opts.mount);
+	for (int i = 0; i < opts.n_a1fs_args; i++) printf(" %s", opts.a1fs_args[i]);
+	printf(" duration_ms=%ld small_files=%zu small_size=%zu large_size=%zu io_size=%zu"
+	       " read_pct=%u depth=%zu chains=%zu\n", opts.duration_ms, opts.n_small,
+	       opts.small_size, opts.large_size, opts.io_size, opts.read_pct, opts.depth, opts.chains);
+	printf("# workload\tthreads\top\tops\tops_per_s\tmib_per_s\tavg_us\tp50_us\tp99_us"
+	       "\tp999_us\terrors\n");
+	for (int p = 0; p < opts.n_phases; p++) {
+		for (int r = 0; r < opts.n_runs; r++) {
+			if (!run(&opts, p, opts.threads[r])) goto end;
+		}
+	}
+	ret = 0;
+
+end:
+	if (opts.img_path != NULL) unmount_image(&opts);
+	return ret;
+}
@@ -26,46 +26,87 @@
 #include "util.h"
 #include "helper.h"
 
-void *map_file(const char *path, size_t block_size, size_t *size)
+/** Map the whole file open at a file descriptor with given protection and flags. */
+static void *map(int fd, size_t block_size, size_t *size, int prot, int flags)
 {
-	// Open the file for reading and writing
-	int fd = open(path, O_RDWR);
-	if (fd < 0) {
-		perror(path);
-		return NULL;
-	}
-
-	void *addr = NULL;
 	// Get file size
 	struct stat s;
 	if (fstat(fd, &s) < 0) {
 		perror("fstat");
-		goto end;
+		return NULL;
 	}
 
 	// Check that the file size is valid
 	if (s.st_size == 0) {
 		fprintf(stderr, "Image file is empty\n");
-		goto end;
+		return NULL;
 	}
 	if (s.st_size % block_size != 0) {
 		fprintf(stderr, "Image file size is not a multiple of block size\n");
-		goto end;
+		return NULL;
 	}
 
 	// Map file contents into memory
-	addr = mmap(NULL, s.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	void *addr = mmap(NULL, s.st_size, prot, flags, fd, 0);
 	if (addr == MAP_FAILED) {
 		perror("mmap");
-		addr = NULL;
-		goto end;
+		return NULL;
 	}
 	assert(is_aligned((size_t)addr, block_size));
 	*size = s.st_size;
+	return addr;
+}
+
+void *map_fd(int fd, size_t block_size, size_t *size)
+{
+	return map(fd, block_size, size, PROT_READ | PROT_WRITE, MAP_SHARED);
+}
+
+void *map_fd_private(int fd, size_t block_size, size_t *size)
+{
+	// No swap is reserved for the whole image, only written pages are copied
+	return map(fd, block_size, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE);
+}
 
-end:
+void *map_file(const char *path, size_t block_size, size_t *size)
+{
+	// Open the file for reading and writing
+	int fd = open(path, O_RDWR);
+	if (fd < 0) {
+		perror(path);
+		return NULL;
+	}
+
+	void *addr = map_fd(fd, block_size, size);
 	//NOTE: memory mapping keeps a reference to the open file; can safely close
 	// the file descriptor now; a future munmap() will close the file
 	close(fd);
 	return addr;
 }
+
+void *map_file_readonly(const char *path, size_t block_size, size_t *size)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return NULL;
+	}
+
+	void *addr = map(fd, block_size, size, PROT_READ, MAP_SHARED);
+	close(fd);
+	return addr;
+}
+
+void *map_file_private(const char *path, size_t block_size, size_t *size)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return NULL;
+	}
+
+	// No swap is reserved for the whole image, only touched pages are copied
+	void *addr = map(fd, block_size, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE);
+	close(fd);
+	return addr;
+}
@@ -33,3 +33,60 @@
  *                    NULL on failure.
  */
 void *map_file(const char *path, size_t block_size, size_t *size);
+
+/**
+ * Map the whole file open at a file descriptor (e.g. a memfd) into memory for
+ * reading and writing. The descriptor is left open.
+ *
+ * File size must be a non-zero multiple of the block_size.
+ *
+ * @param fd          file descriptor open for reading and writing.
+ * @param block_size  file system block size.
+ * @param size        pointer to the variable that will be set to file size.
+ * @return            pointer to the file mapping in memory on success;
+ *                    NULL on failure.
+ */
+void *map_fd(int fd, size_t block_size, size_t *size);
+
+/**
+ * Map the whole file open at a file descriptor into private copy-on-write
+ * memory. Changes only reach the file when the caller writes them to the
+ * descriptor. The descriptor is left open.
+ *
+ * File size must be a non-zero multiple of the block_size.
+ *
+ * @param fd          file descriptor open for reading and writing.
+ * @param block_size  file system block size.
+ * @param size        pointer to the variable that will be set to file size.
+ * @return            pointer to the file mapping in memory on success;
+ *                    NULL on failure.
+ */
+void *map_fd_private(int fd, size_t block_size, size_t *size);
+
+/**
+ * Map the whole file into memory for reading only, e.g. to inspect an image
+ * that may be mounted. Writing to the mapping crashes the process.
+ *
+ * File size must be a non-zero multiple of the block_size.
+ *
+ * @param path        image file path.
+ * @param block_size  file system block size.
+ * @param size        pointer to the variable that will be set to file size.
+ * @return            pointer to the file mapping in memory on success;
+ *                    NULL on failure.
+ */
+void *map_file_readonly(const char *path, size_t block_size, size_t *size);
+
+/**
+ * Map the whole file into private copy-on-write memory. The mapping can be
+ * written, but changes are never written back to the file.
+ *
+ * File size must be a non-zero multiple of the block_size.
+ *
+ * @param path        image file path.
+ * @param block_size  file system block size.
+ * @param size        pointer to the variable that will be set to file size.
+ * @return            pointer to the file mapping in memory on success;
+ *                    NULL on failure.
+ */
+void *map_file_private(const char *path, size_t block_size, size_t *size);
@@ -16,6 +16,11 @@
  * CSC369 Assignment 1 - a1fs formatting tool.
  */
 
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -26,6 +31,7 @@
 #include <sys/time.h>
 
 #include "a1fs.h"
+#include "fs_ctx.h"
 #include "map.h"
 #include "util.h"
 #include "helper.h"
@@ -37,6 +43,12 @@ typedef struct mkfs_opts {
 	const char *img_path;
 	/** Number of inodes. */
 	size_t n_inodes;
+	/** Number of threads zeroing regions that can't be punched out. */
+	size_t n_threads;
+	/** Number of journal blocks; 0 for no journal. */
+	size_t n_journal;
+	/** Whether n_journal was given, otherwise it is derived from the size. */
+	bool journal_set;
 
 	/** Print help and exit. */
 	bool help;
@@ -57,27 +69,50 @@ Usage: %s options image\n\
 Format the image file into a1fs file system. The file must exist and\n\
 its size must be a multiple of a1fs block size - %zu bytes.\n\
 \n\
+Only the metadata is initialized; the inode table is initialized lazily as\n\
+inodes are allocated, and regions that must read as zeros are punched out of\n\
+the image file where the host file system supports it.\n\
+\n\
 Options:\n\
     -i num  number of inodes; required argument\n\
+    -j num  number of threads zeroing regions that can't be punched out\n\
+            (default: 1)\n\
+    -J num  number of metadata journal blocks, 0 for no journal\n\
+            (default: 1/256 of the image, between %d and %d, but at\n\
+            most a quarter of the free space; none if that is too small).\n\
+            The journal makes committed metadata changes atomic and\n\
+            durable; after a crash, run a1fs-fsck to reclaim the blocks\n\
+            and inodes that were held in allocation pools\n\
     -h      print help and exit\n\
     -f      force format - overwrite existing a1fs file system\n\
     -s      sync image file contents to disk\n\
     -v      verbose output\n\
-    -z      zero out image contents\n\
+    -z      zero out image contents (punched out where supported)\n\
 ";
 
+/** Bounds of the default journal size, in blocks. */
+#define JOURNAL_MIN 64
+#define JOURNAL_MAX 8192
+/** Smallest journal that can hold a transaction, in blocks. */
+#define JOURNAL_BLOCKS_MIN 4
+
 static void print_help(FILE *f, const char *progname)
 {
-	fprintf(f, help_str, progname, A1FS_BLOCK_SIZE);
+	fprintf(f, help_str, progname, A1FS_BLOCK_SIZE, JOURNAL_MIN, JOURNAL_MAX);
 }
 
 
 static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
 {
 	char o;
-	while ((o = getopt(argc, argv, "i:hfsvz")) != -1) {
+	while ((o = getopt(argc, argv, "i:j:J:hfsvz")) != -1) {
 		switch (o) {
 			case 'i': opts->n_inodes = strtoul(optarg, NULL, 10); break;
+			case 'j': opts->n_threads = strtoul(optarg, NULL, 10); break;
+			case 'J':
+				opts->n_journal = strtoul(optarg, NULL, 10);
+				opts->journal_set = true;
+				break;
 
 			case 'h': opts->help    = true; return true;// skip other arguments
 			case 'f': opts->force   = true; break;
@@ -100,6 +135,11 @@ static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
 		fprintf(stderr, "Missing or invalid number of inodes\n");
 		return false;
 	}
+	if (opts->n_threads == 0) opts->n_threads = 1;
+	if (opts->journal_set && opts->n_journal != 0 && opts->n_journal < JOURNAL_BLOCKS_MIN) {
+		fprintf(stderr, "The journal needs at least %d blocks\n", JOURNAL_BLOCKS_MIN);
+		return false;
+	}
 	return true;
 }
 
@@ -119,6 +159,68 @@ static bool a1fs_is_present(void *image)
 }
 
 
+/** Part of a region zeroed by a thread. */
+typedef struct zero_work {
+	pthread_t thread;
+	unsigned char *start;
+	size_t len;
+} zero_work;
+
+static void *zero_thread(void *arg)
+{
+	zero_work *work = (zero_work *)arg;
+	memset(work->start, 0, work->len);
+	return NULL;
+}
+
+/**
+ * Make a block aligned region of the image read as zeros.
+ *
+ * The region is punched out of the image file, which frees its storage and
+ * doesn't touch its pages. If the host file system can't do that, the region
+ * is cleared with memset(), split between opts->n_threads threads.
+ *
+ * @param image  pointer to the start of the image.
+ * @param fd     image file descriptor; -1 to always use memset().
+ * @param off    region offset in bytes.
+ * @param len    region length in bytes.
+ * @param opts   command line options.
+ */
+static void zero_range(void *image, int fd, size_t off, size_t len, mkfs_opts *opts)
+{
+	if (len == 0) return;
+	if (fd >= 0 && fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) == 0) {
+		return;
+	}
+	if (opts->verbose) {
+		printf("Zeroing %zu bytes at offset %zu with %zu thread(s)\n", len, off, opts->n_threads);
+	}
+
+	// Split on block boundaries so that threads don't share pages
+	size_t n = opts->n_threads;
+	if (n > len / A1FS_BLOCK_SIZE) n = len / A1FS_BLOCK_SIZE;
+	zero_work *work = (n > 1) ? calloc(n, sizeof(zero_work)) : NULL;
+	if (work == NULL) {
+		memset((unsigned char *)image + off, 0, len);
+		return;
+	}
+	size_t per_thread = len / A1FS_BLOCK_SIZE / n * A1FS_BLOCK_SIZE;
+	size_t started = 0;
+	for (; started < n; started++) {
+		work[started].start = (unsigned char *)image + off + started * per_thread;
+		work[started].len = (started == n - 1) ? len - started * per_thread : per_thread;
+		if (pthread_create(&work[started].thread, NULL, zero_thread, &work[started]) != 0) break;
+	}
+	// Do whatever couldn't be handed out to a thread
+	for (size_t i = started; i < n; i++) {
+		zero_thread(&work[i]);
+	}
+	for (size_t i = 0; i < started; i++) {
+		pthread_join(work[i].thread, NULL);
+	}
+	free(work);
+}
+
 /**
  * Format the image into a1fs.
  *
@@ -126,16 +228,18 @@ static bool a1fs_is_present(void *image)
  *
  * @param image  pointer to the start of the image.
  * @param size   image size in bytes.
+ * @param fd     image file descriptor (see zero_range()).
  * @param opts   command line options.
  * @return       true on success;
  *               false on error, e.g. options are invalid for given image size.
  */
-static bool mkfs(void *image, size_t size, mkfs_opts *opts)
+static bool mkfs(void *image, size_t size, int fd, mkfs_opts *opts)
 {
 	//TODO: initialize the superblock and create an empty root directory
     is_aligned(size,A1FS_BLOCK_SIZE);
     
     if(opts->n_inodes <= 1){
+           fprintf(stderr, "The image needs at least 2 inodes\n");
            return false;
        }
     
@@ -155,23 +259,56 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts)
     //calculate the number of blocks needed to store the block bitmap
     uint64_t num_blocks = size / A1FS_BLOCK_SIZE;
     uint64_t block_bitmap_count = num_blocks / (A1FS_BLOCK_SIZE * 8) + (num_blocks % (A1FS_BLOCK_SIZE * 8) > 0 ? 1 : 0);
+
+    //calculate the number of blocks needed to store the block reference count table
+    uint64_t refs_in_block = A1FS_BLOCK_SIZE / sizeof(a1fs_ref_t);
+    uint64_t refcount_count = num_blocks / refs_in_block + (num_blocks % refs_in_block > 0 ? 1 : 0);
     
+    //then the free space summary, one entry per block of the block bitmap
+    uint64_t summary_count = (block_bitmap_count * sizeof(a1fs_region) + A1FS_BLOCK_SIZE - 1) / A1FS_BLOCK_SIZE;
+
+    //the metadata journal follows the free space summary
+    uint64_t meta_count = 2 + inode_bitmap_count + block_bitmap_count + num_blocks_inodes + refcount_count +
+                          summary_count;
+    uint64_t journal_count = opts->n_journal;
+    if (!opts->journal_set){
+        journal_count = num_blocks / 256;
+        if (journal_count < JOURNAL_MIN) journal_count = JOURNAL_MIN;
+        if (journal_count > JOURNAL_MAX) journal_count = JOURNAL_MAX;
+        //a small image keeps at least three quarters of its free space for data, and has no journal
+        // if what is left for it is too small to hold a transaction
+        uint64_t avail = (num_blocks > meta_count) ? (num_blocks - meta_count) / 4 : 0;
+        if (journal_count > avail) journal_count = (avail < JOURNAL_BLOCKS_MIN) ? 0 : avail;
+    }
+
     //invalid size check
-    size_t minimum_size = (2 + inode_bitmap_count + block_bitmap_count + num_blocks_inodes) * A1FS_BLOCK_SIZE;
-   
-    if (size <= minimum_size) {
+    if (num_blocks <= meta_count + journal_count) {
+        fprintf(stderr, "The image is too small: %lu blocks, the metadata needs more than %lu\n",
+                (unsigned long)num_blocks, (unsigned long)(meta_count + journal_count));
         return false;
     }
     
-    memset(image,0,size);
-    
+    //only the metadata needs to be cleared: data blocks are initialized when they are allocated,
+    // the reference count table (possibly large) is punched out, and of the inode table only the
+    // block holding the root inode is cleared now, the rest when inodes are first allocated
+    uint64_t inode_table_start = 1 + inode_bitmap_count + block_bitmap_count;
+    memset(image, 0, (inode_table_start + 1) * A1FS_BLOCK_SIZE);
+    zero_range(image, fd, (inode_table_start + num_blocks_inodes) * A1FS_BLOCK_SIZE,
+               (refcount_count + summary_count + journal_count) * A1FS_BLOCK_SIZE, opts);
+
 	//set all info in superblock
     a1fs_superblock *superblock = (a1fs_superblock *)image;
     
     superblock->inode_bitmap_start = 1;
     superblock->block_bitmap_start = 1 + inode_bitmap_count;
     superblock->inode_table_start = 1 + inode_bitmap_count + block_bitmap_count;
-    superblock->data_start = 1 + inode_bitmap_count + block_bitmap_count + num_blocks_inodes;
+    superblock->refcount_start = 1 + inode_bitmap_count + block_bitmap_count + num_blocks_inodes;
+    superblock->refcount_blocks = refcount_count;
+    superblock->summary_start = superblock->refcount_start + refcount_count;
+    superblock->summary_blocks = summary_count;
+    superblock->journal_start = superblock->summary_start + summary_count;
+    superblock->journal_blocks = journal_count;
+    superblock->data_start = superblock->journal_start + journal_count;
     
     superblock->magic = A1FS_MAGIC;
     superblock->size = size;
@@ -181,14 +318,29 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts)
     superblock->free_blocks_count = superblock->blocks_count;
     superblock->ino_bitmap_bytes = (superblock->inodes_count / 8) + (superblock->inodes_count % 8 > 0 ? 1 : 0);
     superblock->blk_bitmap_bytes = (superblock->blocks_count / 8) + (superblock->blocks_count % 8 > 0 ? 1 : 0);
+    superblock->inodes_init_end = (opts->n_inodes > inodes_in_block) ? inodes_in_block : 0;
 	// set all blocks occupied to 1
 	unsigned char * block_bitmap = (unsigned char * )((unsigned char * )image + (superblock->block_bitmap_start) * A1FS_BLOCK_SIZE);
 	for(int i = 0;i < (int)superblock->data_start;i++){
 		set_bit(block_bitmap,1,i,1,superblock);
 	}
+	//only the metadata blocks at the start are used, so every region is free from data_start on
+	a1fs_region *summary = (a1fs_region *)((unsigned char *)image + superblock->summary_start * A1FS_BLOCK_SIZE);
+	for (uint64_t r = 0; r < block_bitmap_count; r++) {
+		uint64_t start = r * A1FS_REGION_BLOCKS;
+		uint64_t end = (start + A1FS_REGION_BLOCKS < num_blocks) ? start + A1FS_REGION_BLOCKS : num_blocks;
+		if (start < superblock->data_start) start = (superblock->data_start < end) ? superblock->data_start : end;
+		summary[r].free = summary[r].longest = (uint32_t)(end - start);
+	}
+	superblock->state = A1FS_STATE_CLEAN;
 
-	a1fs_ino_t root = create_inode((mode_t)S_IFDIR, 0, image, 0);
+	fs_ctx fs;
+	if (!fs_ctx_init(&fs, image, size, -1, NULL)) {
+		return false;
+	}
+	a1fs_ino_t root = create_inode((mode_t)S_IFDIR, 0, &fs, 0);
 	assert(root == 0);
+	fs_ctx_destroy(&fs);
     
 	return true;
 }
@@ -220,8 +372,14 @@ int main(int argc, char *argv[])
 		goto end;
 	}
 
-	if (opts.zero) memset(image, 0, size);
-	if (!mkfs(image, size, &opts)) {
+	// The mapping is only needed for metadata, the file for punching holes
+	int fd = open(opts.img_path, O_RDWR);
+	if (fd < 0 && opts.verbose) perror(opts.img_path);
+
+	if (opts.zero) zero_range(image, fd, 0, size, &opts);
+	bool ok = mkfs(image, size, fd, &opts);
+	if (fd >= 0) close(fd);
+	if (!ok) {
 		fprintf(stderr, "Failed to format the image\n");
 		goto end;
 	}
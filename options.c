@@ -16,9 +16,14 @@
  * CSC369 Assignment 1 - a1fs command line options parser implementation.
  */
 
+#include <limits.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#include <fuse_opt.h>
 
 #include "options.h"
 
@@ -27,6 +32,13 @@
 // See fuse_opt.h in libfuse source code for details.
 
 #define A1FS_OPT(t, p) { t, offsetof(a1fs_opts, p), 1 }
+// Options with a value, e.g. "--dirty-age=%u"
+#define A1FS_OPT_VAL(t, p) { t, offsetof(a1fs_opts, p), 0 }
+
+/** Writeback defaults, see a1fs_opts. */
+#define DEFAULT_DIRTY_AGE          30000
+#define DEFAULT_DIRTY_RATIO        10
+#define DEFAULT_WRITEBACK_INTERVAL 5000
 
 static const struct fuse_opt opt_spec[] = {
 	A1FS_OPT("-h"    , help),
@@ -35,8 +47,18 @@ static const struct fuse_opt opt_spec[] = {
 	A1FS_OPT("-V"       , version),
 	A1FS_OPT("--version", version),
 
-	A1FS_OPT("--sync"   , sync   ),
-	A1FS_OPT("--verbose", verbose),
+	A1FS_OPT("--sync"    , sync    ),
+	A1FS_OPT("--verbose" , verbose ),
+	A1FS_OPT("--lazytime", lazytime),
+
+	A1FS_OPT_VAL("--cache-file=%s", cache_file   ),
+	A1FS_OPT("--no-cache-file"    , no_cache_file),
+	A1FS_OPT_VAL("--record=%s"    , record_file  ),
+
+	A1FS_OPT("--no-writeback", no_writeback),
+	A1FS_OPT_VAL("--dirty-age=%u"         , dirty_age         ),
+	A1FS_OPT_VAL("--dirty-ratio=%u"       , dirty_ratio       ),
+	A1FS_OPT_VAL("--writeback-interval=%u", writeback_interval),
 
 	FUSE_OPT_END
 };
@@ -45,7 +67,7 @@ static const char *help_str = "\
 Usage: %s image dir [options]\n\
 \n\
 Mount a1fs image file at given mount point. Use fusermount(1) to unmount.\n\
-Only single-threaded mount is supported; -s FUSE option is implied.\n\
+Requests are served by multiple threads; pass -s for a single-threaded mount.\n\
 \n\
 general options:\n\
     -o opt,[opt...]        mount options\n\
@@ -55,6 +77,20 @@ general options:\n\
 a1fs options:\n\
     --sync                 sync image file contents to disk on unmount\n\
     --verbose              verbose output; only useful in foreground mode (-f)\n\
+    --lazytime             keep modification times in memory until fsync or\n\
+                           unmount, and don't propagate them past the parent\n\
+    --cache-file=PATH      save the path lookup cache here on unmount and\n\
+                           preload it on the next mount (default: image.cache)\n\
+    --no-cache-file        don't save or preload the path lookup cache\n\
+    --record=PATH          record every operation to this file, to be run\n\
+                           again with a1fs-replay\n\
+\n\
+    Changed blocks are written back in the background:\n\
+    --dirty-age=MS         once dirty for this long (default: %u)\n\
+    --dirty-ratio=PCT      or while more than this percentage of the image\n\
+                           is dirty (default: %u)\n\
+    --writeback-interval=MS  how often to check (default: %u)\n\
+    --no-writeback         only on fsync and unmount, and by the kernel\n\
 \n\
 ";
 
@@ -78,7 +114,8 @@ bool a1fs_opt_parse(struct fuse_args *args, a1fs_opts *opts)
 
 	//NOTE: printing to stderr to keep it consistent with FUSE
 	if (opts->help) {
-		fprintf(stderr, help_str, args->argv[0]);
+		fprintf(stderr, help_str, args->argv[0], DEFAULT_DIRTY_AGE, DEFAULT_DIRTY_RATIO,
+		        DEFAULT_WRITEBACK_INTERVAL);
 		fuse_opt_add_arg(args, "-ho");
 	}
 	if (opts->version) {
@@ -86,12 +123,35 @@ bool a1fs_opt_parse(struct fuse_args *args, a1fs_opts *opts)
 		fuse_opt_add_arg(args, "-V");
 	}
 
+	if (opts->dirty_age == 0) opts->dirty_age = DEFAULT_DIRTY_AGE;
+	if (opts->dirty_ratio == 0 || opts->dirty_ratio > 100) opts->dirty_ratio = DEFAULT_DIRTY_RATIO;
+	if (opts->writeback_interval == 0) opts->writeback_interval = DEFAULT_WRITEBACK_INTERVAL;
+
+	// The cache file is written on unmount, after FUSE has changed the
+	// working directory, so it needs an absolute path
+	if (opts->no_cache_file || opts->img_path == NULL) {
+		opts->cache_file = NULL;
+	} else {
+		const char *base = (opts->cache_file != NULL) ? opts->cache_file : opts->img_path;
+		const char *suffix = (opts->cache_file != NULL) ? "" : ".cache";
+		char cwd[PATH_MAX] = "";
+		if (base[0] != '/' && getcwd(cwd, sizeof(cwd)) == NULL) {
+			perror("getcwd");
+			return false;
+		}
+		size_t len = strlen(cwd) + 1 + strlen(base) + strlen(suffix) + 1;
+		char *path = malloc(len);
+		if (path == NULL) {
+			perror("malloc");
+			return false;
+		}
+		snprintf(path, len, "%s%s%s%s", cwd, (cwd[0] != '\0') ? "/" : "", base, suffix);
+		opts->cache_file = path;
+	}
+
 	if (!opts->help && !opts->version && !opts->img_path) {
 		fprintf(stderr, "Missing image path\n");
 		return false;
 	}
-
-	// Only single-threaded mount is supported
-	fuse_opt_add_arg(args, "-s");
 	return true;
 }
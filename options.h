@@ -20,7 +20,7 @@
 
 #include <stdbool.h>
 
-#include <fuse_opt.h>
+struct fuse_args;
 
 
 /** a1fs command line options. */
@@ -38,6 +38,26 @@ typedef struct a1fs_opts {
 	/** Verbose output. Only print logging/debug info if this flag is set. */
 	int verbose;
 
+	/** Don't start the background writeback thread. */
+	int no_writeback;
+	/** Blocks dirty for longer than this (ms) are written back. */
+	unsigned int dirty_age;
+	/** Percentage of the image that may be dirty before younger blocks are written back too. */
+	unsigned int dirty_ratio;
+	/** Period of the writeback thread (ms). */
+	unsigned int writeback_interval;
+
+	/** Keep modification times in memory until fsync or unmount, see update_mtime(). */
+	int lazytime;
+
+	/** Where the path lookup cache is saved on unmount (see dcache.h); NULL if it isn't. */
+	const char *cache_file;
+	/** Don't save or load the path lookup cache. */
+	int no_cache_file;
+
+	/** Where every operation is recorded (see record.h); NULL if they aren't. */
+	const char *record_file;
+
 } a1fs_opts;
 
 /**
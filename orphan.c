@@ -0,0 +1,173 @@
+/**
+ * a1fs orphan list implementation.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+
+#include "alloc.h"
+#include "fs_ctx.h"
+#include "helper.h"
+#include "orphan.h"
+#include "trace.h"
+
+
+void orphan_add(fs_ctx *fs, a1fs_ino_t ino)
+{
+	a1fs_inode *inode = &fs->inodes[ino];
+
+	// Even a small file is left to the reclaimer: operations that looked it
+	// up before it was removed may still be using the inode
+	inode->flags |= A1FS_INODE_ORPHAN;
+	pthread_mutex_lock(&fs->orphan_lock);
+	inode->next_orphan = fs->sb->orphan_head;
+	fs->sb->orphan_head = ino;
+	journal_dirty_inode(fs, inode);
+	journal_dirty(fs, fs->sb, sizeof(*fs->sb));
+	pthread_cond_signal(&fs->orphan_cond);
+	pthread_mutex_unlock(&fs->orphan_lock);
+}
+
+/**
+ * Release up to A1FS_RECLAIM_BATCH data blocks from the end of an orphan.
+ *
+ * @return  true if the orphan has no data blocks left.
+ */
+static bool reclaim_batch(fs_ctx *fs, a1fs_inode *inode)
+{
+	a1fs_extent *extent = (a1fs_extent *)((char *)fs->image + (size_t)inode->block_no * A1FS_BLOCK_SIZE);
+	a1fs_blk_t budget = A1FS_RECLAIM_BATCH;
+
+	while (budget > 0 && inode->free_extent_num < 512) {
+		a1fs_extent *last = &extent[511 - inode->free_extent_num];
+		a1fs_blk_t n = (last->count < budget) ? last->count : budget;
+		a1fs_blk_t start = last->start + last->count - n;
+
+		// Trim the extent first: a crash before the blocks are released
+		// leaks them instead of releasing them twice on the next mount
+		last->count -= n;
+		if (last->count == 0) inode->free_extent_num++;
+		release_blocks(start, n, fs);
+		budget -= n;
+	}
+	journal_dirty_inode(fs, inode);
+	return inode->free_extent_num == 512;
+}
+
+/** Unlink a fully reclaimed orphan from the list and free its inode. */
+static void reclaim_finish(fs_ctx *fs, a1fs_ino_t ino)
+{
+	a1fs_inode *inode = &fs->inodes[ino];
+
+	pthread_mutex_lock(&fs->orphan_lock);
+	a1fs_ino_t *link = &fs->sb->orphan_head;
+	while (*link != ino) {
+		link = &fs->inodes[*link].next_orphan;
+	}
+	*link = inode->next_orphan;
+	journal_dirty(fs, link, sizeof(*link));
+	// The orphans after it were added earlier, so they are past use as well
+	if (fs->orphan_safe == ino) fs->orphan_safe = inode->next_orphan;
+	if (fs->sb->orphan_head == 0) pthread_cond_broadcast(&fs->orphan_done);
+	pthread_mutex_unlock(&fs->orphan_lock);
+
+	inode->next_orphan = 0;
+	inode->flags &= ~A1FS_INODE_ORPHAN;
+	journal_dirty(fs, inode, sizeof(*inode));
+	release_block(inode->block_no, fs);
+	release_inode(ino, fs);
+}
+
+/**
+ * Reclaim a batch of the orphan at the head of the list.
+ *
+ * @return  false if the list is empty.
+ */
+static bool reclaim_head(fs_ctx *fs)
+{
+	pthread_mutex_lock(&fs->orphan_lock);
+	a1fs_ino_t ino = fs->sb->orphan_head;
+	pthread_mutex_unlock(&fs->orphan_lock);
+	if (ino == 0) return false;
+
+	// Orphans are unreachable, but operations that looked one up before it
+	// was removed may still be using it; once those have ended only the
+	// reclaimer touches it. Orphans are added at the head, so the ones behind
+	// a safe orphan are safe too
+	if (ino != fs->orphan_safe) {
+		op_synchronize(fs);
+		pthread_mutex_lock(&fs->orphan_lock);
+		fs->orphan_safe = ino;
+		pthread_mutex_unlock(&fs->orphan_lock);
+	}
+
+	// Each batch is an operation, so that it stays out of a journal commit
+	TRACE_START(start);
+	op_begin(fs);
+	if (reclaim_batch(fs, &fs->inodes[ino])) reclaim_finish(fs, ino);
+	op_end(fs);
+	TRACE(TRACE_RECLAIM, start, ino, 0, 0, 0);
+	return true;
+}
+
+static void *reclaimer(void *arg)
+{
+	fs_ctx *fs = (fs_ctx *)arg;
+
+	pthread_mutex_lock(&fs->orphan_lock);
+	while (true) {
+		while (fs->sb->orphan_head == 0 && !fs->reclaimer_stop) {
+			pthread_cond_wait(&fs->orphan_cond, &fs->orphan_lock);
+		}
+		// Keep going until the list is empty, even when asked to stop
+		if (fs->sb->orphan_head == 0) break;
+		pthread_mutex_unlock(&fs->orphan_lock);
+		reclaim_head(fs);
+		pthread_mutex_lock(&fs->orphan_lock);
+	}
+	pthread_mutex_unlock(&fs->orphan_lock);
+	return NULL;
+}
+
+bool orphan_start(fs_ctx *fs)
+{
+	fs->reclaimer_stop = false;
+	int err = pthread_create(&fs->reclaimer, NULL, reclaimer, fs);
+	if (err != 0) {
+		errno = err;
+		perror("pthread_create");
+		return false;
+	}
+	fs->reclaimer_running = true;
+	return true;
+}
+
+void orphan_stop(fs_ctx *fs)
+{
+	if (!fs->reclaimer_running) return;
+
+	pthread_mutex_lock(&fs->orphan_lock);
+	fs->reclaimer_stop = true;
+	pthread_cond_signal(&fs->orphan_cond);
+	pthread_mutex_unlock(&fs->orphan_lock);
+	pthread_join(fs->reclaimer, NULL);
+	fs->reclaimer_running = false;
+}
+
+bool orphan_wait(fs_ctx *fs)
+{
+	if (!fs->reclaimer_running) return false;
+
+	pthread_mutex_lock(&fs->orphan_lock);
+	bool pending = (fs->sb->orphan_head != 0);
+	while (fs->sb->orphan_head != 0) {
+		pthread_cond_wait(&fs->orphan_done, &fs->orphan_lock);
+	}
+	pthread_mutex_unlock(&fs->orphan_lock);
+	return pending;
+}
+
+void orphan_reclaim_all(fs_ctx *fs)
+{
+	while (reclaim_head(fs));
+}
@@ -0,0 +1,68 @@
+/**
+ * a1fs orphan list - asynchronous reclamation of unlinked files.
+ *
+ * Unlinking a file only detaches its inode into a singly linked list of
+ * orphans rooted in the superblock (see a1fs_superblock.orphan_head) and
+ * returns. A background reclaimer thread releases the data blocks of orphans
+ * a batch at a time, trimming the inode's extents as it goes, so that the
+ * list always describes exactly the blocks that are still to be freed. An
+ * orphan is unlinked from the list and its inode freed once all its blocks
+ * are gone. Orphans left over by a crash are picked up on the next mount.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "a1fs.h"
+
+
+/** Maximum number of blocks released by the reclaimer at a time. */
+#define A1FS_RECLAIM_BATCH 4096
+
+struct fs_ctx;
+
+/**
+ * Put an unlinked file or removed directory on the orphan list for the
+ * reclaimer, which frees it once the operations in progress have ended.
+ *
+ * The inode must not be reachable from the namespace anymore.
+ *
+ * @param fs   file system context.
+ * @param ino  inode number of the unlinked file.
+ */
+void orphan_add(struct fs_ctx *fs, a1fs_ino_t ino);
+
+/**
+ * Start the background reclaimer thread.
+ *
+ * @param fs  file system context.
+ * @return    true on success; false if the thread could not be created.
+ */
+bool orphan_start(struct fs_ctx *fs);
+
+/**
+ * Stop the background reclaimer thread after it has emptied the orphan list.
+ *
+ * @param fs  file system context.
+ */
+void orphan_stop(struct fs_ctx *fs);
+
+/**
+ * Wait until the reclaimer has emptied the orphan list. Used to retry an
+ * operation that ran out of space while removed files were still to be freed.
+ * Must not be called from within an operation (see op_begin()).
+ *
+ * @param fs  file system context.
+ * @return    true if there were orphans to wait for; false if there were
+ *            none or no reclaimer is running.
+ */
+bool orphan_wait(struct fs_ctx *fs);
+
+/**
+ * Reclaim all orphans in the calling thread. Used by the tools that open an
+ * unmounted image, where no reclaimer is running.
+ *
+ * @param fs  file system context.
+ */
+void orphan_reclaim_all(struct fs_ctx *fs);
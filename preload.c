@@ -0,0 +1,1064 @@
+/**
+ * a1fs LD_PRELOAD shim.
+ *
+ * Serves the files of an a1fs image under a path prefix directly from the
+ * process, through liba1fs, without a FUSE mount: the image is mapped into the
+ * process, and the libc calls that take a path under the prefix, or a file
+ * descriptor or directory stream opened through one, are answered from the
+ * mapping. Everything else falls through to libc.
+ *
+ * Usage:
+ *   A1FS_IMAGE=disk.img A1FS_PREFIX=/a1fs LD_PRELOAD=./liba1fs-preload.so prog
+ *
+ * The image is mapped privately by default, so that any number of processes can
+ * read it at once: opening a file for writing fails with EROFS. With
+ * A1FS_WRITABLE=1 the image is mapped shared and changes are written back when
+ * the process exits; the image must then not be used by anything else at the
+ * same time, mounted or not.
+ *
+ * Interposed: open, openat, creat, fopen, close, dup, dup2, dup3, fcntl (only
+ * to duplicate descriptors), read, pread, write, pwrite, lseek, stat, lstat,
+ * fstat, fstatat, statx, access, getxattr, listxattr, opendir, readdir,
+ * rewinddir, closedir (and their 64-bit, fortified, l* and __xstat variants).
+ * File descriptors of a1fs files are backed by /dev/null descriptors, so that
+ * their numbers can't clash with real ones; calls this shim doesn't know about
+ * (mmap, exec, ...) see /dev/null, as do the writes libc makes internally, e.g.
+ * stdio writing to a descriptor that a shell redirection put in place. Only
+ * 64-bit builds are supported, where struct stat and struct stat64 are the
+ * same.
+ */
+
+// The 64-bit variants are defined explicitly below, rather than through the
+// redirections of _FILE_OFFSET_BITS
+#undef _FILE_OFFSET_BITS
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "liba1fs.h"
+
+
+/** Device number reported for a1fs files. */
+#define SHIM_DEV makedev(0xa1, 0xf5)
+/** Largest number of file descriptors tracked. */
+#define SHIM_MAX_FILES 65536
+
+/** Open a1fs file. */
+typedef struct shim_file {
+	/** Path within the image. */
+	char path[PATH_MAX];
+	/** open() flags. */
+	int flags;
+	/** File offset, protected by lock. */
+	off_t offset;
+	pthread_mutex_t lock;
+	/** Number of file descriptors sharing the file (see dup()), protected by shim.lock. */
+	int refs;
+} shim_file;
+
+/** Open a1fs directory stream, returned as a DIR *. */
+typedef struct shim_dir {
+	struct shim_dir *next;
+	/** Entry names, each terminated by '\0'. */
+	char *names;
+	size_t len;
+	size_t cap;
+	/** Offset of the next entry in names, and its index. */
+	size_t pos;
+	long index;
+	struct dirent ent;
+} shim_dir;
+
+/** Shim state. */
+static struct {
+	/** Open image; NULL if the shim is not configured. */
+	fs_ctx *fs;
+	/** Private mapping of the image; NULL if mapped by liba1fs. */
+	void *image;
+	size_t size;
+	bool writable;
+
+	/** Normalized path prefix, without a trailing '/'. */
+	char prefix[PATH_MAX];
+	size_t prefix_len;
+
+	/** Open files by file descriptor; protected by lock. */
+	shim_file **files;
+	int max_files;
+	/** Open directory streams; protected by lock. */
+	shim_dir *dirs;
+	pthread_mutex_t lock;
+} shim = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static pthread_once_t shim_once = PTHREAD_ONCE_INIT;
+/** Set while shim_init() runs; liba1fs calls libc then, which must fall through. */
+static __thread bool shim_initializing;
+
+// libc functions, resolved by shim_init()
+static int (*real_open)(const char *, int, ...);
+static int (*real_openat)(int, const char *, int, ...);
+static int (*real_close)(int);
+static int (*real_dup)(int);
+static int (*real_dup2)(int, int);
+static int (*real_dup3)(int, int, int);
+static int (*real_fcntl)(int, int, ...);
+static ssize_t (*real_read)(int, void *, size_t);
+static ssize_t (*real_pread)(int, void *, size_t, off_t);
+static ssize_t (*real_write)(int, const void *, size_t);
+static ssize_t (*real_pwrite)(int, const void *, size_t, off_t);
+static off_t (*real_lseek)(int, off_t, int);
+static int (*real_stat)(const char *, struct stat *);
+static int (*real_lstat)(const char *, struct stat *);
+static int (*real_fstat)(int, struct stat *);
+static int (*real_fstatat)(int, const char *, struct stat *, int);
+static int (*real_statx)(int, const char *, int, unsigned int, struct statx *);
+static int (*real_access)(const char *, int);
+static ssize_t (*real_getxattr)(const char *, const char *, void *, size_t);
+static ssize_t (*real_lgetxattr)(const char *, const char *, void *, size_t);
+static ssize_t (*real_listxattr)(const char *, char *, size_t);
+static ssize_t (*real_llistxattr)(const char *, char *, size_t);
+static FILE *(*real_fopen)(const char *, const char *);
+static DIR *(*real_opendir)(const char *);
+static struct dirent *(*real_readdir)(DIR *);
+static void (*real_rewinddir)(DIR *);
+static int (*real_closedir)(DIR *);
+
+static void *real(const char *name)
+{
+	void *fn = dlsym(RTLD_NEXT, name);
+	if (fn == NULL) {
+		fprintf(stderr, "a1fs-preload: %s not found\n", name);
+		abort();
+	}
+	return fn;
+}
+
+/**
+ * Normalize an absolute path: collapse repeated '/', drop "." components and
+ * resolve ".." components lexically.
+ *
+ * @param path  absolute path.
+ * @param out   receives the result, PATH_MAX bytes.
+ * @return      true on success; false if the result is too long.
+ */
+static bool normalize(const char *path, char *out)
+{
+	size_t len = 0;
+	out[0] = '\0';
+	while (*path != '\0') {
+		while (*path == '/') path++;
+		const char *end = strchrnul(path, '/');
+		size_t n = end - path;
+		if (n == 0 || (n == 1 && path[0] == '.')) {
+			// nothing to add
+		} else if (n == 2 && path[0] == '.' && path[1] == '.') {
+			while (len > 0 && out[len - 1] != '/') len--;
+			if (len > 0) len--;
+		} else {
+			if (len + 1 + n >= PATH_MAX) return false;
+			out[len++] = '/';
+			memcpy(out + len, path, n);
+			len += n;
+		}
+		path = end;
+	}
+	if (len == 0) out[len++] = '/';
+	out[len] = '\0';
+	return true;
+}
+
+/** Map the image and open it, if configured. */
+static void shim_init(void)
+{
+	real_open = real("open");
+	real_openat = real("openat");
+	real_close = real("close");
+	real_dup = real("dup");
+	real_dup2 = real("dup2");
+	real_dup3 = real("dup3");
+	real_fcntl = real("fcntl");
+	real_read = real("read");
+	real_pread = real("pread");
+	real_write = real("write");
+	real_pwrite = real("pwrite");
+	real_lseek = real("lseek");
+	real_stat = real("stat");
+	real_lstat = real("lstat");
+	real_fstat = real("fstat");
+	real_fstatat = real("fstatat");
+	real_statx = real("statx");
+	real_access = real("access");
+	real_getxattr = real("getxattr");
+	real_lgetxattr = real("lgetxattr");
+	real_listxattr = real("listxattr");
+	real_llistxattr = real("llistxattr");
+	real_fopen = real("fopen");
+	real_opendir = real("opendir");
+	real_readdir = real("readdir");
+	real_rewinddir = real("rewinddir");
+	real_closedir = real("closedir");
+	shim_initializing = true;
+
+	const char *img_path = getenv("A1FS_IMAGE");
+	const char *prefix = getenv("A1FS_PREFIX");
+	if (img_path == NULL || prefix == NULL) goto end;
+	if (prefix[0] != '/' || !normalize(prefix, shim.prefix) || strcmp(shim.prefix, "/") == 0) {
+		fprintf(stderr, "a1fs-preload: A1FS_PREFIX must be an absolute path other than /\n");
+		goto end;
+	}
+	shim.prefix_len = strlen(shim.prefix);
+	const char *writable = getenv("A1FS_WRITABLE");
+	shim.writable = writable != NULL && strcmp(writable, "0") != 0;
+
+	struct rlimit rl;
+	shim.max_files = SHIM_MAX_FILES;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)shim.max_files) {
+		shim.max_files = (int)rl.rlim_cur;
+	}
+	shim.files = calloc(shim.max_files, sizeof(shim_file *));
+	if (shim.files == NULL) {
+		perror("a1fs-preload: calloc");
+		goto end;
+	}
+
+	int fd = real_open(img_path, shim.writable ? O_RDWR : O_RDONLY);
+	if (fd < 0) {
+		perror(img_path);
+		goto end;
+	}
+	if (shim.writable) {
+		shim.fs = a1fs_open_fd(fd, NULL);
+	} else {
+		// Mounting writes to the superblock (and replays the journal), which
+		// must not reach the image
+		struct stat st;
+		if (real_fstat(fd, &st) == 0 && st.st_size > 0) {
+			void *image = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+			if (image != MAP_FAILED) {
+				shim.image = image;
+				shim.size = st.st_size;
+				shim.fs = a1fs_open_mem(image, st.st_size, NULL);
+				if (shim.fs == NULL) munmap(image, st.st_size);
+			}
+		}
+	}
+	real_close(fd);
+	if (shim.fs == NULL) fprintf(stderr, "a1fs-preload: failed to open %s\n", img_path);
+end:
+	shim_initializing = false;
+}
+
+/** Write back the changes made by the process. */
+__attribute__((destructor))
+static void shim_fini(void)
+{
+	if (shim.fs == NULL) return;
+	a1fs_close(shim.fs);
+	shim.fs = NULL;
+	if (shim.image != NULL) munmap(shim.image, shim.size);
+}
+
+/** Get the open image; NULL if the shim is not configured. */
+static fs_ctx *shim_fs(void)
+{
+	if (shim_initializing) return NULL;
+	pthread_once(&shim_once, shim_init);
+	return shim.fs;
+}
+
+/** Get the a1fs file open at a file descriptor; NULL if it isn't one. */
+static shim_file *get_file(int fd)
+{
+	if (shim_fs() == NULL || fd < 0 || fd >= shim.max_files) return NULL;
+	return __atomic_load_n(&shim.files[fd], __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Translate a path to a path within the image.
+ *
+ * @param dirfd  directory a relative path is relative to, or AT_FDCWD.
+ * @param path   path as passed to libc.
+ * @param out    receives the path within the image, PATH_MAX bytes.
+ * @return       true if the path is under the prefix; false otherwise.
+ */
+static bool inner_path(int dirfd, const char *path, char *out)
+{
+	if (shim_fs() == NULL || path == NULL) return false;
+
+	char full[PATH_MAX];
+	if (path[0] == '/') {
+		if (!normalize(path, full)) return false;
+	} else {
+		char base[PATH_MAX];
+		shim_file *dir = (dirfd == AT_FDCWD) ? NULL : get_file(dirfd);
+		if (dir != NULL) {
+			// Relative to an a1fs directory, already within the image
+			if ((size_t)snprintf(base, sizeof(base), "%s/%s", dir->path, path) >= sizeof(base)) return false;
+			return normalize(base, out);
+		}
+		if (dirfd != AT_FDCWD || getcwd(base, sizeof(base)) == NULL) return false;
+		size_t len = strlen(base);
+		if (len + 1 + strlen(path) >= sizeof(base)) return false;
+		base[len] = '/';
+		strcpy(base + len + 1, path);
+		if (!normalize(base, full)) return false;
+	}
+
+	if (strncmp(full, shim.prefix, shim.prefix_len) != 0) return false;
+	const char *rest = full + shim.prefix_len;
+	if (*rest != '\0' && *rest != '/') return false;
+	strcpy(out, (*rest == '\0') ? "/" : rest);
+	return true;
+}
+
+/** Set errno from a -errno result and return -1; or return the result. */
+static long result(long ret)
+{
+	if (ret >= 0) return ret;
+	errno = (int)-ret;
+	return -1;
+}
+
+
+/**
+ * Open an a1fs file.
+ *
+ * @return  file descriptor on success; -errno on error.
+ */
+static int file_open(const char *path, int flags, mode_t mode)
+{
+	fs_ctx *fs = shim.fs;
+	int acc = flags & O_ACCMODE;
+	bool write = acc != O_RDONLY || (flags & O_TRUNC);
+	if (write && !shim.writable) return -EROFS;
+
+	struct stat st;
+	int ret = a1fs_stat(fs, path, &st);
+	if (ret == -ENOENT && (flags & O_CREAT)) {
+		if (!shim.writable) return -EROFS;
+		ret = a1fs_create(fs, path, mode & 07777);
+		if (ret == 0) ret = a1fs_stat(fs, path, &st);
+	} else if (ret == 0 && (flags & O_CREAT) && (flags & O_EXCL)) {
+		return -EEXIST;
+	}
+	if (ret != 0) return ret;
+	if (S_ISDIR(st.st_mode) && write) return -EISDIR;
+	if (!S_ISDIR(st.st_mode) && (flags & O_DIRECTORY)) return -ENOTDIR;
+	if ((flags & O_TRUNC) && st.st_size != 0) {
+		ret = a1fs_truncate(fs, path, 0);
+		if (ret != 0) return ret;
+	}
+
+	shim_file *file = malloc(sizeof(shim_file));
+	if (file == NULL) return -ENOMEM;
+	strcpy(file->path, path);
+	file->flags = flags;
+	file->offset = 0;
+	pthread_mutex_init(&file->lock, NULL);
+	file->refs = 1;
+
+	// A real descriptor reserves the number
+	int fd = real_open("/dev/null", O_RDWR | (flags & O_CLOEXEC));
+	if (fd < 0 || fd >= shim.max_files) {
+		ret = (fd < 0) ? -errno : -EMFILE;
+		if (fd >= 0) real_close(fd);
+		pthread_mutex_destroy(&file->lock);
+		free(file);
+		return ret;
+	}
+	__atomic_store_n(&shim.files[fd], file, __ATOMIC_RELEASE);
+	return fd;
+}
+
+/**
+ * Remove an a1fs file from the descriptor table, freeing it when it was the
+ * last descriptor of the file. The real descriptor is left open.
+ *
+ * @return  0 on success; -errno on error.
+ */
+static int file_release(int fd, shim_file *file)
+{
+	pthread_mutex_lock(&shim.lock);
+	__atomic_store_n(&shim.files[fd], NULL, __ATOMIC_RELEASE);
+	bool last = --file->refs == 0;
+	pthread_mutex_unlock(&shim.lock);
+	if (!last) return 0;
+
+	int ret = ((file->flags & O_ACCMODE) != O_RDONLY) ? a1fs_flush(shim.fs, file->path) : 0;
+	pthread_mutex_destroy(&file->lock);
+	free(file);
+	return ret;
+}
+
+/** Close an a1fs file descriptor. */
+static int file_close(int fd, shim_file *file)
+{
+	int ret = file_release(fd, file);
+	real_close(fd);
+	return ret;
+}
+
+/**
+ * Make a new descriptor, already reserved by duplicating the real one, refer to
+ * an a1fs file.
+ *
+ * @return  fd on success; -errno on error.
+ */
+static int file_dup(shim_file *file, int fd)
+{
+	if (fd >= shim.max_files) {
+		real_close(fd);
+		return -EMFILE;
+	}
+	pthread_mutex_lock(&shim.lock);
+	file->refs++;
+	__atomic_store_n(&shim.files[fd], file, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&shim.lock);
+	return fd;
+}
+
+/**
+ * Read from an a1fs file.
+ *
+ * @param offset  file offset; -1 to use and advance the file descriptor offset.
+ * @return        number of bytes read; -errno on error.
+ */
+static ssize_t file_read(shim_file *file, void *buf, size_t count, off_t offset)
+{
+	if ((file->flags & O_ACCMODE) == O_WRONLY) return -EBADF;
+	if (count > INT_MAX) count = INT_MAX;
+	if (offset >= 0) return a1fs_read(shim.fs, file->path, buf, count, offset);
+
+	pthread_mutex_lock(&file->lock);
+	ssize_t ret = a1fs_read(shim.fs, file->path, buf, count, file->offset);
+	if (ret > 0) file->offset += ret;
+	pthread_mutex_unlock(&file->lock);
+	return ret;
+}
+
+/**
+ * Write to an a1fs file.
+ *
+ * @param offset  file offset; -1 to use and advance the file descriptor offset.
+ * @return        number of bytes written; -errno on error.
+ */
+static ssize_t file_write(shim_file *file, const void *buf, size_t count, off_t offset)
+{
+	if ((file->flags & O_ACCMODE) == O_RDONLY) return -EBADF;
+	if (count > INT_MAX) count = INT_MAX;
+	if (offset >= 0) return a1fs_write(shim.fs, file->path, buf, count, offset);
+
+	pthread_mutex_lock(&file->lock);
+	if (file->flags & O_APPEND) {
+		struct stat st;
+		int ret = a1fs_stat(shim.fs, file->path, &st);
+		if (ret != 0) {
+			pthread_mutex_unlock(&file->lock);
+			return ret;
+		}
+		file->offset = st.st_size;
+	}
+	ssize_t ret = a1fs_write(shim.fs, file->path, buf, count, file->offset);
+	if (ret > 0) file->offset += ret;
+	pthread_mutex_unlock(&file->lock);
+	return ret;
+}
+
+/** Get the attributes of a file within the image. */
+static int path_stat(const char *path, struct stat *st)
+{
+	int ret = a1fs_stat(shim.fs, path, st);
+	if (ret != 0) return ret;
+	st->st_dev = SHIM_DEV;
+	st->st_blksize = A1FS_BLOCK_SIZE;
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	st->st_atim = st->st_mtim;
+	st->st_ctim = st->st_mtim;
+	return 0;
+}
+
+
+static int do_open(int dirfd, const char *path, int flags, mode_t mode)
+{
+	char inner[PATH_MAX];
+	if (!inner_path(dirfd, path, inner)) {
+		if (dirfd == AT_FDCWD) return real_open(path, flags, mode);
+		return real_openat(dirfd, path, flags, mode);
+	}
+	return (int)result(file_open(inner, flags, mode));
+}
+
+/** Get the mode argument of open(), only passed with O_CREAT or O_TMPFILE. */
+#define OPEN_MODE(flags, mode) \
+	do { \
+		if ((flags) & (O_CREAT | O_TMPFILE)) { \
+			va_list ap; \
+			va_start(ap, flags); \
+			mode = va_arg(ap, mode_t); \
+			va_end(ap); \
+		} \
+	} while (0)
+
+int open(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	OPEN_MODE(flags, mode);
+	return do_open(AT_FDCWD, path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	OPEN_MODE(flags, mode);
+	return do_open(AT_FDCWD, path, flags | O_LARGEFILE, mode);
+}
+
+int openat(int dirfd, const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	OPEN_MODE(flags, mode);
+	return do_open(dirfd, path, flags, mode);
+}
+
+int openat64(int dirfd, const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	OPEN_MODE(flags, mode);
+	return do_open(dirfd, path, flags | O_LARGEFILE, mode);
+}
+
+int __open_2(const char *path, int flags)
+{
+	return do_open(AT_FDCWD, path, flags, 0);
+}
+
+int __open64_2(const char *path, int flags)
+{
+	return do_open(AT_FDCWD, path, flags | O_LARGEFILE, 0);
+}
+
+int creat(const char *path, mode_t mode)
+{
+	return do_open(AT_FDCWD, path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+}
+
+int creat64(const char *path, mode_t mode)
+{
+	return creat(path, mode);
+}
+
+int close(int fd)
+{
+	shim_file *file = get_file(fd);
+	if (file == NULL) return real_close(fd);
+	return (int)result(file_close(fd, file));
+}
+
+int dup(int oldfd)
+{
+	shim_file *file = get_file(oldfd);
+	if (file == NULL) return real_dup(oldfd);
+	int fd = real_dup(oldfd);
+	if (fd < 0) return fd;
+	return (int)result(file_dup(file, fd));
+}
+
+int dup3(int oldfd, int newfd, int flags)
+{
+	shim_file *file = get_file(oldfd);
+	shim_file *old = get_file(newfd);
+	if (file == NULL && old == NULL) return real_dup3(oldfd, newfd, flags);
+	if (oldfd == newfd) {
+		errno = EINVAL;
+		return -1;
+	}
+	// newfd is closed silently, like dup2() does
+	if (old != NULL) file_release(newfd, old);
+	int fd = real_dup3(oldfd, newfd, flags);
+	if (fd < 0 || file == NULL) return fd;
+	return (int)result(file_dup(file, fd));
+}
+
+int dup2(int oldfd, int newfd)
+{
+	if (oldfd == newfd) return real_dup2(oldfd, newfd);
+	return dup3(oldfd, newfd, 0);
+}
+
+int fcntl(int fd, int cmd, ...)
+{
+	// All commands take an int, a pointer or nothing; passing on a pointer
+	// sized argument covers them all
+	va_list ap;
+	va_start(ap, cmd);
+	void *arg = va_arg(ap, void *);
+	va_end(ap);
+
+	int ret = real_fcntl(fd, cmd, arg);
+	if (ret < 0 || (cmd != F_DUPFD && cmd != F_DUPFD_CLOEXEC)) return ret;
+	shim_file *file = get_file(fd);
+	if (file == NULL) return ret;
+	return (int)result(file_dup(file, ret));
+}
+
+int fcntl64(int fd, int cmd, ...)
+{
+	va_list ap;
+	va_start(ap, cmd);
+	void *arg = va_arg(ap, void *);
+	va_end(ap);
+	return fcntl(fd, cmd, arg);
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+	shim_file *file = get_file(fd);
+	if (file == NULL) return real_read(fd, buf, count);
+	return result(file_read(file, buf, count, -1));
+}
+
+ssize_t __read_chk(int fd, void *buf, size_t count, size_t buflen)
+{
+	if (count > buflen) abort();
+	return read(fd, buf, count);
+}
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset)
+{
+	shim_file *file = get_file(fd);
+	if (file == NULL) return real_pread(fd, buf, count, offset);
+	if (offset < 0) return result(-EINVAL);
+	return result(file_read(file, buf, count, offset));
+}
+
+ssize_t pread64(int fd, void *buf, size_t count, off64_t offset)
+{
+	return pread(fd, buf, count, offset);
+}
+
+ssize_t __pread_chk(int fd, void *buf, size_t count, off_t offset, size_t buflen)
+{
+	if (count > buflen) abort();
+	return pread(fd, buf, count, offset);
+}
+
+ssize_t __pread64_chk(int fd, void *buf, size_t count, off64_t offset, size_t buflen)
+{
+	if (count > buflen) abort();
+	return pread(fd, buf, count, offset);
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+	shim_file *file = get_file(fd);
+	if (file == NULL) return real_write(fd, buf, count);
+	return result(file_write(file, buf, count, -1));
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+	shim_file *file = get_file(fd);
+	if (file == NULL) return real_pwrite(fd, buf, count, offset);
+	if (offset < 0) return result(-EINVAL);
+	return result(file_write(file, buf, count, offset));
+}
+
+ssize_t pwrite64(int fd, const void *buf, size_t count, off64_t offset)
+{
+	return pwrite(fd, buf, count, offset);
+}
+
+off_t lseek(int fd, off_t offset, int whence)
+{
+	shim_file *file = get_file(fd);
+	if (file == NULL) return real_lseek(fd, offset, whence);
+
+	pthread_mutex_lock(&file->lock);
+	off_t base = 0;
+	long ret = 0;
+	if (whence == SEEK_CUR) {
+		base = file->offset;
+	} else if (whence == SEEK_END) {
+		struct stat st;
+		ret = a1fs_stat(shim.fs, file->path, &st);
+		base = st.st_size;
+	} else if (whence != SEEK_SET) {
+		ret = -EINVAL;
+	}
+	if (ret == 0 && base + offset < 0) ret = -EINVAL;
+	if (ret == 0) ret = file->offset = base + offset;
+	pthread_mutex_unlock(&file->lock);
+	return result(ret);
+}
+
+off64_t lseek64(int fd, off64_t offset, int whence)
+{
+	return lseek(fd, offset, whence);
+}
+
+
+int stat(const char *path, struct stat *st)
+{
+	char inner[PATH_MAX];
+	if (!inner_path(AT_FDCWD, path, inner)) return real_stat(path, st);
+	return (int)result(path_stat(inner, st));
+}
+
+int lstat(const char *path, struct stat *st)
+{
+	// No symbolic links in a1fs
+	char inner[PATH_MAX];
+	if (!inner_path(AT_FDCWD, path, inner)) return real_lstat(path, st);
+	return (int)result(path_stat(inner, st));
+}
+
+int fstat(int fd, struct stat *st)
+{
+	shim_file *file = get_file(fd);
+	if (file == NULL) return real_fstat(fd, st);
+	return (int)result(path_stat(file->path, st));
+}
+
+int fstatat(int dirfd, const char *path, struct stat *st, int flags)
+{
+	if ((flags & AT_EMPTY_PATH) && path[0] == '\0') {
+		if (dirfd == AT_FDCWD) return stat(".", st);
+		return fstat(dirfd, st);
+	}
+	char inner[PATH_MAX];
+	if (!inner_path(dirfd, path, inner)) return real_fstatat(dirfd, path, st, flags);
+	return (int)result(path_stat(inner, st));
+}
+
+int stat64(const char *path, struct stat64 *st)
+{
+	return stat(path, (struct stat *)st);
+}
+
+int lstat64(const char *path, struct stat64 *st)
+{
+	return lstat(path, (struct stat *)st);
+}
+
+int fstat64(int fd, struct stat64 *st)
+{
+	return fstat(fd, (struct stat *)st);
+}
+
+int fstatat64(int dirfd, const char *path, struct stat64 *st, int flags)
+{
+	return fstatat(dirfd, path, (struct stat *)st, flags);
+}
+
+// Binaries built against glibc before 2.33 call these instead
+int __xstat(int ver, const char *path, struct stat *st)
+{
+	(void)ver;// unused
+	return stat(path, st);
+}
+
+int __lxstat(int ver, const char *path, struct stat *st)
+{
+	(void)ver;// unused
+	return lstat(path, st);
+}
+
+int __fxstat(int ver, int fd, struct stat *st)
+{
+	(void)ver;// unused
+	return fstat(fd, st);
+}
+
+int __fxstatat(int ver, int dirfd, const char *path, struct stat *st, int flags)
+{
+	(void)ver;// unused
+	return fstatat(dirfd, path, st, flags);
+}
+
+int __xstat64(int ver, const char *path, struct stat64 *st)
+{
+	(void)ver;// unused
+	return stat(path, (struct stat *)st);
+}
+
+int __lxstat64(int ver, const char *path, struct stat64 *st)
+{
+	(void)ver;// unused
+	return lstat(path, (struct stat *)st);
+}
+
+int __fxstat64(int ver, int fd, struct stat64 *st)
+{
+	(void)ver;// unused
+	return fstat(fd, (struct stat *)st);
+}
+
+int __fxstatat64(int ver, int dirfd, const char *path, struct stat64 *st, int flags)
+{
+	(void)ver;// unused
+	return fstatat(dirfd, path, (struct stat *)st, flags);
+}
+
+int statx(int dirfd, const char *path, int flags, unsigned int mask, struct statx *stx)
+{
+	struct stat st;
+	int ret;
+	shim_file *file = NULL;
+	char inner[PATH_MAX];
+	if ((flags & AT_EMPTY_PATH) && path[0] == '\0') {
+		file = get_file(dirfd);
+		if (file == NULL) return real_statx(dirfd, path, flags, mask, stx);
+		ret = path_stat(file->path, &st);
+	} else {
+		if (!inner_path(dirfd, path, inner)) return real_statx(dirfd, path, flags, mask, stx);
+		ret = path_stat(inner, &st);
+	}
+	if (ret != 0) return (int)result(ret);
+
+	memset(stx, 0, sizeof(*stx));
+	stx->stx_mask = STATX_BASIC_STATS & ~STATX_ATIME & ~STATX_CTIME & ~STATX_BTIME;
+	stx->stx_blksize = st.st_blksize;
+	stx->stx_nlink = st.st_nlink;
+	stx->stx_uid = st.st_uid;
+	stx->stx_gid = st.st_gid;
+	stx->stx_mode = st.st_mode;
+	stx->stx_ino = st.st_ino;
+	stx->stx_size = st.st_size;
+	stx->stx_blocks = st.st_blocks;
+	stx->stx_mtime.tv_sec = st.st_mtim.tv_sec;
+	stx->stx_mtime.tv_nsec = st.st_mtim.tv_nsec;
+	stx->stx_dev_major = major(st.st_dev);
+	stx->stx_dev_minor = minor(st.st_dev);
+	return 0;
+}
+
+int access(const char *path, int mode)
+{
+	char inner[PATH_MAX];
+	if (!inner_path(AT_FDCWD, path, inner)) return real_access(path, mode);
+	struct stat st;
+	int ret = path_stat(inner, &st);
+	if (ret == 0 && (mode & W_OK) && !shim.writable) ret = -EROFS;
+	return (int)result(ret);
+}
+
+
+/** a1fs has no extended attributes; fail like a file system without any would. */
+static ssize_t path_getxattr(const char *path)
+{
+	struct stat st;
+	int ret = path_stat(path, &st);
+	return result((ret != 0) ? ret : -ENODATA);
+}
+
+static ssize_t path_listxattr(const char *path)
+{
+	struct stat st;
+	return result(path_stat(path, &st));
+}
+
+ssize_t getxattr(const char *path, const char *name, void *value, size_t size)
+{
+	char inner[PATH_MAX];
+	if (!inner_path(AT_FDCWD, path, inner)) return real_getxattr(path, name, value, size);
+	return path_getxattr(inner);
+}
+
+ssize_t lgetxattr(const char *path, const char *name, void *value, size_t size)
+{
+	char inner[PATH_MAX];
+	if (!inner_path(AT_FDCWD, path, inner)) return real_lgetxattr(path, name, value, size);
+	return path_getxattr(inner);
+}
+
+ssize_t listxattr(const char *path, char *list, size_t size)
+{
+	char inner[PATH_MAX];
+	if (!inner_path(AT_FDCWD, path, inner)) return real_listxattr(path, list, size);
+	return path_listxattr(inner);
+}
+
+ssize_t llistxattr(const char *path, char *list, size_t size)
+{
+	char inner[PATH_MAX];
+	if (!inner_path(AT_FDCWD, path, inner)) return real_llistxattr(path, list, size);
+	return path_listxattr(inner);
+}
+
+/** fopencookie() functions of a1fs streams; the cookie is the descriptor. */
+static ssize_t cookie_read(void *cookie, char *buf, size_t size)
+{
+	return read((int)(intptr_t)cookie, buf, size);
+}
+
+static ssize_t cookie_write(void *cookie, const char *buf, size_t size)
+{
+	ssize_t ret = write((int)(intptr_t)cookie, buf, size);
+	// A short write is reported as an error by stdio anyway
+	return (ret < 0) ? 0 : ret;
+}
+
+static int cookie_seek(void *cookie, off64_t *offset, int whence)
+{
+	off_t ret = lseek((int)(intptr_t)cookie, *offset, whence);
+	if (ret < 0) return -1;
+	*offset = ret;
+	return 0;
+}
+
+static int cookie_close(void *cookie)
+{
+	return close((int)(intptr_t)cookie);
+}
+
+FILE *fopen(const char *path, const char *mode)
+{
+	char inner[PATH_MAX];
+	if (!inner_path(AT_FDCWD, path, inner)) return real_fopen(path, mode);
+
+	int flags;
+	switch (mode[0]) {
+		case 'r': flags = O_RDONLY; break;
+		case 'w': flags = O_WRONLY | O_CREAT | O_TRUNC; break;
+		case 'a': flags = O_WRONLY | O_CREAT | O_APPEND; break;
+		default : errno = EINVAL; return NULL;
+	}
+	for (const char *c = mode + 1; *c != '\0'; c++) {
+		if (*c == '+') flags = (flags & ~O_ACCMODE) | O_RDWR;
+		if (*c == 'x') flags |= O_EXCL;
+		if (*c == 'e') flags |= O_CLOEXEC;
+	}
+	int fd = (int)result(file_open(inner, flags, 0666));
+	if (fd < 0) return NULL;
+
+	cookie_io_functions_t io = { cookie_read, cookie_write, cookie_seek, cookie_close };
+	FILE *f = fopencookie((void *)(intptr_t)fd, mode, io);
+	if (f == NULL) close(fd);
+	return f;
+}
+
+FILE *fopen64(const char *path, const char *mode)
+{
+	return fopen(path, mode);
+}
+
+
+/** Append a directory entry name, called by a1fs_readdir(). */
+static int dir_add(void *buf, const char *name)
+{
+	shim_dir *dir = (shim_dir *)buf;
+	size_t n = strlen(name) + 1;
+	if (dir->len + n > dir->cap) {
+		size_t cap = (dir->cap == 0) ? 4096 : dir->cap * 2;
+		while (cap < dir->len + n) cap *= 2;
+		char *names = realloc(dir->names, cap);
+		if (names == NULL) return -ENOMEM;
+		dir->names = names;
+		dir->cap = cap;
+	}
+	memcpy(dir->names + dir->len, name, n);
+	dir->len += n;
+	return 0;
+}
+
+/** Check whether a directory stream was opened by the shim. */
+static shim_dir *get_dir(DIR *d)
+{
+	if (shim_fs() == NULL) return NULL;
+	pthread_mutex_lock(&shim.lock);
+	shim_dir *dir = shim.dirs;
+	while (dir != NULL && dir != (shim_dir *)d) dir = dir->next;
+	pthread_mutex_unlock(&shim.lock);
+	return dir;
+}
+
+DIR *opendir(const char *path)
+{
+	char inner[PATH_MAX];
+	if (!inner_path(AT_FDCWD, path, inner)) return real_opendir(path);
+
+	// The entries are read all at once, like getdents() into a large buffer
+	shim_dir *dir = calloc(1, sizeof(shim_dir));
+	if (dir == NULL) return NULL;
+	int ret = a1fs_readdir(shim.fs, inner, dir, dir_add);
+	if (ret != 0) {
+		free(dir->names);
+		free(dir);
+		errno = (ret < 0) ? -ret : ENOMEM;
+		return NULL;
+	}
+	pthread_mutex_lock(&shim.lock);
+	dir->next = shim.dirs;
+	shim.dirs = dir;
+	pthread_mutex_unlock(&shim.lock);
+	return (DIR *)dir;
+}
+
+struct dirent *readdir(DIR *d)
+{
+	shim_dir *dir = get_dir(d);
+	if (dir == NULL) return real_readdir(d);
+	if (dir->pos >= dir->len) return NULL;
+
+	const char *name = dir->names + dir->pos;
+	size_t n = strlen(name) + 1;
+	memset(&dir->ent, 0, sizeof(dir->ent));
+	// Entries with d_ino 0 are skipped by some programs
+	dir->ent.d_ino = ++dir->index;
+	dir->ent.d_off = dir->index;
+	dir->ent.d_reclen = sizeof(dir->ent);
+	dir->ent.d_type = DT_UNKNOWN;
+	memcpy(dir->ent.d_name, name, n);
+	dir->pos += n;
+	return &dir->ent;
+}
+
+struct dirent64 *readdir64(DIR *d)
+{
+	return (struct dirent64 *)readdir(d);
+}
+
+void rewinddir(DIR *d)
+{
+	shim_dir *dir = get_dir(d);
+	if (dir == NULL) {
+		real_rewinddir(d);
+		return;
+	}
+	dir->pos = 0;
+	dir->index = 0;
+}
+
+int closedir(DIR *d)
+{
+	shim_dir *dir = get_dir(d);
+	if (dir == NULL) return real_closedir(d);
+
+	pthread_mutex_lock(&shim.lock);
+	shim_dir **p = &shim.dirs;
+	while (*p != dir) p = &(*p)->next;
+	*p = dir->next;
+	pthread_mutex_unlock(&shim.lock);
+	free(dir->names);
+	free(dir);
+	return 0;
+}
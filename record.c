@@ -0,0 +1,105 @@
+/**
+ * a1fs workload recording implementation.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "a1fs.h"
+#include "record.h"
+
+
+struct record_log {
+	FILE *f;
+	/** stats_begin() time at the start of the recording. */
+	uint64_t epoch;
+	/** A record could not be written. */
+	bool failed;
+};
+
+
+record_log *record_open(const char *path)
+{
+	record_log *log = malloc(sizeof(record_log));
+	if (log == NULL) return NULL;
+	log->f = fopen(path, "w");
+	if (log->f == NULL) {
+		free(log);
+		return NULL;
+	}
+	// Large writes, few system calls
+	setvbuf(log->f, NULL, _IOFBF, 1 << 20);
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	record_header header = {
+		.magic = A1FS_RECORD_MAGIC,
+		.version = A1FS_RECORD_VERSION,
+		.realtime = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec,
+	};
+	log->epoch = stats_begin();
+	// Written right away, so that a fork (e.g. FUSE daemonizing) doesn't
+	// leave a copy of it in the buffer of each process
+	log->failed = fwrite(&header, sizeof(header), 1, log->f) != 1 || fflush(log->f) != 0;
+	return log;
+}
+
+void record_add(record_log *log, stats_op op, uint64_t start, const char *path,
+                const char *path2, uint64_t a, uint64_t b, int ret)
+{
+	char buf[sizeof(record_entry) + 2 * A1FS_PATH_MAX];
+	size_t path_len = strnlen(path, A1FS_PATH_MAX - 1);
+	size_t path2_len = (path2 != NULL) ? strnlen(path2, A1FS_PATH_MAX - 1) : 0;
+	record_entry entry = {
+		.start = start - log->epoch,
+		.duration = stats_begin() - start,
+		.a = a,
+		.b = b,
+		.ret = ret,
+		.op = (uint16_t)op,
+		.path_len = (uint16_t)path_len,
+		.path2_len = (uint16_t)path2_len,
+	};
+	memcpy(buf, &entry, sizeof(entry));
+	memcpy(buf + sizeof(entry), path, path_len);
+	if (path2_len != 0) memcpy(buf + sizeof(entry) + path_len, path2, path2_len);
+
+	// A single fwrite() is atomic with respect to other threads
+	size_t len = sizeof(entry) + path_len + path2_len;
+	if (fwrite(buf, len, 1, log->f) != 1) {
+		__atomic_store_n(&log->failed, true, __ATOMIC_RELAXED);
+	}
+}
+
+bool record_close(record_log *log)
+{
+	bool ok = !log->failed;
+	if (fclose(log->f) != 0) ok = false;
+	free(log);
+	return ok;
+}
+
+bool record_read_header(FILE *f, record_header *header)
+{
+	return fread(header, sizeof(*header), 1, f) == 1 &&
+	       header->magic == A1FS_RECORD_MAGIC && header->version == A1FS_RECORD_VERSION;
+}
+
+int record_read(FILE *f, record_entry *entry, char *path, char *path2)
+{
+	size_t n = fread(entry, 1, sizeof(*entry), f);
+	if (n == 0 && feof(f)) return 0;
+	if (n != sizeof(*entry) || entry->op >= STATS_N_OPS || entry->path_len == 0 ||
+	    entry->path_len >= A1FS_PATH_MAX || entry->path2_len >= A1FS_PATH_MAX)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if (fread(path, entry->path_len, 1, f) != 1) return -1;
+	path[entry->path_len] = '\0';
+	if (entry->path2_len != 0 && fread(path2, entry->path2_len, 1, f) != 1) return -1;
+	path2[entry->path2_len] = '\0';
+	return 1;
+}
@@ -0,0 +1,130 @@
+/**
+ * a1fs workload recording.
+ *
+ * With --record=PATH (see options.h) every liba1fs operation is appended to a
+ * binary log as it completes: which operation, on which path, its offset and
+ * size, when it started relative to the start of the recording, how long it
+ * took and what it returned. File contents are not recorded. a1fs-replay runs
+ * a log again on another image or build and compares the latencies.
+ *
+ * The log starts with a record_header, followed by the records: a
+ * record_entry, then path_len bytes of the path and path2_len bytes of the
+ * second path, without terminating nul. Records are in completion order; the
+ * start times of operations that ran in parallel may be out of order.
+ *
+ * Each record is formatted on the stack and appended to a buffered stream
+ * under a lock, so recording serializes the operations for a few hundred
+ * nanoseconds each.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "stats.h"
+
+
+/** Must match record_header.magic. */
+#define A1FS_RECORD_MAGIC   0xA1F5EC0Du
+#define A1FS_RECORD_VERSION 1
+
+/** Log file header. */
+typedef struct record_header {
+	uint32_t magic;
+	uint32_t version;
+	/** Wall clock time at the start of the recording, in nanoseconds. */
+	uint64_t realtime;
+} record_header;
+
+/** Log record of an operation. */
+typedef struct record_entry {
+	/** Start time, in nanoseconds since the start of the recording. */
+	uint64_t start;
+	/** Duration in nanoseconds. */
+	uint64_t duration;
+	/**
+	 * Operation arguments:
+	 *   read, write  a is the offset, b is the size;
+	 *   truncate     b is the size;
+	 *   mkdir, create  b is the mode;
+	 *   utimens      a and b are the seconds and nanoseconds of the mtime;
+	 *   ioctl        a is the command, b the flags of A1FS_IOC_SETFLAGS.
+	 */
+	uint64_t a;
+	uint64_t b;
+	/** Result; negative errno on failure. */
+	int32_t ret;
+	/** Operation, a stats_op. */
+	uint16_t op;
+	/** Length of the path. */
+	uint16_t path_len;
+	/** Length of the second path (rename target, clone source); 0 if none. */
+	uint16_t path2_len;
+	uint16_t reserved;
+} __attribute__((packed)) record_entry;
+
+/** Open recording (see record_open()). */
+typedef struct record_log record_log;
+
+/**
+ * Create a log file, replacing an existing one, and start recording.
+ *
+ * @param path  log file path.
+ * @return      log on success; NULL on failure (errno is set).
+ */
+record_log *record_open(const char *path);
+
+/**
+ * Append a completed operation to a log. Thread-safe.
+ *
+ * @param log    log.
+ * @param op     operation.
+ * @param start  start time from stats_begin().
+ * @param path   path the operation was called on.
+ * @param path2  second path; NULL if none.
+ * @param a      operation argument, see record_entry.
+ * @param b      operation argument, see record_entry.
+ * @param ret    result.
+ */
+void record_add(record_log *log, stats_op op, uint64_t start, const char *path,
+                const char *path2, uint64_t a, uint64_t b, int ret);
+
+/**
+ * Stop recording and close a log.
+ *
+ * @param log  log; invalid afterwards.
+ * @return     true if every record was written; false otherwise.
+ */
+bool record_close(record_log *log);
+
+/**
+ * Read and check the header of a log file.
+ *
+ * @param f       log file, at its start.
+ * @param header  receives the header.
+ * @return        true on success; false if the file is not a log in a
+ *                supported version.
+ */
+bool record_read_header(FILE *f, record_header *header);
+
+/**
+ * Read the next record of a log file.
+ *
+ * @param f      log file, after the header.
+ * @param entry  receives the record.
+ * @param path   receives the nul-terminated path; room for A1FS_PATH_MAX.
+ * @param path2  receives the nul-terminated second path ("" if none); room
+ *               for A1FS_PATH_MAX.
+ * @return       1 on success; 0 at the end of the log; -1 if the log is
+ *               truncated or corrupted.
+ */
+int record_read(FILE *f, record_entry *entry, char *path, char *path2);
+
+
+/** Record an operation if the image is being recorded. */
+#define RECORD(fs, op, start, path, path2, a, b, ret) do { \
+	if ((fs)->record != NULL) \
+		record_add((fs)->record, (op), (start), (path), (path2), (a), (b), (ret)); \
+} while (0)
@@ -0,0 +1,565 @@
+/**
+ * a1fs workload replay tool.
+ *
+ * Runs the operations of a recording (see record.h) again, in the recorded
+ * order, on an image through liba1fs or on a mounted a1fs through system
+ * calls, and compares their latencies with those of the recording or of a
+ * baseline (e.g. the replay of the same recording by another build, saved
+ * with -o). Writes store pseudo-random data of the recorded size, since the
+ * contents aren't recorded.
+ *
+ * The operations are replayed by a single thread, so the latencies of a
+ * recording of parallel requests are compared without the contention they
+ * originally saw.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "a1fs_ioctl.h"
+#include "liba1fs.h"
+#include "record.h"
+#include "stats.h"
+
+
+/** Command line options. */
+typedef struct replay_opts {
+	/** Recording file path. */
+	const char *rec_path;
+	/** Image file path, or mount point with -m. */
+	const char *target;
+	/** Recording whose latencies to compare with; NULL to use rec_path. */
+	const char *baseline;
+	/** Where to save the replayed operations and their latencies; NULL if not saved. */
+	const char *out_path;
+
+	/** Print help and exit. */
+	bool help;
+	/** The target is a mount point. */
+	bool mount;
+	/** Replay on a private copy of the image, leaving the file unchanged. */
+	bool copy;
+	/** Keep the recorded time between the starts of operations. */
+	bool timed;
+	/** Print the operations whose result differs from the recorded one. */
+	bool verbose;
+
+} replay_opts;
+
+static const char *help_str = "\
+Usage: %s options recording target\n\
+\n\
+Replay the operations of a recording made with a1fs --record on the image\n\
+file target, or on the a1fs mounted at target with -m, and compare their\n\
+latencies with the recorded ones. Use an image in the state the recording\n\
+started from, e.g. a copy made before mounting it with --record.\n\
+\n\
+Options:\n\
+    -b file  compare with the latencies in this recording instead, e.g. one\n\
+             saved with -o by another build\n\
+    -c       replay on a private copy of the image, leaving the file unchanged\n\
+    -h       print help and exit\n\
+    -m       target is a mount point\n\
+    -o file  save the replayed operations and their latencies as a recording\n\
+    -t       keep the recorded time between operations (default: as fast as\n\
+             possible)\n\
+    -v       print the operations whose result differs from the recorded one\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+	fprintf(f, help_str, progname);
+}
+
+
+static bool parse_args(int argc, char *argv[], replay_opts *opts)
+{
+	int o;
+	while ((o = getopt(argc, argv, "b:chmo:tv")) != -1) {
+		switch (o) {
+			case 'b': opts->baseline = optarg; break;
+			case 'o': opts->out_path = optarg; break;
+
+			case 'c': opts->copy    = true; break;
+			case 'h': opts->help    = true; return true;// skip other arguments
+			case 'm': opts->mount   = true; break;
+			case 't': opts->timed   = true; break;
+			case 'v': opts->verbose = true; break;
+
+			case '?': return false;
+			default : assert(false);
+		}
+	}
+
+	if (optind + 2 > argc) {
+		fprintf(stderr, "Missing recording or target path\n");
+		return false;
+	}
+	opts->rec_path = argv[optind];
+	opts->target = argv[optind + 1];
+	if (opts->mount && opts->copy) {
+		fprintf(stderr, "-c only applies to images\n");
+		return false;
+	}
+	return true;
+}
+
+
+/** Latencies of the operations of one type. */
+typedef struct latencies {
+	uint64_t *ns;
+	size_t n;
+	size_t cap;
+	uint64_t total;
+	/** Results that differ from the recorded ones. */
+	uint64_t mismatches;
+} latencies;
+
+static bool lat_add(latencies *lat, uint64_t ns)
+{
+	if (lat->n == lat->cap) {
+		size_t cap = lat->cap ? lat->cap * 2 : 1024;
+		uint64_t *p = realloc(lat->ns, cap * sizeof(uint64_t));
+		if (p == NULL) return false;
+		lat->ns = p;
+		lat->cap = cap;
+	}
+	lat->ns[lat->n++] = ns;
+	lat->total += ns;
+	return true;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/** Get a percentile (between 0 and 1) of sorted latencies, in microseconds. */
+static double lat_percentile(const latencies *lat, double p)
+{
+	size_t i = (size_t)(p * lat->n);
+	if (i >= lat->n) i = lat->n - 1;
+	return lat->ns[i] / 1000.0;
+}
+
+/**
+ * Read the latencies of the operations in a recording.
+ *
+ * @param path  recording file path.
+ * @param lat   receives the latencies, indexed by operation.
+ * @return      true on success; false on failure.
+ */
+static bool read_latencies(const char *path, latencies *lat)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		return false;
+	}
+	static char p1[A1FS_PATH_MAX], p2[A1FS_PATH_MAX];
+	record_header header;
+	record_entry e;
+	int r = record_read_header(f, &header) ? 1 : -1;
+	while (r > 0 && (r = record_read(f, &e, p1, p2)) > 0) {
+		if (!lat_add(&lat[e.op], e.duration)) r = -1;
+	}
+	fclose(f);
+	if (r < 0) fprintf(stderr, "%s: invalid recording\n", path);
+	return r == 0;
+}
+
+
+/** What the operations are replayed on. */
+typedef struct target {
+	/** Image opened through liba1fs; NULL when replaying on a mount. */
+	fs_ctx *fs;
+	/** Private copy of the image (-c); NULL if none. */
+	void *image;
+	size_t size;
+
+	/** Mount point. */
+	const char *mount;
+	/** File kept open for consecutive operations on the same path. */
+	int fd;
+	char fd_path[A1FS_PATH_MAX];
+	/** Path under the mount point, for the operation being replayed. */
+	char full[2][PATH_MAX];
+
+	/** Data buffer for reads and writes. */
+	char *buf;
+	size_t buf_size;
+} target;
+
+static bool target_open(target *t, const replay_opts *opts)
+{
+	t->fd = -1;
+	if (opts->mount) {
+		t->mount = opts->target;
+		return true;
+	}
+	if (!opts->copy) {
+		t->fs = a1fs_open(opts->target, NULL);
+	} else {
+		// Changes go to private copy-on-write pages
+		int fd = open(opts->target, O_RDONLY);
+		struct stat st;
+		if (fd < 0 || fstat(fd, &st) != 0) {
+			perror(opts->target);
+			if (fd >= 0) close(fd);
+			return false;
+		}
+		t->image = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (t->image == MAP_FAILED) {
+			perror("mmap");
+			t->image = NULL;
+			return false;
+		}
+		t->size = st.st_size;
+		t->fs = a1fs_open_mem(t->image, t->size, NULL);
+	}
+	if (t->fs == NULL) return false;
+	// Free unlinked files in the background, like a mount
+	a1fs_start(t->fs);
+	return true;
+}
+
+static void target_close(target *t)
+{
+	if (t->fd >= 0) close(t->fd);
+	if (t->fs != NULL) a1fs_close(t->fs);
+	if (t->image != NULL) munmap(t->image, t->size);
+	free(t->buf);
+}
+
+/** Make the data buffer large enough, filling it with pseudo-random data. */
+static bool target_buf(target *t, size_t size)
+{
+	if (size <= t->buf_size) return true;
+	char *buf = realloc(t->buf, size);
+	if (buf == NULL) return false;
+	uint64_t x = 0x9E3779B97F4A7C15ul ^ t->buf_size;
+	for (size_t i = t->buf_size; i < size; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		buf[i] = (char)x;
+	}
+	t->buf = buf;
+	t->buf_size = size;
+	return true;
+}
+
+/** Get the path of a file under the mount point. */
+static const char *mnt_path(target *t, int i, const char *path)
+{
+	snprintf(t->full[i], PATH_MAX, "%s%s", t->mount, path);
+	return t->full[i];
+}
+
+static void mnt_close(target *t)
+{
+	if (t->fd >= 0) close(t->fd);
+	t->fd = -1;
+}
+
+/** Get a descriptor of a file under the mount point; -errno on error. */
+static int mnt_fd(target *t, const char *path)
+{
+	if (t->fd >= 0 && strcmp(t->fd_path, path) == 0) return t->fd;
+	mnt_close(t);
+	const char *full = mnt_path(t, 0, path);
+	int fd = open(full, O_RDWR);
+	if (fd < 0 && (errno == EISDIR || errno == EACCES)) fd = open(full, O_RDONLY);
+	if (fd < 0) return -errno;
+	t->fd = fd;
+	strcpy(t->fd_path, path);
+	return fd;
+}
+
+static int count_entry(void *buf, const char *name)
+{
+	(void)name;// unused
+	(*(int *)buf)++;
+	return 0;
+}
+
+/** Replay an operation through liba1fs. */
+static long lib_run(target *t, const record_entry *e, const char *path, const char *path2)
+{
+	fs_ctx *fs = t->fs;
+	switch (e->op) {
+		case STATS_STATFS: {
+			struct statvfs st;
+			return a1fs_statfs(fs, &st);
+		}
+		case STATS_STAT: {
+			struct stat st;
+			return a1fs_stat(fs, path, &st);
+		}
+		case STATS_READDIR: {
+			int n = 0;
+			return a1fs_readdir(fs, path, &n, count_entry);
+		}
+		case STATS_MKDIR:  return a1fs_mkdir(fs, path, (mode_t)e->b);
+		case STATS_RMDIR:  return a1fs_rmdir(fs, path);
+		case STATS_CREATE: return a1fs_create(fs, path, (mode_t)e->b);
+		case STATS_UNLINK: return a1fs_unlink(fs, path);
+		case STATS_RENAME: return a1fs_rename(fs, path, path2);
+		case STATS_UTIMENS: {
+			struct timespec tv[2] = { { 0, UTIME_OMIT }, { (time_t)e->a, (long)e->b } };
+			return a1fs_utimens(fs, path, tv);
+		}
+		case STATS_TRUNCATE: return a1fs_truncate(fs, path, (off_t)e->b);
+		case STATS_READ:     return a1fs_read(fs, path, t->buf, e->b, (off_t)e->a);
+		case STATS_WRITE:    return a1fs_write(fs, path, t->buf, e->b, (off_t)e->a);
+		case STATS_FLUSH:    return a1fs_flush(fs, path);
+		case STATS_FSYNC:    return a1fs_fsync(fs, path);
+		case STATS_IOCTL: {
+			if (e->a == A1FS_IOC_CLONE) {
+				static a1fs_clone_args args;
+				strcpy(args.src, path2);
+				return a1fs_ioctl(fs, path, A1FS_IOC_CLONE, &args);
+			}
+			uint32_t flags = (uint32_t)e->b;
+			return a1fs_ioctl(fs, path, (unsigned int)e->a, &flags);
+		}
+		default: assert(false);
+	}
+	return -ENOSYS;
+}
+
+/** Replay an operation on the mount through system calls. */
+static long mnt_run(target *t, const record_entry *e, const char *path, const char *path2)
+{
+	// Anything that changes the namespace may change what the open file is
+	switch (e->op) {
+		case STATS_MKDIR: case STATS_RMDIR: case STATS_CREATE:
+		case STATS_UNLINK: case STATS_RENAME:
+			mnt_close(t);
+			break;
+	}
+
+	int fd;
+	long ret;
+	switch (e->op) {
+		case STATS_STATFS: {
+			struct statvfs st;
+			ret = statvfs(mnt_path(t, 0, path), &st);
+			break;
+		}
+		case STATS_STAT: {
+			struct stat st;
+			ret = lstat(mnt_path(t, 0, path), &st);
+			break;
+		}
+		case STATS_READDIR: {
+			DIR *dir = opendir(mnt_path(t, 0, path));
+			if (dir == NULL) return -errno;
+			while (readdir(dir) != NULL) {}
+			closedir(dir);
+			return 0;
+		}
+		case STATS_MKDIR: ret = mkdir(mnt_path(t, 0, path), (mode_t)e->b); break;
+		case STATS_RMDIR: ret = rmdir(mnt_path(t, 0, path)); break;
+		case STATS_CREATE:
+			fd = open(mnt_path(t, 0, path), O_CREAT | O_EXCL | O_WRONLY, (mode_t)e->b);
+			if (fd < 0) return -errno;
+			close(fd);
+			return 0;
+		case STATS_UNLINK: ret = unlink(mnt_path(t, 0, path)); break;
+		case STATS_RENAME: ret = rename(mnt_path(t, 0, path), mnt_path(t, 1, path2)); break;
+		case STATS_UTIMENS: {
+			struct timespec tv[2] = { { 0, UTIME_OMIT }, { (time_t)e->a, (long)e->b } };
+			ret = utimensat(AT_FDCWD, mnt_path(t, 0, path), tv, AT_SYMLINK_NOFOLLOW);
+			break;
+		}
+		case STATS_TRUNCATE: ret = truncate(mnt_path(t, 0, path), (off_t)e->b); break;
+		case STATS_READ:
+			if ((fd = mnt_fd(t, path)) < 0) return fd;
+			ret = pread(fd, t->buf, e->b, (off_t)e->a);
+			break;
+		case STATS_WRITE:
+			if ((fd = mnt_fd(t, path)) < 0) return fd;
+			ret = pwrite(fd, t->buf, e->b, (off_t)e->a);
+			break;
+		case STATS_FLUSH:
+			// A flush is sent when a descriptor of the file is closed
+			if (t->fd >= 0 && strcmp(t->fd_path, path) == 0) mnt_close(t);
+			return 0;
+		case STATS_FSYNC:
+			if ((fd = mnt_fd(t, path)) < 0) return fd;
+			ret = fsync(fd);
+			break;
+		case STATS_IOCTL: {
+			if ((fd = mnt_fd(t, path)) < 0) return fd;
+			if (e->a == A1FS_IOC_CLONE) {
+				static a1fs_clone_args args;
+				strcpy(args.src, path2);
+				ret = ioctl(fd, A1FS_IOC_CLONE, &args);
+			} else {
+				uint32_t flags = (uint32_t)e->b;
+				ret = ioctl(fd, (unsigned long)e->a, &flags);
+			}
+			break;
+		}
+		default: assert(false); return -ENOSYS;
+	}
+	return (ret < 0) ? -errno : ret;
+}
+
+
+static void print_report(const latencies *base, latencies *lat, uint64_t ops, uint64_t elapsed,
+                         uint64_t bytes_read, uint64_t bytes_written)
+{
+	double secs = elapsed / 1e9;
+	printf("Replayed %lu operations in %.3f s: %.0f ops/s, %.1f MiB/s read, %.1f MiB/s written\n\n",
+	       ops, secs, ops / secs, bytes_read / secs / (1 << 20), bytes_written / secs / (1 << 20));
+
+	printf("%-10s %10s %8s %10s %10s %8s %10s %10s %10s %10s %8s\n", "op", "calls", "differ",
+	       "base_avg", "avg_us", "delta", "base_p50", "p50_us", "base_p99", "p99_us", "delta");
+	uint64_t base_total = 0, total = 0;
+	for (int op = 0; op < STATS_N_OPS; op++) {
+		latencies *l = &lat[op];
+		const latencies *b = &base[op];
+		if (l->n == 0) continue;
+		qsort(l->ns, l->n, sizeof(uint64_t), cmp_u64);
+		double avg = l->total / 1000.0 / l->n;
+		double p99 = lat_percentile(l, 0.99);
+		total += l->total;
+		printf("%-10s %10zu %8lu ", stats_op_name(op), l->n, l->mismatches);
+		if (b->n == 0) {
+			printf("%10s %10.1f %8s %10s %10.1f %10s %10.1f %8s\n",
+			       "-", avg, "-", "-", lat_percentile(l, 0.5), "-", p99, "-");
+			continue;
+		}
+		double base_avg = b->total / 1000.0 / b->n;
+		double base_p99 = lat_percentile(b, 0.99);
+		base_total += b->total;
+		printf("%10.1f %10.1f %+7.1f%% %10.1f %10.1f %10.1f %10.1f %+7.1f%%\n",
+		       base_avg, avg, 100.0 * (avg - base_avg) / base_avg,
+		       lat_percentile(b, 0.5), lat_percentile(l, 0.5),
+		       base_p99, p99, base_p99 > 0 ? 100.0 * (p99 - base_p99) / base_p99 : 0.0);
+	}
+	if (base_total != 0) {
+		printf("\nTime in operations: %.3f s, baseline %.3f s (%+.1f%%)\n", total / 1e9,
+		       base_total / 1e9, 100.0 * ((double)total - base_total) / base_total);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	replay_opts opts = {0};// defaults are all 0
+	if (!parse_args(argc, argv, &opts)) {
+		// Invalid arguments, print help to stderr
+		print_help(stderr, argv[0]);
+		return 1;
+	}
+	if (opts.help) {
+		// Help requested, print it to stdout
+		print_help(stdout, argv[0]);
+		return 0;
+	}
+
+	int ret = 1;
+	latencies base[STATS_N_OPS] = {{0}}, lat[STATS_N_OPS] = {{0}};
+	if (!read_latencies(opts.baseline ? opts.baseline : opts.rec_path, base)) return 1;
+	for (int op = 0; op < STATS_N_OPS; op++) {
+		qsort(base[op].ns, base[op].n, sizeof(uint64_t), cmp_u64);
+	}
+
+	FILE *f = fopen(opts.rec_path, "r");
+	if (f == NULL) {
+		perror(opts.rec_path);
+		return 1;
+	}
+	record_header header;
+	if (!record_read_header(f, &header)) {
+		fprintf(stderr, "%s: invalid recording\n", opts.rec_path);
+		fclose(f);
+		return 1;
+	}
+	record_log *out = NULL;
+	if (opts.out_path != NULL && (out = record_open(opts.out_path)) == NULL) {
+		perror(opts.out_path);
+		fclose(f);
+		return 1;
+	}
+	target t = {0};
+	if (!target_open(&t, &opts)) goto end;
+
+	static char path[A1FS_PATH_MAX], path2[A1FS_PATH_MAX];
+	record_entry e;
+	uint64_t ops = 0, bytes_read = 0, bytes_written = 0;
+	uint64_t begin = stats_begin();
+	int r;
+	while ((r = record_read(f, &e, path, path2)) > 0) {
+		if ((e.op == STATS_READ || e.op == STATS_WRITE) && !target_buf(&t, e.b)) {
+			fprintf(stderr, "Out of memory\n");
+			goto end;
+		}
+		if (opts.timed) {
+			uint64_t when = begin + e.start;
+			struct timespec ts = { (time_t)(when / 1000000000), (long)(when % 1000000000) };
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		}
+
+		uint64_t start = stats_begin();
+		long res = (t.fs != NULL) ? lib_run(&t, &e, path, path2) : mnt_run(&t, &e, path, path2);
+		uint64_t ns = stats_begin() - start;
+
+		if (!lat_add(&lat[e.op], ns)) {
+			fprintf(stderr, "Out of memory\n");
+			goto end;
+		}
+		if (out != NULL) record_add(out, e.op, start, path, path2[0] ? path2 : NULL, e.a, e.b, (int)res);
+		if (res != e.ret) {
+			lat[e.op].mismatches++;
+			if (opts.verbose) {
+				printf("%s %s%s%s: %ld, recorded %d\n", stats_op_name(e.op), path,
+				       path2[0] ? " " : "", path2, res, e.ret);
+			}
+		}
+		if (e.op == STATS_READ && res > 0) bytes_read += res;
+		if (e.op == STATS_WRITE && res > 0) bytes_written += res;
+		ops++;
+	}
+	if (r < 0) {
+		fprintf(stderr, "%s: invalid recording, stopped after %lu operations\n", opts.rec_path, ops);
+		goto end;
+	}
+	uint64_t elapsed = stats_begin() - begin;
+
+	print_report(base, lat, ops, elapsed, bytes_read, bytes_written);
+	ret = 0;
+
+end:
+	target_close(&t);
+	if (out != NULL && !record_close(out)) {
+		fprintf(stderr, "Failed to write %s\n", opts.out_path);
+		ret = 1;
+	}
+	fclose(f);
+	for (int op = 0; op < STATS_N_OPS; op++) {
+		free(base[op].ns);
+		free(lat[op].ns);
+	}
+	return ret;
+}
@@ -0,0 +1,55 @@
+/**
+ * Sequence counters for lock-free readers.
+ *
+ * A writer (already serialized against other writers by a lock) makes the
+ * counter odd while it modifies the protected data and even again when it is
+ * done. A reader samples the counter, copies the data and checks that the
+ * counter is even and unchanged; otherwise the copy may be torn and the read
+ * must be retried. Readers never write shared memory, so they don't slow down
+ * writers or each other, but they must not trust anything they read (e.g.
+ * block numbers) before it has been validated.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/** Number of optimistic attempts before a reader falls back to locking. */
+#define SEQ_READ_ATTEMPTS 8
+
+/** Start a write section. The caller holds the writer lock. */
+static inline void seq_write_begin(uint32_t *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/** End a write section. */
+static inline void seq_write_end(uint32_t *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Start a read section.
+ *
+ * @return  the counter value to pass to seq_read_retry(); odd if a writer is
+ *          active, in which case the read will fail validation.
+ */
+static inline uint32_t seq_read_begin(const uint32_t *seq)
+{
+	return __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Check whether the data read since seq_read_begin() may be inconsistent.
+ *
+ * @return  true if the read must be retried.
+ */
+static inline bool seq_read_retry(const uint32_t *seq, uint32_t start)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return (start & 1) || __atomic_load_n(seq, __ATOMIC_RELAXED) != start;
+}
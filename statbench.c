@@ -0,0 +1,195 @@
+/**
+ * a1fs metadata contention benchmark.
+ *
+ * Calls stat() on a set of paths in a mounted file system from an increasing
+ * number of threads and reports the aggregate throughput for each thread
+ * count, showing how well getattr requests scale. Run the file system without
+ * -s (and with enough FUSE worker threads) for the numbers to be meaningful.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/** Command line options. */
+typedef struct statbench_opts {
+	/** Paths to stat. */
+	char **paths;
+	size_t n_paths;
+	/** Maximum number of threads. */
+	size_t max_threads;
+	/** Duration of each run in milliseconds. */
+	long duration_ms;
+
+	/** Print help and exit. */
+	bool help;
+
+} statbench_opts;
+
+static const char *help_str = "\
+Usage: %s options path...\n\
+\n\
+Measure stat() throughput on the given paths (e.g. files and directories in\n\
+an a1fs mount) with 1, 2, 4, ... threads. Each run prints the number of\n\
+threads, the throughput in operations per second and the speedup relative to\n\
+a single thread.\n\
+\n\
+Options:\n\
+    -j num  maximum number of threads (default: number of CPUs)\n\
+    -t ms   duration of each run in milliseconds (default: 1000)\n\
+    -h      print help and exit\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+	fprintf(f, help_str, progname);
+}
+
+
+static bool parse_args(int argc, char *argv[], statbench_opts *opts)
+{
+	int o;
+	while ((o = getopt(argc, argv, "j:t:h")) != -1) {
+		switch (o) {
+			case 'j': opts->max_threads = strtoul(optarg, NULL, 10); break;
+			case 't': opts->duration_ms = strtol(optarg, NULL, 10); break;
+
+			case 'h': opts->help = true; return true;// skip other arguments
+
+			case '?': return false;
+			default : assert(false);
+		}
+	}
+
+	if (optind >= argc) {
+		fprintf(stderr, "Missing paths\n");
+		return false;
+	}
+	opts->paths = &argv[optind];
+	opts->n_paths = argc - optind;
+
+	if (opts->max_threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		opts->max_threads = (cpus > 0) ? (size_t)cpus : 1;
+	}
+	if (opts->duration_ms <= 0) opts->duration_ms = 1000;
+	return true;
+}
+
+
+/** State of a benchmark thread. */
+typedef struct bench_thread {
+	pthread_t thread;
+	const statbench_opts *opts;
+	/** Index of the first path, so that the threads are spread over them. */
+	size_t first;
+	/** Set by the main thread when the run is over. */
+	const bool *stop;
+	/** Number of completed stat() calls. */
+	uint64_t ops;
+	/** Number of failed stat() calls. */
+	uint64_t errors;
+} __attribute__((aligned(64))) bench_thread;
+
+static void *bench_loop(void *arg)
+{
+	bench_thread *t = (bench_thread *)arg;
+	size_t i = t->first;
+	struct stat st;
+
+	while (!__atomic_load_n(t->stop, __ATOMIC_RELAXED)) {
+		if (stat(t->opts->paths[i++ % t->opts->n_paths], &st) < 0) {
+			t->errors++;
+		}
+		t->ops++;
+	}
+	return NULL;
+}
+
+/** Run the benchmark with n threads; return the throughput in ops/s. */
+static double run(const statbench_opts *opts, size_t n, uint64_t *errors)
+{
+	bench_thread *threads = calloc(n, sizeof(bench_thread));
+	if (threads == NULL) {
+		perror("calloc");
+		return -1;
+	}
+
+	bool stop = false;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	size_t started = 0;
+	for (; started < n; started++) {
+		threads[started].opts = opts;
+		threads[started].first = started;
+		threads[started].stop = &stop;
+		if ((errno = pthread_create(&threads[started].thread, NULL, bench_loop,
+		                            &threads[started])) != 0) {
+			perror("pthread_create");
+			break;
+		}
+	}
+
+	struct timespec delay = {
+		.tv_sec = opts->duration_ms / 1000,
+		.tv_nsec = (opts->duration_ms % 1000) * 1000000,
+	};
+	nanosleep(&delay, NULL);
+	__atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+
+	uint64_t ops = 0;
+	for (size_t i = 0; i < started; i++) {
+		pthread_join(threads[i].thread, NULL);
+		ops += threads[i].ops;
+		*errors += threads[i].errors;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	free(threads);
+	if (started < n) return -1;
+
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	return ops / secs;
+}
+
+
+int main(int argc, char *argv[])
+{
+	statbench_opts opts = {0};// defaults are all 0
+	if (!parse_args(argc, argv, &opts)) {
+		// Invalid arguments, print help to stderr
+		print_help(stderr, argv[0]);
+		return 1;
+	}
+	if (opts.help) {
+		// Help requested, print it to stdout
+		print_help(stdout, argv[0]);
+		return 0;
+	}
+
+	printf("%-8s %14s %8s\n", "threads", "ops/s", "speedup");
+	double base = 0;
+	uint64_t errors = 0;
+	for (size_t n = 1; ; n = (n * 2 > opts.max_threads && n < opts.max_threads)
+	                        ? opts.max_threads : n * 2) {
+		double rate = run(&opts, n, &errors);
+		if (rate < 0) return 1;
+		if (base == 0) base = rate;
+		printf("%-8zu %14.0f %7.2fx\n", n, rate, rate / base);
+		if (n >= opts.max_threads) break;
+	}
+
+	if (errors != 0) {
+		fprintf(stderr, "%lu stat() calls failed\n", (unsigned long)errors);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,157 @@
+/**
+ * a1fs operation statistics implementation.
+ */
+
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fs_ctx.h"
+#include "stats.h"
+
+
+/** Operation names, as printed by stats_format(). */
+static const char *op_names[STATS_N_OPS] = {
+	"statfs", "stat", "readdir", "mkdir", "rmdir", "create", "unlink", "rename",
+	"utimens", "truncate", "read", "write", "flush", "fsync", "ioctl",
+};
+
+/** Counter names, as printed by stats_format(). */
+static const char *counter_names[STATS_N_COUNTERS] = {
+	"lookups", "lookup_cache_hits", "blocks_allocated", "blocks_freed",
+	"inodes_allocated", "inodes_freed", "pool_refills", "bytes_read",
+	"bytes_written",
+};
+
+
+static stats_shard *my_shard(fs_ctx *fs)
+{
+	int cpu = sched_getcpu();
+	return &fs->stats[(cpu < 0 ? 0 : cpu) % fs->n_stats];
+}
+
+int stats_bucket(uint64_t ns)
+{
+	if (ns < 4) return (int)ns;
+	int b = 63 - __builtin_clzll(ns);
+	int k = 4 * (b - 1) + (int)((ns >> (b - 2)) & 3);
+	return (k < STATS_BUCKETS) ? k : STATS_BUCKETS - 1;
+}
+
+/** Get the upper bound of a histogram bucket, in nanoseconds. */
+static uint64_t bucket_end(int k)
+{
+	if (k < 4) return (uint64_t)k + 1;
+	int b = k / 4 + 1;
+	return (uint64_t)(4 + k % 4 + 1) << (b - 2);
+}
+
+uint64_t stats_percentile(const uint64_t *hist, uint64_t total, double p)
+{
+	// Nearest rank: the smallest sample with at least p of them at or below it
+	double want = p * total;
+	uint64_t rank = (uint64_t)want;
+	if (rank < want) rank++;
+	if (rank == 0) rank = 1;
+	if (rank > total) rank = total;
+	uint64_t seen = 0;
+	for (int k = 0; k < STATS_BUCKETS; k++) {
+		seen += hist[k];
+		if (seen >= rank) return bucket_end(k);
+	}
+	return bucket_end(STATS_BUCKETS - 1);
+}
+
+
+bool stats_init(fs_ctx *fs)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_CONF);
+	fs->n_stats = (ncpu < 1) ? 1 : (ncpu > 256 ? 256 : (int)ncpu);
+	fs->stats = aligned_alloc(_Alignof(stats_shard), fs->n_stats * sizeof(stats_shard));
+	if (fs->stats == NULL) return false;
+	memset(fs->stats, 0, fs->n_stats * sizeof(stats_shard));
+	return true;
+}
+
+void stats_destroy(fs_ctx *fs)
+{
+	free(fs->stats);
+	fs->stats = NULL;
+}
+
+void stats_end(fs_ctx *fs, stats_op op, uint64_t start, long ret)
+{
+	uint64_t ns = stats_begin() - start;
+	// Threads can share a shard after migrating between CPUs
+	stats_shard *shard = my_shard(fs);
+	__atomic_fetch_add(&shard->calls[op], 1, __ATOMIC_RELAXED);
+	if (ret < 0) __atomic_fetch_add(&shard->errors[op], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&shard->total_ns[op], ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&shard->latency[op][stats_bucket(ns)], 1, __ATOMIC_RELAXED);
+}
+
+const char *stats_op_name(stats_op op)
+{
+	return op_names[op];
+}
+
+void stats_count(fs_ctx *fs, stats_counter c, uint64_t n)
+{
+	__atomic_fetch_add(&my_shard(fs)->counters[c], n, __ATOMIC_RELAXED);
+}
+
+char *stats_format(fs_ctx *fs)
+{
+	char *text;
+	size_t len;
+	FILE *out = open_memstream(&text, &len);
+	if (out == NULL) return NULL;
+
+	fprintf(out, "%-10s %12s %10s %10s %10s %10s %10s\n",
+	        "op", "calls", "errors", "avg_us", "p50_us", "p99_us", "p999_us");
+	for (int op = 0; op < STATS_N_OPS; op++) {
+		uint64_t calls = 0, errors = 0, total_ns = 0;
+		uint64_t hist[STATS_BUCKETS] = {0};
+		for (int i = 0; i < fs->n_stats; i++) {
+			stats_shard *shard = &fs->stats[i];
+			calls += __atomic_load_n(&shard->calls[op], __ATOMIC_RELAXED);
+			errors += __atomic_load_n(&shard->errors[op], __ATOMIC_RELAXED);
+			total_ns += __atomic_load_n(&shard->total_ns[op], __ATOMIC_RELAXED);
+			for (int k = 0; k < STATS_BUCKETS; k++) {
+				hist[k] += __atomic_load_n(&shard->latency[op][k], __ATOMIC_RELAXED);
+			}
+		}
+		// The histogram may be a few samples behind the call count
+		uint64_t samples = 0;
+		for (int k = 0; k < STATS_BUCKETS; k++) samples += hist[k];
+		if (samples == 0) {
+			fprintf(out, "%-10s %12lu %10lu %10s %10s %10s %10s\n",
+			        op_names[op], calls, errors, "-", "-", "-", "-");
+			continue;
+		}
+		fprintf(out, "%-10s %12lu %10lu %10.1f %10.1f %10.1f %10.1f\n",
+		        op_names[op], calls, errors, total_ns / 1000.0 / (calls ? calls : 1),
+		        stats_percentile(hist, samples, 0.5) / 1000.0,
+		        stats_percentile(hist, samples, 0.99) / 1000.0,
+		        stats_percentile(hist, samples, 0.999) / 1000.0);
+	}
+
+	fputc('\n', out);
+	for (int c = 0; c < STATS_N_COUNTERS; c++) {
+		uint64_t sum = 0;
+		for (int i = 0; i < fs->n_stats; i++) {
+			sum += __atomic_load_n(&fs->stats[i].counters[c], __ATOMIC_RELAXED);
+		}
+		fprintf(out, "%-18s %lu\n", counter_names[c], sum);
+	}
+
+	if (fclose(out) != 0) {
+		free(text);
+		return NULL;
+	}
+	return text;
+}
@@ -0,0 +1,154 @@
+/**
+ * a1fs operation statistics.
+ *
+ * Every liba1fs operation counts its calls and errors and records its latency
+ * in a histogram; path lookups, the allocator and the data path bump event
+ * counters. Everything is kept in per-CPU shards, like the allocation pools
+ * (see alloc.h), and only summed up when the statistics are formatted, so
+ * that threads counting in parallel don't bounce cache lines.
+ *
+ * The histograms are log-linear: four buckets per power of two nanoseconds,
+ * so a percentile is known to within 25%, up to about two minutes.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+
+/** Operations, one per liba1fs entry point (see liba1fs.h). */
+typedef enum stats_op {
+	STATS_STATFS,
+	STATS_STAT,
+	STATS_READDIR,
+	STATS_MKDIR,
+	STATS_RMDIR,
+	STATS_CREATE,
+	STATS_UNLINK,
+	STATS_RENAME,
+	STATS_UTIMENS,
+	STATS_TRUNCATE,
+	STATS_READ,
+	STATS_WRITE,
+	STATS_FLUSH,
+	STATS_FSYNC,
+	STATS_IOCTL,
+	STATS_N_OPS
+} stats_op;
+
+/** Event counters. */
+typedef enum stats_counter {
+	/** Path lookups, and those answered by the lookup cache. */
+	STATS_LOOKUPS,
+	STATS_LOOKUP_HITS,
+	/** Blocks and inodes handed out and freed by the allocator. */
+	STATS_BLOCKS_ALLOCATED,
+	STATS_BLOCKS_FREED,
+	STATS_INODES_ALLOCATED,
+	STATS_INODES_FREED,
+	/** Allocation pool refills, i.e. bitmap scans under the allocator lock. */
+	STATS_POOL_REFILLS,
+	/** File data returned by reads and accepted by writes. */
+	STATS_BYTES_READ,
+	STATS_BYTES_WRITTEN,
+	STATS_N_COUNTERS
+} stats_counter;
+
+/** Number of latency histogram buckets, the last one is open ended. */
+#define STATS_BUCKETS 144
+
+/** Per-CPU statistics. */
+typedef struct stats_shard {
+	uint64_t calls[STATS_N_OPS];
+	uint64_t errors[STATS_N_OPS];
+	uint64_t total_ns[STATS_N_OPS];
+	uint64_t latency[STATS_N_OPS][STATS_BUCKETS];
+	uint64_t counters[STATS_N_COUNTERS];
+} __attribute__((aligned(64))) stats_shard;
+
+struct fs_ctx;
+
+/**
+ * Create the statistics shards.
+ *
+ * @param fs  file system context.
+ * @return    true on success; false if out of memory.
+ */
+bool stats_init(struct fs_ctx *fs);
+
+/**
+ * Free the statistics shards.
+ *
+ * @param fs  file system context.
+ */
+void stats_destroy(struct fs_ctx *fs);
+
+/**
+ * Get the start time of an operation, to be passed to stats_end().
+ *
+ * @return  monotonic time in nanoseconds.
+ */
+static inline uint64_t stats_begin(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Record a completed operation.
+ *
+ * @param fs     file system context.
+ * @param op     operation.
+ * @param start  start time from stats_begin().
+ * @param ret    result of the operation; negative if it failed.
+ */
+void stats_end(struct fs_ctx *fs, stats_op op, uint64_t start, long ret);
+
+/**
+ * Add to an event counter.
+ *
+ * @param fs  file system context.
+ * @param c   counter.
+ * @param n   value to add.
+ */
+void stats_count(struct fs_ctx *fs, stats_counter c, uint64_t n);
+
+/**
+ * Get the name of an operation.
+ *
+ * @param op  operation.
+ * @return    name, e.g. "read".
+ */
+const char *stats_op_name(stats_op op);
+
+/**
+ * Get the histogram bucket of a latency, for tools keeping histograms of
+ * their own in the same format.
+ *
+ * @param ns  latency in nanoseconds.
+ * @return    bucket, below STATS_BUCKETS.
+ */
+int stats_bucket(uint64_t ns);
+
+/**
+ * Get a latency percentile from a histogram.
+ *
+ * @param hist   histogram of STATS_BUCKETS buckets.
+ * @param total  number of samples in the histogram.
+ * @param p      percentile, between 0 and 1.
+ * @return       upper bound of the bucket holding the percentile, in
+ *               nanoseconds.
+ */
+uint64_t stats_percentile(const uint64_t *hist, uint64_t total, double p);
+
+/**
+ * Format the statistics: calls, errors and average, p50, p99 and p999
+ * latencies of each operation, followed by the event counters.
+ *
+ * @param fs  file system context.
+ * @return    malloc()ed text; NULL if out of memory.
+ */
+char *stats_format(struct fs_ctx *fs);
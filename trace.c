@@ -0,0 +1,204 @@
+/**
+ * a1fs tracing implementation.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+
+#ifdef A1FS_TRACE
+
+/** Per-thread event ring buffer. */
+typedef struct trace_ring {
+	struct trace_ring *next;
+	/**
+	 * Number of events ever added. Only the owning thread writes events; it
+	 * fills in the slot first and then publishes it by advancing head.
+	 */
+	uint64_t head;
+	/** The owning thread has exited, protected by rings_lock. */
+	bool free;
+	trace_event events[TRACE_RING_EVENTS];
+} trace_ring;
+
+/** Names of the event types and of their arguments; NULL if unused. */
+static const struct {
+	const char *name;
+	const char *a;
+	const char *b;
+} types[TRACE_N_TYPES] = {
+	[TRACE_OP]             = { NULL, "offset", "size" },
+	[TRACE_LOOKUP]         = { "lookup", "cached", NULL },
+	[TRACE_POOL_REFILL]    = { "pool_refill", "taken", "inodes" },
+	[TRACE_JOURNAL_COMMIT] = { "journal_commit", "blocks", NULL },
+	[TRACE_MSYNC]          = { "msync", "block", "count" },
+	[TRACE_RECLAIM]        = { "reclaim", NULL, NULL },
+	[TRACE_COMPRESS]       = { "compress", "size", NULL },
+};
+
+/** All rings ever created; they are never freed. */
+static trace_ring *rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Frees the ring of an exiting thread, see ring_get(). */
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static __thread trace_ring *my_ring;
+static __thread uint32_t my_tid;
+
+
+static void ring_free(void *arg)
+{
+	trace_ring *ring = (trace_ring *)arg;
+	pthread_mutex_lock(&rings_lock);
+	ring->free = true;
+	pthread_mutex_unlock(&rings_lock);
+}
+
+static void ring_key_create(void)
+{
+	pthread_key_create(&ring_key, ring_free);
+}
+
+/** Get the ring of the calling thread, taking over a free one or creating one. */
+static trace_ring *ring_get(void)
+{
+	if (my_ring != NULL) return my_ring;
+
+	pthread_once(&ring_key_once, ring_key_create);
+	pthread_mutex_lock(&rings_lock);
+	trace_ring *ring = rings;
+	while (ring != NULL && !ring->free) ring = ring->next;
+	if (ring == NULL) {
+		ring = calloc(1, sizeof(trace_ring));
+		if (ring == NULL) {
+			pthread_mutex_unlock(&rings_lock);
+			return NULL;
+		}
+		ring->next = rings;
+		rings = ring;
+	}
+	ring->free = false;
+	pthread_mutex_unlock(&rings_lock);
+
+	my_tid = (uint32_t)syscall(SYS_gettid);
+	pthread_setspecific(ring_key, ring);
+	my_ring = ring;
+	return ring;
+}
+
+void trace_event_add(trace_type type, stats_op op, uint64_t start, a1fs_ino_t ino,
+                     uint64_t a, uint64_t b, int64_t ret)
+{
+	trace_ring *ring = ring_get();
+	if (ring == NULL) return;
+
+	uint64_t head = ring->head;
+	trace_event *ev = &ring->events[head % TRACE_RING_EVENTS];
+	ev->start = start;
+	ev->duration = stats_begin() - start;
+	ev->a = a;
+	ev->b = b;
+	ev->ret = ret;
+	ev->tid = my_tid;
+	ev->ino = ino;
+	ev->type = (uint16_t)type;
+	ev->op = (uint16_t)op;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Copy the valid events of a ring.
+ *
+ * @param ring  ring to read.
+ * @param out   receives the events, room for TRACE_RING_EVENTS.
+ * @return      number of events copied.
+ */
+static size_t ring_copy(trace_ring *ring, trace_event *out)
+{
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint64_t first = (head > TRACE_RING_EVENTS) ? head - TRACE_RING_EVENTS : 0;
+	for (uint64_t i = first; i < head; i++) {
+		out[i - first] = ring->events[i % TRACE_RING_EVENTS];
+	}
+
+	// The writer may have overwritten the oldest events meanwhile, including
+	// the slot of the event it is adding now
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	uint64_t now = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	uint64_t valid = (now + 1 > TRACE_RING_EVENTS) ? now + 1 - TRACE_RING_EVENTS : 0;
+	if (valid <= first) return head - first;
+	if (valid >= head) return 0;
+	memmove(out, &out[valid - first], (head - valid) * sizeof(trace_event));
+	return head - valid;
+}
+
+static void print_event(FILE *out, const trace_event *ev, bool first)
+{
+	const char *name = (ev->type == TRACE_OP) ? stats_op_name(ev->op) : types[ev->type].name;
+	fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,"
+	        "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"ret\":%ld",
+	        first ? "" : ",", name, (ev->type == TRACE_OP) ? "op" : "internal",
+	        (int)getpid(), ev->tid, ev->start / 1000.0, ev->duration / 1000.0, (long)ev->ret);
+	if (ev->ino != (a1fs_ino_t)-1) fprintf(out, ",\"ino\":%u", ev->ino);
+	// Operations without an offset and size pass 0 for both
+	bool args = ev->type != TRACE_OP || ev->a != 0 || ev->b != 0;
+	if (args && types[ev->type].a != NULL) fprintf(out, ",\"%s\":%lu", types[ev->type].a, (unsigned long)ev->a);
+	if (args && types[ev->type].b != NULL) fprintf(out, ",\"%s\":%lu", types[ev->type].b, (unsigned long)ev->b);
+	fputs("}}", out);
+}
+
+char *trace_export(void)
+{
+	trace_event *events = malloc(TRACE_RING_EVENTS * sizeof(trace_event));
+	if (events == NULL) return NULL;
+	char *text;
+	size_t len;
+	FILE *out = open_memstream(&text, &len);
+	if (out == NULL) {
+		free(events);
+		return NULL;
+	}
+
+	fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", out);
+	bool first = true;
+	// Rings are only ever added at the head
+	pthread_mutex_lock(&rings_lock);
+	trace_ring *ring = rings;
+	pthread_mutex_unlock(&rings_lock);
+	for (; ring != NULL; ring = ring->next) {
+		size_t n = ring_copy(ring, events);
+		for (size_t i = 0; i < n; i++) {
+			print_event(out, &events[i], first);
+			first = false;
+		}
+	}
+	fputs("\n]}\n", out);
+	free(events);
+
+	if (fclose(out) != 0) {
+		free(text);
+		return NULL;
+	}
+	return text;
+}
+
+#else
+
+char *trace_export(void)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+#endif
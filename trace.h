@@ -0,0 +1,107 @@
+/**
+ * a1fs tracing.
+ *
+ * Trace points record binary events (what, when, how long, inode, two event
+ * specific arguments and a result) into a ring buffer of the calling thread,
+ * without locks or formatting; trace_export() turns the rings into Chrome
+ * trace event JSON, to be loaded into chrome://tracing or Perfetto. Each ring
+ * keeps the last TRACE_RING_EVENTS events of its thread. A ring outlives its
+ * thread and is handed to the next new thread.
+ *
+ * The trace points are only compiled in when A1FS_TRACE is defined (make
+ * TRACE=1); otherwise they expand to nothing.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "stats.h"
+
+
+/** Number of events kept per thread; a power of two. */
+#define TRACE_RING_EVENTS 8192
+
+/** Event types. */
+typedef enum trace_type {
+	/** liba1fs operation; op is the stats_op, a and b as in trace_op(). */
+	TRACE_OP,
+	/** Path lookup; a is 1 if answered by the lookup cache. */
+	TRACE_LOOKUP,
+	/** Allocation pool refill; a is the number taken, b is 1 for inodes. */
+	TRACE_POOL_REFILL,
+	/** Journal commit; a is the number of blocks logged. */
+	TRACE_JOURNAL_COMMIT,
+	/** msync() of a run of dirty blocks; a is the first block, b the count. */
+	TRACE_MSYNC,
+	/** Batch of blocks of an orphan freed by the reclaimer. */
+	TRACE_RECLAIM,
+	/** File compressed; a is the size. */
+	TRACE_COMPRESS,
+	TRACE_N_TYPES
+} trace_type;
+
+/** Trace event, as stored in the ring buffers. */
+typedef struct trace_event {
+	/** Start time, see stats_begin(). */
+	uint64_t start;
+	/** Duration in nanoseconds. */
+	uint64_t duration;
+	/** Event specific arguments. */
+	uint64_t a;
+	uint64_t b;
+	/** Result; negative errno on failure. */
+	int64_t ret;
+	/** Thread id. */
+	uint32_t tid;
+	/** Inode number; (a1fs_ino_t)-1 if not known. */
+	a1fs_ino_t ino;
+	uint16_t type;
+	uint16_t op;
+} trace_event;
+
+/**
+ * Record an event that started at the given time and ends now.
+ *
+ * @param type   event type.
+ * @param op     operation, for TRACE_OP events.
+ * @param start  start time from stats_begin().
+ * @param ino    inode number; (a1fs_ino_t)-1 if not known.
+ * @param a      event specific argument.
+ * @param b      event specific argument.
+ * @param ret    result.
+ */
+void trace_event_add(trace_type type, stats_op op, uint64_t start, a1fs_ino_t ino,
+                     uint64_t a, uint64_t b, int64_t ret);
+
+/**
+ * Export the events in all rings as Chrome trace event JSON.
+ *
+ * Events are read without stopping the threads recording them; those
+ * overwritten while being read are left out.
+ *
+ * @return  malloc()ed text; NULL if out of memory or if the trace points
+ *          aren't compiled in (errno is ENOSYS then).
+ */
+char *trace_export(void);
+
+
+#ifdef A1FS_TRACE
+
+/** Declare a variable holding the start time of a traced section. */
+#define TRACE_START(t) uint64_t t = stats_begin()
+/** Record an event of a section started by TRACE_START(t). */
+#define TRACE(type, t, ino, a, b, ret) \
+	trace_event_add((type), 0, (t), (ino), (a), (b), (ret))
+/** Record a liba1fs operation; a and b are the offset and size, if any. */
+#define TRACE_OP(op, t, a, b, ret) \
+	trace_event_add(TRACE_OP, (op), (t), (a1fs_ino_t)-1, (a), (b), (ret))
+
+#else
+
+#define TRACE_START(t) do {} while (0)
+#define TRACE(type, t, ino, a, b, ret) do {} while (0)
+#define TRACE_OP(op, t, a, b, ret) do {} while (0)
+
+#endif
@@ -0,0 +1,356 @@
+/**
+ * a1fs writeback implementation.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fs_ctx.h"
+#include "trace.h"
+#include "writeback.h"
+
+
+/** Milliseconds since the context was set up, plus one so that it's never 0. */
+static uint64_t wb_now(fs_ctx *fs)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t)(ts.tv_sec - fs->wb_epoch) * 1000 + ts.tv_nsec / 1000000 + 1;
+}
+
+bool writeback_init(fs_ctx *fs)
+{
+	fs->writeback_running = false;
+	size_t n_groups = fs->sb->blocks_count / A1FS_WB_GROUP + 1;
+	// Padded to whole groups
+	fs->dirty = calloc(n_groups, A1FS_WB_GROUP / 8);
+	fs->dirty_since = calloc(n_groups, sizeof(uint64_t));
+	if (fs->dirty == NULL || fs->dirty_since == NULL) {
+		free(fs->dirty);
+		free(fs->dirty_since);
+		fs->dirty = NULL;
+		return false;
+	}
+	fs->n_dirty = 0;
+	// No kicks until the thread is started
+	fs->dirty_limit = UINT64_MAX - 1;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	fs->wb_epoch = ts.tv_sec;
+	pthread_mutex_init(&fs->wb_lock, NULL);
+	pthread_cond_init(&fs->wb_cond, NULL);
+	return true;
+}
+
+void writeback_destroy(fs_ctx *fs)
+{
+	if (fs->dirty == NULL) return;
+	pthread_mutex_destroy(&fs->wb_lock);
+	pthread_cond_destroy(&fs->wb_cond);
+	free(fs->dirty);
+	free(fs->dirty_since);
+	fs->dirty = NULL;
+}
+
+void writeback_dirty(fs_ctx *fs, const void *addr, size_t len)
+{
+	if (fs->dirty == NULL || len == 0) return;
+
+	size_t off = (const char *)addr - (const char *)fs->image;
+	for (size_t blk = off / A1FS_BLOCK_SIZE; blk <= (off + len - 1) / A1FS_BLOCK_SIZE; blk++) {
+		unsigned char bit = 1 << (blk % 8);
+		// Most changes hit blocks that are already dirty
+		if (__atomic_load_n(&fs->dirty[blk / 8], __ATOMIC_RELAXED) & bit) continue;
+		if (__atomic_fetch_or(&fs->dirty[blk / 8], bit, __ATOMIC_RELAXED) & bit) continue;
+		uint64_t n = __atomic_add_fetch(&fs->n_dirty, 1, __ATOMIC_RELAXED);
+		if (n == fs->dirty_limit + 1) {
+			pthread_mutex_lock(&fs->wb_lock);
+			fs->writeback_kick = true;
+			pthread_cond_signal(&fs->wb_cond);
+			pthread_mutex_unlock(&fs->wb_lock);
+		}
+
+		// The group's age is that of its oldest dirty block
+		uint64_t *since = &fs->dirty_since[blk / A1FS_WB_GROUP];
+		uint64_t clean = 0;
+		if (__atomic_load_n(since, __ATOMIC_RELAXED) == 0) {
+			__atomic_compare_exchange_n(since, &clean, wb_now(fs), false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+int writeback_write(fs_ctx *fs, a1fs_blk_t blk, const void *src, a1fs_blk_t count)
+{
+	size_t off = (size_t)blk * A1FS_BLOCK_SIZE;
+	size_t len = (size_t)count * A1FS_BLOCK_SIZE;
+	if (fs->fd < 0) {
+		if (msync((char *)fs->image + off, len, MS_SYNC) < 0) {
+			int err = errno;
+			perror("msync");
+			return -err;
+		}
+		return 0;
+	}
+	for (size_t done = 0; done < len; ) {
+		ssize_t n = pwrite(fs->fd, (const char *)src + done, len - done, off + done);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			int err = errno;
+			perror("pwrite");
+			return -err;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+int writeback_flush(fs_ctx *fs)
+{
+	if (fs->fd >= 0 && fdatasync(fs->fd) < 0) {
+		int err = errno;
+		perror("fdatasync");
+		return -err;
+	}
+	return 0;
+}
+
+/**
+ * Clear the dirty bit of a block.
+ *
+ * @return  true if the block was dirty.
+ */
+static bool take_dirty(fs_ctx *fs, a1fs_blk_t blk)
+{
+	unsigned char bit = 1 << (blk % 8);
+	if (!(__atomic_load_n(&fs->dirty[blk / 8], __ATOMIC_RELAXED) & bit)) return false;
+	if (!(__atomic_fetch_and(&fs->dirty[blk / 8], (unsigned char)~bit, __ATOMIC_RELAXED) & bit)) return false;
+	__atomic_fetch_sub(&fs->n_dirty, 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+void writeback_forget(fs_ctx *fs, a1fs_blk_t blk)
+{
+	if (fs->dirty != NULL) take_dirty(fs, blk);
+}
+
+/** Check if any block of a group is dirty. */
+static bool group_dirty(fs_ctx *fs, size_t group)
+{
+	for (size_t i = group * (A1FS_WB_GROUP / 8); i < (group + 1) * (A1FS_WB_GROUP / 8); i++) {
+		if (__atomic_load_n(&fs->dirty[i], __ATOMIC_RELAXED) != 0) return true;
+	}
+	return false;
+}
+
+/** A range of dirty blocks being collected for a single write. */
+typedef struct wb_run {
+	a1fs_blk_t start;
+	a1fs_blk_t len;
+	int ret;
+	/** Some dirty blocks were left for after the next commit (see journal_pinned()). */
+	bool pinned;
+	/**
+	 * Drop the private copies of the blocks once written, so that they are
+	 * read from the file again. Only for blocks that nobody writes meanwhile.
+	 */
+	bool release;
+} wb_run;
+
+static void run_flush(fs_ctx *fs, wb_run *run)
+{
+	if (run->len == 0) return;
+	TRACE_START(start);
+	void *addr = (char *)fs->image + (size_t)run->start * A1FS_BLOCK_SIZE;
+	int err = writeback_write(fs, run->start, addr, run->len);
+	if (err == 0 && run->release && fs->fd >= 0) {
+		madvise(addr, (size_t)run->len * A1FS_BLOCK_SIZE, MADV_DONTNEED);
+	}
+	if (run->ret == 0) run->ret = err;
+	TRACE(TRACE_MSYNC, start, (a1fs_ino_t)-1, run->start, run->len, err);
+	run->len = 0;
+}
+
+/** Take the dirty blocks in [start, end) into the run, in increasing order. */
+static void run_collect(fs_ctx *fs, wb_run *run, a1fs_blk_t start, a1fs_blk_t end)
+{
+	for (a1fs_blk_t blk = start; blk < end; blk++) {
+		// Skip clean bytes of the bitmap at a time
+		if (blk % 8 == 0 && blk + 8 <= end && __atomic_load_n(&fs->dirty[blk / 8], __ATOMIC_RELAXED) == 0) {
+			run_flush(fs, run);
+			blk += 7;
+			continue;
+		}
+		// A block freed by a transaction that isn't durable yet still
+		// belongs to its old owner in the image file; it stays dirty
+		if ((__atomic_load_n(&fs->dirty[blk / 8], __ATOMIC_RELAXED) & (1 << (blk % 8))) &&
+		    journal_pinned(fs, blk)) {
+			run->pinned = true;
+			run_flush(fs, run);
+			continue;
+		}
+		if (!take_dirty(fs, blk)) {
+			run_flush(fs, run);
+			continue;
+		}
+		if (run->len > 0 && run->start + run->len != blk) run_flush(fs, run);
+		if (run->len == 0) run->start = blk;
+		run->len++;
+	}
+}
+
+int writeback_range(fs_ctx *fs, a1fs_blk_t start, a1fs_blk_t count)
+{
+	if (fs->dirty == NULL) return 0;
+
+	a1fs_blk_t end = start + count;
+	if (end > fs->sb->blocks_count) end = fs->sb->blocks_count;
+	wb_run run = {0};
+	run_collect(fs, &run, start, end);
+	run_flush(fs, &run);
+	int err = writeback_flush(fs);
+	return (run.ret != 0) ? run.ret : err;
+}
+
+int writeback_inode(fs_ctx *fs, a1fs_ino_t ino)
+{
+	a1fs_inode *inode = &fs->inodes[ino];
+	a1fs_extent *extent = (a1fs_extent *)((char *)fs->image + (size_t)inode->block_no * A1FS_BLOCK_SIZE);
+	if (fs->dirty == NULL) return 0;
+
+	// The file's writers are held off by the caller's lock
+	wb_run run = { .release = true };
+	for (int i = 0; i < 512 - (int)inode->free_extent_num; i++) {
+		a1fs_blk_t end = extent[i].start + extent[i].count;
+		run_collect(fs, &run, extent[i].start, (end < fs->sb->blocks_count) ? end : fs->sb->blocks_count);
+		run_flush(fs, &run);
+	}
+	if (fs->journal == NULL) {
+		run.release = false;
+		run_collect(fs, &run, inode->block_no, inode->block_no + 1);
+		run_collect(fs, &run, 0, fs->sb->data_start);
+		run_flush(fs, &run);
+	}
+	int err = writeback_flush(fs);
+	if (run.ret != 0) return run.ret;
+	return (err == 0 && run.pinned) ? -EAGAIN : err;
+}
+
+/**
+ * Write back the groups that have been dirty since before a point in time, in
+ * block order, until at most a number of blocks is left dirty. Adjacent dirty
+ * blocks of consecutive groups are written back together.
+ *
+ * @param cutoff  groups dirtied at or before this time are written back.
+ * @param target  stop once no more than this many blocks are dirty.
+ */
+static void flush_groups(fs_ctx *fs, uint64_t cutoff, uint64_t target)
+{
+	a1fs_blk_t blocks = fs->sb->blocks_count;
+	size_t n_groups = (blocks + A1FS_WB_GROUP - 1) / A1FS_WB_GROUP;
+	wb_run run = {0};
+
+	for (size_t g = 0; g < n_groups; g++) {
+		if (__atomic_load_n(&fs->n_dirty, __ATOMIC_RELAXED) <= target) break;
+		uint64_t since = __atomic_load_n(&fs->dirty_since[g], __ATOMIC_RELAXED);
+		if (!group_dirty(fs, g)) {
+			// Written back by fsync since
+			if (since != 0) __atomic_store_n(&fs->dirty_since[g], 0, __ATOMIC_RELAXED);
+			run_flush(fs, &run);
+			continue;
+		}
+		// A block dirtied while the group was being reset has no age yet
+		if (since == 0) {
+			uint64_t clean = 0;
+			__atomic_compare_exchange_n(&fs->dirty_since[g], &clean, wb_now(fs), false,
+			                            __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+			run_flush(fs, &run);
+			continue;
+		}
+		if (since > cutoff) {
+			run_flush(fs, &run);
+			continue;
+		}
+
+		__atomic_store_n(&fs->dirty_since[g], 0, __ATOMIC_RELAXED);
+		a1fs_blk_t end = (g + 1) * A1FS_WB_GROUP;
+		run_collect(fs, &run, g * A1FS_WB_GROUP, (end < blocks) ? end : blocks);
+	}
+	run_flush(fs, &run);
+	writeback_flush(fs);
+}
+
+static void *writeback_thread(void *arg)
+{
+	fs_ctx *fs = (fs_ctx *)arg;
+	a1fs_opts *opts = fs->opts;
+
+	pthread_mutex_lock(&fs->wb_lock);
+	while (!fs->writeback_stop) {
+		struct timespec wake;
+		clock_gettime(CLOCK_REALTIME, &wake);
+		wake.tv_sec += opts->writeback_interval / 1000;
+		wake.tv_nsec += (long)(opts->writeback_interval % 1000) * 1000000;
+		if (wake.tv_nsec >= 1000000000) {
+			wake.tv_sec++;
+			wake.tv_nsec -= 1000000000;
+		}
+		if (!fs->writeback_kick) pthread_cond_timedwait(&fs->wb_cond, &fs->wb_lock, &wake);
+		if (fs->writeback_stop) break;
+		bool over_limit = fs->writeback_kick;
+		fs->writeback_kick = false;
+		pthread_mutex_unlock(&fs->wb_lock);
+
+		if (__atomic_load_n(&fs->n_dirty, __ATOMIC_RELAXED) == 0) {
+			pthread_mutex_lock(&fs->wb_lock);
+			continue;
+		}
+		// Home locations of metadata are only written after the log
+		journal_commit(fs);
+		uint64_t now = wb_now(fs);
+		uint64_t cutoff = (now > opts->dirty_age) ? now - opts->dirty_age : 0;
+		flush_groups(fs, cutoff, 0);
+		// Above the limit, write back younger blocks too, down to half of it
+		if (over_limit || __atomic_load_n(&fs->n_dirty, __ATOMIC_RELAXED) > fs->dirty_limit) {
+			flush_groups(fs, UINT64_MAX, fs->dirty_limit / 2);
+		}
+
+		pthread_mutex_lock(&fs->wb_lock);
+	}
+	pthread_mutex_unlock(&fs->wb_lock);
+	return NULL;
+}
+
+bool writeback_start(fs_ctx *fs)
+{
+	if (fs->dirty == NULL || fs->opts == NULL || fs->opts->no_writeback) return true;
+
+	fs->writeback_stop = false;
+	fs->writeback_kick = false;
+	fs->dirty_limit = (uint64_t)fs->sb->blocks_count * fs->opts->dirty_ratio / 100;
+	int err = pthread_create(&fs->writeback, NULL, writeback_thread, fs);
+	if (err != 0) {
+		errno = err;
+		perror("pthread_create");
+		return false;
+	}
+	fs->writeback_running = true;
+	return true;
+}
+
+void writeback_stop(fs_ctx *fs)
+{
+	if (!fs->writeback_running) return;
+
+	pthread_mutex_lock(&fs->wb_lock);
+	fs->writeback_stop = true;
+	pthread_cond_signal(&fs->wb_cond);
+	pthread_mutex_unlock(&fs->wb_lock);
+	pthread_join(fs->writeback, NULL);
+	fs->writeback_running = false;
+	fs->dirty_limit = UINT64_MAX - 1;
+}
@@ -0,0 +1,129 @@
+/**
+ * a1fs writeback - tracking of changed blocks and ranged write back.
+ *
+ * Every change to the image, metadata or file data, marks the blocks it
+ * touches in a bitmap with writeback_dirty(), after the change is made. A
+ * block is written back only if it is marked, and its mark is cleared first,
+ * so that a change made meanwhile marks it again. This makes fsync() cost
+ * proportional to what changed in the file rather than to the size of the
+ * image. Blocks of a privately mapped image are written to the file with
+ * pwrite(), those of a shared mapping with msync(). With a journal, metadata
+ * is not marked at all: the journal writes it back at checkpoints (see
+ * journal.h), and blocks it pins are left dirty until then.
+ *
+ * A background thread (see writeback_start()) writes back blocks that have
+ * been dirty for longer than the dirty-age threshold, and younger ones too
+ * while more than the dirty-ratio share of the image is dirty, so that
+ * neither unmount nor the kernel has a large backlog to write. Ages are kept
+ * per group of A1FS_WB_GROUP blocks, and the blocks are written back in block
+ * order with adjacent dirty blocks coalesced into a single write.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "a1fs.h"
+
+
+/** Number of blocks that share a dirty age. */
+#define A1FS_WB_GROUP 64
+
+struct fs_ctx;
+
+/**
+ * Set up the dirty block bitmap.
+ *
+ * @param fs  file system context.
+ * @return    true on success; false if out of memory.
+ */
+bool writeback_init(struct fs_ctx *fs);
+
+/**
+ * Free the dirty block bitmap.
+ *
+ * @param fs  file system context.
+ */
+void writeback_destroy(struct fs_ctx *fs);
+
+/**
+ * Mark the blocks overlapping a range of the image as dirty.
+ *
+ * @param fs    file system context.
+ * @param addr  start of the changed range in the image.
+ * @param len   length of the range in bytes.
+ */
+void writeback_dirty(struct fs_ctx *fs, const void *addr, size_t len);
+
+/**
+ * Clear the dirty mark of a freed block, whose contents no longer matter.
+ *
+ * @param fs   file system context.
+ * @param blk  block number.
+ */
+void writeback_forget(struct fs_ctx *fs, a1fs_blk_t blk);
+
+/**
+ * Write blocks to their location in the image file, without waiting for the
+ * disk. In a shared mapping, the blocks of the image at that location are
+ * msync()ed instead, which does wait.
+ *
+ * @param fs     file system context.
+ * @param blk    first block of the location in the image file.
+ * @param src    contents to write; ignored for a shared mapping.
+ * @param count  number of blocks.
+ * @return       0 on success; -errno on failure.
+ */
+int writeback_write(struct fs_ctx *fs, a1fs_blk_t blk, const void *src, a1fs_blk_t count);
+
+/**
+ * Wait for the blocks written with writeback_write() to reach the disk.
+ *
+ * @param fs  file system context.
+ * @return    0 on success; -errno on failure.
+ */
+int writeback_flush(struct fs_ctx *fs);
+
+/**
+ * Write back the dirty blocks in a range of blocks, coalescing adjacent ones
+ * into a single write, and wait for them to reach the disk.
+ *
+ * @param fs     file system context.
+ * @param start  first block of the range.
+ * @param count  number of blocks in the range.
+ * @return       0 on success; -errno on failure.
+ */
+int writeback_range(struct fs_ctx *fs, a1fs_blk_t start, a1fs_blk_t count);
+
+/**
+ * Write back the dirty data blocks of a file or directory. Without a journal,
+ * its extent block and the dirty blocks of the metadata area (superblock,
+ * bitmaps, inode table and reference counts) are written back as well;
+ * otherwise the metadata is made durable by a journal commit.
+ *
+ * The caller is in an operation (see op_begin()) and holds the inode's lock
+ * (shared).
+ *
+ * @param fs   file system context.
+ * @param ino  inode number.
+ * @return     0 on success; -EAGAIN if some blocks are pinned by the journal
+ *             (see journal_pinned()) and were left dirty; -errno on failure.
+ */
+int writeback_inode(struct fs_ctx *fs, a1fs_ino_t ino);
+
+/**
+ * Start the background writeback thread, unless disabled by the mount
+ * options (fs->opts->no_writeback) or the image is opened by a tool.
+ *
+ * @param fs  file system context.
+ * @return    true on success; false if the thread could not be created.
+ */
+bool writeback_start(struct fs_ctx *fs);
+
+/**
+ * Stop the background writeback thread.
+ *
+ * @param fs  file system context.
+ */
+void writeback_stop(struct fs_ctx *fs);